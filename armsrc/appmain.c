@@ -1284,12 +1284,18 @@ void UsbPacketReceived(uint8_t *packet, int len)
 
 			LED_B_ON();
 			uint8_t *BigBuf = BigBuf_get_addr();
-			for(size_t i=0; i<c->arg[1]; i += USB_CMD_DATA_SIZE) {
-				size_t len = MIN((c->arg[1] - i),USB_CMD_DATA_SIZE);
+			size_t numofbytes = c->arg[1];
+			if (c->arg[2] & FLAG_DOWNLOAD_TRACE) {
+				// the whole recorded trace, saves the client a round trip to ask for its length.
+				// arg[1] only limits what older firmware sends.
+				numofbytes = BigBuf_get_traceLen();
+			}
+			for(size_t i=0; i<numofbytes; i += USB_CMD_DATA_SIZE) {
+				size_t len = MIN((numofbytes - i),USB_CMD_DATA_SIZE);
 				cmd_send(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K,i,len,BigBuf_get_traceLen(),BigBuf+c->arg[0]+i,len);
 			}
 			// Trigger a finish downloading signal with an ACK frame
-			cmd_send(CMD_ACK,1,0,BigBuf_get_traceLen(),getSamplingConfig(),sizeof(sample_config));
+			cmd_send(CMD_ACK,1,c->arg[2] & FLAG_DOWNLOAD_TRACE,BigBuf_get_traceLen(),getSamplingConfig(),sizeof(sample_config));
 			LED_B_OFF();
 			break;
 
@@ -11,7 +11,9 @@
 #include <stdio.h>    // also included in util.h
 #include <string.h>   // also included in util.h
 #include <inttypes.h>
+#include <stddef.h>   // for offsetof
 #include <limits.h>   // for CmdNorm INT_MIN && INT_MAX
+#include <time.h>     // for trace timestamps
 #include "data.h"     // also included in util.h
 #include "cmddata.h"
 #include "util.h"
@@ -24,6 +26,8 @@
 #include "lfdemod.h"  // for demod code
 #include "loclass/cipherutils.h" // for decimating samples in getsamples
 #include "cmdlfem4x.h"// for em410x demod
+#include "fft.h"      // for autocorrelation
+#include "tracefile.h"// for load and save
 
 uint8_t DemodBuffer[MAX_DEMOD_BUF_LEN];
 uint8_t g_debugMode=0;
@@ -105,20 +109,146 @@ int usage_data_printdemodbuf(){
 		return 0;	
 }
 
-//by marshmellow
-void printDemodBuff(void)
+// prints up to 512 bits, 16 per line. Formats into its own buffer rather
+// than sprint_bin_break's static one so concurrent demods can use it.
+void printDemodBits(const uint8_t *bits, size_t bitLen)
 {
-	int bitLen = DemodBufferLen;
 	if (bitLen<1) {
 		PrintAndLog("no bits found in demod buffer");
 		return;
 	}
 	if (bitLen>512) bitLen=512; //max output to 512 bits if we have more - should be plenty
 
-	char *bin = sprint_bin_break(DemodBuffer,bitLen,16);
+	char bin[512 + 512/16 + 1];
+	char *p = bin;
+	for (size_t i = 0; i < bitLen; i++) {
+		if (bits[i] < 10) *p++ = '0' + bits[i];
+		if (!((i+1) % 16)) *p++ = '\n';
+	}
+	*p = '\0';
 	PrintAndLog("%s",bin);
+}
 
-	return;
+//by marshmellow
+void printDemodBuff(void)
+{
+	printDemodBits(DemodBuffer, DemodBufferLen);
+}
+
+// not calloc: zeroing the buffers costs more than the demods lf search runs
+static lf_demod_ctx_t *lf_demod_ctx_alloc(void)
+{
+	lf_demod_ctx_t *ctx = malloc(sizeof(lf_demod_ctx_t));
+	if (ctx == NULL) {
+		PrintAndLog("Failed to allocate memory for the demodulation");
+		return NULL;
+	}
+	memset(&ctx->samples_len, 0, sizeof(lf_demod_ctx_t) - offsetof(lf_demod_ctx_t, samples_len));
+	return ctx;
+}
+
+lf_demod_ctx_t *lf_demod_ctx_new(const int *samples, size_t len)
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_alloc();
+	if (ctx == NULL) return NULL;
+	if (len > MAX_GRAPH_TRACE_LEN) len = MAX_GRAPH_TRACE_LEN;
+	for (size_t i = 0; i < len; i++) {
+		int sample = samples[i];
+		if (sample > 127) sample = 127; //trim
+		if (sample < -127) sample = -127;
+		ctx->samples[i] = (uint8_t)(sample + 128);
+	}
+	ctx->samples_len = len;
+	return ctx;
+}
+
+// GraphBuffer gets trimmed to +-127 in place, as getFromGraphBuf always did
+lf_demod_ctx_t *lf_demod_ctx_from_graph(void)
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_alloc();
+	if (ctx == NULL) return NULL;
+	ctx->samples_len = getFromGraphBuf(ctx->samples);
+	return ctx;
+}
+
+// a new context on the samples of ctx, for another demod to run alongside
+lf_demod_ctx_t *lf_demod_ctx_clone(const lf_demod_ctx_t *ctx)
+{
+	lf_demod_ctx_t *clone = lf_demod_ctx_alloc();
+	if (clone == NULL) return NULL;
+	memcpy(clone->samples, ctx->samples, ctx->samples_len);
+	clone->samples_len = ctx->samples_len;
+	return clone;
+}
+
+void lf_demod_ctx_free(lf_demod_ctx_t *ctx)
+{
+	free(ctx);
+}
+
+// a fresh copy of the samples for one demod to work on. The demods overwrite
+// their input, this is what saves converting GraphBuffer again per protocol.
+uint8_t *lf_demod_ctx_bits(lf_demod_ctx_t *ctx, size_t *len)
+{
+	memcpy(ctx->bits, ctx->samples, ctx->samples_len);
+	// a decoder checking a frame that runs off the end reads zeros, as it did
+	// from the zeroed arrays on the stack
+	memset(ctx->bits + ctx->samples_len, 0, sizeof(ctx->bits) - ctx->samples_len);
+	*len = ctx->samples_len;
+	return ctx->bits;
+}
+
+// setDemodBuf() for a context. buff may be ctx->demod itself
+void lf_demod_ctx_set_demod(lf_demod_ctx_t *ctx, const uint8_t *buff, size_t size, size_t startIdx)
+{
+	if (buff == NULL)
+		return;
+
+	if ( size > MAX_DEMOD_BUF_LEN - startIdx)
+		size = MAX_DEMOD_BUF_LEN - startIdx;
+
+	for (size_t i = 0; i < size; i++) {
+		ctx->demod[i] = buff[startIdx++];
+	}
+	ctx->demod_len = size;
+	ctx->demod_set = true;
+}
+
+// setClockGrid() for a context, the grid is only drawn by lf_demod_ctx_show()
+void lf_demod_ctx_set_clock(lf_demod_ctx_t *ctx, int clk, int offset)
+{
+	ctx->demod_clock = clk;
+	ctx->demod_start_idx = offset;
+	ctx->clock_set = true;
+}
+
+void lf_demod_ctx_print(const lf_demod_ctx_t *ctx)
+{
+	printDemodBits(ctx->demod, ctx->demod_len);
+}
+
+// publish what the demods found to DemodBuffer, the clock grid and the
+// graph cursors, as the commands working on GraphBuffer always did
+void lf_demod_ctx_show(const lf_demod_ctx_t *ctx)
+{
+	if (ctx->st_found) {
+		CursorCPos = ctx->st_start;
+		CursorDPos = ctx->st_end;
+	}
+	if (ctx->demod_set)
+		setDemodBuf((uint8_t *)ctx->demod, ctx->demod_len, 0);
+	if (ctx->clock_set)
+		setClockGrid(ctx->demod_clock, ctx->demod_start_idx);
+	if (ctx->em410x_found)
+		g_em410xId = ctx->em410x_id;
+}
+
+// for the commands working on GraphBuffer: show the result, free the context
+int lf_demod_ctx_finish(lf_demod_ctx_t *ctx, int ans)
+{
+	lf_demod_ctx_show(ctx);
+	lf_demod_ctx_free(ctx);
+	return ans;
 }
 
 int CmdPrintDemodBuff(const char *Cmd)
@@ -200,14 +330,13 @@ int CmdGetBitStream(const char *Cmd)
 //verbose will print results and demoding messages
 //emSearch will auto search for EM410x format in bitstream
 //askType switches decode: ask/raw = 0, ask/manchester = 1 
-int ASKDemod_ext(const char *Cmd, bool verbose, bool emSearch, uint8_t askType, bool *stCheck) {
+int ASKDemodCtx(lf_demod_ctx_t *ctx, const char *Cmd, bool verbose, bool emSearch, uint8_t askType, bool *stCheck) {
 	int invert=0;
 	int clk=0;
 	int maxErr=100;
 	int maxLen=0;
 	uint8_t askamp = 0;
 	char amp = param_getchar(Cmd, 0);
-	uint8_t BitStream[MAX_GRAPH_TRACE_LEN]={0};
 	sscanf(Cmd, "%i %i %i %i %c", &clk, &invert, &maxErr, &maxLen, &amp);
 	if (!maxLen) maxLen = BIGBUF_SIZE;
 	if (invert != 0 && invert != 1) {
@@ -218,7 +347,8 @@ int ASKDemod_ext(const char *Cmd, bool verbose, bool emSearch, uint8_t askType,
 		invert=1;
 		clk=0;
 	}
-	size_t BitLen = getFromGraphBuf(BitStream);
+	size_t BitLen = 0;
+	uint8_t *BitStream = lf_demod_ctx_bits(ctx, &BitLen);
 	if (g_debugMode) PrintAndLog("DEBUG: Bitlen from grphbuff: %d",BitLen);
 	if (BitLen < 255) return 0;
 	if (maxLen < BitLen && maxLen != 0) BitLen = maxLen;
@@ -233,8 +363,9 @@ int ASKDemod_ext(const char *Cmd, bool verbose, bool emSearch, uint8_t askType,
 	*stCheck = st;
 	if (st) {
 		clk = (clk == 0) ? foundclk : clk;
-		CursorCPos = ststart;
-		CursorDPos = stend;
+		ctx->st_found = true;
+		ctx->st_start = ststart;
+		ctx->st_end = stend;
 		if (verbose || g_debugMode) PrintAndLog("\nFound Sequence Terminator - First one is shown by orange and blue graph markers");
 		//Graph ST trim (for testing)
 		//for (int i = 0; i < BitLen; i++) {
@@ -254,24 +385,29 @@ int ASKDemod_ext(const char *Cmd, bool verbose, bool emSearch, uint8_t askType,
 	}
 	if (verbose || g_debugMode) PrintAndLog("\nUsing Clock:%d, Invert:%d, Bits Found:%d",clk,invert,BitLen);
 	//output
-	setDemodBuf(BitStream,BitLen,0);
-	setClockGrid(clk, startIdx);
+	lf_demod_ctx_set_demod(ctx, BitStream, BitLen, 0);
+	lf_demod_ctx_set_clock(ctx, clk, startIdx);
 
 	if (verbose || g_debugMode){
 		if (errCnt>0) PrintAndLog("# Errors during Demoding (shown as 7 in bit stream): %d",errCnt);
 		if (askType) PrintAndLog("ASK/Manchester - Clock: %d - Decoded bitstream:",clk);
 		else PrintAndLog("ASK/Raw - Clock: %d - Decoded bitstream:",clk);
 		// Now output the bitstream to the scrollback by line of 16 bits
-		printDemodBuff();
+		lf_demod_ctx_print(ctx);
 		
 	}
 	uint64_t lo = 0;
 	uint32_t hi = 0;
 	if (emSearch){
-		AskEm410xDecode(true, &hi, &lo);
+		AskEm410xDecodeCtx(ctx, true, &hi, &lo);
 	}
 	return 1;
 }
+int ASKDemod_ext(const char *Cmd, bool verbose, bool emSearch, uint8_t askType, bool *stCheck) {
+	lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+	if (ctx == NULL) return 0;
+	return lf_demod_ctx_finish(ctx, ASKDemodCtx(ctx, Cmd, verbose, emSearch, askType, stCheck));
+}
 int ASKDemod(const char *Cmd, bool verbose, bool emSearch, uint8_t askType) {
 	bool st = false;
 	return ASKDemod_ext(Cmd, verbose, emSearch, askType, &st);
@@ -513,18 +649,38 @@ int Cmdaskrawdemod(const char *Cmd)
 	return ASKDemod(Cmd, true, false, 0);
 }
 
+// the correlation sum at i as it always was calculated, every product truncated to /256
+static int truncatedSum(const int *in, int i, int window)
+{
+	int sum = 0;
+	for (int j = 0; j < window; ++j) {
+		sum += (in[j]*in[i + j]) / 256;
+	}
+	return sum;
+}
+
 int AutoCorrelate(const int *in, int *out, size_t len, int window, bool SaveGrph, bool verbose)
 {
 	static int CorrelBuffer[MAX_GRAPH_TRACE_LEN];
+	static bool Truncated[MAX_GRAPH_TRACE_LEN];
+	static int64_t Sums[MAX_GRAPH_TRACE_LEN];
 	size_t Correlation = 0;
 	int maxSum = 0;
 	int lastMax = 0;
 	if (verbose) PrintAndLog("performing %d correlations", GraphTraceLen - window);
+	// all sums of in[j]*in[i+j] at once, in O(len*log(len)) instead of O(len*window)
+	if (!correlate(in, len, window, Sums)) {
+		PrintAndLog("Cannot allocate memory for correlation");
+		return 0;
+	}
+	// Sums[i]/256 differs from the truncated sum by less than window (+1 for rounding).
+	// Only the sums which may get close to the maximum are recalculated with truncation,
+	// so the detected correlation is the same as with the old double loop.
+	int margin = window + 1;
 	for (int i = 0; i < len - window; ++i) {
-		int sum = 0;
-		for (int j = 0; j < window; ++j) {
-			sum += (in[j]*in[i + j]) / 256;
-		}
+		int sum = (int)(Sums[i] / 256);
+		Truncated[i] = (sum + margin >= maxSum-100);
+		if (Truncated[i]) sum = truncatedSum(in, i, window);
 		CorrelBuffer[i] = sum;
 		if (sum >= maxSum-100 && sum <= maxSum+100) {
 			//another max
@@ -539,6 +695,10 @@ int AutoCorrelate(const int *in, int *out, size_t len, int window, bool SaveGrph
 	if (Correlation==0) {
 		//try again with wider margin
 		for (int i = 0; i < len - window; i++) {
+			if (!Truncated[i] && CorrelBuffer[i] + margin >= maxSum-(maxSum*0.05) && CorrelBuffer[i] - margin <= maxSum+(maxSum*0.05)) {
+				CorrelBuffer[i] = truncatedSum(in, i, window);
+				Truncated[i] = true;
+			}
 			if (CorrelBuffer[i] >= maxSum-(maxSum*0.05) && CorrelBuffer[i] <= maxSum+(maxSum*0.05)) {
 				//another max
 				Correlation = i-lastMax;
@@ -1118,7 +1278,6 @@ int CmdHexsamples(const char *Cmd)
 	int offset = 0;
 	char string_buf[25];
 	char* string_ptr = string_buf;
-	uint8_t got[BIGBUF_SIZE];
 
 	sscanf(Cmd, "%i %i", &requested, &offset);
 
@@ -1126,13 +1285,16 @@ int CmdHexsamples(const char *Cmd)
 	if (requested == 0) {
 		requested = 8;
 	}
-	if (offset + requested > sizeof(got)) {
+	if (offset + requested > BIGBUF_SIZE) {
 		PrintAndLog("Tried to read past end of buffer, <bytes> + <offset> > %d", BIGBUF_SIZE);
 		return 0;
 	}
 
-	GetFromBigBuf(got,requested,offset);
-	WaitForResponse(CMD_ACK,NULL);
+	bigbuf_download_t *download = DownloadBigBuf(offset, requested, false, NULL, NULL);
+	if (download == NULL) {
+		return 0;
+	}
+	uint8_t *got = download->data;
 
 	i = 0;
 	for (j = 0; j < requested; j++) {
@@ -1151,6 +1313,7 @@ int CmdHexsamples(const char *Cmd)
 			string_buf[0] = '\0';
 		}
 	}
+	free(download);
 	return 0;
 }
 
@@ -1187,6 +1350,12 @@ uint8_t getByte(uint8_t bits_per_sample, BitstreamIn* b)
 	return val;
 }
 
+// lets the user abort a long download from device memory
+static bool abortOnKeypress(uint32_t received, uint32_t total, void *arg)
+{
+	return ukbhit() <= 0;
+}
+
 int getSamples(int n, bool silent)
 {
 	//If we get all but the last byte in bigbuf,
@@ -1194,25 +1363,33 @@ int getSamples(int n, bool silent)
 	// in the last byte in case the bits-per-sample
 	// does not line up on byte boundaries
 
-	uint8_t got[BIGBUF_SIZE-1] = { 0 };
-
-	if (n == 0 || n > sizeof(got))
-		n = sizeof(got);
+	if (n == 0 || n > BIGBUF_SIZE-1)
+		n = BIGBUF_SIZE-1;
 
 	if (!silent) PrintAndLog("Reading %d bytes from device memory\n", n);
-	GetFromBigBuf(got,n,0);
+	bigbuf_download_t *download = DownloadBigBuf(0, n, false, silent ? NULL : abortOnKeypress, NULL);
+	if (download == NULL) {
+		if (!silent) PrintAndLog("Download aborted");
+		return 1;
+	}
 	if (!silent) PrintAndLog("Data fetched");
-	UsbCommand response;
-	WaitForResponse(CMD_ACK, &response);
+	uint8_t *got = download->data;
 	uint8_t bits_per_sample = 8;
 
 	//Old devices without this feature would send 0 at arg[0]
-	if(response.arg[0] > 0)
+	memset(&GraphTraceInfo, 0, sizeof(GraphTraceInfo));
+	GraphTraceInfo.timestamp = time(NULL);
+	if(download->ack.arg[0] > 0)
 	{
-		sample_config *sc = (sample_config *) response.d.asBytes;
+		sample_config *sc = (sample_config *) download->ack.d.asBytes;
 		if (!silent) PrintAndLog("Samples @ %d bits/smpl, decimation 1:%d ", sc->bits_per_sample
 		    , sc->decimation);
 		bits_per_sample = sc->bits_per_sample;
+		GraphTraceInfo.bits_per_sample = sc->bits_per_sample;
+		GraphTraceInfo.decimation = sc->decimation;
+		GraphTraceInfo.averaging = sc->averaging;
+		// the ADC takes a sample per carrier cycle, 12MHz/(divisor+1)
+		if (sc->decimation) GraphTraceInfo.sample_rate = 12000000 / (sc->divisor + 1) / sc->decimation;
 	}
 	if(bits_per_sample < 8)
 	{
@@ -1232,6 +1409,7 @@ int getSamples(int n, bool silent)
 		}
 		GraphTraceLen = n;
 	}
+	free(download);
 
 	setClockGrid(0,0);
 	DemodBufferLen = 0;
@@ -1321,23 +1499,26 @@ int CmdLoad(const char *Cmd)
 	int len = 0;
 
 	len = strlen(Cmd);
-	if (len > FILE_PATH_SIZE) len = FILE_PATH_SIZE;
+	if (len > FILE_PATH_SIZE - 1) len = FILE_PATH_SIZE - 1;
 	memcpy(filename, Cmd, len);
-	
-	FILE *f = fopen(filename, "r");
-	if (!f) {
-		 PrintAndLog("couldn't open '%s'", filename);
-		return 0;
-	}
 
-	GraphTraceLen = 0;
-	char line[80];
-	while (fgets(line, sizeof (line), f)) {
-		GraphBuffer[GraphTraceLen] = atoi(line);
-		GraphTraceLen++;
+	len = loadTraceFile(filename, GraphBuffer, MAX_GRAPH_TRACE_LEN, &GraphTraceInfo);
+	if (len == TRACE_ERR_OPEN) {
+		PrintAndLog("couldn't open '%s'", filename);
+		return 0;
+	} else if (len < 0) {
+		PrintAndLog("'%s' is not a valid trace file", filename);
+		return 0;
 	}
-	fclose(f);
+	GraphTraceLen = len;
 	PrintAndLog("loaded %d samples", GraphTraceLen);
+	if (GraphTraceInfo.bits_per_sample) {
+		time_t taken = GraphTraceInfo.timestamp;
+		char when[32] = "unknown";
+		if (taken) strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&taken));
+		PrintAndLog("Samples @ %d bits/smpl, decimation 1:%d, %d Hz, taken %s", GraphTraceInfo.bits_per_sample,
+			GraphTraceInfo.decimation, GraphTraceInfo.sample_rate, when);
+	}
 	setClockGrid(0,0);
 	DemodBufferLen = 0;
 	RepaintGraphWindow();
@@ -1411,27 +1592,56 @@ int CmdPlot(const char *Cmd)
 	return 0;
 }
 
+int usage_data_save(void)
+{
+	PrintAndLog("Usage: data save [-b|-z] <filename>");
+	PrintAndLog("Options:        ");
+	PrintAndLog("       -b         binary trace, with how the samples were taken in its header");
+	PrintAndLog("       -z         binary trace, deflated");
+	PrintAndLog("Without an option the samples are saved as text, one per line.");
+	PrintAndLog("data load reads either format.");
+	return 0;
+}
+
 int CmdSave(const char *Cmd)
 {
 	char filename[FILE_PATH_SIZE] = {0x00};
 	int len = 0;
+	bool binary = false, compress = false;
+
+	// options before the file name select the binary format
+	while (*Cmd == ' ') Cmd++;
+	while (Cmd[0] == '-' && Cmd[1] != 0x00 && (Cmd[2] == ' ' || Cmd[2] == 0x00)) {
+		switch (Cmd[1]) {
+		case 'b':
+		case 'B':
+			binary = true;
+			break;
+		case 'z':
+		case 'Z':
+			binary = compress = true;
+			break;
+		default:
+			PrintAndLog("Invalid option");
+			return usage_data_save();
+		}
+		Cmd += 2;
+		while (*Cmd == ' ') Cmd++;
+	}
+	char cmdp = param_getchar(Cmd, 0);
+	if (cmdp == 0x00 || (strlen(Cmd) == 1 && (cmdp == 'h' || cmdp == 'H'))) {
+		return usage_data_save();
+	}
 
 	len = strlen(Cmd);
-	if (len > FILE_PATH_SIZE) len = FILE_PATH_SIZE;
+	if (len > FILE_PATH_SIZE - 1) len = FILE_PATH_SIZE - 1;
 	memcpy(filename, Cmd, len);
-	 
 
-	FILE *f = fopen(filename, "w");
-	if(!f) {
-		PrintAndLog("couldn't open '%s'", filename);
+	if (!saveTraceFile(filename, GraphBuffer, GraphTraceLen, &GraphTraceInfo, binary, compress)) {
+		PrintAndLog("couldn't save to '%s'", filename);
 		return 0;
 	}
-	int i;
-	for (i = 0; i < GraphTraceLen; i++) {
-		fprintf(f, "%d\n", GraphBuffer[i]);
-	}
-	fclose(f);
-	PrintAndLog("saved to '%s'", Cmd);
+	PrintAndLog("saved to '%s'", filename);
 	return 0;
 }
 
@@ -1834,7 +2044,7 @@ static command_t CommandTable[] =
 	{"printdemodbuffer",CmdPrintDemodBuff,  1, "[x] [o] <offset> [l] <length> -- print the data in the DemodBuffer - 'x' for hex output"},
 	{"rawdemod",        CmdRawDemod,        1, "[modulation] ... <options> -see help (h option) -- Demodulate the data in the GraphBuffer and output binary"},  
 	{"samples",         CmdSamples,         0, "[512 - 40000] -- Get raw samples for graph window (GraphBuffer)"},
-	{"save",            CmdSave,            1, "<filename> -- Save trace (from graph window)"},
+	{"save",            CmdSave,            1, "[-b|-z] <filename> -- Save trace (from graph window), as text or binary ('-z' deflated)"},
 	{"setgraphmarkers", CmdSetGraphMarkers, 1, "[orange_marker] [blue_marker] (in graph window)"},
 	{"scale",           CmdScale,           1, "<int> -- Set cursor display scale"},
 	{"setdebugmode",    CmdSetDebugMode,    1, "<0|1|2> -- Turn on or off Debugging Level for lf demods"},
@@ -16,11 +16,13 @@
 #include <stdbool.h> //bool
 
 #include "cmdparser.h" // for command_t
+#include "graph.h"     // for MAX_GRAPH_TRACE_LEN
 
 command_t * CmdDataCommands();
 
 int CmdData(const char *Cmd);
 void printDemodBuff(void);
+void printDemodBits(const uint8_t *bits, size_t bitLen);
 void setDemodBuf(uint8_t *buff, size_t size, size_t startIdx);
 bool getDemodBuf(uint8_t *buff, size_t *size);
 void save_restoreDB(uint8_t saveOpt);// option '1' to save DemodBuffer any other to restore
@@ -77,4 +79,41 @@ extern int g_DemodClock;
 extern uint8_t g_debugMode;
 #define BIGBUF_SIZE 40000
 
+// One LF demodulation: the samples it works on and what it found. Demods
+// taking a context leave GraphBuffer, DemodBuffer and the plot alone, so a
+// capture converted once can be tried against several protocols, or several
+// captures demodulated at the same time. lf_demod_ctx_show() publishes the
+// result the way the commands working on GraphBuffer do.
+typedef struct {
+	uint8_t samples[MAX_GRAPH_TRACE_LEN]; // trimmed to +-127 and shifted by 128
+	uint8_t bits[MAX_GRAPH_TRACE_LEN];    // scratch copy of samples for one demod
+	uint8_t demod[MAX_DEMOD_BUF_LEN];
+	// the buffers above are only read as far as they were written,
+	// a new context starts zeroed from here
+	size_t samples_len;
+	size_t demod_len;
+	bool demod_set;
+	int demod_start_idx;
+	int demod_clock;
+	bool clock_set;
+	bool st_found;                        // sequence terminator, shown by cursors C/D
+	size_t st_start;
+	size_t st_end;
+	bool em410x_found;
+	uint64_t em410x_id;
+	char tag_id[40];                      // hex ID of the tag a demod found
+} lf_demod_ctx_t;
+
+lf_demod_ctx_t *lf_demod_ctx_new(const int *samples, size_t len);
+lf_demod_ctx_t *lf_demod_ctx_from_graph(void);
+lf_demod_ctx_t *lf_demod_ctx_clone(const lf_demod_ctx_t *ctx);
+void lf_demod_ctx_free(lf_demod_ctx_t *ctx);
+uint8_t *lf_demod_ctx_bits(lf_demod_ctx_t *ctx, size_t *len);
+void lf_demod_ctx_set_demod(lf_demod_ctx_t *ctx, const uint8_t *buff, size_t size, size_t startIdx);
+void lf_demod_ctx_set_clock(lf_demod_ctx_t *ctx, int clk, int offset);
+void lf_demod_ctx_print(const lf_demod_ctx_t *ctx);
+void lf_demod_ctx_show(const lf_demod_ctx_t *ctx);
+int lf_demod_ctx_finish(lf_demod_ctx_t *ctx, int ans);
+int ASKDemodCtx(lf_demod_ctx_t *ctx, const char *Cmd, bool verbose, bool emSearch, uint8_t askType, bool *stCheck);
+
 #endif
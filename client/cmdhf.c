@@ -19,6 +19,7 @@
 #include "parity.h"
 #include "cmdmain.h"
 #include "cmdparser.h"
+#include "cmddata.h"
 #include "cmdhf.h"
 #include "cmdhf14a.h"
 #include "cmdhf14b.h"
@@ -621,26 +622,16 @@ int CmdHFList(const char *Cmd)
 		markCRCBytes = true;
 	}
 
-	uint8_t *trace;
 	uint16_t tracepos = 0;
-	trace = malloc(USB_CMD_DATA_SIZE);
-
-	// Query for the size of the trace
-	UsbCommand response;
-	GetFromBigBuf(trace, USB_CMD_DATA_SIZE, 0);
-	WaitForResponse(CMD_ACK, &response);
-	uint16_t traceLen = response.arg[2];
-	if (traceLen > USB_CMD_DATA_SIZE) {
-		uint8_t *p = realloc(trace, traceLen);
-		if (p == NULL) {
-			PrintAndLog("Cannot allocate memory for trace");
-			free(trace);
-			return 2;
-		}
-		trace = p;
-		GetFromBigBuf(trace, traceLen, 0);
-		WaitForResponse(CMD_ACK, NULL);
+
+	// trace length and data in one transfer
+	bigbuf_download_t *download = DownloadBigBuf(0, 0, true, NULL, NULL);
+	if (download == NULL) {
+		PrintAndLog("Cannot download trace");
+		return 2;
 	}
+	uint8_t *trace = download->data;
+	uint16_t traceLen = download->len;
 	
 	PrintAndLog("Recorded Activity (TraceLen = %d bytes)", traceLen);
 	PrintAndLog("");
@@ -656,7 +647,7 @@ int CmdHFList(const char *Cmd)
 		tracepos = printTraceLine(tracepos, traceLen, trace, protocol, showWaitCycles, markCRCBytes);
 	}
 
-	free(trace);
+	free(download);
 	return 0;
 }
 
@@ -14,6 +14,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include "iso14443crc.h" // Can also be used for iClass, using 0xE012 as CRC-type
 #include "data.h"
 #include "proxmark3.h"
@@ -22,6 +25,7 @@
 #include "cmdhficlass.h"
 #include "common.h"
 #include "util.h"
+#include "util_posix.h"
 #include "cmdmain.h"
 #include "loclass/des.h"
 #include "loclass/cipherutils.h"
@@ -29,6 +33,7 @@
 #include "loclass/ikeys.h"
 #include "loclass/elite_crack.h"
 #include "loclass/fileutils.h"
+#include "loclass/iclass_mac_core.h"
 #include "protocols.h"
 #include "usb_cmd.h"
 #include "cmdhfmfu.h"
@@ -1265,6 +1270,7 @@ int CmdHFiClass_loclass(const char *Cmd) {
 	{
 		int errors = testCipherUtils();
 		errors += testMAC();
+		errors += testMACBatch();
 		errors += doKeyTests(0);
 		errors += testElite();
 		if(errors)
@@ -1277,6 +1283,319 @@ int CmdHFiClass_loclass(const char *Cmd) {
 	return 0;
 }
 
+// offline dictionary attack against a MAC sniffed from a reader.
+// The file is read in blocks of keys, which are diversified and checked by
+// one worker thread per CPU.
+#define LOOKUP_BLOCK_KEYS	4096
+#define LOOKUP_QUEUE_BLOCKS	8
+
+typedef struct {
+	uint32_t count;
+	uint8_t keys[LOOKUP_BLOCK_KEYS][8];
+} lookup_block_t;
+
+typedef struct {
+	uint8_t csn[8];
+	uint8_t cc_nr[12];
+	uint8_t mac[4];
+	bool elite;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	lookup_block_t *queue[LOOKUP_QUEUE_BLOCKS];
+	uint32_t head;
+	uint32_t tail;
+	uint32_t used;
+	bool eof;
+	volatile bool found;
+	uint8_t found_key[8];
+} lookup_ctx_t;
+
+static void *lookupWorker(void *arg) {
+	lookup_ctx_t *ctx = (lookup_ctx_t *)arg;
+	uint8_t div_keys[ICLASS_MAC_LANES][8];
+	uint8_t macs[ICLASS_MAC_LANES][4];
+
+	pthread_mutex_lock(&ctx->lock);
+	while (true) {
+		while (ctx->used == 0 && !ctx->eof && !ctx->found) {
+			pthread_cond_wait(&ctx->not_empty, &ctx->lock);
+		}
+		if (ctx->used == 0 || ctx->found) break;
+
+		lookup_block_t *block = ctx->queue[ctx->tail];
+		ctx->tail = (ctx->tail + 1) % LOOKUP_QUEUE_BLOCKS;
+		ctx->used--;
+		pthread_cond_signal(&ctx->not_full);
+		pthread_mutex_unlock(&ctx->lock);
+
+		int hit = -1;
+		for (uint32_t i = 0; i < block->count && hit < 0 && !ctx->found; i += ICLASS_MAC_LANES) {
+			uint32_t n = block->count - i < ICLASS_MAC_LANES ? block->count - i : ICLASS_MAC_LANES;
+			for (uint32_t j = 0; j < n; j++) {
+				HFiClassCalcDivKey(ctx->csn, block->keys[i + j], div_keys[j], ctx->elite);
+			}
+			iclass_mac_batch(ctx->cc_nr, div_keys, macs, n);
+			for (uint32_t j = 0; j < n; j++) {
+				if (memcmp(macs[j], ctx->mac, 4) == 0) {
+					hit = i + j;
+					break;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		if (hit >= 0 && !ctx->found) {
+			memcpy(ctx->found_key, block->keys[hit], 8);
+			ctx->found = true;
+			pthread_cond_broadcast(&ctx->not_empty);
+			pthread_cond_broadcast(&ctx->not_full);
+		}
+		free(block);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+// hands a block over to the workers. Returns false if the search is over.
+static bool lookupQueueBlock(lookup_ctx_t *ctx, lookup_block_t *block) {
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->used == LOOKUP_QUEUE_BLOCKS && !ctx->found) {
+		pthread_cond_wait(&ctx->not_full, &ctx->lock);
+	}
+	bool queued = !ctx->found;
+	if (queued) {
+		ctx->queue[ctx->head] = block;
+		ctx->head = (ctx->head + 1) % LOOKUP_QUEUE_BLOCKS;
+		ctx->used++;
+		pthread_cond_signal(&ctx->not_empty);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	if (!queued) free(block);
+	return queued;
+}
+
+// frees the blocks still waiting in the queue
+static void lookupDropQueue(lookup_ctx_t *ctx) {
+	while (ctx->used > 0) {
+		free(ctx->queue[ctx->tail]);
+		ctx->tail = (ctx->tail + 1) % LOOKUP_QUEUE_BLOCKS;
+		ctx->used--;
+	}
+}
+
+static int hexnibble(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// parses a dictionary line holding a key as 16 hex symbols.
+// Returns 0 for a key, 1 for empty lines and comments, -1 for garbage
+static int lookupParseLine(const char *line, uint8_t *key) {
+	while (*line == ' ' || *line == '\t') line++;
+	if (*line == '#' || *line == '\r' || *line == '\n' || *line == '\0') return 1;
+
+	for (int i = 0; i < 8; i++) {
+		int hi = hexnibble(line[i * 2]);
+		int lo = hi < 0 ? -1 : hexnibble(line[i * 2 + 1]);
+		if (lo < 0) return -1;
+		key[i] = (hi << 4) | lo;
+	}
+	if (isxdigit((unsigned char)line[16])) return -1;
+	return 0;
+}
+
+int usage_hf_iclass_lookup(void) {
+	PrintAndLog("Lookup a key in a dictionary file, using a MAC sniffed from a reader. Works offline.");
+	PrintAndLog("Usage:  hf iclass lookup f <dictfile> u <csn> p <epurse> m <nr+mac> [e]");
+	PrintAndLog("  Options:");
+	PrintAndLog("  f <filename> : *dictionary file with one key (16 hex symbols) per line");
+	PrintAndLog("  u <csn>      : *card Serial number, 16 hex symbols");
+	PrintAndLog("  p <epurse>   : *epurse (CC) the card answered with, 16 hex symbols");
+	PrintAndLog("  m <nr+mac>   : *reader nonce and MAC from the reader's CHECK command, 16 hex symbols");
+	PrintAndLog("  e            : keys in the dictionary are elite keys");
+	PrintAndLog("Samples:");
+	PrintAndLog("  hf iclass lookup f iclass_keys.dic u 010a0ffff7ff12e0 p feffffffffffffff m 1dd8a8a6b8ac2a79");
+	PrintAndLog("  hf iclass lookup f iclass_keys.dic u 010a0ffff7ff12e0 p feffffffffffffff m 1dd8a8a6b8ac2a79 e");
+	PrintAndLog("NOTE: * = required\n");
+	return 1;
+}
+
+int CmdHFiClassLookup(const char *Cmd) {
+	char filename[FILE_PATH_SIZE] = {0};
+	uint8_t CSN[8] = {0};
+	uint8_t EPURSE[8] = {0};
+	uint8_t NRMAC[8] = {0};
+	bool haveFile = false, haveCSN = false, haveEpurse = false, haveNRMAC = false;
+	bool elite = false;
+	bool errors = false;
+	uint8_t cmdp = 0;
+	while(param_getchar(Cmd, cmdp) != 0x00 && !errors)
+	{
+		switch(param_getchar(Cmd, cmdp))
+		{
+		case 'h':
+		case 'H':
+			return usage_hf_iclass_lookup();
+		case 'e':
+		case 'E':
+			elite = true;
+			cmdp++;
+			break;
+		case 'f':
+		case 'F':
+			if (param_getlength(Cmd, cmdp+1) >= sizeof(filename)) {
+				PrintAndLog("\nERROR: Filename too long\n");
+				errors = true;
+			} else {
+				param_getstr(Cmd, cmdp+1, filename);
+			}
+			haveFile = true;
+			cmdp += 2;
+			break;
+		case 'u':
+		case 'U':
+			if (param_gethex(Cmd, cmdp+1, CSN, 16)) {
+				PrintAndLog("\nERROR: CSN must include 16 HEX symbols\n");
+				errors = true;
+			}
+			haveCSN = true;
+			cmdp += 2;
+			break;
+		case 'p':
+		case 'P':
+			if (param_gethex(Cmd, cmdp+1, EPURSE, 16)) {
+				PrintAndLog("\nERROR: epurse must include 16 HEX symbols\n");
+				errors = true;
+			}
+			haveEpurse = true;
+			cmdp += 2;
+			break;
+		case 'm':
+		case 'M':
+			if (param_gethex(Cmd, cmdp+1, NRMAC, 16)) {
+				PrintAndLog("\nERROR: NR+MAC must include 16 HEX symbols\n");
+				errors = true;
+			}
+			haveNRMAC = true;
+			cmdp += 2;
+			break;
+		default:
+			PrintAndLog("Unknown parameter '%c'\n", param_getchar(Cmd, cmdp));
+			errors = true;
+			break;
+		}
+	}
+	if (errors || !haveFile || !haveCSN || !haveEpurse || !haveNRMAC) return usage_hf_iclass_lookup();
+
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		PrintAndLog("File: %s: not found or locked.", filename);
+		return 1;
+	}
+
+	lookup_ctx_t ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	memcpy(ctx.csn, CSN, 8);
+	memcpy(ctx.cc_nr, EPURSE, 8);
+	memcpy(ctx.cc_nr + 8, NRMAC, 4);
+	memcpy(ctx.mac, NRMAC + 4, 4);
+	ctx.elite = elite;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.not_empty, NULL);
+	pthread_cond_init(&ctx.not_full, NULL);
+
+	int num_threads = num_CPUs();
+	pthread_t threads[num_threads];
+	for (int i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, lookupWorker, &ctx);
+	}
+
+	PrintAndLog("Looking up %s key with %d threads. Press keyboard to abort", elite ? "elite" : "standard", num_threads);
+	uint64_t t1 = msclock();
+	uint64_t keycount = 0;
+	uint32_t lineno = 0;
+	bool aborted = false;
+	char buf[256];
+	lookup_block_t *block = NULL;
+	while (fgets(buf, sizeof(buf), f)) {
+		lineno++;
+		// skip the rest of overlong lines
+		if (strchr(buf, '\n') == NULL && !feof(f)) {
+			int c;
+			while ((c = fgetc(f)) != '\n' && c != EOF) ;
+		}
+		if (block == NULL) {
+			block = malloc(sizeof(lookup_block_t));
+			if (!block) {
+				PrintAndLog("Cannot allocate memory for keys");
+				break;
+			}
+			block->count = 0;
+		}
+		int res = lookupParseLine(buf, block->keys[block->count]);
+		if (res < 0) {
+			PrintAndLog("File content error. Line %u must include 16 HEX symbols", lineno);
+			continue;
+		}
+		if (res > 0) continue;
+		keycount++;
+		if (++block->count == LOOKUP_BLOCK_KEYS) {
+			bool queued = lookupQueueBlock(&ctx, block);
+			block = NULL;
+			if (!queued) break;
+			if (ukbhit() > 0) {
+				aborted = true;
+				break;
+			}
+		}
+	}
+	if (block != NULL) {
+		if (block->count > 0 && !aborted) {
+			lookupQueueBlock(&ctx, block);
+		} else {
+			free(block);
+		}
+	}
+	fclose(f);
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.eof = true;
+	if (aborted) {
+		// let the workers drop the queued blocks
+		lookupDropQueue(&ctx);
+	}
+	pthread_cond_broadcast(&ctx.not_empty);
+	pthread_mutex_unlock(&ctx.lock);
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	// workers stop as soon as the key is found and leave the rest of the queue behind
+	lookupDropQueue(&ctx);
+	pthread_cond_destroy(&ctx.not_full);
+	pthread_cond_destroy(&ctx.not_empty);
+	pthread_mutex_destroy(&ctx.lock);
+
+	t1 = msclock() - t1;
+	if (ctx.found) {
+		uint8_t div_key[8] = {0};
+		HFiClassCalcDivKey(CSN, ctx.found_key, div_key, elite);
+		PrintAndLog("Found valid key %s", sprint_hex(ctx.found_key, 8));
+		PrintAndLog("Div key %s", sprint_hex(div_key, 8));
+		PrintAndLog("Time in lookup: %.1f seconds", (float)t1/1000.0);
+		return 0;
+	}
+	if (aborted) {
+		PrintAndLog("Aborted by keypress after %" PRIu64 " keys", keycount);
+	} else {
+		PrintAndLog("No key found. Tested %" PRIu64 " keys in %.1f seconds", keycount, (float)t1/1000.0);
+	}
+	return 1;
+}
+
 void printIclassDumpContents(uint8_t *iclass_dump, uint8_t startblock, uint8_t endblock, size_t filesize) {
 	uint8_t mem_config;
 	memcpy(&mem_config, iclass_dump + 13,1);
@@ -1383,7 +1702,7 @@ void HFiClassCalcDivKey(uint8_t	*CSN, uint8_t	*KEY, uint8_t *div_key, bool elite
 	if (elite) {
 		uint8_t key_sel[8] = { 0 };
 		uint8_t key_sel_p[8] = { 0 };
-		hash2(KEY, keytable);
+		hash2_keytable(KEY, keytable);
 		hash1(CSN, key_index);
 		for(uint8_t i = 0; i < 8 ; i++)
 			key_sel[i] = keytable[key_index[i]] & 0xFF;
@@ -1710,6 +2029,7 @@ static command_t CommandTable[] =
 	{"encryptblk",  CmdHFiClassEncryptBlk,      	1,	"<BlockData> Encrypt given block data"},
 	{"list",        CmdHFiClassList,            	0,	"            (Deprecated) List iClass history"},
 	{"loclass",     CmdHFiClass_loclass,        	1,	"[options..] Use loclass to perform bruteforce of reader attack dump"},
+	{"lookup",      CmdHFiClassLookup,          	1,	"[options..] Lookup a key in a dictionary file, using a sniffed reader MAC"},
 	{"managekeys",  CmdHFiClassManageKeys,      	1,	"[options..] Manage the keys to use with iClass"},
 	{"readblk",     CmdHFiClass_ReadBlock,      	0,	"[options..] Authenticate and Read iClass block"},
 	{"reader",      CmdHFiClassReader,          	0,	"            Look for iClass tags until a key or the pm3 button is pressed"},
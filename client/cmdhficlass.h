@@ -30,6 +30,7 @@ int CmdHFiClass_ReadBlock(const char *Cmd);
 int CmdHFiClass_TestMac(const char *Cmd);
 int CmdHFiClassManageKeys(const char *Cmd);
 int CmdHFiClass_loclass(const char *Cmd);
+int CmdHFiClassLookup(const char *Cmd);
 int CmdHFiClassSnoop(const char *Cmd);
 int CmdHFiClassSim(const char *Cmd);
 int CmdHFiClassWriteKeyFile(const char *Cmd);
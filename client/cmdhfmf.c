@@ -18,6 +18,9 @@
 #include "proxmark3.h"
 #include "cmdmain.h"
 #include "cmdhfmfhard.h"
+#include "hardnested/hardnested_distributed.h"
+#include "hardnested/hardnested_bruteforce.h"
+#include "hardnested/hardnested_noncefile.h"
 #include "util.h"
 #include "util_posix.h"
 #include "usb_cmd.h"
@@ -42,6 +45,7 @@ int CmdHF14AMifare(const char *Cmd)
 		case -4 : PrintAndLog("Card is not vulnerable to Darkside attack (its random number generator seems to be based on the wellknown");
 				  PrintAndLog("generating polynomial with 16 effective bits only, but shows unexpected behaviour."); return 1;
 		case -5 : PrintAndLog("Aborted via keyboard.");  return 1;
+		case -6 : PrintAndLog("Out of memory.");  return 1;
 		default : PrintAndLog("Found valid key:%012" PRIx64 "\n", key);
 	}
 
@@ -672,40 +676,46 @@ int CmdHF14AMfNested(const char *Cmd)
 			}
 		}
 
-		// nested sectors
-		iterations = 0;
-		PrintAndLog("nested...");
-		bool calibrate = true;
-		for (i = 0; i < NESTED_SECTOR_RETRY; i++) {
-			for (uint8_t sectorNo = 0; sectorNo < SectorsCnt; sectorNo++) {
-				for (trgKeyType = 0; trgKeyType < 2; trgKeyType++) {
-					if (e_sector[sectorNo].foundKey[trgKeyType]) continue;
-					PrintAndLog("-----------------------------------------------");
-					int16_t isOK = mfnested(blockNo, keyType, key, FirstBlockOfSector(sectorNo), trgKeyType, keyBlock, calibrate);
-					if(isOK) {
-						switch (isOK) {
-							case -1 : PrintAndLog("Error: No response from Proxmark.\n"); break;
-							case -2 : PrintAndLog("Button pressed. Aborted.\n"); break;
-							case -3 : PrintAndLog("Tag isn't vulnerable to Nested Attack (random numbers are not predictable).\n"); break;
-							default : PrintAndLog("Unknown Error.\n");
-						}
-						free(e_sector);
-						return 2;
-					} else {
-						calibrate = false;
-					}
+		// nested sectors. The nonces for the next sectors are acquired while the keys of the previous ones are calculated.
+		nested_target_t *targets = calloc(SectorsCnt * 2, sizeof(nested_target_t));
+		if (targets == NULL) {
+			free(e_sector);
+			return 1;
+		}
+		for (i = 0; i < SectorsCnt; i++) {
+			for (j = 0; j < 2; j++) {
+				targets[i * 2 + j].blockNo = FirstBlockOfSector(i);
+				targets[i * 2 + j].keyType = j;
+				targets[i * 2 + j].found = e_sector[i].foundKey[j];
+			}
+		}
 
-					iterations++;
+		PrintAndLog("nested...");
+		int16_t isOK = mfnested_pipelined(blockNo, keyType, key, targets, SectorsCnt * 2, NESTED_SECTOR_RETRY);
+		if (isOK) {
+			switch (isOK) {
+				case -1 : PrintAndLog("Error: No response from Proxmark.\n"); break;
+				case -2 : PrintAndLog("Button pressed. Aborted.\n"); break;
+				case -3 : PrintAndLog("Tag isn't vulnerable to Nested Attack (random numbers are not predictable).\n"); break;
+				case -4 : PrintAndLog("Out of memory.\n"); break;
+				default : PrintAndLog("Unknown Error.\n");
+			}
+			free(targets);
+			free(e_sector);
+			return 2;
+		}
 
-					key64 = bytes_to_num(keyBlock, 6);
-					if (key64) {
-						PrintAndLog("Found valid key:%012" PRIx64, key64);
-						e_sector[sectorNo].foundKey[trgKeyType] = 1;
-						e_sector[sectorNo].Key[trgKeyType] = key64;
-					}
+		iterations = 0;
+		for (i = 0; i < SectorsCnt; i++) {
+			for (j = 0; j < 2; j++) {
+				iterations += targets[i * 2 + j].attempts;
+				if (targets[i * 2 + j].found && !e_sector[i].foundKey[j]) {
+					e_sector[i].foundKey[j] = 1;
+					e_sector[i].Key[j] = targets[i * 2 + j].key;
 				}
 			}
 		}
+		free(targets);
 
 		printf("Time in nested: %1.3f (%1.3f sec per key)\n\n", ((float)(msclock() - msclock1))/1000.0, ((float)(msclock() - msclock1))/iterations/1000.0);
 
@@ -779,39 +789,166 @@ int CmdHF14AMfNestedHard(const char *Cmd)
 	char ctmp;
 	ctmp = param_getchar(Cmd, 0);
 
-	if (ctmp != 'R' && ctmp != 'r' && ctmp != 'T' && ctmp != 't' && strlen(Cmd) < 20) {
+	if (ctmp != 'R' && ctmp != 'r' && ctmp != 'T' && ctmp != 't' && ctmp != 'C' && ctmp != 'c' && ctmp != 'B' && ctmp != 'b' && ctmp != 'D' && ctmp != 'd' && ctmp != 'J' && ctmp != 'j' && ctmp != 'F' && ctmp != 'f' && ctmp != 'L' && ctmp != 'l' && ctmp != 'M' && ctmp != 'm' && ctmp != 'K' && ctmp != 'k' && strlen(Cmd) < 20) {
 		PrintAndLog("Usage:");
 		PrintAndLog("      hf mf hardnested <block number> <key A|B> <key (12 hex symbols)>");
-		PrintAndLog("                       <target block number> <target key A|B> [known target key (12 hex symbols)] [w] [s]");
+		PrintAndLog("                       <target block number> <target key A|B> [known target key (12 hex symbols)] [w|a] [s]");
 		PrintAndLog("  or  hf mf hardnested r [known target key]");
+		PrintAndLog("  or  hf mf hardnested f <nonce file|named pipe> [known target key]");
+		PrintAndLog("  or  hf mf hardnested l <nonce file>");
+		PrintAndLog("  or  hf mf hardnested m <output nonce file> <nonce file> [nonce file ...]");
+		PrintAndLog("  or  hf mf hardnested b <file with list of nonce files>");
+		PrintAndLog("  or  hf mf hardnested c");
+		PrintAndLog("  or  hf mf hardnested d <[host:]port|socket path> [known target key]");
+		PrintAndLog("  or  hf mf hardnested j <host:port|socket path> [number of threads]");
+		PrintAndLog("  or  hf mf hardnested k <on [checkpoint file]|off|clear>");
 		PrintAndLog(" ");
 		PrintAndLog("Options: ");
 		PrintAndLog("      w: Acquire nonces and write them to binary file nonces.bin");
+		PrintAndLog("      a: Acquire nonces and add them to binary file nonces.bin, which can hold the nonces of several targets");
 		PrintAndLog("      s: Slower acquisition (required by some non standard cards)");
-		PrintAndLog("      r: Read nonces.bin and start attack");
+		PrintAndLog("      r: Read nonces.bin and start attack on the target acquired last");
+		PrintAndLog("      f: Read nonces while they are being written to a file or pipe and start attack as soon as there are enough.");
+		PrintAndLog("         The target is the one of the capture appended last");
+		PrintAndLog("      b: Batch mode. Attack all targets in the nonce files (nonces.bin format) listed in a text file, one per line");
+		PrintAndLog("      c: Create an uncompressed cache of the bitflip tables for faster startup (one time, ~500MB disk space)");
+		PrintAndLog("      d: Read nonces.bin and start attack. Workers connecting to the given port or Unix socket help with the brute force");
+		PrintAndLog("      j: Join an attack started with d as a worker. Uses all CPUs by default");
+		PrintAndLog("      l: List the targets in a nonce file");
+		PrintAndLog("      m: Add the nonces of all targets in the nonce files to the output file in compressed form");
+		PrintAndLog("      k: Switch brute force checkpoints on (optionally to another file) or off for this session, or delete the checkpoint file");
+		PrintAndLog(" ");
+		PrintAndLog("Brute force progress is saved to hardnested_checkpoint.bin. An interrupted attack on the same nonces resumes from there.");
+		PrintAndLog("The progress of an attack is removed when it finishes, with or without a key.");
 		PrintAndLog(" ");
 		PrintAndLog("      sample1: hf mf hardnested 0 A FFFFFFFFFFFF 4 A");
 		PrintAndLog("      sample2: hf mf hardnested 0 A FFFFFFFFFFFF 4 A w");
 		PrintAndLog("      sample3: hf mf hardnested 0 A FFFFFFFFFFFF 4 A w s");
 		PrintAndLog("      sample4: hf mf hardnested r");
+		PrintAndLog("      sample5: hf mf hardnested b noncefiles.txt");
+		PrintAndLog("      sample6: hf mf hardnested d 40100");
+		PrintAndLog("      sample7: hf mf hardnested j 192.168.1.10:40100");
+		PrintAndLog("      sample8: hf mf hardnested f /tmp/nonces.fifo");
+		PrintAndLog("      sample9: hf mf hardnested m archive.bin nonces.bin");
 		PrintAndLog(" ");
 		PrintAndLog("Add the known target key to check if it is present in the remaining key space:");
-		PrintAndLog("      sample5: hf mf hardnested 0 A A0A1A2A3A4A5 4 A FFFFFFFFFFFF");
+		PrintAndLog("      sample10: hf mf hardnested 0 A A0A1A2A3A4A5 4 A FFFFFFFFFFFF");
 		return 0;
 	}
 
 	bool know_target_key = false;
 	bool nonce_file_read = false;
 	bool nonce_file_write = false;
+	bool nonce_file_append = false;
+	char nonce_stream[FILE_PATH_SIZE] = {0};
 	bool slow = false;
 	int tests = 0;
 
 
-	if (ctmp == 'R' || ctmp == 'r') {
+	if (ctmp == 'C' || ctmp == 'c') {
+		return hardnested_create_table_cache();
+	}
+
+	if (ctmp == 'B' || ctmp == 'b') {
+		char list_file_name[FILE_PATH_SIZE] = {0};
+		if (param_getstr(Cmd, 1, list_file_name) == 0) {
+			PrintAndLog("Missing name of file with list of nonce files");
+			return 1;
+		}
+		return mfnestedhard_batch(list_file_name);
+	}
+
+	if (ctmp == 'L' || ctmp == 'l') {
+		char nonce_file_name[FILE_PATH_SIZE] = {0};
+		if (param_getstr(Cmd, 1, nonce_file_name) == 0) {
+			PrintAndLog("Missing name of nonce file");
+			return 1;
+		}
+		return nonce_file_list(nonce_file_name);
+	}
+
+	if (ctmp == 'M' || ctmp == 'm') {
+		char nonce_file_names[16][FILE_PATH_SIZE];
+		char *inputs[16];
+		uint32_t num_inputs = 0;
+		if (param_getstr(Cmd, 1, nonce_file_names[0]) == 0 || param_getstr(Cmd, 2, nonce_file_names[1]) == 0) {
+			PrintAndLog("Missing name of output or input nonce file");
+			return 1;
+		}
+		while (param_getstr(Cmd, num_inputs + 2, nonce_file_names[num_inputs + 1]) != 0) {
+			inputs[num_inputs] = nonce_file_names[num_inputs + 1];
+			num_inputs++;
+			if (num_inputs == 15 && param_getchar(Cmd, num_inputs + 2) != 0x00) {
+				PrintAndLog("Too many nonce files. At most 15 can be merged at once");
+				return 1;
+			}
+		}
+		return nonce_file_merge(nonce_file_names[0], inputs, num_inputs);
+	}
+
+	if (ctmp == 'K' || ctmp == 'k') {
+		char action[FILE_PATH_SIZE] = {0};
+		char checkpoint_file[FILE_PATH_SIZE] = {0};
+		param_getstr(Cmd, 1, action);
+		if (!strcmp(action, "on")) {
+			param_getstr(Cmd, 2, checkpoint_file);
+			hardnested_set_checkpoints(true, checkpoint_file);
+		} else if (!strcmp(action, "off")) {
+			hardnested_set_checkpoints(false, NULL);
+		} else if (!strcmp(action, "clear")) {
+			hardnested_checkpoints(checkpoint_file);
+			if (!hardnested_clear_checkpoints()) {
+				PrintAndLog("Could not delete checkpoint file %s", checkpoint_file);
+				return 1;
+			}
+			PrintAndLog("Checkpoint file %s deleted", checkpoint_file);
+			return 0;
+		} else if (action[0] != '\0') {
+			PrintAndLog("Possible actions are on, off and clear");
+			return 1;
+		}
+		bool enabled = hardnested_checkpoints(checkpoint_file);
+		PrintAndLog("Brute force checkpoints: %s (%s)", enabled ? "on" : "off", checkpoint_file);
+		return 0;
+	}
+
+	if (ctmp == 'J' || ctmp == 'j') {
+		char address[FILE_PATH_SIZE] = {0};
+		if (param_getstr(Cmd, 1, address) == 0) {
+			PrintAndLog("Missing address of coordinator");
+			return 1;
+		}
+		return hardnested_worker(address, param_get32ex(Cmd, 2, 0, 10));
+	}
+
+	bool distributed = false;
+	if (ctmp == 'D' || ctmp == 'd') {
+		char address[FILE_PATH_SIZE] = {0};
+		if (param_getstr(Cmd, 1, address) == 0) {
+			PrintAndLog("Missing port or socket path to listen on");
+			return 1;
+		}
+		if (!hardnested_coordinator_start(address)) {
+			return 1;
+		}
+		distributed = true;
+		nonce_file_read = true;
+		if (!param_gethex(Cmd, 2, trgkey, 12)) {
+			know_target_key = true;
+		}
+	} else if (ctmp == 'R' || ctmp == 'r') {
 		nonce_file_read = true;
 		if (!param_gethex(Cmd, 1, trgkey, 12)) {
 			know_target_key = true;
 		}
+	} else if (ctmp == 'F' || ctmp == 'f') {
+		if (param_getstr(Cmd, 1, nonce_stream) == 0) {
+			PrintAndLog("Missing name of nonce file or pipe");
+			return 1;
+		}
+		if (!param_gethex(Cmd, 2, trgkey, 12)) {
+			know_target_key = true;
+		}
 	} else if (ctmp == 'T' || ctmp == 't') {
 		tests = param_get32ex(Cmd, 1, 100, 10);
 		if (!param_gethex(Cmd, 2, trgkey, 12)) {
@@ -855,8 +992,11 @@ int CmdHF14AMfNestedHard(const char *Cmd)
 				slow = true;
 			} else if (ctmp == 'w' || ctmp == 'W') {
 				nonce_file_write = true;
+			} else if (ctmp == 'a' || ctmp == 'A') {
+				nonce_file_write = true;
+				nonce_file_append = true;
 			} else {
-				PrintAndLog("Possible options are w and/or s");
+				PrintAndLog("Possible options are w or a and/or s");
 				return 1;
 			}
 			i++;
@@ -868,11 +1008,15 @@ int CmdHF14AMfNestedHard(const char *Cmd)
 			trgKeyType?'B':'A',
 			trgkey[0], trgkey[1], trgkey[2], trgkey[3], trgkey[4], trgkey[5],
 			know_target_key?"":" (not set)",
-			nonce_file_write?"write":nonce_file_read?"read":"none",
+			nonce_file_append?"append":nonce_file_write?"write":nonce_file_read?"read":nonce_stream[0]?"stream":"none",
 			slow?"Yes":"No",
 			tests);
 
-	int16_t isOK = mfnestedhard(blockNo, keyType, key, trgBlockNo, trgKeyType, know_target_key?trgkey:NULL, nonce_file_read, nonce_file_write, slow, tests);
+	int16_t isOK = mfnestedhard(blockNo, keyType, key, trgBlockNo, trgKeyType, know_target_key?trgkey:NULL, nonce_file_read, nonce_file_write, nonce_file_append, nonce_stream[0]?nonce_stream:NULL, slow, tests);
+
+	if (distributed) {
+		hardnested_coordinator_stop();
+	}
 
 	if (isOK) {
 		switch (isOK) {
@@ -21,11 +21,17 @@
 #include <inttypes.h>
 #include <string.h>
 #include <time.h>
-#include <pthread.h>
 #include <locale.h>
 #include <math.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "proxmark3.h"
 #include "cmdmain.h"
+#include "data.h"
 #include "ui.h"
 #include "util.h"
 #include "util_posix.h"
@@ -33,15 +39,24 @@
 #include "parity.h"
 #include "hardnested/hardnested_bruteforce.h"
 #include "hardnested/hardnested_bitarray_core.h"
+#include "hardnested/hardnested_threadpool.h"
+#include "hardnested/hardnested_noncefile.h"
 #include "zlib.h"
 
-#define NUM_CHECK_BITFLIPS_THREADS		(num_CPUs())
-#define NUM_REDUCTION_WORKING_THREADS	(num_CPUs())
+#define NUM_CHECK_BITFLIPS_TASKS		(MIN(4 * hardnested_num_workers(), 128))
 
 #define IGNORE_BITFLIP_THRESHOLD		0.99	// ignore bitflip arrays which have nearly only valid states
 
 #define STATE_FILES_DIRECTORY			"hardnested/tables/"
 #define STATE_FILE_TEMPLATE				"bitflip_%d_%03" PRIx16 "_states.bin.z"
+#define STATE_CACHE_FILE				"bitflip_states.cache"
+#define STATE_CACHE_MAGIC				"PM3BFTC\0"
+#define STATE_CACHE_VERSION				1
+#define STATE_CACHE_ALIGNMENT			4096	// page size
+#define BITARRAY_SIZE					(sizeof(uint32_t) * (1<<19))
+#define STREAM_POLL_INTERVAL			100		// ms to wait for more data from a nonce stream
+#define STREAM_IDLE_TIMEOUT				10000	// ms without new data after which a growing nonce file is considered complete
+#define STREAM_BATCH_SIZE				64		// nonce pairs to read before updating the key space estimation
 
 #define DEBUG_KEY_ELIMINATION
 // #define DEBUG_REDUCTION
@@ -93,7 +108,7 @@ static void print_progress_header(void) {
 	char progress_text[80];
 	char instr_set[12] = "";
 	get_SIMD_instruction_set(instr_set);
-	sprintf(progress_text, "Start using %d threads and %s SIMD core", num_CPUs(), instr_set);
+	sprintf(progress_text, "Start using %u threads and %s SIMD core", hardnested_num_workers(), instr_set);
 	PrintAndLog("\n\n");
 	PrintAndLog(" time    | #nonces | Activity                                                | expected to brute force");
 	PrintAndLog("         |         |                                                         | #states         | time ");
@@ -276,23 +291,19 @@ static void init_inflate(z_streamp compressed_stream, uint8_t *input_buffer, uin
 }
 
 
-static void init_bitflip_bitarrays(void)
+static void read_bitflip_files(void)
 {
 #if defined (DEBUG_REDUCTION)
 	uint8_t line = 0;
 #endif	
 
-
 	z_stream compressed_stream;
 	
 	char state_files_path[strlen(get_my_executable_directory()) + strlen(STATE_FILES_DIRECTORY) + strlen(STATE_FILE_TEMPLATE) + 1];
 	char state_file_name[strlen(STATE_FILE_TEMPLATE)+1];
 	
 	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
-		num_effective_bitflips[odd_even] = 0;
 		for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
-			bitflip_bitarrays[odd_even][bitflip] = NULL;
-			count_bitflip_bitarrays[odd_even][bitflip] = 1<<24;
 			sprintf(state_file_name, STATE_FILE_TEMPLATE, odd_even, bitflip);
 			strcpy(state_files_path, get_my_executable_directory());
 			strcat(state_files_path, STATE_FILES_DIRECTORY);
@@ -326,7 +337,6 @@ static void init_bitflip_bitarrays(void)
 					compressed_stream.next_out = (uint8_t *)bitset;
 					compressed_stream.avail_out = sizeof(uint32_t) * (1<<19);
 					inflate(&compressed_stream, Z_SYNC_FLUSH);
-					effective_bitflip[odd_even][num_effective_bitflips[odd_even]++] = bitflip;
 					bitflip_bitarrays[odd_even][bitflip] = bitset;
 					count_bitflip_bitarrays[odd_even][bitflip] = count;
 #if defined (DEBUG_REDUCTION)
@@ -341,6 +351,183 @@ static void init_bitflip_bitarrays(void)
 				inflateEnd(&compressed_stream);
 			}
 		}
+	}
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// bitflip table cache. 
+// An uncompressed copy of all effective bitflip bitarrays in one file. The file starts with a header and an 
+// index (one entry per odd_even and bitflip), followed by the page aligned bitarrays. It is mapped read only, 
+// i.e. the tables don't need to be decompressed and concurrent processes share the same physical pages.
+
+#if !defined(_WIN32)
+
+typedef struct {
+	uint32_t count;					// number of states in bitarray
+	uint32_t slot;					// position of bitarray in data area + 1. 0 = no bitarray
+} bitflip_cache_index_t;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_bitarrays;
+	bitflip_cache_index_t index[2][0x400];
+} bitflip_cache_header_t;
+
+static void *bitflip_cache_map = NULL;
+static size_t bitflip_cache_size = 0;
+
+
+static void get_bitflip_cache_path(char *path)
+{
+	strcpy(path, get_my_executable_directory());
+	strcat(path, STATE_FILES_DIRECTORY);
+	strcat(path, STATE_CACHE_FILE);
+}
+
+
+static size_t bitflip_cache_data_offset(void)
+{
+	return (sizeof(bitflip_cache_header_t) + STATE_CACHE_ALIGNMENT - 1) & ~(STATE_CACHE_ALIGNMENT - 1);
+}
+
+
+static bool map_bitflip_cache(void)
+{
+	char cache_path[strlen(get_my_executable_directory()) + strlen(STATE_FILES_DIRECTORY) + strlen(STATE_CACHE_FILE) + 1];
+	get_bitflip_cache_path(cache_path);
+
+	int fd = open(cache_path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	bitflip_cache_header_t header;
+	if (fstat(fd, &st) != 0 
+		|| read(fd, &header, sizeof(header)) != sizeof(header)
+		|| memcmp(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != STATE_CACHE_VERSION
+		|| (size_t)st.st_size != bitflip_cache_data_offset() + (size_t)header.num_bitarrays * BITARRAY_SIZE) {
+		PrintAndLog("Ignoring invalid bitflip table cache %s", cache_path);
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	uint8_t *data = (uint8_t *)map + bitflip_cache_data_offset();
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+			bitflip_cache_index_t *entry = &header.index[odd_even][bitflip];
+			if (entry->slot != 0 && entry->slot <= header.num_bitarrays) {
+				bitflip_bitarrays[odd_even][bitflip] = (uint32_t *)(data + (size_t)(entry->slot - 1) * BITARRAY_SIZE);
+				count_bitflip_bitarrays[odd_even][bitflip] = entry->count;
+			}
+		}
+	}
+
+	bitflip_cache_map = map;
+	bitflip_cache_size = st.st_size;
+	return true;
+}
+
+
+static void unmap_bitflip_cache(void)
+{
+	munmap(bitflip_cache_map, bitflip_cache_size);
+	bitflip_cache_map = NULL;
+	bitflip_cache_size = 0;
+}
+
+
+static int write_bitflip_cache(void)
+{
+	char cache_path[strlen(get_my_executable_directory()) + strlen(STATE_FILES_DIRECTORY) + strlen(STATE_CACHE_FILE) + 1];
+	get_bitflip_cache_path(cache_path);
+	char tmp_path[sizeof(cache_path) + 4];
+	sprintf(tmp_path, "%s.tmp", cache_path);
+
+	bitflip_cache_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = STATE_CACHE_VERSION;
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+			if (bitflip_bitarrays[odd_even][bitflip] != NULL) {
+				header.index[odd_even][bitflip].count = count_bitflip_bitarrays[odd_even][bitflip];
+				header.index[odd_even][bitflip].slot = ++header.num_bitarrays;
+			}
+		}
+	}
+
+	FILE *cachefile = fopen(tmp_path, "wb");
+	if (cachefile == NULL) {
+		PrintAndLog("Could not create file %s", tmp_path);
+		return 3;
+	}
+	
+	bool write_ok = (fwrite(&header, 1, sizeof(header), cachefile) == sizeof(header));
+	for (size_t i = sizeof(header); write_ok && i < bitflip_cache_data_offset(); i++) {
+		write_ok = (fputc(0, cachefile) != EOF);
+	}
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE && write_ok; odd_even++) {
+		for (uint16_t bitflip = 0x001; bitflip < 0x400 && write_ok; bitflip++) {
+			if (bitflip_bitarrays[odd_even][bitflip] != NULL) {
+				write_ok = (fwrite(bitflip_bitarrays[odd_even][bitflip], 1, BITARRAY_SIZE, cachefile) == BITARRAY_SIZE);
+			}
+		}
+	}
+	if (fclose(cachefile) != 0 || !write_ok) {
+		PrintAndLog("File write error with %s", tmp_path);
+		remove(tmp_path);
+		return 3;
+	}
+	
+	// atomically replace an existing cache, in case other processes are currently using it
+	if (rename(tmp_path, cache_path) != 0) {
+		PrintAndLog("Could not rename %s to %s", tmp_path, cache_path);
+		remove(tmp_path);
+		return 3;
+	}
+
+	PrintAndLog("Wrote %" PRIu32 " bitflip tables (%1.0f MiB) to %s", header.num_bitarrays, 
+		(float)(bitflip_cache_data_offset() + (size_t)header.num_bitarrays * BITARRAY_SIZE) / (1024*1024), cache_path);
+	return 0;
+}
+
+#endif
+
+
+static void init_bitflip_bitarrays(void)
+{
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+			bitflip_bitarrays[odd_even][bitflip] = NULL;
+			count_bitflip_bitarrays[odd_even][bitflip] = 1<<24;
+		}
+	}
+	
+	bool cached = false;
+#if !defined(_WIN32)
+	cached = map_bitflip_cache();
+#endif	
+	if (!cached) {
+		read_bitflip_files();
+	}
+
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		num_effective_bitflips[odd_even] = 0;
+		for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+			if (bitflip_bitarrays[odd_even][bitflip] != NULL) {
+				effective_bitflip[odd_even][num_effective_bitflips[odd_even]++] = bitflip;
+			}
+		}
 		effective_bitflip[odd_even][num_effective_bitflips[odd_even]] = 0x400;	// EndOfList marker
 	}
 
@@ -378,13 +565,24 @@ static void init_bitflip_bitarrays(void)
 	}
 #endif	
 	char progress_text[80];
-	sprintf(progress_text, "Using %d precalculated bitflip state tables", num_all_effective_bitflips);
+	sprintf(progress_text, "Using %d precalculated bitflip state tables%s", num_all_effective_bitflips, cached?" (cached)":"");
 	hardnested_print_progress(0, progress_text, (float)(1LL<<47), 0);
 }
 
 
 static void	free_bitflip_bitarrays(void)
 {
+#if !defined(_WIN32)
+	if (bitflip_cache_map != NULL) {
+		unmap_bitflip_cache();
+		for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+			for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+				bitflip_bitarrays[odd_even][bitflip] = NULL;
+			}
+		}
+		return;
+	}
+#endif
 	for (int16_t bitflip = 0x3ff; bitflip > 0x000; bitflip--) {
 		free_bitarray(bitflip_bitarrays[ODD_STATE][bitflip]);
 	}
@@ -394,11 +592,34 @@ static void	free_bitflip_bitarrays(void)
 }
 
 
+int hardnested_create_table_cache(void)
+{
+#if defined(_WIN32)
+	PrintAndLog("Bitflip table cache is not supported on this platform");
+	return 3;
+#else
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		for (uint16_t bitflip = 0x001; bitflip < 0x400; bitflip++) {
+			bitflip_bitarrays[odd_even][bitflip] = NULL;
+			count_bitflip_bitarrays[odd_even][bitflip] = 1<<24;
+		}
+	}
+	PrintAndLog("Decompressing bitflip tables...");
+	read_bitflip_files();
+	int res = write_bitflip_cache();
+	free_bitflip_bitarrays();
+	return res;
+#endif
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // sum property bitarrays
 
 static uint32_t *part_sum_a0_bitarrays[2][NUM_PART_SUMS];
 static uint32_t *part_sum_a8_bitarrays[2][NUM_PART_SUMS];
+static uint32_t *part_sum_a0_bitarrays_saved[2][NUM_PART_SUMS];
+static uint32_t *part_sum_a8_bitarrays_saved[2][NUM_PART_SUMS];
 static uint32_t *sum_a0_bitarrays[2][NUM_SUMS];	
 
 static uint16_t PartialSumProperty(uint32_t state, odd_even_t odd_even)
@@ -469,6 +690,46 @@ static void init_part_sum_bitarrays(void)
 }
 
 
+static void save_part_sum_bitarrays(void)
+{
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		for (uint16_t part_sum = 0; part_sum < NUM_PART_SUMS; part_sum++) {
+			part_sum_a0_bitarrays_saved[odd_even][part_sum] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1<<19));
+			part_sum_a8_bitarrays_saved[odd_even][part_sum] = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1<<19));
+			if (part_sum_a0_bitarrays_saved[odd_even][part_sum] == NULL || part_sum_a8_bitarrays_saved[odd_even][part_sum] == NULL) {
+				printf("Out of memory error in save_part_sum_bitarrays(). Aborting...\n");
+				exit(4);
+			}
+			memcpy(part_sum_a0_bitarrays_saved[odd_even][part_sum], part_sum_a0_bitarrays[odd_even][part_sum], sizeof(uint32_t) * (1<<19));
+			memcpy(part_sum_a8_bitarrays_saved[odd_even][part_sum], part_sum_a8_bitarrays[odd_even][part_sum], sizeof(uint32_t) * (1<<19));
+		}
+	}
+}
+
+
+static void restore_part_sum_bitarrays(void)
+{
+	// the partial sum bitarrays are reduced by update_sum_bitarrays() during an attack. Reset them for the next one.
+	for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+		for (uint16_t part_sum = 0; part_sum < NUM_PART_SUMS; part_sum++) {
+			memcpy(part_sum_a0_bitarrays[odd_even][part_sum], part_sum_a0_bitarrays_saved[odd_even][part_sum], sizeof(uint32_t) * (1<<19));
+			memcpy(part_sum_a8_bitarrays[odd_even][part_sum], part_sum_a8_bitarrays_saved[odd_even][part_sum], sizeof(uint32_t) * (1<<19));
+		}
+	}
+}
+
+
+static void free_saved_part_sum_bitarrays(void)
+{
+	for (int16_t part_sum = (NUM_PART_SUMS-1); part_sum >= 0; part_sum--) {
+		free_bitarray(part_sum_a8_bitarrays_saved[ODD_STATE][part_sum]);
+		free_bitarray(part_sum_a8_bitarrays_saved[EVEN_STATE][part_sum]);
+		free_bitarray(part_sum_a0_bitarrays_saved[ODD_STATE][part_sum]);
+		free_bitarray(part_sum_a0_bitarrays_saved[EVEN_STATE][part_sum]);
+	}
+}
+
+
 static void free_part_sum_bitarrays(void) 
 {
 	for (int16_t part_sum_a8 = (NUM_PART_SUMS-1); part_sum_a8 >= 0; part_sum_a8--) {
@@ -553,6 +814,9 @@ static uint64_t last_sample_clock = 0;
 static uint64_t sample_period = 0;
 static uint64_t num_keys_tested = 0;
 static statelist_t *candidates = NULL;
+static noncelistentry_t *second_byte_index[256][256];	// nonce list entry by 1st and 2nd byte. Invalid after pre_XOR_nonces()
+static uint8_t new_2nd_bytes[256][256];					// 2nd bytes not yet checked for bit flip properties
+static uint16_t num_new_2nd_bytes[256];
 
 
 static int add_nonce(uint32_t nonce_enc, uint8_t par_enc) 
@@ -592,6 +856,10 @@ static int add_nonce(uint32_t nonce_enc, uint8_t par_enc)
 	p2->nonce_enc = nonce_enc;
 	p2->par_enc = par_enc;
 
+	uint8_t second_byte = (nonce_enc >> 16) & 0xff;
+	second_byte_index[first_byte][second_byte] = p2;
+	new_2nd_bytes[first_byte][num_new_2nd_bytes[first_byte]++] = second_byte;
+
 	nonces[first_byte].num++;
 	nonces[first_byte].Sum += evenparity32((nonce_enc & 0x00ff0000) | (par_enc & 0x04));
 	nonces[first_byte].sum_a8_guess_dirty = true;   // indicates that we need to recalculate the Sum(a8) probability for this first byte
@@ -629,6 +897,10 @@ static void init_nonce_memory(void)
 		nonces[i].num_states_bitarray[ODD_STATE] = 1 << 24;
 		nonces[i].all_bitflips_dirty[EVEN_STATE] = false;
 		nonces[i].all_bitflips_dirty[ODD_STATE] = false;
+		for (uint16_t j = 0; j < 256; j++) {
+			second_byte_index[i][j] = NULL;
+		}
+		num_new_2nd_bytes[i] = 0;
 	}
 	first_byte_num = 0;
 	first_byte_Sum = 0;
@@ -1117,49 +1389,49 @@ static void estimate_sum_a8(void)
 }	
 
 
-static int read_nonce_file(void)
+static void add_nonce_from_file(uint32_t nt_enc, uint8_t par_enc, void *arg)
 {
-	FILE *fnonces = NULL;
-	size_t bytes_read;
-	uint8_t trgBlockNo;
-	uint8_t trgKeyType;
-	uint8_t read_buf[9];
-	uint32_t nt_enc1, nt_enc2;
-	uint8_t par_enc;
-	
+	add_nonce(nt_enc, par_enc);
+	num_acquired_nonces++;
+}
+
+
+// read the nonces of one target from a nonce file. A negative target number selects the most recently acquired target.
+static int read_nonce_file(char *filename, int32_t target, uint8_t *trgBlockNo, uint8_t *trgKeyType)
+{
+	nonce_file_index_t index;
+
 	num_acquired_nonces = 0;
-	if ((fnonces = fopen("nonces.bin","rb")) == NULL) { 
-		PrintAndLog("Could not open file nonces.bin");
+	int result = nonce_file_read_index(filename, &index);
+	if (result == 1) {
+		PrintAndLog("Could not open file %s", filename);
 		return 1;
-	}
-
-	hardnested_print_progress(0, "Reading nonces from file nonces.bin...", (float)(1LL<<47), 0);
-	bytes_read = fread(read_buf, 1, 6, fnonces);
-	if (bytes_read != 6) {
+	} else if (result != 0 || index.num_targets == 0) {
 		PrintAndLog("File reading error.");
-		fclose(fnonces);
+		nonce_file_free_index(&index);
 		return 1;
 	}
-	cuid = bytes_to_num(read_buf, 4);
-	trgBlockNo = bytes_to_num(read_buf+4, 1);
-	trgKeyType = bytes_to_num(read_buf+5, 1);
-
-	bytes_read = fread(read_buf, 1, 9, fnonces);
-	while (bytes_read == 9) {
-		nt_enc1 = bytes_to_num(read_buf, 4);
-		nt_enc2 = bytes_to_num(read_buf+4, 4);
-		par_enc = bytes_to_num(read_buf+8, 1);
-		add_nonce(nt_enc1, par_enc >> 4);
-		add_nonce(nt_enc2, par_enc & 0x0f);
-		num_acquired_nonces += 2;
-		bytes_read = fread(read_buf, 1, 9, fnonces);
+	if (target < 0) {
+		target = index.last_target;
 	}
-	fclose(fnonces);
-	
+
 	char progress_string[80];
+	snprintf(progress_string, sizeof(progress_string), "Reading nonces from file %s...", filename);
+	hardnested_print_progress(0, progress_string, (float)(1LL<<47), 0);
+	if (index.num_targets > 1) {
+		sprintf(progress_string, "Using target %" PRId32 " of %" PRIu32 " in file", target + 1, index.num_targets);
+		hardnested_print_progress(0, progress_string, (float)(1LL<<47), 0);
+	}
+
+	cuid = index.targets[target].cuid;
+	*trgBlockNo = index.targets[target].blockNo;
+	*trgKeyType = index.targets[target].keyType;
+	nonce_file_read_target(filename, &index, target, add_nonce_from_file, NULL);
+	nonce_file_free_index(&index);
+	
 	sprintf(progress_string, "Read %d nonces from file. cuid=%08x", num_acquired_nonces, cuid); 
 	hardnested_print_progress(num_acquired_nonces, progress_string, (float)(1LL<<47), 0);
-	sprintf(progress_string, "Target Block=%d, Keytype=%c", trgBlockNo, trgKeyType==0?'A':'B');
+	sprintf(progress_string, "Target Block=%d, Keytype=%c", *trgBlockNo, *trgKeyType==0?'A':'B');
 	hardnested_print_progress(num_acquired_nonces, progress_string, (float)(1LL<<47), 0);
 
 	for (uint16_t i = 0; i < NUM_SUMS; i++) {
@@ -1175,14 +1447,7 @@ static int read_nonce_file(void)
 
 noncelistentry_t *SearchFor2ndByte(uint8_t b1, uint8_t b2)
 {
-	noncelistentry_t *p = nonces[b1].first;
-	while (p != NULL) {
-		if ((p->nonce_enc >> 16 & 0xff) == b2) {
-			return p;
-		}
-		p = p->next;
-	}
-	return NULL;
+	return second_byte_index[b1][b2];
 }
 
 
@@ -1192,11 +1457,12 @@ static bool timeout(void)
 }
 
 
-static void *check_for_BitFlipProperties_thread(void *args)
+static void check_for_BitFlipProperties_task(void *all_args, uint32_t task)
 {
-	uint8_t first_byte = ((uint8_t *)args)[0];
-	uint8_t last_byte = ((uint8_t *)args)[1];
-	uint8_t time_budget = ((uint8_t *)args)[2];
+	uint8_t *args = (uint8_t *)all_args + 3 * task;
+	uint8_t first_byte = args[0];
+	uint8_t last_byte = args[1];
+	uint8_t time_budget = args[2];
 	
 	if (hardnested_stage & CHECK_1ST_BYTES) {
 		// for (uint16_t bitflip = 0x001; bitflip < 0x200; bitflip++) {
@@ -1206,7 +1472,7 @@ static void *check_for_BitFlipProperties_thread(void *args)
 #if defined (DEBUG_REDUCTION)				
 				printf("break at bitflip_idx %d...", bitflip_idx);
 #endif				
-				return NULL;
+				return;
 			}
 			for (uint16_t i = first_byte; i <= last_byte; i++) {
 				if (nonces[i].BitFlips[bitflip] == 0 && nonces[i].BitFlips[bitflip ^ 0x100] == 0
@@ -1229,11 +1495,11 @@ static void *check_for_BitFlipProperties_thread(void *args)
 					}
 				}
 			}
-			((uint8_t *)args)[1] = num_1st_byte_effective_bitflips - bitflip_idx - 1;  // bitflips still to go in stage 1
+			args[1] = num_1st_byte_effective_bitflips - bitflip_idx - 1;  // bitflips still to go in stage 1
 		}
 	}
 
-	((uint8_t *)args)[1] = 0;  // stage 1 definitely completed
+	args[1] = 0;  // stage 1 definitely completed
 
 	if (hardnested_stage & CHECK_2ND_BYTES) {
 		for (uint16_t bitflip_idx = num_1st_byte_effective_bitflips; bitflip_idx < num_all_effective_bitflips; bitflip_idx++) {
@@ -1242,12 +1508,13 @@ static void *check_for_BitFlipProperties_thread(void *args)
 #if defined (DEBUG_REDUCTION)
 				printf("break at bitflip_idx %d...", bitflip_idx);
 #endif
-				return NULL;
+				return;
 			}
 			for (uint16_t i = first_byte; i <= last_byte; i++) {
-				// Check for Bit Flip Property of 2nd bytes
+				// Check for Bit Flip Property of 2nd bytes. Only pairs with a new 2nd byte can show a new property.
 				if (nonces[i].BitFlips[bitflip] == 0) {
-					for (uint16_t j = 0; j < 256; j++) { 	// for each 2nd Byte
+					for (uint16_t k = 0; k < num_new_2nd_bytes[i]; k++) {
+						uint8_t j = new_2nd_bytes[i][k];
 						noncelistentry_t *byte1 = SearchFor2ndByte(i, j);
 						noncelistentry_t *byte2 = SearchFor2ndByte(i, j^(bitflip&0xff));
 						if (byte1 != NULL && byte2 != NULL) {
@@ -1274,41 +1541,33 @@ static void *check_for_BitFlipProperties_thread(void *args)
 				// printf("states_bitarray[1][%" PRIu16 "] contains %d ones.\n", i, count_states(nonces[i].states_bitarray[ODD_STATE]));
 			}
 		}
+		for (uint16_t i = first_byte; i <= last_byte; i++) {
+			num_new_2nd_bytes[i] = 0;		// all checked
+		}
 	}
 
-	return NULL;
+	return;
 }
 
 
 static void check_for_BitFlipProperties(bool time_budget)
 {
-	// create and run worker threads
-	pthread_t thread_id[NUM_CHECK_BITFLIPS_THREADS];
-		
-	uint8_t args[NUM_CHECK_BITFLIPS_THREADS][3];
-	uint16_t bytes_per_thread = (256 + (NUM_CHECK_BITFLIPS_THREADS/2)) / NUM_CHECK_BITFLIPS_THREADS; 
-	for (uint8_t i = 0; i < NUM_CHECK_BITFLIPS_THREADS; i++) {
-		args[i][0] = i * bytes_per_thread;
-		args[i][1] = MIN(args[i][0]+bytes_per_thread-1, 255);
+	// split the 256 first bytes into tasks for the worker threads
+	uint32_t num_tasks = NUM_CHECK_BITFLIPS_TASKS;
+	uint8_t args[num_tasks][3];
+	for (uint32_t i = 0; i < num_tasks; i++) {
+		args[i][0] = i * 256 / num_tasks;
+		args[i][1] = (i+1) * 256 / num_tasks - 1;
 		args[i][2] = time_budget;
 	}
-	args[NUM_CHECK_BITFLIPS_THREADS-1][1] = MAX(args[NUM_CHECK_BITFLIPS_THREADS-1][1], 255);
-	
-	// start threads
-	for (uint8_t i = 0; i < NUM_CHECK_BITFLIPS_THREADS; i++) {
-		pthread_create(&thread_id[i], NULL, check_for_BitFlipProperties_thread, args[i]);
-	}
-	
-	// wait for threads to terminate:
-	for (uint8_t i = 0; i < NUM_CHECK_BITFLIPS_THREADS; i++) {
-		pthread_join(thread_id[i], NULL);
-	}
+
+	hardnested_run_tasks(check_for_BitFlipProperties_task, args, num_tasks);
 	
 	if (hardnested_stage & CHECK_2ND_BYTES) {
 		hardnested_stage &= ~CHECK_1ST_BYTES;	// we are done with 1st stage, except...
-		for (uint16_t i = 0; i < NUM_CHECK_BITFLIPS_THREADS; i++) {
+		for (uint32_t i = 0; i < num_tasks; i++) {
 			if (args[i][1] != 0) {
-				hardnested_stage |= CHECK_1ST_BYTES;  // ... when any of the threads didn't complete in time
+				hardnested_stage |= CHECK_1ST_BYTES;  // ... when any of the tasks didn't complete in time
 				break;
 			}
 		}
@@ -1345,6 +1604,42 @@ static void apply_sum_a0(void)
 }
 
 
+// Apply the properties of all nonces added since the last call and decide if we have enough of them.
+static bool update_key_space_estimation(bool *reported_suma8, float *brute_force)
+{
+	bool acquisition_completed;
+
+	if (first_byte_num == 256) {
+		if (hardnested_stage == CHECK_1ST_BYTES) {
+			for (uint16_t i = 0; i < NUM_SUMS; i++) {
+				if (first_byte_Sum == sums[i]) {
+					first_byte_Sum = i;
+					break;
+				}
+			}
+			hardnested_stage |= CHECK_2ND_BYTES;
+			apply_sum_a0();
+		}
+		update_nonce_data(true);
+		acquisition_completed = shrink_key_space(brute_force);
+		if (!*reported_suma8) {
+			char progress_string[80];
+			sprintf(progress_string, "Apply Sum property. Sum(a0) = %d", sums[first_byte_Sum]);
+			hardnested_print_progress(num_acquired_nonces, progress_string, *brute_force, 0);
+			*reported_suma8 = true;
+		} else {
+			hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", *brute_force, 0);
+		}
+	} else {
+		update_nonce_data(true);
+		acquisition_completed = shrink_key_space(brute_force);
+		hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", *brute_force, 0);
+	}
+
+	return acquisition_completed;
+}
+
+
 static void simulate_MFplus_RNG(uint32_t test_cuid, uint64_t test_key, uint32_t *nt_enc, uint8_t *par_enc)
 {
 	struct Crypto1State sim_cs = {0, 0};
@@ -1404,32 +1699,7 @@ static void simulate_acquire_nonces()
 
 		last_sample_clock = msclock();
 	
-		if (first_byte_num == 256 ) {
-			if (hardnested_stage == CHECK_1ST_BYTES) {
-				for (uint16_t i = 0; i < NUM_SUMS; i++) {
-					if (first_byte_Sum == sums[i]) {
-						first_byte_Sum = i;
-						break;
-					}
-				}
-				hardnested_stage |= CHECK_2ND_BYTES;
-				apply_sum_a0();
-			} 
-			update_nonce_data(true);
-			acquisition_completed = shrink_key_space(&brute_force);
-			if (!reported_suma8) {
-				char progress_string[80];
-				sprintf(progress_string, "Apply Sum property. Sum(a0) = %d", sums[first_byte_Sum]);
-				hardnested_print_progress(num_acquired_nonces, progress_string, brute_force, 0);
-				reported_suma8 = true;
-			} else {
-				hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", brute_force, 0);
-			}
-		} else {
-			update_nonce_data(true);
-			acquisition_completed = shrink_key_space(&brute_force);
-			hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", brute_force, 0);
-		}
+		acquisition_completed = update_key_space_estimation(&reported_suma8, &brute_force);
 	} while (!acquisition_completed);
 
 	time_t end_time = time(NULL);
@@ -1444,7 +1714,7 @@ static void simulate_acquire_nonces()
 }
 
 
-static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, bool nonce_file_write, bool slow)
+static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, bool nonce_file_write, bool nonce_file_append, bool slow)
 {
 	last_sample_clock = msclock();
 	sample_period = 2000;	// initial rough estimate. Will be refined.
@@ -1453,7 +1723,9 @@ static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_
 	hardnested_stage = CHECK_1ST_BYTES;
 	bool acquisition_completed = false;
 	uint32_t flags = 0;
-	uint8_t write_buf[9];
+	nonce_chunk_t file_chunk = {0};
+	uint32_t write_nt_enc[USB_CMD_DATA_SIZE / 9 * 2];
+	uint8_t write_par_enc[USB_CMD_DATA_SIZE / 9 * 2];
 	uint32_t total_num_nonces = 0;
 	float brute_force;
 	bool reported_suma8 = false;
@@ -1484,15 +1756,17 @@ static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_
 			cuid = resp.arg[1];
 			// PrintAndLog("Acquiring nonces for CUID 0x%08x", cuid); 
 			if (nonce_file_write && fnonces == NULL) {
-				if ((fnonces = fopen("nonces.bin","wb")) == NULL) { 
+				fnonces = nonce_file_append ? nonce_file_open_append("nonces.bin") : nonce_file_create("nonces.bin");
+				if (fnonces == NULL) { 
 					PrintAndLog("Could not create file nonces.bin");
 					return 3;
 				}
-				hardnested_print_progress(0, "Writing acquired nonces to binary file nonces.bin", (float)(1LL<<47), 0);
-				num_to_bytes(cuid, 4, write_buf);
-				fwrite(write_buf, 1, 4, fnonces);
-				fwrite(&trgBlockNo, 1, 1, fnonces);
-				fwrite(&trgKeyType, 1, 1, fnonces);
+				hardnested_print_progress(0, nonce_file_append ? "Adding acquired nonces to binary file nonces.bin" : "Writing acquired nonces to binary file nonces.bin", (float)(1LL<<47), 0);
+				file_chunk.cuid = cuid;
+				file_chunk.blockNo = trgBlockNo;
+				file_chunk.keyType = trgKeyType;
+				file_chunk.srcBlockNo = blockNo;
+				file_chunk.flags = (keyType ? NONCE_CHUNK_SOURCE_KEY_B : 0) | (slow ? NONCE_CHUNK_SLOW_ACQUISITION : 0);
 			}
 		}
 
@@ -1511,39 +1785,20 @@ static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_
 				//printf("Encrypted nonce: %08x, encrypted_parity: %02x\n", nt_enc2, par_enc & 0x0f);
 				num_acquired_nonces += add_nonce(nt_enc2, par_enc & 0x0f);
 
-				if (nonce_file_write) {
-					fwrite(bufp, 1, 9, fnonces);
-				}
+				write_nt_enc[i] = nt_enc1;
+				write_nt_enc[i+1] = nt_enc2;
+				write_par_enc[i] = par_enc >> 4;
+				write_par_enc[i+1] = par_enc & 0x0f;
 				bufp += 9;
 			}
+			if (nonce_file_write) {
+				file_chunk.capture_time = time(NULL);
+				nonce_file_write_chunk(fnonces, &file_chunk, write_nt_enc, write_par_enc, num_sampled_nonces);
+				fflush(fnonces);	// for a concurrent hf mf hardnested f
+			}
 			total_num_nonces += num_sampled_nonces;
 		
-			if (first_byte_num == 256 ) {
-				if (hardnested_stage == CHECK_1ST_BYTES) {
-					for (uint16_t i = 0; i < NUM_SUMS; i++) {
-						if (first_byte_Sum == sums[i]) {
-							first_byte_Sum = i;
-							break;
-						}
-					}
-					hardnested_stage |= CHECK_2ND_BYTES;
-					apply_sum_a0();
-				}
-				update_nonce_data(true);
-				acquisition_completed = shrink_key_space(&brute_force);
-				if (!reported_suma8) {
-					char progress_string[80];
-					sprintf(progress_string, "Apply Sum property. Sum(a0) = %d", sums[first_byte_Sum]);
-					hardnested_print_progress(num_acquired_nonces, progress_string, brute_force, 0);
-					reported_suma8 = true;
-				} else {
-					hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", brute_force, 0);
-				}
-			} else {
-				update_nonce_data(true);
-				acquisition_completed = shrink_key_space(&brute_force);
-				hardnested_print_progress(num_acquired_nonces, "Apply bit flip properties", brute_force, 0);
-			}
+			acquisition_completed = update_key_space_estimation(&reported_suma8, &brute_force);
 		}
 		
 		if (acquisition_completed) {
@@ -1587,6 +1842,216 @@ static int acquire_nonces(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_
 }
 
 
+// Continue reading a record of len bytes from a stream which may not have all of it yet.
+// Returns true when the record is complete.
+static bool read_stream_record(FILE *stream, uint8_t *record, size_t len, size_t *bytes_in_record)
+{
+	clearerr(stream);	// the writer may have added data since we hit EOF
+	*bytes_in_record += fread(record + *bytes_in_record, 1, len - *bytes_in_record, stream);
+	if (*bytes_in_record < len) {
+		return false;
+	}
+	*bytes_in_record = 0;
+	return true;
+}
+
+
+// Wait until a record is complete. Returns false if the writer closed the pipe or didn't write for STREAM_IDLE_TIMEOUT ms.
+static bool wait_for_stream_record(FILE *stream, uint8_t *record, size_t len, size_t *bytes_in_record, bool is_pipe)
+{
+	uint64_t start_clock = msclock();
+	while (!read_stream_record(stream, record, len, bytes_in_record)) {
+		if ((is_pipe && feof(stream)) || msclock() - start_clock > STREAM_IDLE_TIMEOUT) {
+			return false;
+		}
+		msleep(STREAM_POLL_INTERVAL);
+	}
+	return true;
+}
+
+
+typedef struct {
+	uint8_t header[NONCE_CHUNK_HEADER_SIZE];
+	size_t bytes_in_header;
+	bool header_complete;
+	nonce_chunk_t chunk;
+	uint8_t *payload;
+	size_t bytes_in_payload;
+} stream_chunk_t;
+
+
+// Continue reading a chunk of a nonce file from a stream. Returns true when the chunk is complete.
+static bool read_stream_chunk(FILE *stream, stream_chunk_t *c)
+{
+	while (!c->header_complete) {
+		if (!read_stream_record(stream, c->header, NONCE_CHUNK_HEADER_SIZE, &c->bytes_in_header)) {
+			return false;
+		}
+		if (nonce_file_parse_chunk_header(c->header, &c->chunk)) {
+			c->header_complete = true;
+			c->payload = realloc(c->payload, c->chunk.payload_len + 1);
+			if (c->payload == NULL) {
+				PrintAndLog("Out of memory error in read_stream_chunk(). Aborting...");
+				exit(4);
+			}
+		} else {	// damaged. Search for the next chunk header
+			memmove(c->header, c->header + 1, NONCE_CHUNK_HEADER_SIZE - 1);
+			c->bytes_in_header = NONCE_CHUNK_HEADER_SIZE - 1;
+		}
+	}
+	if (!read_stream_record(stream, c->payload, c->chunk.payload_len, &c->bytes_in_payload)) {
+		return false;
+	}
+	c->header_complete = false;
+	return true;
+}
+
+
+static void add_nonce_from_stream(uint32_t nt_enc, uint8_t par_enc, void *arg)
+{
+	num_acquired_nonces += add_nonce(nt_enc, par_enc);
+	(*(uint32_t *)arg)++;
+}
+
+
+// Read nonces from a file which is still being written, e.g. by another client's "hf mf hardnested ... w",
+// or from a named pipe. Both the chunked and the old nonces.bin format are accepted. A chunked file is read
+// for the target of the most recently appended chunk, i.e. the capture which is still going on, or, if
+// there is no chunk yet, for the target of the first chunk to arrive. The key space is updated while the nonces arrive and reading stops
+// as soon as the estimation says that we have enough of them. A pipe is read until it is closed by the
+// writer, a regular file until no new data arrived for STREAM_IDLE_TIMEOUT ms.
+static int stream_nonce_file(char *filename, uint8_t *trgBlockNo, uint8_t *trgKeyType)
+{
+	FILE *fnonces = NULL;
+	uint8_t record[NONCE_FILE_HEADER_SIZE];
+	size_t bytes_in_record = 0;
+	stream_chunk_t stream_chunk = {{0}};
+	bool chunked = false;
+	bool target_known = false;
+	bool is_pipe = false;
+	bool acquisition_completed = false;
+	bool end_of_stream = false;
+	bool reported_suma8 = false;
+	float brute_force = (float)(1LL<<47);
+
+	num_acquired_nonces = 0;
+	if ((fnonces = fopen(filename, "rb")) == NULL) {
+		PrintAndLog("Could not open file %s", filename);
+		return 1;
+	}
+#if !defined(_WIN32)
+	struct stat stream_stat;
+	if (stat(filename, &stream_stat) == 0) {
+		is_pipe = S_ISFIFO(stream_stat.st_mode);
+	}
+#endif
+
+	char progress_string[80];
+	snprintf(progress_string, sizeof(progress_string), "Streaming nonces from %s...", filename);
+	hardnested_print_progress(0, progress_string, brute_force, 0);
+
+	// the old format's header is 6 bytes long. The first 6 bytes of the chunked format's header are unique enough.
+	if (!wait_for_stream_record(fnonces, record, 6, &bytes_in_record, is_pipe)) {
+		PrintAndLog("File reading error.");
+		fclose(fnonces);
+		return 1;
+	}
+	if (memcmp(record, NONCE_FILE_MAGIC, 6) == 0) {
+		bytes_in_record = 6;
+		if (!wait_for_stream_record(fnonces, record, NONCE_FILE_HEADER_SIZE, &bytes_in_record, is_pipe) || !nonce_file_is_header(record)) {
+			PrintAndLog("File reading error.");
+			fclose(fnonces);
+			return 1;
+		}
+		chunked = true;
+		if (!is_pipe) {
+			nonce_file_index_t index;
+			if (nonce_file_read_index(filename, &index) == 0 && index.num_targets > 0) {
+				nonce_target_t *target = &index.targets[index.last_target];
+				cuid = target->cuid;
+				*trgBlockNo = target->blockNo;
+				*trgKeyType = target->keyType;
+				target_known = true;
+				sprintf(progress_string, "cuid=%08x, Target Block=%d, Keytype=%c", cuid, *trgBlockNo, *trgKeyType==0?'A':'B');
+				hardnested_print_progress(0, progress_string, brute_force, 0);
+			}
+			nonce_file_free_index(&index);
+		}
+	} else {
+		cuid = bytes_to_num(record, 4);
+		*trgBlockNo = bytes_to_num(record+4, 1);
+		*trgKeyType = bytes_to_num(record+5, 1);
+		target_known = true;
+		sprintf(progress_string, "cuid=%08x, Target Block=%d, Keytype=%c", cuid, *trgBlockNo, *trgKeyType==0?'A':'B');
+		hardnested_print_progress(0, progress_string, brute_force, 0);
+	}
+
+	hardnested_stage = CHECK_1ST_BYTES;
+	sample_period = 1000;
+	uint64_t last_data_clock = msclock();
+	while (!acquisition_completed && !end_of_stream) {
+		uint32_t num_nonces = 0;
+		if (chunked) {
+			while (num_nonces < 2 * STREAM_BATCH_SIZE && read_stream_chunk(fnonces, &stream_chunk)) {
+				nonce_chunk_t *chunk = &stream_chunk.chunk;
+				if (!target_known) {
+					cuid = chunk->cuid;
+					*trgBlockNo = chunk->blockNo;
+					*trgKeyType = chunk->keyType;
+					target_known = true;
+					sprintf(progress_string, "cuid=%08x, Target Block=%d, Keytype=%c", cuid, *trgBlockNo, *trgKeyType==0?'A':'B');
+					hardnested_print_progress(0, progress_string, brute_force, 0);
+				}
+				if (chunk->cuid == cuid && chunk->blockNo == *trgBlockNo && chunk->keyType == *trgKeyType) {
+					nonce_file_decode_chunk(chunk, stream_chunk.payload, add_nonce_from_stream, &num_nonces);
+				}
+			}
+		} else {
+			while (num_nonces < 2 * STREAM_BATCH_SIZE && read_stream_record(fnonces, record, 9, &bytes_in_record)) {
+				add_nonce_from_stream(bytes_to_num(record, 4), record[8] >> 4, &num_nonces);
+				add_nonce_from_stream(bytes_to_num(record+4, 4), record[8] & 0x0f, &num_nonces);
+			}
+		}
+		if (num_nonces > 0) {
+			last_sample_clock = msclock();
+			acquisition_completed = update_key_space_estimation(&reported_suma8, &brute_force);
+			last_data_clock = msclock();
+		} else if ((is_pipe && feof(fnonces)) || msclock() - last_data_clock > STREAM_IDLE_TIMEOUT) {
+			end_of_stream = true;
+		} else {
+			msleep(STREAM_POLL_INTERVAL);
+		}
+	}
+	free(stream_chunk.payload);
+	fclose(fnonces);
+
+	if (!target_known) {
+		PrintAndLog("File reading error.");
+		return 1;
+	}
+
+	if (!acquisition_completed) {
+		// no more nonces to come. Do the remaining checks without time budget.
+		if (!(hardnested_stage & CHECK_2ND_BYTES)) {
+			for (uint16_t i = 0; i < NUM_SUMS; i++) {
+				if (first_byte_Sum == sums[i]) {
+					first_byte_Sum = i;
+					break;
+				}
+			}
+		}
+		hardnested_stage = CHECK_1ST_BYTES | CHECK_2ND_BYTES;
+		update_nonce_data(false);
+		shrink_key_space(&brute_force);
+	}
+
+	sprintf(progress_string, "Read %d nonces from stream%s", num_acquired_nonces, acquisition_completed ? ". Enough for the attack" : "");
+	hardnested_print_progress(num_acquired_nonces, progress_string, brute_force, 0);
+
+	return 0;
+}
+
+
 static inline bool invariant_holds(uint_fast8_t byte_diff, uint_fast32_t state1, uint_fast32_t state2, uint_fast8_t bit, uint_fast8_t state_bit)
 {
 	uint_fast8_t j_1_bit_mask = 0x01 << (bit-1);
@@ -1641,13 +2106,8 @@ static inline bool remaining_bits_match(uint_fast8_t num_common_bits, uint_fast8
 }
 
 
-static pthread_mutex_t statelist_cache_mutex;
-static pthread_mutex_t book_of_work_mutex;
-
-
 typedef enum {
 	TO_BE_DONE,
-	WORK_IN_PROGRESS,
 	COMPLETED
 } work_status_t;
 
@@ -1660,7 +2120,6 @@ static struct sl_cache_entry {
 
 static void init_statelist_cache(void)
 {
-	pthread_mutex_lock(&statelist_cache_mutex);
 	for (uint16_t i = 0; i < NUM_PART_SUMS; i++) {
 		for (uint16_t j = 0; j < NUM_PART_SUMS; j++) {
 			for (uint16_t k = 0; k < 2; k++) {
@@ -1670,13 +2129,11 @@ static void init_statelist_cache(void)
 			}
 		}
 	}		
-	pthread_mutex_unlock(&statelist_cache_mutex);
 }
 
 
 static void free_statelist_cache(void)
 {
-	pthread_mutex_lock(&statelist_cache_mutex);
 	for (uint16_t i = 0; i < NUM_PART_SUMS; i++) {
 		for (uint16_t j = 0; j < NUM_PART_SUMS; j++) {
 			for (uint16_t k = 0; k < 2; k++) {
@@ -1684,7 +2141,6 @@ static void free_statelist_cache(void)
 			}
 		}
 	}		
-	pthread_mutex_unlock(&statelist_cache_mutex);
 }
 
 
@@ -1788,18 +2244,19 @@ static void add_cached_states(statelist_t *candidates, uint16_t part_sum_a0, uin
 }
 
 
-static void add_matching_states(statelist_t *candidates, uint8_t part_sum_a0, uint8_t part_sum_a8, odd_even_t odd_even)
+static void add_matching_states(uint8_t part_sum_a0, uint8_t part_sum_a8, odd_even_t odd_even)
 {
+	struct sl_cache_entry *cache_entry = &sl_cache[part_sum_a0/2][part_sum_a8/2][odd_even];
 	uint32_t worstcase_size = 1<<20;
-	candidates->states[odd_even] = (uint32_t *)malloc(sizeof(uint32_t) * worstcase_size);
-	if (candidates->states[odd_even] == NULL) {
+	uint32_t *states = (uint32_t *)malloc(sizeof(uint32_t) * worstcase_size);
+	if (states == NULL) {
 		PrintAndLog("Out of memory error in add_matching_states() - statelist.\n");
 		exit(4);
 	}
 	uint32_t *candidates_bitarray = (uint32_t *)malloc_bitarray(sizeof(uint32_t) * (1<<19));
 	if (candidates_bitarray == NULL) {
 		PrintAndLog("Out of memory error in add_matching_states() - bitarray.\n");
-		free(candidates->states[odd_even]);
+		free(states);
 		exit(4);
 	}
 	
@@ -1812,21 +2269,20 @@ static void add_matching_states(statelist_t *candidates, uint8_t part_sum_a0, ui
 	// }
 	bitarray_AND4(candidates_bitarray, bitarray_a0, bitarray_a8, bitarray_bitflips);
 	
-	bitarray_to_list(best_first_bytes[0], candidates_bitarray, candidates->states[odd_even], &(candidates->len[odd_even]), odd_even);
-	if (candidates->len[odd_even] == 0) {
-		free(candidates->states[odd_even]);
-		candidates->states[odd_even] = NULL;
-	} else if (candidates->len[odd_even] + 1 < worstcase_size) {
-		candidates->states[odd_even] = realloc(candidates->states[odd_even], sizeof(uint32_t) * (candidates->len[odd_even] + 1));
+	uint32_t len;
+	bitarray_to_list(best_first_bytes[0], candidates_bitarray, states, &len, odd_even);
+	if (len == 0) {
+		free(states);
+		states = NULL;
+	} else if (len + 1 < worstcase_size) {
+		states = realloc(states, sizeof(uint32_t) * (len + 1));
 	}
 	free_bitarray(candidates_bitarray);
 
-
-	pthread_mutex_lock(&statelist_cache_mutex);
-	sl_cache[part_sum_a0/2][part_sum_a8/2][odd_even].sl = candidates->states[odd_even];
-	sl_cache[part_sum_a0/2][part_sum_a8/2][odd_even].len = candidates->len[odd_even];
-	sl_cache[part_sum_a0/2][part_sum_a8/2][odd_even].cache_status = COMPLETED;
-	pthread_mutex_unlock(&statelist_cache_mutex);
+	// each cache entry is calculated by exactly one task, no locking required
+	cache_entry->sl = states;
+	cache_entry->len = len;
+	cache_entry->cache_status = COMPLETED;
 
 	return;
 }
@@ -1923,162 +2379,35 @@ static bool TestIfKeyExists(uint64_t key)
 }
 
 
-static work_status_t book_of_work[NUM_PART_SUMS][NUM_PART_SUMS][NUM_PART_SUMS][NUM_PART_SUMS];
+// the statelist cache entries to be calculated by the worker threads
+static uint16_t num_statelist_tasks;
+static struct statelist_task {
+	uint8_t part_sum_a0;
+	uint8_t part_sum_a8;
+	odd_even_t odd_even;
+	} statelist_tasks[NUM_PART_SUMS * NUM_PART_SUMS];
 
 
-static void init_book_of_work(void)
+static void generate_candidates_task(void *args, uint32_t task)
 {
-	for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
-		for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
-			for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
-				for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
-					book_of_work[p][q][r][s] = TO_BE_DONE;
-				}
-			}
-		}
-	}
+	struct statelist_task *my_task = &((struct statelist_task *)args)[task];
+	add_matching_states(my_task->part_sum_a0, my_task->part_sum_a8, my_task->odd_even);
 }
 
 
-static void *generate_candidates_worker_thread(void *args)
+static void add_statelist_task(uint8_t p, uint8_t r, odd_even_t odd_even)
 {
-	uint16_t *sum_args = (uint16_t *)args;
-	uint16_t sum_a0 = sums[sum_args[0]];
-	uint16_t sum_a8 = sums[sum_args[1]];
-	// uint16_t my_thread_number = sums[2];
-	
-	bool there_might_be_more_work = true;
-	do {
-		there_might_be_more_work = false;
-		for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
-			for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
-				if (2*p*(16-2*q) + (16-2*p)*2*q == sum_a0) {
-					// printf("Reducing Partial Statelists (p,q) = (%d,%d) with lengths %d, %d\n", 
-							// p, q, partial_statelist[p].len[ODD_STATE], partial_statelist[q].len[EVEN_STATE]);
-					for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
-						for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
-							if (2*r*(16-2*s) + (16-2*r)*2*s == sum_a8) {
-								pthread_mutex_lock(&book_of_work_mutex);
-								if (book_of_work[p][q][r][s] != TO_BE_DONE) {  // this has been done or is currently been done by another thread. Look for some other work.
-									pthread_mutex_unlock(&book_of_work_mutex);
-									continue;
-								}
-
-								pthread_mutex_lock(&statelist_cache_mutex);
-								if (sl_cache[p][r][ODD_STATE].cache_status == WORK_IN_PROGRESS
-									|| sl_cache[q][s][EVEN_STATE].cache_status == WORK_IN_PROGRESS) { // defer until not blocked by another thread.
-									pthread_mutex_unlock(&statelist_cache_mutex);
-									pthread_mutex_unlock(&book_of_work_mutex);
-									there_might_be_more_work = true;
-									continue;
-								}
-
-								// we finally can do some work.
-								book_of_work[p][q][r][s] = WORK_IN_PROGRESS;
-								statelist_t *current_candidates = add_more_candidates();
-
-								// Check for cached results and add them first
-								bool odd_completed = false;
-								if (sl_cache[p][r][ODD_STATE].cache_status == COMPLETED) {
-									add_cached_states(current_candidates, 2*p, 2*r, ODD_STATE);
-									odd_completed = true;
-								}
-								bool even_completed = false;
-								if (sl_cache[q][s][EVEN_STATE].cache_status == COMPLETED) {
-									add_cached_states(current_candidates, 2*q, 2*s, EVEN_STATE);
-									even_completed = true;
-								}
-								
-								bool work_required = true;
-
-								// if there had been two cached results, there is no more work to do
-								if (even_completed && odd_completed) {
-									work_required = false;
-								}	
-
-								// if there had been one cached empty result, there is no need to calculate the other part:
-								if (work_required) {
-									if (even_completed && !current_candidates->len[EVEN_STATE]) {
-										current_candidates->len[ODD_STATE] = 0;
-										current_candidates->states[ODD_STATE] = NULL;
-										work_required = false;
-									}									
-									if (odd_completed && !current_candidates->len[ODD_STATE]) {
-										current_candidates->len[EVEN_STATE] = 0;
-										current_candidates->states[EVEN_STATE] = NULL;
-										work_required = false;
-									}
-								}
-
-								if (!work_required) {
-									pthread_mutex_unlock(&statelist_cache_mutex);
-									pthread_mutex_unlock(&book_of_work_mutex);
-								} else {
-									// we really need to calculate something
-									if (even_completed) { // we had one cache hit with non-zero even states
-										// printf("Thread #%u: start working on  odd states p=%2d, r=%2d...\n", my_thread_number, p, r);
-										sl_cache[p][r][ODD_STATE].cache_status = WORK_IN_PROGRESS;
-										pthread_mutex_unlock(&statelist_cache_mutex);
-										pthread_mutex_unlock(&book_of_work_mutex);
-										add_matching_states(current_candidates, 2*p, 2*r, ODD_STATE);
-										work_required = false;
-									} else if (odd_completed) { // we had one cache hit with non-zero odd_states
-										// printf("Thread #%u: start working on even states q=%2d, s=%2d...\n", my_thread_number, q, s);
-										sl_cache[q][s][EVEN_STATE].cache_status = WORK_IN_PROGRESS;
-										pthread_mutex_unlock(&statelist_cache_mutex);
-										pthread_mutex_unlock(&book_of_work_mutex);
-										add_matching_states(current_candidates, 2*q, 2*s, EVEN_STATE);
-										work_required = false;
-									}
-								}
-									
-								if (work_required) { // we had no cached result. Need to calculate both odd and even
-									sl_cache[p][r][ODD_STATE].cache_status = WORK_IN_PROGRESS;
-									sl_cache[q][s][EVEN_STATE].cache_status = WORK_IN_PROGRESS;
-									pthread_mutex_unlock(&statelist_cache_mutex);
-									pthread_mutex_unlock(&book_of_work_mutex);
-
-									add_matching_states(current_candidates, 2*p, 2*r, ODD_STATE);
-									if(current_candidates->len[ODD_STATE]) {
-										// printf("Thread #%u: start working on even states q=%2d, s=%2d...\n", my_thread_number, q, s);
-										add_matching_states(current_candidates, 2*q, 2*s, EVEN_STATE);
-									} else { // no need to calculate even states yet
-										pthread_mutex_lock(&statelist_cache_mutex);
-										sl_cache[q][s][EVEN_STATE].cache_status = TO_BE_DONE;
-										pthread_mutex_unlock(&statelist_cache_mutex);
-										current_candidates->len[EVEN_STATE] = 0;
-										current_candidates->states[EVEN_STATE] = NULL;
-									}
-								}
-
-								// update book of work
-								pthread_mutex_lock(&book_of_work_mutex);
-								book_of_work[p][q][r][s] = COMPLETED;
-								pthread_mutex_unlock(&book_of_work_mutex);
-
-								// if ((uint64_t)current_candidates->len[ODD_STATE] * current_candidates->len[EVEN_STATE]) {
-									// printf("Candidates for p=%2u, q=%2u, r=%2u, s=%2u: %" PRIu32 " * %" PRIu32 " = %" PRIu64 " (2^%0.1f)\n",
-										// 2*p, 2*q, 2*r, 2*s, current_candidates->len[ODD_STATE], current_candidates->len[EVEN_STATE],
-										// (uint64_t)current_candidates->len[ODD_STATE] * current_candidates->len[EVEN_STATE],
-										// log((uint64_t)current_candidates->len[ODD_STATE] * current_candidates->len[EVEN_STATE])/log(2));
-									// uint32_t estimated_odd = estimated_num_states_part_sum(best_first_bytes[0], p, r, ODD_STATE);
-									// uint32_t estimated_even= estimated_num_states_part_sum(best_first_bytes[0], q, s, EVEN_STATE);
-									// uint64_t estimated_total = (uint64_t)estimated_odd * estimated_even; 
-									// printf("Estimated: %" PRIu32 " * %" PRIu32 " = %" PRIu64 " (2^%0.1f)\n", estimated_odd, estimated_even, estimated_total, log(estimated_total) / log(2));
-									// if (estimated_odd < current_candidates->len[ODD_STATE] || estimated_even < current_candidates->len[EVEN_STATE]) {
-										// printf("############################################################################ERROR! ESTIMATED < REAL !!!\n"); 
-										// //exit(2);
-										// }
-								// }
-							}
-						}
-					}
-				}
+	if (sl_cache[p][r][odd_even].cache_status == TO_BE_DONE) {
+		for (uint16_t i = 0; i < num_statelist_tasks; i++) {
+			if (statelist_tasks[i].part_sum_a0 == 2*p && statelist_tasks[i].part_sum_a8 == 2*r) {
+				return;
 			}
 		}
-	} while (there_might_be_more_work);
-	
-	return NULL;
+		statelist_tasks[num_statelist_tasks].part_sum_a0 = 2*p;
+		statelist_tasks[num_statelist_tasks].part_sum_a8 = 2*r;
+		statelist_tasks[num_statelist_tasks].odd_even = odd_even;
+		num_statelist_tasks++;
+	}
 }
 
 
@@ -2099,31 +2428,63 @@ static void generate_candidates(uint8_t sum_a0_idx, uint8_t sum_a8_idx)
 	// printf("Number of possible keys with Sum(a0) = %d: %" PRIu64 " (2^%1.1f)\n", sum_a0, maximum_states, log(maximum_states)/log(2.0));
 	
 	init_statelist_cache();
-	init_book_of_work();
 
-	// create mutexes for accessing the statelist cache and our "book of work"
-	pthread_mutex_init(&statelist_cache_mutex, NULL);
-	pthread_mutex_init(&book_of_work_mutex, NULL);
+	uint16_t sum_a0 = sums[sum_a0_idx];
+	uint16_t sum_a8 = sums[sum_a8_idx];
 
-	// create and run worker threads
-	pthread_t thread_id[NUM_REDUCTION_WORKING_THREADS];
-		
-	uint16_t sums[NUM_REDUCTION_WORKING_THREADS][3];
-	for (uint16_t i = 0; i < NUM_REDUCTION_WORKING_THREADS; i++) {
-		sums[i][0] = sum_a0_idx;
-		sums[i][1] = sum_a8_idx;
-		sums[i][2] = i+1;
-		pthread_create(thread_id + i, NULL, generate_candidates_worker_thread, sums[i]);
+	// first calculate all odd statelists which are compatible with Sum(a0) and Sum(a8)
+	num_statelist_tasks = 0;
+	for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
+		for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
+			if (2*p*(16-2*q) + (16-2*p)*2*q == sum_a0) {
+				for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
+					for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+						if (2*r*(16-2*s) + (16-2*r)*2*s == sum_a8) {
+							add_statelist_task(p, r, ODD_STATE);
+						}
+					}
+				}
+			}
+		}
 	}
-	
-	// wait for threads to terminate:
-	for (uint16_t i = 0; i < NUM_REDUCTION_WORKING_THREADS; i++) {
-		pthread_join(thread_id[i], NULL);
+	hardnested_run_tasks(generate_candidates_task, statelist_tasks, num_statelist_tasks);
+
+	// then calculate the even statelists, but only where the corresponding odd statelist isn't empty
+	num_statelist_tasks = 0;
+	for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
+		for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
+			if (2*p*(16-2*q) + (16-2*p)*2*q == sum_a0) {
+				for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
+					for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+						if (2*r*(16-2*s) + (16-2*r)*2*s == sum_a8 && sl_cache[p][r][ODD_STATE].len != 0) {
+							add_statelist_task(q, s, EVEN_STATE);
+						}
+					}
+				}
+			}
+		}
+	}
+	hardnested_run_tasks(generate_candidates_task, statelist_tasks, num_statelist_tasks);
+
+	// finally combine the cached odd and even statelists to candidates
+	for (uint8_t p = 0; p < NUM_PART_SUMS; p++) {
+		for (uint8_t q = 0; q < NUM_PART_SUMS; q++) {
+			if (2*p*(16-2*q) + (16-2*p)*2*q == sum_a0) {
+				for (uint8_t r = 0; r < NUM_PART_SUMS; r++) {
+					for (uint8_t s = 0; s < NUM_PART_SUMS; s++) {
+						if (2*r*(16-2*s) + (16-2*r)*2*s == sum_a8) {
+							statelist_t *current_candidates = add_more_candidates();
+							if (sl_cache[p][r][ODD_STATE].len != 0 && sl_cache[q][s][EVEN_STATE].len != 0) {
+								add_cached_states(current_candidates, 2*p, 2*r, ODD_STATE);
+								add_cached_states(current_candidates, 2*q, 2*s, EVEN_STATE);
+							}
+						}
+					}
+				}
+			}
+		}
 	}
 
-	// clean up mutex
-	pthread_mutex_destroy(&statelist_cache_mutex);
-	
 	maximum_states = 0;
 	for (statelist_t *sl = candidates; sl != NULL; sl = sl->next) {
 		maximum_states += (uint64_t)sl->len[ODD_STATE] * sl->len[EVEN_STATE];
@@ -2171,12 +2532,12 @@ static void pre_XOR_nonces(void)
 }
 	
 
-static bool brute_force(void)
+static bool brute_force(uint64_t *found_key)
 {
 	if (known_target_key != -1) {
 		TestIfKeyExists(known_target_key);
 	}
-	return brute_force_bs(NULL, candidates, cuid, num_acquired_nonces, maximum_states, nonces, best_first_bytes);
+	return brute_force_bs(NULL, candidates, cuid, num_acquired_nonces, maximum_states, nonces, best_first_bytes, found_key);
 }
 
 
@@ -2525,7 +2886,73 @@ static void set_test_state(uint8_t byte)
 }
 
 
-int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t *trgkey, bool nonce_file_read, bool nonce_file_write, bool slow, int tests) 
+static bool search_key(uint64_t *found_key)
+{
+	char progress_text[80];
+
+	bool key_found = false;
+	num_keys_tested = 0;
+	uint32_t num_odd = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[ODD_STATE];
+	uint32_t num_even = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[EVEN_STATE];
+	float expected_brute_force1 = (float)num_odd * num_even / 2.0;
+	float expected_brute_force2 = nonces[best_first_bytes[0]].expected_num_brute_force;
+	if (write_stats) {
+		fprintf(fstats, "%1.1f;%1.1f;", log(expected_brute_force1)/log(2.0), log(expected_brute_force2)/log(2.0));
+	}
+	if (expected_brute_force1 < expected_brute_force2) {
+		hardnested_print_progress(num_acquired_nonces, "(Ignoring Sum(a8) properties)", expected_brute_force1, 0);
+		set_test_state(best_first_byte_smallest_bitarray);
+		add_bitflip_candidates(best_first_byte_smallest_bitarray);
+		Tests2();
+		maximum_states = 0;
+		for (statelist_t *sl = candidates; sl != NULL; sl = sl->next) {
+			maximum_states += (uint64_t)sl->len[ODD_STATE] * sl->len[EVEN_STATE];
+		}
+		// printf("Number of remaining possible keys: %" PRIu64 " (2^%1.1f)\n", maximum_states, log(maximum_states)/log(2.0));
+		best_first_bytes[0] = best_first_byte_smallest_bitarray;
+		pre_XOR_nonces();
+		prepare_bf_test_nonces(nonces, best_first_bytes[0]);
+		hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force1, 0);
+		key_found = brute_force(found_key);
+		free(candidates->states[ODD_STATE]);
+		free(candidates->states[EVEN_STATE]);
+		free_candidates_memory(candidates);
+		candidates = NULL;
+	} else {
+		pre_XOR_nonces();
+		prepare_bf_test_nonces(nonces, best_first_bytes[0]);
+		for (uint8_t j = 0; j < NUM_SUMS && !key_found; j++) {
+			float expected_brute_force = nonces[best_first_bytes[0]].expected_num_brute_force;
+			sprintf(progress_text, "(%d. guess: Sum(a8) = %" PRIu16 ")", j+1, sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx]);
+			hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0); 
+			if (known_target_key != -1 && sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx] != real_sum_a8) {
+				sprintf(progress_text, "(Estimated Sum(a8) is WRONG! Correct Sum(a8) = %" PRIu16 ")", real_sum_a8);
+				hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0);
+			}
+			// printf("Estimated remaining states: %" PRIu64 " (2^%1.1f)\n", nonces[best_first_bytes[0]].sum_a8_guess[j].num_states, log(nonces[best_first_bytes[0]].sum_a8_guess[j].num_states)/log(2.0));
+			generate_candidates(first_byte_Sum, nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx);
+			// printf("Time for generating key candidates list: %1.0f sec (%1.1f sec CPU)\n", difftime(time(NULL), start_time), (float)(msclock() - start_clock)/1000.0);
+			hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force, 0);
+			key_found = brute_force(found_key);
+			free_statelist_cache();
+			free_candidates_memory(candidates);
+			candidates = NULL;
+			if (!key_found) {
+				// update the statistics
+				nonces[best_first_bytes[0]].sum_a8_guess[j].prob = 0;
+				nonces[best_first_bytes[0]].sum_a8_guess[j].num_states = 0;
+				// and calculate new expected number of brute forces
+				update_expected_brute_force(best_first_bytes[0]);
+			}
+
+		}
+	}
+
+	return key_found;
+}
+
+
+int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t *trgkey, bool nonce_file_read, bool nonce_file_write, bool nonce_file_append, char *nonce_stream, bool slow, int tests) 
 {
 	char progress_text[80];
 
@@ -2575,61 +3002,7 @@ int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBloc
 #ifdef DEBUG_KEY_ELIMINATION
 			failstr[0] = '\0';
 #endif
-			bool key_found = false;
-			num_keys_tested = 0;
-			uint32_t num_odd = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[ODD_STATE];
-			uint32_t num_even = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[EVEN_STATE];
-			float expected_brute_force1 = (float)num_odd * num_even / 2.0;
-			float expected_brute_force2 = nonces[best_first_bytes[0]].expected_num_brute_force;
-			fprintf(fstats, "%1.1f;%1.1f;", log(expected_brute_force1)/log(2.0), log(expected_brute_force2)/log(2.0));
-			if (expected_brute_force1 < expected_brute_force2) {
-				hardnested_print_progress(num_acquired_nonces, "(Ignoring Sum(a8) properties)", expected_brute_force1, 0);
-				set_test_state(best_first_byte_smallest_bitarray);
-				add_bitflip_candidates(best_first_byte_smallest_bitarray);
-				Tests2();
-				maximum_states = 0;
-				for (statelist_t *sl = candidates; sl != NULL; sl = sl->next) {
-					maximum_states += (uint64_t)sl->len[ODD_STATE] * sl->len[EVEN_STATE];
-				}
-				//printf("Number of remaining possible keys: %" PRIu64 " (2^%1.1f)\n", maximum_states, log(maximum_states)/log(2.0));
-				// fprintf("fstats, "%" PRIu64 ";", maximum_states);
-				best_first_bytes[0] = best_first_byte_smallest_bitarray;
-				pre_XOR_nonces();
-				prepare_bf_test_nonces(nonces, best_first_bytes[0]);
-				hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force1, 0);
-				key_found = brute_force();
-				free(candidates->states[ODD_STATE]);
-				free(candidates->states[EVEN_STATE]);
-				free_candidates_memory(candidates);
-				candidates = NULL;
-			} else {
-				pre_XOR_nonces();
-				prepare_bf_test_nonces(nonces, best_first_bytes[0]);
-				for (uint8_t j = 0; j < NUM_SUMS && !key_found; j++) {
-					float expected_brute_force = nonces[best_first_bytes[0]].expected_num_brute_force;
-					sprintf(progress_text, "(%d. guess: Sum(a8) = %" PRIu16 ")", j+1, sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx]);
-					hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0); 
-					if (sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx] != real_sum_a8) {
-						sprintf(progress_text, "(Estimated Sum(a8) is WRONG! Correct Sum(a8) = %" PRIu16 ")", real_sum_a8);
-						hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0);
-					}
-					// printf("Estimated remaining states: %" PRIu64 " (2^%1.1f)\n", nonces[best_first_bytes[0]].sum_a8_guess[j].num_states, log(nonces[best_first_bytes[0]].sum_a8_guess[j].num_states)/log(2.0));
-					generate_candidates(first_byte_Sum, nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx);
-					// printf("Time for generating key candidates list: %1.0f sec (%1.1f sec CPU)\n", difftime(time(NULL), start_time), (float)(msclock() - start_clock)/1000.0);
-					hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force, 0);
-					key_found = brute_force();
-					free_statelist_cache();
-					free_candidates_memory(candidates);
-					candidates = NULL;
-					if (!key_found) {
-						// update the statistics
-						nonces[best_first_bytes[0]].sum_a8_guess[j].prob = 0;
-						nonces[best_first_bytes[0]].sum_a8_guess[j].num_states = 0;
-						// and calculate new expected number of brute forces
-						update_expected_brute_force(best_first_bytes[0]);
-					}
-				}
-			}
+			bool key_found = search_key(NULL);
 			#ifdef DEBUG_KEY_ELIMINATION
 			fprintf(fstats, "%1.1f;%1.0f;%d;%s\n", log(num_keys_tested)/log(2.0), (float)num_keys_tested/brute_force_per_second, key_found, failstr);
 			#else
@@ -2656,7 +3029,8 @@ int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBloc
 		update_reduction_rate(0.0, true);
 
 		if (nonce_file_read) {  	// use pre-acquired data from file nonces.bin
-			if (read_nonce_file() != 0) {
+			uint8_t file_trgBlockNo, file_trgKeyType;
+			if (read_nonce_file("nonces.bin", -1, &file_trgBlockNo, &file_trgKeyType) != 0) {
 				free_bitflip_bitarrays();
 				free_nonces_memory();
 				free_bitarray(all_bitflips_bitarray[ODD_STATE]);
@@ -2669,8 +3043,19 @@ int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBloc
 			update_nonce_data(false);
 			float brute_force;
 			shrink_key_space(&brute_force);
+		} else if (nonce_stream != NULL) {	// use nonces as they are written to a file or pipe
+			uint8_t file_trgBlockNo, file_trgKeyType;
+			if (stream_nonce_file(nonce_stream, &file_trgBlockNo, &file_trgKeyType) != 0) {
+				free_bitflip_bitarrays();
+				free_nonces_memory();
+				free_bitarray(all_bitflips_bitarray[ODD_STATE]);
+				free_bitarray(all_bitflips_bitarray[EVEN_STATE]);
+				free_sum_bitarrays();
+				free_part_sum_bitarrays();
+				return 3;
+			}
 		} else {					// acquire nonces.
-			uint16_t is_OK = acquire_nonces(blockNo, keyType, key, trgBlockNo, trgKeyType, nonce_file_write, slow);
+			uint16_t is_OK = acquire_nonces(blockNo, keyType, key, trgBlockNo, trgKeyType, nonce_file_write, nonce_file_append, slow);
 			if (is_OK != 0) {
 				free_bitflip_bitarrays();
 				free_nonces_memory();
@@ -2692,61 +3077,8 @@ int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBloc
 		Tests();
 
 		free_bitflip_bitarrays();
-		bool key_found = false;
-		num_keys_tested = 0;
-		uint32_t num_odd = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[ODD_STATE];
-		uint32_t num_even = nonces[best_first_byte_smallest_bitarray].num_states_bitarray[EVEN_STATE];
-		float expected_brute_force1 = (float)num_odd * num_even / 2.0;
-		float expected_brute_force2 = nonces[best_first_bytes[0]].expected_num_brute_force;
-		if (expected_brute_force1 < expected_brute_force2) {
-			hardnested_print_progress(num_acquired_nonces, "(Ignoring Sum(a8) properties)", expected_brute_force1, 0);
-			set_test_state(best_first_byte_smallest_bitarray);
-			add_bitflip_candidates(best_first_byte_smallest_bitarray);
-			Tests2();
-			maximum_states = 0;
-			for (statelist_t *sl = candidates; sl != NULL; sl = sl->next) {
-				maximum_states += (uint64_t)sl->len[ODD_STATE] * sl->len[EVEN_STATE];
-			}
-			// printf("Number of remaining possible keys: %" PRIu64 " (2^%1.1f)\n", maximum_states, log(maximum_states)/log(2.0));
-			best_first_bytes[0] = best_first_byte_smallest_bitarray;
-			pre_XOR_nonces();
-			prepare_bf_test_nonces(nonces, best_first_bytes[0]);
-			hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force1, 0);
-			key_found = brute_force();
-			free(candidates->states[ODD_STATE]);
-			free(candidates->states[EVEN_STATE]);
-			free_candidates_memory(candidates);
-			candidates = NULL;
-		} else {
-			pre_XOR_nonces();
-			prepare_bf_test_nonces(nonces, best_first_bytes[0]);
-			for (uint8_t j = 0; j < NUM_SUMS && !key_found; j++) {
-				float expected_brute_force = nonces[best_first_bytes[0]].expected_num_brute_force;
-				sprintf(progress_text, "(%d. guess: Sum(a8) = %" PRIu16 ")", j+1, sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx]);
-				hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0); 
-				if (trgkey != NULL && sums[nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx] != real_sum_a8) {
-					sprintf(progress_text, "(Estimated Sum(a8) is WRONG! Correct Sum(a8) = %" PRIu16 ")", real_sum_a8);
-					hardnested_print_progress(num_acquired_nonces, progress_text, expected_brute_force, 0);
-				}
-				// printf("Estimated remaining states: %" PRIu64 " (2^%1.1f)\n", nonces[best_first_bytes[0]].sum_a8_guess[j].num_states, log(nonces[best_first_bytes[0]].sum_a8_guess[j].num_states)/log(2.0));
-				generate_candidates(first_byte_Sum, nonces[best_first_bytes[0]].sum_a8_guess[j].sum_a8_idx);
-				// printf("Time for generating key candidates list: %1.0f sec (%1.1f sec CPU)\n", difftime(time(NULL), start_time), (float)(msclock() - start_clock)/1000.0);
-				hardnested_print_progress(num_acquired_nonces, "Starting brute force...", expected_brute_force, 0);
-				key_found = brute_force();
-				free_statelist_cache();
-				free_candidates_memory(candidates);
-				candidates = NULL;
-				if (!key_found) {
-					// update the statistics
-					nonces[best_first_bytes[0]].sum_a8_guess[j].prob = 0;
-					nonces[best_first_bytes[0]].sum_a8_guess[j].num_states = 0;
-					// and calculate new expected number of brute forces
-					update_expected_brute_force(best_first_bytes[0]);
-				}
+		search_key(NULL);
 
-			}
-		}
-		
 		free_nonces_memory();
 		free_bitarray(all_bitflips_bitarray[ODD_STATE]);
 		free_bitarray(all_bitflips_bitarray[EVEN_STATE]);
@@ -2756,3 +3088,129 @@ int mfnestedhard(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBloc
 
 	return 0;
 }
+
+
+typedef struct {
+	char nonce_file[FILE_PATH_SIZE];
+	uint32_t cuid;
+	uint8_t trgBlockNo;
+	uint8_t trgKeyType;
+	bool file_ok;
+	bool key_found;
+	uint64_t key;
+	uint64_t time;
+} hardnested_batch_result_t;
+
+
+int mfnestedhard_batch(char *list_file_name)
+{
+	char progress_text[80];
+	char nonce_file_name[FILE_PATH_SIZE];
+	hardnested_batch_result_t *results = NULL;
+	uint32_t num_results = 0;
+	uint64_t batch_start_time = msclock();
+
+	FILE *flist = fopen(list_file_name, "r");
+	if (flist == NULL) {
+		PrintAndLog("Could not open file %s", list_file_name);
+		return 3;
+	}
+
+	// everything which doesn't depend on the nonces is done once for all files
+	srand((unsigned) time(NULL));
+	brute_force_per_second = brute_force_benchmark();
+	write_stats = false;
+	known_target_key = -1;
+	start_time = msclock();
+	print_progress_header();
+	sprintf(progress_text, "Brute force benchmark: %1.0f million (2^%1.1f) keys/s", brute_force_per_second/1000000, log(brute_force_per_second)/log(2.0));
+	hardnested_print_progress(0, progress_text, (float)(1LL<<47), 0);
+	init_bitflip_bitarrays();
+	init_part_sum_bitarrays();
+	save_part_sum_bitarrays();
+	init_sum_bitarrays();
+
+	while (fgets(nonce_file_name, sizeof(nonce_file_name), flist)) {
+		nonce_file_name[strcspn(nonce_file_name, "\r\n")] = '\0';
+		if (nonce_file_name[0] == '\0' || nonce_file_name[0] == '#') {
+			continue;
+		}
+
+		// attack each target in the file
+		nonce_file_index_t index;
+		nonce_file_read_index(nonce_file_name, &index);
+		uint32_t num_targets = MAX(index.num_targets, 1);
+		nonce_file_free_index(&index);
+
+		for (uint32_t target = 0; target < num_targets; target++) {
+			hardnested_batch_result_t *new_results = realloc(results, (num_results + 1) * sizeof(hardnested_batch_result_t));
+			if (new_results == NULL) {
+				PrintAndLog("Out of memory error in mfnestedhard_batch(). Aborting...");
+				break;
+			}
+			results = new_results;
+			hardnested_batch_result_t *result = &results[num_results++];
+			memset(result, 0, sizeof(hardnested_batch_result_t));
+			strcpy(result->nonce_file, nonce_file_name);
+
+			if (num_results > 1) {
+				start_time = msclock();
+				print_progress_header();
+				restore_part_sum_bitarrays();
+			}
+			memset(part_sum_count, 0, sizeof(part_sum_count));
+			init_allbitflips_array();
+			init_nonce_memory();
+			update_reduction_rate(0.0, true);
+
+			if (read_nonce_file(nonce_file_name, target, &result->trgBlockNo, &result->trgKeyType) == 0) {
+				result->file_ok = true;
+				result->cuid = cuid;
+				hardnested_stage = CHECK_1ST_BYTES | CHECK_2ND_BYTES;
+				update_nonce_data(false);
+				float brute_force;
+				shrink_key_space(&brute_force);
+				result->key_found = search_key(&result->key);
+			}
+			result->time = msclock() - start_time;
+
+			free_nonces_memory();
+			free_bitarray(all_bitflips_bitarray[ODD_STATE]);
+			free_bitarray(all_bitflips_bitarray[EVEN_STATE]);
+		}
+	}
+	fclose(flist);
+
+	free_bitflip_bitarrays();
+	free_sum_bitarrays();
+	free_saved_part_sum_bitarrays();
+	free_part_sum_bitarrays();
+
+	uint32_t keys_found = 0;
+	PrintAndLog("\n");
+	PrintAndLog(" nonce file                               | cuid     | block | key type | key          | time");
+	PrintAndLog("----------------------------------------------------------------------------------------------");
+	for (uint32_t i = 0; i < num_results; i++) {
+		char key_string[13];
+		if (!results[i].file_ok) {
+			strcpy(key_string, "file error");
+		} else if (results[i].key_found) {
+			sprintf(key_string, "%012" PRIx64, results[i].key);
+			keys_found++;
+		} else {
+			strcpy(key_string, "not found");
+		}
+		PrintAndLog(" %-40s | %08" PRIx32 " | %5d | %8c | %-12s | %4.0fs", 
+			results[i].nonce_file, 
+			results[i].cuid, 
+			results[i].trgBlockNo, 
+			results[i].trgKeyType?'B':'A',
+			key_string,
+			(float)results[i].time/1000.0);
+	}
+	PrintAndLog("----------------------------------------------------------------------------------------------");
+	PrintAndLog("Found %" PRIu32 " of %" PRIu32 " keys in %1.0f seconds", keys_found, num_results, (float)(msclock() - batch_start_time)/1000.0);
+
+	free(results);
+	return 0;
+}
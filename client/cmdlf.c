@@ -14,12 +14,16 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
 #include "proxmark3.h"
 #include "cmdlf.h"
 #include "lfdemod.h"     // for psk2TOpsk1
 #include "util.h"        // for parsing cli command utils
+#include "util_posix.h"  // for msclock
 #include "ui.h"          // for show graph controls
 #include "graph.h"       // for graph data
+#include "tracefile.h"   // for `lf batch`
 #include "cmdparser.h"   // for getting cli commands included in cmdmain.h
 #include "cmdmain.h"     // for sending cmds to device
 #include "data.h"        // for GetFromBigBuf
@@ -875,6 +879,337 @@ int CmdVchDemod(const char *Cmd)
 }
 
 
+static int demodEM410xCtx(lf_demod_ctx_t *ctx) {
+	uint32_t hi = 0;
+	uint64_t lo = 0;
+	return AskEm410xDemodCtx(ctx, "", &hi, &lo, true);
+}
+
+// the decoders lf search runs concurrently, in the order their results are
+// preferred. They only need a lf_demod_ctx, the others use GraphBuffer.
+static const struct {
+	const char *name;
+	const char *modulation;
+	int (*demod)(lf_demod_ctx_t *ctx);
+} searchDemods[] = {
+	{"IO Prox",  "FSK2a",          FSKdemodIOCtx},
+	{"Pyramid",  "FSK2a",          FSKdemodPyramidCtx},
+	{"Paradox",  "FSK2a",          FSKdemodParadoxCtx},
+	{"AWID",     "FSK2a",          FSKdemodAWIDCtx},
+	{"HID Prox", "FSK2a",          FSKdemodHIDCtx},
+	{"EM410x",   "ASK/Manchester", demodEM410xCtx},
+};
+#define SEARCH_DEMODS (sizeof(searchDemods)/sizeof(searchDemods[0]))
+
+typedef struct {
+	lf_demod_ctx_t *ctx[SEARCH_DEMODS];
+	held_log_t log[SEARCH_DEMODS];
+	int ans[SEARCH_DEMODS];
+	size_t next;
+	size_t first_found; // later decoders needn't run
+	pthread_mutex_t lock;
+} search_jobs_t;
+
+static void *searchWorker(void *arg) {
+	search_jobs_t *jobs = (search_jobs_t *)arg;
+	while (true) {
+		pthread_mutex_lock(&jobs->lock);
+		size_t i = jobs->next++;
+		bool skip = i > jobs->first_found;
+		pthread_mutex_unlock(&jobs->lock);
+		if (i >= SEARCH_DEMODS || skip) break;
+
+		if (jobs->ctx[i] == NULL) jobs->ctx[i] = lf_demod_ctx_clone(jobs->ctx[0]);
+		if (jobs->ctx[i] == NULL) continue;
+
+		// hold the output back, searchKnownDemods prints it in order
+		PrintAndLogHold(&jobs->log[i]);
+		jobs->ans[i] = searchDemods[i].demod(jobs->ctx[i]);
+		PrintAndLogHold(NULL);
+
+		if (jobs->ans[i] > 0) {
+			pthread_mutex_lock(&jobs->lock);
+			if (i < jobs->first_found) jobs->first_found = i;
+			pthread_mutex_unlock(&jobs->lock);
+		}
+	}
+	return NULL;
+}
+
+// runs the searchDemods on one conversion of GraphBuffer, each on its own
+// copy and as many at once as there are CPUs. Output and GraphBuffer/
+// DemodBuffer end up as if they ran one after another, stopping at the first
+// match. Returns its index or -1
+static int searchKnownDemods(void) {
+	search_jobs_t jobs;
+	memset(&jobs, 0, sizeof(jobs));
+	jobs.first_found = SEARCH_DEMODS;
+	pthread_mutex_init(&jobs.lock, NULL);
+
+	int found = -1;
+	jobs.ctx[0] = lf_demod_ctx_from_graph();
+	if (jobs.ctx[0] == NULL) goto out;
+
+	pthread_t threads[SEARCH_DEMODS];
+	size_t num_threads = num_CPUs();
+	if (num_threads > SEARCH_DEMODS) num_threads = SEARCH_DEMODS;
+	size_t started = 0;
+	if (num_threads > 1) {
+		for (; started < num_threads; started++) {
+			if (pthread_create(&threads[started], NULL, searchWorker, &jobs)) break;
+		}
+	}
+	// a single CPU, or no threads available: run them here
+	if (started == 0) searchWorker(&jobs);
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (size_t i = 0; i < SEARCH_DEMODS; i++) {
+		if (found < 0 && jobs.ctx[i]) {
+			PrintAndLogRelease(&jobs.log[i], true);
+			lf_demod_ctx_show(jobs.ctx[i]);
+			if (jobs.ans[i] > 0) found = i;
+		} else {
+			PrintAndLogRelease(&jobs.log[i], false);
+		}
+	}
+
+out:
+	for (size_t i = 0; i < SEARCH_DEMODS; i++) {
+		lf_demod_ctx_free(jobs.ctx[i]);
+	}
+	pthread_mutex_destroy(&jobs.lock);
+	return found;
+}
+
+int usage_lf_batch(void)
+{
+	PrintAndLog("Decodes .pm3 trace files with the decoders lf search runs concurrently,");
+	PrintAndLog("one trace per CPU, and prints one line per trace in the order given:");
+	PrintAndLog("  <file> protocol=<name> id=<hex> clock=<RF/n> modulation=<mod> confidence=<high|low>");
+	PrintAndLog("The first decoder in lf search order wins. Confidence is low if others matched too.");
+	PrintAndLog("");
+	PrintAndLog("Usage:  lf batch <directory|file> [<directory|file> ...]");
+	PrintAndLog("     directories are read for files ending in .pm3");
+	PrintAndLog("");
+	PrintAndLog("    sample: lf batch ../traces");
+	return 0;
+}
+
+typedef struct {
+	char **files;
+	size_t count;
+	char **results;        // line for each file, once decoded
+	size_t next;           // next file to decode
+	size_t printed;        // results are printed in order up to here
+	size_t decoded;
+	pthread_mutex_t lock;
+} batch_jobs_t;
+
+// stands in for the result line of a file when there was no memory for it
+static char batchNoMemory[] = "";
+
+// strdup isn't C99
+static char *batchCopy(const char *str) {
+	char *copy = malloc(strlen(str) + 1);
+	if (copy) strcpy(copy, str);
+	return copy;
+}
+
+// reads a trace the way data load does, returns the number of samples or -1
+static char *batchDecode(const char *file, int *samples, bool *decoded) {
+	char result[FILE_PATH_SIZE + 160];
+	*decoded = false;
+
+	int len = loadTraceFile(file, samples, MAX_GRAPH_TRACE_LEN, NULL);
+	if (len == TRACE_ERR_OPEN) {
+		snprintf(result, sizeof(result), "%s error=\"couldn't open\"", file);
+		return batchCopy(result);
+	} else if (len < 0) {
+		snprintf(result, sizeof(result), "%s error=\"not a valid trace\"", file);
+		return batchCopy(result);
+	}
+	// the same checks as lf search
+	if (len < 1000) {
+		snprintf(result, sizeof(result), "%s error=\"too few samples\"", file);
+		return batchCopy(result);
+	}
+	if (graphJustNoise(samples, 1000)) {
+		snprintf(result, sizeof(result), "%s protocol=none reason=noise", file);
+		return batchCopy(result);
+	}
+
+	lf_demod_ctx_t *ctx = lf_demod_ctx_new(samples, len);
+	if (ctx == NULL) {
+		snprintf(result, sizeof(result), "%s error=\"out of memory\"", file);
+		return batchCopy(result);
+	}
+	int found = -1, matches = 0;
+	char id[sizeof(ctx->tag_id)];
+	int clock = 0;
+	for (size_t i = 0; i < SEARCH_DEMODS; i++) {
+		ctx->tag_id[0] = '\0';
+		ctx->demod_clock = 0;
+		if (searchDemods[i].demod(ctx) <= 0) continue;
+		matches++;
+		if (found < 0) {
+			found = i;
+			memcpy(id, ctx->tag_id, sizeof(id));
+			clock = ctx->demod_clock;
+		}
+	}
+	lf_demod_ctx_free(ctx);
+
+	if (found < 0) {
+		snprintf(result, sizeof(result), "%s protocol=none", file);
+	} else {
+		*decoded = true;
+		snprintf(result, sizeof(result), "%s protocol=\"%s\" id=%s clock=RF/%d modulation=%s confidence=%s",
+			file, searchDemods[found].name, id, clock, searchDemods[found].modulation,
+			(matches == 1) ? "high" : "low");
+	}
+	return batchCopy(result);
+}
+
+static void *batchWorker(void *arg) {
+	batch_jobs_t *jobs = (batch_jobs_t *)arg;
+	int *samples = malloc(MAX_GRAPH_TRACE_LEN * sizeof(int));
+	if (samples == NULL) return NULL;
+
+	while (true) {
+		pthread_mutex_lock(&jobs->lock);
+		size_t i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		if (i >= jobs->count) break;
+
+		// the decoders' own output isn't wanted here
+		held_log_t log = {0};
+		bool decoded;
+		PrintAndLogHold(&log);
+		char *result = batchDecode(jobs->files[i], samples, &decoded);
+		PrintAndLogHold(NULL);
+		PrintAndLogRelease(&log, false);
+
+		pthread_mutex_lock(&jobs->lock);
+		jobs->results[i] = result ? result : batchNoMemory;
+		if (decoded) jobs->decoded++;
+		while (jobs->printed < jobs->count && jobs->results[jobs->printed]) {
+			if (jobs->results[jobs->printed] == batchNoMemory) {
+				PrintAndLog("%s error=\"out of memory\"", jobs->files[jobs->printed]);
+			} else {
+				PrintAndLog("%s", jobs->results[jobs->printed]);
+			}
+			jobs->printed++;
+		}
+		pthread_mutex_unlock(&jobs->lock);
+	}
+	free(samples);
+	return NULL;
+}
+
+static int batchCompare(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static bool batchAddFile(batch_jobs_t *jobs, size_t *size, const char *file) {
+	if (jobs->count == *size) {
+		size_t new_size = *size ? *size * 2 : 64;
+		char **files = realloc(jobs->files, new_size * sizeof(char *));
+		if (files == NULL) return false;
+		jobs->files = files;
+		*size = new_size;
+	}
+	jobs->files[jobs->count] = batchCopy(file);
+	if (jobs->files[jobs->count] == NULL) return false;
+	jobs->count++;
+	return true;
+}
+
+// adds the .pm3 files of a directory, sorted, or the path itself if it isn't one
+static bool batchAddPath(batch_jobs_t *jobs, size_t *size, const char *path) {
+	DIR *dp = opendir(path);
+	if (dp == NULL) return batchAddFile(jobs, size, path);
+
+	size_t first = jobs->count;
+	struct dirent *ep;
+	char file[FILE_PATH_SIZE];
+	bool ok = true;
+	while (ok && (ep = readdir(dp)) != NULL) {
+		size_t len = strlen(ep->d_name);
+		if (len < 4 || strcmp(ep->d_name + len - 4, ".pm3") != 0) continue;
+		if (snprintf(file, sizeof(file), "%s/%s", path, ep->d_name) >= (int)sizeof(file)) continue;
+		ok = batchAddFile(jobs, size, file);
+	}
+	closedir(dp);
+	if (ok) qsort(jobs->files + first, jobs->count - first, sizeof(char *), batchCompare);
+	return ok;
+}
+
+int CmdLFbatch(const char *Cmd)
+{
+	char cmdp = param_getchar(Cmd, 0);
+	if (cmdp == 0x00 || (strlen(Cmd) == 1 && (cmdp == 'h' || cmdp == 'H'))) return usage_lf_batch();
+
+	batch_jobs_t jobs;
+	memset(&jobs, 0, sizeof(jobs));
+	size_t size = 0;
+	char path[FILE_PATH_SIZE];
+	int bg, en;
+	for (int i = 0; !param_getptr(Cmd, &bg, &en, i); i++) {
+		if (en - bg + 1 >= FILE_PATH_SIZE) {
+			PrintAndLog("Path too long: parameter %d", i + 1);
+			goto out;
+		}
+		param_getstr(Cmd, i, path);
+		if (!batchAddPath(&jobs, &size, path)) {
+			PrintAndLog("Failed to allocate memory");
+			goto out;
+		}
+	}
+	if (jobs.count == 0) {
+		PrintAndLog("No .pm3 files found");
+		goto out;
+	}
+	jobs.results = calloc(jobs.count, sizeof(char *));
+	if (jobs.results == NULL) {
+		PrintAndLog("Failed to allocate memory");
+		goto out;
+	}
+	pthread_mutex_init(&jobs.lock, NULL);
+
+	uint64_t start = msclock();
+	size_t num_threads = num_CPUs();
+	if (num_threads > jobs.count) num_threads = jobs.count;
+	pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+	size_t started = 0;
+	if (threads) {
+		for (; started < num_threads; started++) {
+			if (pthread_create(&threads[started], NULL, batchWorker, &jobs)) break;
+		}
+	}
+	if (started == 0) batchWorker(&jobs);
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	uint64_t elapsed = msclock() - start;
+
+	PrintAndLog("%zu of %zu traces decoded in %.3f seconds (%.1f traces/s, %zu threads)",
+		jobs.decoded, jobs.count, elapsed / 1000.0,
+		elapsed ? jobs.count * 1000.0 / elapsed : 0.0, started ? started : 1);
+	pthread_mutex_destroy(&jobs.lock);
+
+out:
+	for (size_t i = 0; i < jobs.count; i++) {
+		free(jobs.files[i]);
+		if (jobs.results && jobs.results[i] != batchNoMemory) free(jobs.results[i]);
+	}
+	free(jobs.files);
+	free(jobs.results);
+	return 0;
+}
+
 //by marshmellow
 int CheckChipType(char cmdp) {
 	uint32_t wordData = 0;
@@ -961,39 +1296,9 @@ int CmdLFfind(const char *Cmd)
 
 	// TODO test for modulation then only test formats that use that modulation
 
-	ans=CmdFSKdemodIO("");
-	if (ans>0) {
-		PrintAndLog("\nValid IO Prox ID Found!");
-		return CheckChipType(cmdp);
-	}
-
-	ans=CmdFSKdemodPyramid("");
-	if (ans>0) {
-		PrintAndLog("\nValid Pyramid ID Found!");
-		return CheckChipType(cmdp);
-	}
-
-	ans=CmdFSKdemodParadox("");
-	if (ans>0) {
-		PrintAndLog("\nValid Paradox ID Found!");
-		return CheckChipType(cmdp);
-	}
-
-	ans=CmdFSKdemodAWID("");
-	if (ans>0) {
-		PrintAndLog("\nValid AWID ID Found!");
-		return CheckChipType(cmdp);
-	}
-
-	ans=CmdFSKdemodHID("");
-	if (ans>0) {
-		PrintAndLog("\nValid HID Prox ID Found!");
-		return CheckChipType(cmdp);
-	}
-
-	ans=CmdAskEM410xDemod("");
-	if (ans>0) {
-		PrintAndLog("\nValid EM410x ID Found!");
+	int found = searchKnownDemods();
+	if (found >= 0) {
+		PrintAndLog("\nValid %s ID Found!", searchDemods[found].name);
 		return CheckChipType(cmdp);
 	}
 
@@ -1123,6 +1428,7 @@ static command_t CommandTable[] =
 	{"ti",          CmdLFTI,            1, "{ TI CHIPs...                }"},
 	{"viking",      CmdLFViking,        1, "{ Viking RFIDs...            }"},
 	{"visa2000",    CmdLFVisa2k,        1, "{ Visa2000 RFIDs...          }"},
+	{"batch",       CmdLFbatch,         1, "<directory|file> ... -- Decode .pm3 trace files, one line per trace"},
 	{"cmdread",     CmdLFCommandRead,   0, "<d period> <z period> <o period> <c command> ['H'] -- Modulate LF reader field to send command before read (all periods in microseconds) (option 'H' for 134)"},
 	{"config",      CmdLFSetConfig,     0, "Set config for LF sampling, bit/sample, decimation, frequency"},
 	{"flexdemod",   CmdFlexdemod,       1, "Demodulate samples for FlexPass"},
@@ -29,6 +29,7 @@ extern int CmdLFSimBidir(const char *Cmd);
 extern int CmdLFSnoop(const char *Cmd);
 extern int CmdVchDemod(const char *Cmd);
 extern int CmdLFfind(const char *Cmd);
+extern int CmdLFbatch(const char *Cmd);
 extern bool lf_read(bool silent, uint32_t samples);
 
 #endif
@@ -82,10 +82,10 @@ int CmdAWIDReadFSK(const char *Cmd) {
 //by marshmellow
 //AWID Prox demod - FSK RF/50 with preamble of 00000001  (always a 96 bit data stream)
 //print full AWID Prox ID and some bit format details if found
-int CmdFSKdemodAWID(const char *Cmd)
+int FSKdemodAWIDCtx(lf_demod_ctx_t *ctx)
 {
-	uint8_t BitStream[MAX_GRAPH_TRACE_LEN]={0};
-	size_t size = getFromGraphBuf(BitStream);
+	size_t size = 0;
+	uint8_t *BitStream = lf_demod_ctx_bits(ctx, &size);
 	if (size==0) return 0;
 
 	int waveIdx = 0;
@@ -126,8 +126,8 @@ int CmdFSKdemodAWID(const char *Cmd)
 	uint32_t rawLo = bytebits_to_byte(BitStream+idx+64,32);
 	uint32_t rawHi = bytebits_to_byte(BitStream+idx+32,32);
 	uint32_t rawHi2 = bytebits_to_byte(BitStream+idx,32);
-	setDemodBuf(BitStream,96,idx);
-	setClockGrid(50, waveIdx + (idx*50));
+	lf_demod_ctx_set_demod(ctx,BitStream,96,idx);
+	lf_demod_ctx_set_clock(ctx, 50, waveIdx + (idx*50));
 
 	size = removeParity(BitStream, idx+8, 4, 1, 88);
 	if (size != 66){
@@ -135,6 +135,7 @@ int CmdFSKdemodAWID(const char *Cmd)
 		return 0;
 	}
 	// ok valid card found!
+	snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%08x%08x%08x", rawHi2, rawHi, rawLo);
 
 	// Index map
 	// 0           10         20        30          40        50        60
@@ -172,12 +173,19 @@ int CmdFSKdemodAWID(const char *Cmd)
 	}
 	if (g_debugMode){
 		PrintAndLog("DEBUG: idx: %d, Len: %d Printing Demod Buffer:", idx, 96);
-		printDemodBuff();
+		lf_demod_ctx_print(ctx);
 	}
 	//todo - convert hi2, hi, lo to demodbuffer for future sim/clone commands
 	return 1;
 }
 
+int CmdFSKdemodAWID(const char *Cmd)
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+	if (ctx == NULL) return 0;
+	return lf_demod_ctx_finish(ctx, FSKdemodAWIDCtx(ctx));
+}
+
 //refactored by marshmellow
 int getAWIDBits(uint32_t fc, uint32_t cn, uint8_t	*AWIDBits) {
 	uint8_t pre[66];
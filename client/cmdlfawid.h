@@ -12,12 +12,14 @@
 #define CMDLFAWID_H__
 
 #include <stdint.h>  // for uint_32+
+#include "cmddata.h" // for lf_demod_ctx_t
 
 int CmdLFAWID(const char *Cmd);
 int CmdAWIDReadFSK(const char *Cmd);
 int CmdAWIDSim(const char *Cmd);
 int CmdAWIDClone(const char *Cmd);
 int CmdFSKdemodAWID(const char *Cmd);
+int FSKdemodAWIDCtx(lf_demod_ctx_t *ctx);
 int getAWIDBits(unsigned int fc, unsigned int cn, uint8_t *AWIDBits);
 int usage_lf_awid_fskdemod(void);
 int usage_lf_awid_clone(void);
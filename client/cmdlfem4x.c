@@ -145,38 +145,62 @@ void printEM410x(uint32_t hi, uint64_t id)
  *   CCCC                  <-- each bit here is parity for the 10 bits above in corresponding column
  *   0                     <-- stop bit, end of tag
  */
-int AskEm410xDecode(bool verbose, uint32_t *hi, uint64_t *lo )
+int AskEm410xDecodeCtx(lf_demod_ctx_t *ctx, bool verbose, uint32_t *hi, uint64_t *lo)
 {
 	size_t idx = 0;
 	uint8_t BitStream[512]={0};
-	size_t BitLen = sizeof(BitStream);
-	if ( !getDemodBuf(BitStream, &BitLen) ) return 0;
+	size_t BitLen = (ctx->demod_len < sizeof(BitStream)) ? ctx->demod_len : sizeof(BitStream);
+	if (BitLen == 0) return 0;
+	memcpy(BitStream, ctx->demod, BitLen);
 
 	if (Em410xDecode(BitStream, &BitLen, &idx, hi, lo)) {
 		//set GraphBuffer for clone or sim command
-		setDemodBuf(DemodBuffer, (BitLen==40) ? 64 : 128, idx+1);
-		setClockGrid(g_DemodClock, g_DemodStartIdx + ((idx+1)*g_DemodClock));
+		size_t size = (BitLen==40) ? 64 : 128;
+		if (size > ctx->demod_len - (idx+1)) size = ctx->demod_len - (idx+1);
+		lf_demod_ctx_set_demod(ctx, ctx->demod, size, idx+1);
+		lf_demod_ctx_set_clock(ctx, ctx->demod_clock, ctx->demod_start_idx + ((idx+1)*ctx->demod_clock));
 
 		if (g_debugMode) {
 			PrintAndLog("DEBUG: idx: %d, Len: %d, Printing Demod Buffer:", idx, BitLen);
-			printDemodBuff();
+			lf_demod_ctx_print(ctx);
 		}
+		if (*hi)
+			snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%06x%016" PRIx64, *hi, *lo);
+		else
+			snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%010" PRIx64, *lo);
 		if (verbose) {
 			PrintAndLog("EM410x pattern found: ");
 			printEM410x(*hi, *lo);
-			g_em410xId = *lo;
+			ctx->em410x_found = true;
+			ctx->em410x_id = *lo;
 		}
 		return 1;
 	}
 	return 0;
 }
-
-//askdemod then call Em410xdecode
-int AskEm410xDemod(const char *Cmd, uint32_t *hi, uint64_t *lo, bool verbose)
+int AskEm410xDemodCtx(lf_demod_ctx_t *ctx, const char *Cmd, uint32_t *hi, uint64_t *lo, bool verbose)
 {
 	bool st = true;
-	if (!ASKDemod_ext(Cmd, false, false, 1, &st)) return 0;
-	return AskEm410xDecode(verbose, hi, lo);
+	if (!ASKDemodCtx(ctx, Cmd, false, false, 1, &st)) return 0;
+	return AskEm410xDecodeCtx(ctx, verbose, hi, lo);
+}
+int AskEm410xDecode(bool verbose, uint32_t *hi, uint64_t *lo )
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_new(NULL, 0);
+	if (ctx == NULL) return 0;
+	lf_demod_ctx_set_demod(ctx, DemodBuffer, DemodBufferLen, 0);
+	lf_demod_ctx_set_clock(ctx, g_DemodClock, g_DemodStartIdx);
+	int ans = AskEm410xDecodeCtx(ctx, verbose, hi, lo);
+	// only publish a decoded ID, DemodBuffer stays as it was otherwise
+	if (ans) lf_demod_ctx_show(ctx);
+	lf_demod_ctx_free(ctx);
+	return ans;
+}
+int AskEm410xDemod(const char *Cmd, uint32_t *hi, uint64_t *lo, bool verbose)
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+	if (ctx == NULL) return 0;
+	return lf_demod_ctx_finish(ctx, AskEm410xDemodCtx(ctx, Cmd, hi, lo, verbose));
 }
 
 //by marshmellow
@@ -13,6 +13,9 @@
 
 #include <stdbool.h>    // for bool
 #include <inttypes.h>
+#include "cmddata.h"    // for lf_demod_ctx_t
+
+extern uint64_t g_em410xId;
 
 extern int CmdLFEM4X(const char *Cmd);
 extern void printEM410x(uint32_t hi, uint64_t id);
@@ -20,6 +23,8 @@ extern int CmdEMdemodASK(const char *Cmd);
 extern int CmdAskEM410xDemod(const char *Cmd);
 extern int AskEm410xDecode(bool verbose, uint32_t *hi, uint64_t *lo );
 extern int AskEm410xDemod(const char *Cmd, uint32_t *hi, uint64_t *lo, bool verbose);
+extern int AskEm410xDecodeCtx(lf_demod_ctx_t *ctx, bool verbose, uint32_t *hi, uint64_t *lo);
+extern int AskEm410xDemodCtx(lf_demod_ctx_t *ctx, const char *Cmd, uint32_t *hi, uint64_t *lo, bool verbose);
 extern int CmdEM410xSim(const char *Cmd);
 extern int CmdEM410xBrute(const char *Cmd);
 extern int CmdEM410xWatch(const char *Cmd);
@@ -23,13 +23,13 @@ static int CmdHelp(const char *Cmd);
 //by marshmellow (based on existing demod + holiman's refactor)
 //HID Prox demod - FSK RF/50 with preamble of 00011101 (then manchester encoded)
 //print full HID Prox ID and some bit format details if found
-int CmdFSKdemodHID(const char *Cmd)
+int FSKdemodHIDCtx(lf_demod_ctx_t *ctx)
 {
   //raw fsk demod no manchester decoding no start bit finding just get binary from wave
   uint32_t hi2=0, hi=0, lo=0;
 
-  uint8_t BitStream[MAX_GRAPH_TRACE_LEN]={0};
-  size_t BitLen = getFromGraphBuf(BitStream);
+  size_t BitLen = 0;
+  uint8_t *BitStream = lf_demod_ctx_bits(ctx, &BitLen);
   if (BitLen==0) return 0;
   //get binary from fsk wave
   int waveIdx = 0;
@@ -99,15 +99,26 @@ int CmdFSKdemodHID(const char *Cmd)
       (unsigned int) hi, (unsigned int) lo, (unsigned int) (lo>>1) & 0xFFFF,
       (unsigned int) fmtLen, (unsigned int) fc, (unsigned int) cardnum);
   }
-  setDemodBuf(BitStream,BitLen,idx);
-  setClockGrid(50, waveIdx + (idx*50));
+  if (hi2 != 0)
+    snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%x%08x%08x", (unsigned int) hi2, (unsigned int) hi, (unsigned int) lo);
+  else
+    snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%x%08x", (unsigned int) hi, (unsigned int) lo);
+  lf_demod_ctx_set_demod(ctx,BitStream,BitLen,idx);
+  lf_demod_ctx_set_clock(ctx, 50, waveIdx + (idx*50));
   if (g_debugMode){ 
     PrintAndLog("DEBUG: idx: %d, Len: %d, Printing Demod Buffer:", idx, BitLen);
-    printDemodBuff();
+    lf_demod_ctx_print(ctx);
   }
   return 1;
 }
 
+int CmdFSKdemodHID(const char *Cmd)
+{
+  lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+  if (ctx == NULL) return 0;
+  return lf_demod_ctx_finish(ctx, FSKdemodHIDCtx(ctx));
+}
+
 int CmdHIDReadFSK(const char *Cmd)
 {
   int findone=0;
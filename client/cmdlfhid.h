@@ -11,8 +11,11 @@
 #ifndef CMDLFHID_H__
 #define CMDLFHID_H__
 
+#include "cmddata.h"  // for lf_demod_ctx_t
+
 int CmdLFHID(const char *Cmd);
 int CmdFSKdemodHID(const char *Cmd);
+int FSKdemodHIDCtx(lf_demod_ctx_t *ctx);
 int CmdHIDReadDemod(const char *Cmd);
 int CmdHIDSim(const char *Cmd);
 int CmdHIDClone(const char *Cmd);
@@ -21,6 +21,7 @@
 #include "hitag2.h"
 #include "hitagS.h"
 #include "cmdmain.h"
+#include "cmddata.h"
 
 static int CmdHelp(const char *Cmd);
 
@@ -30,24 +31,14 @@ size_t nbytes(size_t nbits) {
 
 int CmdLFHitagList(const char *Cmd)
 {
- 	uint8_t *got = malloc(USB_CMD_DATA_SIZE);
-
-	// Query for the actual size of the trace
-	UsbCommand response;
-	GetFromBigBuf(got, USB_CMD_DATA_SIZE, 0);
-	WaitForResponse(CMD_ACK, &response);
-	uint16_t traceLen = response.arg[2];
-	if (traceLen > USB_CMD_DATA_SIZE) {
-		uint8_t *p = realloc(got, traceLen);
-		if (p == NULL) {
-			PrintAndLog("Cannot allocate memory for trace");
-			free(got);
-			return 2;
-		}
-		got = p;
-		GetFromBigBuf(got, traceLen, 0);
-		WaitForResponse(CMD_ACK,NULL);
+	// trace length and data in one transfer
+	bigbuf_download_t *download = DownloadBigBuf(0, 0, true, NULL, NULL);
+	if (download == NULL) {
+		PrintAndLog("Cannot download trace");
+		return 2;
 	}
+	uint8_t *got = download->data;
+	uint16_t traceLen = download->len;
 	
 	PrintAndLog("recorded activity (TraceLen = %d bytes):");
 	PrintAndLog(" ETU     :nbits: who bytes");
@@ -67,6 +58,7 @@ int CmdLFHitagList(const char *Cmd)
 	if (strlen(filename) > 0) {
 		if ((pf = fopen(filename,"wb")) == NULL) {
 			PrintAndLog("Error: Could not open file [%s]",filename);
+			free(download);
 			return 1;
 		}
 	}
@@ -141,7 +133,7 @@ int CmdLFHitagList(const char *Cmd)
 		PrintAndLog("Recorded activity succesfully written to file: %s", filename);
 	}
 
-	free(got);
+	free(download);
 	return 0;
 }
 
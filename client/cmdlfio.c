@@ -23,7 +23,6 @@
 #include "cmddata.h"
 #include "cmdlf.h"
 #include "lfdemod.h"  //for IOdemodFSK + bytebits_to_byte
-#include "util.h"     //for sprint_bin_break
 
 static int CmdHelp(const char *Cmd);
 
@@ -41,16 +40,16 @@ int CmdIOReadFSK(const char *Cmd)
 //by marshmellow
 //IO-Prox demod - FSK RF/64 with preamble of 000000001
 //print ioprox ID and some format details
-int CmdFSKdemodIO(const char *Cmd)
+int FSKdemodIOCtx(lf_demod_ctx_t *ctx)
 {
   int idx=0;
   //something in graphbuffer?
-  if (GraphTraceLen < 65) {
+  if (ctx->samples_len < 65) {
     if (g_debugMode)PrintAndLog("DEBUG: not enough samples in GraphBuffer");
     return 0;
   }
-  uint8_t BitStream[MAX_GRAPH_TRACE_LEN]={0};
-  size_t BitLen = getFromGraphBuf(BitStream);
+  size_t BitLen = 0;
+  uint8_t *BitStream = lf_demod_ctx_bits(ctx, &BitLen);
   if (BitLen==0) return 0;
 
   int waveIdx = 0;
@@ -77,7 +76,7 @@ int CmdFSKdemodIO(const char *Cmd)
   if (idx==0){
     if (g_debugMode){
       PrintAndLog("DEBUG: IO Prox Data not found - FSK Bits: %d",BitLen);
-      if (BitLen > 92) PrintAndLog("%s", sprint_bin_break(BitStream,92,16));
+      if (BitLen > 92) printDemodBits(BitStream,92);
     } 
     return 0;
   }
@@ -119,16 +118,24 @@ int CmdFSKdemodIO(const char *Cmd)
   char *crcStr = (crc == calccrc) ? "crc ok": "!crc";
 
   PrintAndLog("IO Prox XSF(%02d)%02x:%05d (%08x%08x) [%02x %s]",version,facilitycode,number,code,code2, crc, crcStr);
-  setDemodBuf(BitStream,64,idx);
-  setClockGrid(64, waveIdx + (idx*64));
+  snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%08x%08x", code, code2);
+  lf_demod_ctx_set_demod(ctx,BitStream,64,idx);
+  lf_demod_ctx_set_clock(ctx, 64, waveIdx + (idx*64));
 
   if (g_debugMode){
     PrintAndLog("DEBUG: idx: %d, Len: %d, Printing demod buffer:",idx,64);
-    printDemodBuff();
+    lf_demod_ctx_print(ctx);
   }
   return 1;
 }
 
+int CmdFSKdemodIO(const char *Cmd)
+{
+  lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+  if (ctx == NULL) return 0;
+  return lf_demod_ctx_finish(ctx, FSKdemodIOCtx(ctx));
+}
+
 int CmdIOClone(const char *Cmd)
 {
   unsigned int hi = 0, lo = 0;
@@ -4,8 +4,11 @@
 #ifndef CMDLFIO_H__
 #define CMDLFIO_H__
 
+#include "cmddata.h"  // for lf_demod_ctx_t
+
 extern int CmdLFIO(const char *Cmd);
 extern int CmdFSKdemodIO(const char *Cmd);
+extern int FSKdemodIOCtx(lf_demod_ctx_t *ctx);
 extern int CmdIOReadFSK(const char *Cmd);
 
 #endif
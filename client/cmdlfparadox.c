@@ -24,13 +24,13 @@ static int CmdHelp(const char *Cmd);
 //by marshmellow
 //Paradox Prox demod - FSK RF/50 with preamble of 00001111 (then manchester encoded)
 //print full Paradox Prox ID and some bit format details if found
-int CmdFSKdemodParadox(const char *Cmd)
+int FSKdemodParadoxCtx(lf_demod_ctx_t *ctx)
 {
 	//raw fsk demod no manchester decoding no start bit finding just get binary from wave
 	uint32_t hi2=0, hi=0, lo=0;
 
-	uint8_t BitStream[MAX_GRAPH_TRACE_LEN]={0};
-	size_t BitLen = getFromGraphBuf(BitStream);
+	size_t BitLen = 0;
+	uint8_t *BitStream = lf_demod_ctx_bits(ctx, &BitLen);
 	if (BitLen==0) return 0;
 	int waveIdx=0;
 	//get binary from fsk wave
@@ -63,14 +63,22 @@ int CmdFSKdemodParadox(const char *Cmd)
 
 	PrintAndLog("Paradox TAG ID: %x%08x - FC: %d - Card: %d - Checksum: %02x - RAW: %08x%08x%08x",
 		hi>>10, (hi & 0x3)<<26 | (lo>>10), fc, cardnum, (lo>>2) & 0xFF, rawHi2, rawHi, rawLo);
-	setDemodBuf(BitStream,BitLen,idx);
-	setClockGrid(50, waveIdx + (idx*50));
+	snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%08x%08x%08x", rawHi2, rawHi, rawLo);
+	lf_demod_ctx_set_demod(ctx,BitStream,BitLen,idx);
+	lf_demod_ctx_set_clock(ctx, 50, waveIdx + (idx*50));
 	if (g_debugMode){ 
 		PrintAndLog("DEBUG: idx: %d, len: %d, Printing Demod Buffer:", idx, BitLen);
-		printDemodBuff();
+		lf_demod_ctx_print(ctx);
 	}
 	return 1;
 }
+
+int CmdFSKdemodParadox(const char *Cmd)
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+	if (ctx == NULL) return 0;
+	return lf_demod_ctx_finish(ctx, FSKdemodParadoxCtx(ctx));
+}
 //by marshmellow
 //see ASKDemod for what args are accepted
 int CmdParadoxRead(const char *Cmd) {
@@ -8,7 +8,9 @@
 //-----------------------------------------------------------------------------
 #ifndef CMDLFPARADOX_H__
 #define CMDLFPARADOX_H__
+#include "cmddata.h"  // for lf_demod_ctx_t
 extern int CmdLFParadox(const char *Cmd);
 extern int CmdFSKdemodParadox(const char *Cmd);
+extern int FSKdemodParadoxCtx(lf_demod_ctx_t *ctx);
 extern int CmdParadoxRead(const char *Cmd);
 #endif
@@ -89,11 +89,11 @@ int GetPyramidBits(uint32_t fc, uint32_t cn, uint8_t *pyramidBits) {
 //by marshmellow
 //Pyramid Prox demod - FSK RF/50 with preamble of 0000000000000001  (always a 128 bit data stream)
 //print full Farpointe Data/Pyramid Prox ID and some bit format details if found
-int CmdFSKdemodPyramid(const char *Cmd)
+int FSKdemodPyramidCtx(lf_demod_ctx_t *ctx)
 {
 	//raw fsk demod no manchester decoding no start bit finding just get binary from wave
-	uint8_t BitStream[MAX_GRAPH_TRACE_LEN]={0};
-	size_t size = getFromGraphBuf(BitStream);
+	size_t size = 0;
+	uint8_t *BitStream = lf_demod_ctx_bits(ctx, &size);
 	if (size==0) return 0;
 
 	int waveIdx=0;
@@ -152,8 +152,8 @@ int CmdFSKdemodPyramid(const char *Cmd)
 	uint32_t rawHi = bytebits_to_byte(BitStream+idx+64,32);
 	uint32_t rawHi2 = bytebits_to_byte(BitStream+idx+32,32);
 	uint32_t rawHi3 = bytebits_to_byte(BitStream+idx,32);
-	setDemodBuf(BitStream,128,idx);
-	setClockGrid(50, waveIdx + (idx*50));
+	lf_demod_ctx_set_demod(ctx,BitStream,128,idx);
+	lf_demod_ctx_set_clock(ctx, 50, waveIdx + (idx*50));
 
 	size = removeParity(BitStream, idx+8, 8, 1, 120);
 	if (size != 105){
@@ -163,6 +163,7 @@ int CmdFSKdemodPyramid(const char *Cmd)
 	}
 
 	// ok valid card found!
+	snprintf(ctx->tag_id, sizeof(ctx->tag_id), "%08x%08x%08x%08x", rawHi3, rawHi2, rawHi, rawLo);
 
 	// Index map
 	// 0         10        20        30        40        50        60        70
@@ -222,11 +223,18 @@ int CmdFSKdemodPyramid(const char *Cmd)
 
 	if (g_debugMode){
 		PrintAndLog("DEBUG: idx: %d, Len: %d, Printing Demod Buffer:", idx, 128);
-		printDemodBuff();
+		lf_demod_ctx_print(ctx);
 	}
 	return 1;
 }
 
+int CmdFSKdemodPyramid(const char *Cmd)
+{
+	lf_demod_ctx_t *ctx = lf_demod_ctx_from_graph();
+	if (ctx == NULL) return 0;
+	return lf_demod_ctx_finish(ctx, FSKdemodPyramidCtx(ctx));
+}
+
 int CmdPyramidRead(const char *Cmd) {
 	lf_read(true, 15000);
 	return CmdFSKdemodPyramid("");
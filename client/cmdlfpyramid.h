@@ -9,10 +9,13 @@
 #ifndef CMDLFPYRAMID_H__
 #define CMDLFPYRAMID_H__
 
+#include "cmddata.h"  // for lf_demod_ctx_t
+
 extern int CmdLFPyramid(const char *Cmd);
 extern int CmdPyramidClone(const char *Cmd);
 extern int CmdPyramidSim(const char *Cmd);
 extern int CmdFSKdemodPyramid(const char *Cmd);
+extern int FSKdemodPyramidCtx(lf_demod_ctx_t *ctx);
 extern int CmdPyramidRead(const char *Cmd);
 #endif
 
@@ -12,6 +12,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "cmdparser.h"
 #include "proxmark3.h"
 #include "data.h"
@@ -41,6 +44,40 @@ static UsbCommand cmdBuffer[CMD_BUFFER_SIZE];
 static int cmd_head;//Starts as 0
 //Points to the position of the last unread command
 static int cmd_tail;//Starts as 0
+//Protects cmdBuffer, cmd_head, cmd_tail and the waiter list
+static pthread_mutex_t cmd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//A thread blocked in WaitForResponseTimeout(). storeCommand() only wakes the
+//waiters whose cmd matches the stored response.
+typedef struct cmd_waiter {
+	uint32_t cmd;
+	bool signalled;
+	pthread_cond_t cond;
+	struct cmd_waiter *next;
+} cmd_waiter_t;
+static cmd_waiter_t *cmd_waiters = NULL;
+
+//A request sent with SendCommandTracked(). The firmware doesn't echo a tag,
+//so responses of type resp_cmd are matched to the outstanding requests in the
+//order the requests were sent. A request whose waiter timed out stays in the
+//list as abandoned, so that its late response is swallowed instead of being
+//taken as the answer to the next tracked request. The device answers commands
+//in order, so an abandoned request is dropped as soon as a response of another
+//type arrives, and it never takes a response an untracked caller waits for.
+typedef struct tracked_request {
+	uint32_t seq;
+	uint32_t resp_cmd;
+	bool done;
+	bool abandoned;
+	uint64_t abandoned_at;
+	UsbCommand response;
+	pthread_cond_t cond;
+	struct tracked_request *next;
+} tracked_request_t;
+static tracked_request_t *tracked_head = NULL; // oldest first
+static uint32_t tracked_seq = 0;
+//Abandoned requests are forgotten after this long
+#define TRACKED_ABANDON_MS 5000
 
 static command_t CommandTable[] = 
 {
@@ -80,13 +117,73 @@ int CmdRev(const char *Cmd)
 /**
  * @brief This method should be called when sending a new command to the pm3. In case any old
  *  responses from previous commands are stored in the buffer, a call to this method should clear them.
- *  A better method could have been to have explicit command-ACKS, so we can know which ACK goes to which
- *  operation. Right now we'll just have to live with this.
+ *  Commands sent with SendCommandTracked() don't need this, their responses are matched
+ *  to the request and never end up in the buffer.
  */
 void clearCommandBuffer()
 {
     //This is a very simple operation
+    pthread_mutex_lock(&cmd_lock);
     cmd_tail = cmd_head;
+    pthread_mutex_unlock(&cmd_lock);
+}
+
+static void unlinkTrackedRequest(tracked_request_t *req)
+{
+    for (tracked_request_t **r = &tracked_head; *r != NULL; r = &(*r)->next) {
+        if (*r == req) {
+            *r = req->next;
+            break;
+        }
+    }
+}
+
+static bool untrackedWaiterFor(uint32_t cmd)
+{
+    for (cmd_waiter_t *w = cmd_waiters; w != NULL; w = w->next) {
+        if (w->cmd == cmd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief storeTrackedResponse hands a response to the oldest outstanding tracked
+ *  request expecting it. Must be called with cmd_lock held.
+ * @return true if the response was consumed by a tracked request
+ */
+static bool storeTrackedResponse(UsbCommand *command)
+{
+    uint64_t now = msclock();
+    tracked_request_t *req = tracked_head;
+
+    while (req != NULL) {
+        tracked_request_t *next = req->next;
+        if (req->abandoned
+            && (now - req->abandoned_at > TRACKED_ABANDON_MS
+                || req->resp_cmd != command->cmd
+                || untrackedWaiterFor(command->cmd))) {
+            // expired, or the device has already moved on to a later command
+            unlinkTrackedRequest(req);
+            pthread_cond_destroy(&req->cond);
+            free(req);
+        } else if (!req->done && req->resp_cmd == command->cmd) {
+            if (req->abandoned) {
+                // late response to a request nobody waits for anymore
+                unlinkTrackedRequest(req);
+                pthread_cond_destroy(&req->cond);
+                free(req);
+            } else {
+                memcpy(&req->response, command, sizeof(UsbCommand));
+                req->done = true;
+                pthread_cond_signal(&req->cond);
+            }
+            return true;
+        }
+        req = next;
+    }
+    return false;
 }
 
 /**
@@ -95,26 +192,47 @@ void clearCommandBuffer()
  */
 void storeCommand(UsbCommand *command)
 {
+    bool overwrite = false;
+
+    pthread_mutex_lock(&cmd_lock);
+    if (storeTrackedResponse(command)) {
+        pthread_mutex_unlock(&cmd_lock);
+        return;
+    }
     if( ( cmd_head+1) % CMD_BUFFER_SIZE == cmd_tail)
     {
         //If these two are equal, we're about to overwrite in the
         // circular buffer.
-        PrintAndLog("WARNING: Command buffer about to overwrite command! This needs to be fixed!");
+        overwrite = true;
     }
     //Store the command at the 'head' location
     UsbCommand* destination = &cmdBuffer[cmd_head];
     memcpy(destination, command, sizeof(UsbCommand));
 
     cmd_head = (cmd_head +1) % CMD_BUFFER_SIZE; //increment head and wrap
+
+    //Wake only the threads waiting for this response
+    for (cmd_waiter_t *w = cmd_waiters; w != NULL; w = w->next) {
+        if (w->cmd == command->cmd) {
+            w->signalled = true;
+            pthread_cond_signal(&w->cond);
+        }
+    }
+    pthread_mutex_unlock(&cmd_lock);
+
+    if (overwrite) {
+        PrintAndLog("WARNING: Command buffer about to overwrite command! This needs to be fixed!");
+    }
 }
 
 
 /**
  * @brief getCommand gets a command from an internal circular buffer.
+ *  Must be called with cmd_lock held.
  * @param response location to write command
  * @return 1 if response was returned, 0 if nothing has been received
  */
-int getCommand(UsbCommand* response)
+static int getCommand(UsbCommand* response)
 {
     //If head == tail, there's nothing to read, or if we just got initialized
     if(cmd_head == cmd_tail){
@@ -130,6 +248,64 @@ int getCommand(UsbCommand* response)
 }
 
 
+typedef struct {
+	bool forever;
+	bool warned;
+	struct timespec deadline;
+	struct timespec warn_at;
+} wait_deadline_t;
+
+static void initDeadline(wait_deadline_t *d, size_t ms_timeout)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	// ms_timeout == -1 means wait forever
+	d->forever = (ms_timeout == (size_t)-1);
+	d->warned = false;
+	d->warn_at.tv_sec = now.tv_sec + 2; // Two seconds
+	d->warn_at.tv_nsec = now.tv_usec * 1000;
+	d->deadline.tv_sec = now.tv_sec + (d->forever ? 0 : ms_timeout / 1000);
+	d->deadline.tv_nsec = now.tv_usec * 1000 + (d->forever ? 0 : ms_timeout % 1000) * 1000000;
+	if (d->deadline.tv_nsec >= 1000000000) {
+		d->deadline.tv_sec++;
+		d->deadline.tv_nsec -= 1000000000;
+	}
+}
+
+/**
+ * @brief waitDeadline sleeps on cond until *flag is set or the deadline passes.
+ *  Prints the 'waiting for a response' notice once after two seconds.
+ *  Must be called with cmd_lock held.
+ * @return true if *flag was set, false on timeout
+ */
+static bool waitDeadline(wait_deadline_t *d, pthread_cond_t *cond, bool *flag)
+{
+	while (!*flag) {
+		bool warn = !d->warned && (d->forever || d->warn_at.tv_sec < d->deadline.tv_sec
+			|| (d->warn_at.tv_sec == d->deadline.tv_sec && d->warn_at.tv_nsec < d->deadline.tv_nsec));
+		int res;
+		if (d->forever && !warn) {
+			res = pthread_cond_wait(cond, &cmd_lock);
+		} else {
+			res = pthread_cond_timedwait(cond, &cmd_lock, warn ? &d->warn_at : &d->deadline);
+		}
+		if (res != ETIMEDOUT || *flag) {
+			continue;
+		}
+		if (!warn) {
+			return false;
+		}
+		d->warned = true;
+		pthread_mutex_unlock(&cmd_lock);
+		PrintAndLog("Waiting for a response from the proxmark...");
+		PrintAndLog("Don't forget to cancel its operation first by pressing on the button");
+		pthread_mutex_lock(&cmd_lock);
+	}
+	return true;
+}
+
+
 /**
  * Waits for a certain response type. This method waits for a maximum of
  * ms_timeout milliseconds for a specified response command.
@@ -142,25 +318,151 @@ int getCommand(UsbCommand* response)
 bool WaitForResponseTimeout(uint32_t cmd, UsbCommand* response, size_t ms_timeout) {
   
 	UsbCommand resp;
-	
+	cmd_waiter_t waiter;
+	wait_deadline_t deadline;
+	bool found = false;
+
 	if (response == NULL) {
 		response = &resp;
 	}
 
+	initDeadline(&deadline, ms_timeout);
+	waiter.cmd = cmd;
+	waiter.signalled = false;
+	pthread_cond_init(&waiter.cond, NULL);
+
+	pthread_mutex_lock(&cmd_lock);
+	waiter.next = cmd_waiters;
+	cmd_waiters = &waiter;
+
 	// Wait until the command is received
-	for(size_t dm_seconds=0; dm_seconds < ms_timeout/10; dm_seconds++) {
-		while(getCommand(response)) {
-			if(response->cmd == cmd){
-				return true;
+	while (true) {
+		while (getCommand(response)) {
+			if (response->cmd == cmd) {
+				found = true;
+				break;
 			}
 		}
-		msleep(10); // XXX ugh
-		if (dm_seconds == 200) { // Two seconds elapsed
-			PrintAndLog("Waiting for a response from the proxmark...");
-			PrintAndLog("Don't forget to cancel its operation first by pressing on the button");
+		if (found) break;
+
+		waiter.signalled = false;
+		if (!waitDeadline(&deadline, &waiter.cond, &waiter.signalled)) {
+			break;
+		}
+	}
+
+	for (cmd_waiter_t **w = &cmd_waiters; *w != NULL; w = &(*w)->next) {
+		if (*w == &waiter) {
+			*w = waiter.next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cmd_lock);
+	pthread_cond_destroy(&waiter.cond);
+
+	return found;
+}
+
+
+/**
+ * Sends a command and registers it as an outstanding request expecting a
+ * response of type resp_cmd. The response is only handed out through
+ * WaitForTrackedResponse() and never goes through the response buffer, so
+ * there is no need to call clearCommandBuffer() first, and several tracked
+ * requests may be in flight at once. Every tracked request must be waited for.
+ *@brief SendCommandTracked
+ * @param c command to send
+ * @param resp_cmd response command expected for this request
+ * @return sequence number of the request, 0 on failure
+ */
+uint32_t SendCommandTracked(UsbCommand *c, uint32_t resp_cmd) {
+
+	tracked_request_t *req = calloc(1, sizeof(tracked_request_t));
+	if (req == NULL) {
+		return 0;
+	}
+	req->resp_cmd = resp_cmd;
+	pthread_cond_init(&req->cond, NULL);
+
+	pthread_mutex_lock(&cmd_lock);
+	if (++tracked_seq == 0) tracked_seq++;
+	req->seq = tracked_seq;
+	tracked_request_t **tail = &tracked_head;
+	while (*tail != NULL) tail = &(*tail)->next;
+	*tail = req;
+	uint32_t seq = req->seq;
+	pthread_mutex_unlock(&cmd_lock);
+
+	SendCommand(c);
+	return seq;
+}
+
+
+/**
+ * @brief TrackedResponseReady checks without blocking whether the response to a
+ *  request sent with SendCommandTracked() has arrived.
+ * @param seq sequence number returned by SendCommandTracked()
+ * @return true if WaitForTrackedResponse() would return immediately
+ */
+bool TrackedResponseReady(uint32_t seq) {
+
+	bool ready = false;
+
+	pthread_mutex_lock(&cmd_lock);
+	for (tracked_request_t *req = tracked_head; req != NULL; req = req->next) {
+		if (req->seq == seq && !req->abandoned) {
+			ready = req->done;
+			break;
 		}
 	}
-	return false;
+	pthread_mutex_unlock(&cmd_lock);
+
+	return ready;
+}
+
+
+/**
+ * Waits for the response to a request sent with SendCommandTracked(). On
+ * timeout the request is marked as abandoned so a late response can't be
+ * mistaken for the answer to a later request.
+ *@brief WaitForTrackedResponse
+ * @param seq sequence number returned by SendCommandTracked()
+ * @param response struct to copy received command into.
+ * @param ms_timeout
+ * @return true if the response was returned, otherwise false
+ */
+bool WaitForTrackedResponse(uint32_t seq, UsbCommand* response, size_t ms_timeout) {
+
+	wait_deadline_t deadline;
+	tracked_request_t *req;
+
+	initDeadline(&deadline, ms_timeout);
+
+	pthread_mutex_lock(&cmd_lock);
+	for (req = tracked_head; req != NULL; req = req->next) {
+		if (req->seq == seq && !req->abandoned) break;
+	}
+	if (req == NULL) {
+		pthread_mutex_unlock(&cmd_lock);
+		return false;
+	}
+
+	if (!waitDeadline(&deadline, &req->cond, &req->done)) {
+		req->abandoned = true;
+		req->abandoned_at = msclock();
+		pthread_mutex_unlock(&cmd_lock);
+		return false;
+	}
+
+	if (response != NULL) {
+		memcpy(response, &req->response, sizeof(UsbCommand));
+	}
+	unlinkTrackedRequest(req);
+	pthread_mutex_unlock(&cmd_lock);
+	pthread_cond_destroy(&req->cond);
+	free(req);
+
+	return true;
 }
 
 
@@ -201,7 +503,7 @@ void UsbCommandReceived(UsbCommand *UC)
 		} break;
 
 		case CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K: {
-			memcpy(sample_buf+(UC->arg[0]),UC->d.asBytes,UC->arg[1]);
+			StoreBigBufChunk(UC);
 			return;
 		} break;
 
@@ -20,6 +20,9 @@ extern void UsbCommandReceived(UsbCommand *UC);
 extern int CommandReceived(char *Cmd);
 extern bool WaitForResponseTimeout(uint32_t cmd, UsbCommand* response, size_t ms_timeout);
 extern bool WaitForResponse(uint32_t cmd, UsbCommand* response);
+extern uint32_t SendCommandTracked(UsbCommand *c, uint32_t resp_cmd);
+extern bool TrackedResponseReady(uint32_t seq);
+extern bool WaitForTrackedResponse(uint32_t seq, UsbCommand* response, size_t ms_timeout);
 extern void clearCommandBuffer();
 extern command_t* getTopLevelCommandTable();
 
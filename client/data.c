@@ -10,16 +10,231 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "data.h"
 #include "ui.h"
 #include "proxmark3.h"
 #include "cmdmain.h"
+#include "util.h"
+#include "util_posix.h"
 
 uint8_t* sample_buf;
 
+// fail a download when the device stays silent for this long
+#define DOWNLOAD_TIMEOUT_MS 2500
+// how often a waiting download checks for the final ACK if no data arrives
+#define DOWNLOAD_POLL_MS 20
+
+typedef enum {
+	DOWNLOAD_IDLE,       // chunks go to sample_buf (GetFromBigBuf)
+	DOWNLOAD_ACTIVE,     // chunks go to download_buf (DownloadBigBuf)
+	DOWNLOAD_DISCARD,    // download was cancelled, drop the rest of it
+} download_state_t;
+
+// state of the running DownloadBigBuf(), shared with the receiver thread
+static pthread_mutex_t download_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t download_cond = PTHREAD_COND_INITIALIZER;
+static download_state_t download_state = DOWNLOAD_IDLE;
+static bigbuf_download_t *download_buf;
+static uint32_t download_capacity;
+static uint32_t download_received;
+
 void GetFromBigBuf(uint8_t *dest, int bytes, int start_index)
 {
+  pthread_mutex_lock(&download_lock);
+  download_state = DOWNLOAD_IDLE;
   sample_buf = dest;
+  pthread_mutex_unlock(&download_lock);
   UsbCommand c = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {start_index, bytes, 0}};
   SendCommand(&c);
 }
+
+// called from the receiver thread for every CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K
+void StoreBigBufChunk(UsbCommand *UC)
+{
+  uint32_t offset = UC->arg[0];
+  uint32_t len = UC->arg[1];
+
+  pthread_mutex_lock(&download_lock);
+  switch (download_state) {
+    case DOWNLOAD_IDLE:
+      if (sample_buf != NULL) {
+        memcpy(sample_buf + offset, UC->d.asBytes, len);
+      }
+      break;
+
+    case DOWNLOAD_ACTIVE:
+      if (download_buf == NULL) {
+        // trace download: the first chunk tells us how much is coming
+        download_capacity = UC->arg[2];
+        download_buf = malloc(sizeof(bigbuf_download_t) + download_capacity);
+        if (download_buf == NULL) {
+          download_state = DOWNLOAD_DISCARD;
+          break;
+        }
+      }
+      // older firmware ignores FLAG_DOWNLOAD_TRACE and sends more than the trace
+      if (offset < download_capacity) {
+        len = MIN(len, download_capacity - offset);
+        memcpy(download_buf->data + offset, UC->d.asBytes, len);
+        download_received += len;
+      }
+      break;
+
+    case DOWNLOAD_DISCARD:
+      break;
+  }
+  pthread_cond_signal(&download_cond);
+  pthread_mutex_unlock(&download_lock);
+}
+
+// Drops the rest of a download. The device can't be stopped, so the remaining
+// chunks are discarded until its ACK arrives, otherwise they would end up in
+// the next download. If the device stays silent for drain_ms the request is
+// abandoned, its ACK is swallowed when it arrives, and chunks are dropped
+// until the next download starts.
+static void cancelDownload(uint32_t seq, uint32_t drain_ms)
+{
+  pthread_mutex_lock(&download_lock);
+  download_state = DOWNLOAD_DISCARD;
+  free(download_buf);
+  download_buf = NULL;
+  pthread_mutex_unlock(&download_lock);
+  if (seq != 0 && WaitForTrackedResponse(seq, NULL, drain_ms)) {
+    pthread_mutex_lock(&download_lock);
+    download_state = DOWNLOAD_IDLE;
+    pthread_mutex_unlock(&download_lock);
+  }
+}
+
+/**
+ * Downloads bytes from the device's BigBuf, starting at start_index. The
+ * chunks are copied straight from the receive path into the returned buffer.
+ * With trace_only set the device sends the recorded trace, so the trace
+ * length and its data arrive in a single transfer. Older firmware ignores
+ * the flag and only sends the first chunk, the rest of the trace is then
+ * requested once its length is known. bytes is ignored then, exactly the
+ * recorded trace is downloaded.
+ * @param progress optional callback, called whenever data arrived. Returning
+ *  false cancels the download.
+ * @return the downloaded data, free() it when done. NULL if the download
+ *  failed, timed out or was cancelled.
+ */
+bigbuf_download_t *DownloadBigBuf(uint32_t start_index, uint32_t bytes, bool trace_only, download_progress_t progress, void *progress_arg)
+{
+  pthread_mutex_lock(&download_lock);
+  download_state = DOWNLOAD_ACTIVE;
+  download_capacity = bytes;
+  download_received = 0;
+  download_buf = NULL;
+  if (!trace_only) {
+    download_buf = malloc(sizeof(bigbuf_download_t) + bytes);
+    if (download_buf == NULL) {
+      download_state = DOWNLOAD_IDLE;
+      pthread_mutex_unlock(&download_lock);
+      PrintAndLog("Cannot allocate memory for download");
+      return NULL;
+    }
+  }
+  pthread_mutex_unlock(&download_lock);
+
+  UsbCommand c = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {start_index, bytes, trace_only ? FLAG_DOWNLOAD_TRACE : 0}};
+  if (trace_only) {
+    c.arg[1] = USB_CMD_DATA_SIZE;
+  }
+  uint32_t seq = SendCommandTracked(&c, CMD_ACK);
+  if (seq == 0) {
+    cancelDownload(seq, 0);
+    return NULL;
+  }
+
+  uint64_t last_activity = msclock();
+  uint32_t reported = 0;
+
+  pthread_mutex_lock(&download_lock);
+  while (true) {
+    // chunks arrive before the ACK, so we're done once all bytes are in.
+    // The ACK alone ends downloads of an empty trace.
+    if (download_state != DOWNLOAD_ACTIVE
+      || (download_buf != NULL && download_received >= download_capacity)
+      || TrackedResponseReady(seq)) {
+      break;
+    }
+
+    struct timeval now;
+    struct timespec timeout;
+    gettimeofday(&now, NULL);
+    timeout.tv_sec = now.tv_sec;
+    timeout.tv_nsec = now.tv_usec * 1000 + DOWNLOAD_POLL_MS * 1000000;
+    if (timeout.tv_nsec >= 1000000000) {
+      timeout.tv_sec++;
+      timeout.tv_nsec -= 1000000000;
+    }
+    int res = pthread_cond_timedwait(&download_cond, &download_lock, &timeout);
+
+    uint32_t received = download_received;
+    uint32_t total = download_buf != NULL ? download_capacity : 0;
+    if (received != reported) {
+      reported = received;
+      last_activity = msclock();
+      if (progress != NULL) {
+        pthread_mutex_unlock(&download_lock);
+        bool go_on = progress(received, total, progress_arg);
+        pthread_mutex_lock(&download_lock);
+        if (!go_on) {
+          pthread_mutex_unlock(&download_lock);
+          cancelDownload(seq, DOWNLOAD_TIMEOUT_MS);
+          return NULL;
+        }
+      }
+    } else if (res == ETIMEDOUT && msclock() - last_activity > DOWNLOAD_TIMEOUT_MS) {
+      pthread_mutex_unlock(&download_lock);
+      PrintAndLog("Timeout while downloading from device memory");
+      cancelDownload(seq, 0);
+      return NULL;
+    }
+  }
+  bool failed = (download_state != DOWNLOAD_ACTIVE);
+  pthread_mutex_unlock(&download_lock);
+
+  UsbCommand ack;
+  if (failed || !WaitForTrackedResponse(seq, &ack, DOWNLOAD_TIMEOUT_MS)) {
+    PrintAndLog(failed ? "Cannot allocate memory for download" : "Timeout while downloading from device memory");
+    cancelDownload(seq, failed ? DOWNLOAD_TIMEOUT_MS : 0);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&download_lock);
+  bigbuf_download_t *result = download_buf;
+  uint32_t received = download_received;
+  download_buf = NULL;
+  download_state = DOWNLOAD_IDLE;
+  pthread_mutex_unlock(&download_lock);
+
+  if (result == NULL) {
+    // nothing but the ACK, e.g. an empty trace
+    result = malloc(sizeof(bigbuf_download_t));
+    if (result == NULL) {
+      PrintAndLog("Cannot allocate memory for download");
+      return NULL;
+    }
+    received = 0;
+  }
+  result->len = received;
+  result->trace_len = ack.arg[2];
+  memcpy(&result->ack, &ack, sizeof(UsbCommand));
+
+  if (trace_only && !(ack.arg[1] & FLAG_DOWNLOAD_TRACE) && received < result->trace_len) {
+    // older firmware, the ACK told us the trace length. Ask for the whole trace.
+    free(result);
+    return DownloadBigBuf(start_index, ack.arg[2], false, progress, progress_arg);
+  }
+
+  if (progress != NULL && received != reported) {
+    progress(received, result->len, progress_arg);
+  }
+  return result;
+}
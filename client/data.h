@@ -12,12 +12,27 @@
 #define DATA_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "usb_cmd.h"
 
 #define FILE_PATH_SIZE 1000
 
 extern uint8_t* sample_buf;
 #define arraylen(x) (sizeof(x)/sizeof((x)[0]))
 
+// Result of DownloadBigBuf(). Header and data are a single allocation, release it with free().
+typedef struct {
+	uint32_t len;           // number of bytes in data[]
+	uint32_t trace_len;     // trace length reported by the device
+	UsbCommand ack;         // the final CMD_ACK, d.asBytes holds the sample_config
+	uint8_t data[];
+} bigbuf_download_t;
+
+// Called while a download is in progress. Return false to cancel it.
+typedef bool (*download_progress_t)(uint32_t received, uint32_t total, void *arg);
+
 void GetFromBigBuf(uint8_t *dest, int bytes, int start_index);
+bigbuf_download_t *DownloadBigBuf(uint32_t start_index, uint32_t bytes, bool trace_only, download_progress_t progress, void *progress_arg);
+void StoreBigBufChunk(UsbCommand *UC);
 
 #endif
@@ -0,0 +1,162 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// FFT and FFT based correlation of sample buffers
+//-----------------------------------------------------------------------------
+
+#include "fft.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// correlate() multiplies directly if window * len is below this factor times n * log2(n)
+#define CORRELATE_DIRECT_FACTOR 8
+
+// stages up to this size are done block by block while the block is in the cache
+#define FFT_BLOCK 4096
+
+static void butterflies(double *re, double *im, size_t start, size_t end, size_t len, const double *tw_re, const double *tw_im)
+{
+	size_t half = len / 2;
+	// twiddles of this stage are at [half, len)
+	tw_re += half;
+	tw_im += half;
+	for (size_t i = start; i < end; i += len) {
+		double *re_a = re + i, *im_a = im + i;
+		double *re_b = re_a + half, *im_b = im_a + half;
+		for (size_t k = 0; k < half; k++) {
+			double tr = re_b[k] * tw_re[k] - im_b[k] * tw_im[k];
+			double ti = re_b[k] * tw_im[k] + im_b[k] * tw_re[k];
+			re_b[k] = re_a[k] - tr;
+			im_b[k] = im_a[k] - ti;
+			re_a[k] += tr;
+			im_a[k] += ti;
+		}
+	}
+}
+
+bool fft(double *re, double *im, size_t n, bool inverse)
+{
+	if (n < 2) return true;
+
+	// twiddle factors exp(-+2*pi*i*k/len) of every stage len, stored at [len/2, len)
+	double *tw_re = malloc(n * sizeof(double));
+	double *tw_im = malloc(n * sizeof(double));
+	if (!tw_re || !tw_im) {
+		free(tw_re);
+		free(tw_im);
+		return false;
+	}
+	double sign = inverse ? 1.0 : -1.0;
+	for (size_t k = 0; k < n / 2; k++) {
+		tw_re[n / 2 + k] = cos(2 * M_PI * k / n);
+		tw_im[n / 2 + k] = sign * sin(2 * M_PI * k / n);
+	}
+	for (size_t half = n / 4; half > 0; half /= 2) {
+		for (size_t k = 0; k < half; k++) {
+			tw_re[half + k] = tw_re[2 * half + 2 * k];
+			tw_im[half + k] = tw_im[2 * half + 2 * k];
+		}
+	}
+
+	// bit reversal permutation
+	for (size_t i = 1, j = 0; i < n; i++) {
+		size_t bit = n >> 1;
+		for (; j & bit; bit >>= 1) j ^= bit;
+		j ^= bit;
+		if (i < j) {
+			double t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	size_t block = n < FFT_BLOCK ? n : FFT_BLOCK;
+	for (size_t start = 0; start < n; start += block) {
+		for (size_t len = 2; len <= block; len <<= 1) {
+			butterflies(re, im, start, start + block, len, tw_re, tw_im);
+		}
+	}
+	for (size_t len = block * 2; len <= n; len <<= 1) {
+		butterflies(re, im, 0, n, len, tw_re, tw_im);
+	}
+
+	free(tw_re);
+	free(tw_im);
+	return true;
+}
+
+bool correlate(const int *in, size_t len, size_t window, int64_t *out)
+{
+	if (window >= len) return true;
+
+	// no wrap around for i + j < len, so the circular correlation of n >= len is enough
+	size_t n = 1, log2n = 0;
+	while (n < len) {
+		n <<= 1;
+		log2n++;
+	}
+
+	// small windows are faster without the transforms
+	if ((len - window) * window < CORRELATE_DIRECT_FACTOR * n * log2n) {
+		for (size_t i = 0; i < len - window; i++) {
+			int64_t sum = 0;
+			for (size_t j = 0; j < window; j++) {
+				sum += (int64_t)in[j] * in[i + j];
+			}
+			out[i] = sum;
+		}
+		return true;
+	}
+
+	double *re = calloc(n, sizeof(double));
+	double *im = calloc(n, sizeof(double));
+	if (!re || !im) {
+		free(re);
+		free(im);
+		return false;
+	}
+
+	// both real inputs in one transform, the samples as real part and the window as imaginary part
+	for (size_t i = 0; i < len; i++) {
+		re[i] = in[i];
+		if (i < window) im[i] = in[i];
+	}
+	if (!fft(re, im, n, false)) {
+		free(re);
+		free(im);
+		return false;
+	}
+
+	// split Z into X = (Z[k] + conj(Z[n-k])) / 2 and W = (Z[k] - conj(Z[n-k])) / 2i,
+	// then P[k] = X[k] * conj(W[k]) and P[n-k] = conj(P[k])
+	for (size_t k = 0; k <= n / 2; k++) {
+		size_t m = (n - k) & (n - 1);
+		double xr = (re[k] + re[m]) / 2, xi = (im[k] - im[m]) / 2;
+		double wr = (im[k] + im[m]) / 2, wi = (re[m] - re[k]) / 2;
+		double p_re = xr * wr + xi * wi;
+		double p_im = xi * wr - xr * wi;
+		re[k] = p_re;
+		im[k] = p_im;
+		re[m] = p_re;
+		im[m] = -p_im;
+	}
+	if (!fft(re, im, n, true)) {
+		free(re);
+		free(im);
+		return false;
+	}
+
+	for (size_t i = 0; i < len - window; i++) {
+		out[i] = llround(re[i] / n);
+	}
+
+	free(re);
+	free(im);
+	return true;
+}
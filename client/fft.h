@@ -0,0 +1,24 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// FFT and FFT based correlation of sample buffers
+//-----------------------------------------------------------------------------
+
+#ifndef FFT_H__
+#define FFT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// in place radix-2 FFT of re[]/im[], n must be a power of 2.
+// The inverse transform is not scaled by 1/n.
+extern bool fft(double *re, double *im, size_t n, bool inverse);
+
+// out[i] = sum(in[j] * in[i + j]) for 0 <= j < window, 0 <= i < len - window.
+// Returns false if out of memory.
+extern bool correlate(const int *in, size_t len, size_t window, int64_t *out);
+
+#endif
@@ -18,6 +18,7 @@
 
 int GraphBuffer[MAX_GRAPH_TRACE_LEN];
 int GraphTraceLen;
+trace_info_t GraphTraceInfo;  // how the samples in GraphBuffer were taken
 
 int s_Buff[MAX_GRAPH_TRACE_LEN];
 
@@ -43,6 +44,7 @@ int ClearGraph(int redraw)
   memset(GraphBuffer, 0x00, GraphTraceLen);
 
   GraphTraceLen = 0;
+  memset(&GraphTraceInfo, 0, sizeof(GraphTraceInfo));
 
   if (redraw)
     RepaintGraphWindow();
@@ -11,6 +11,7 @@
 #ifndef GRAPH_H__
 #define GRAPH_H__
 #include <stdint.h>
+#include "tracefile.h"
 
 void AppendGraph(int redraw, int clock, int bit);
 int ClearGraph(int redraw);
@@ -37,6 +38,7 @@ void DetectHighLowInGraph(int *high, int *low, bool addFuzz);
 
 extern int GraphBuffer[MAX_GRAPH_TRACE_LEN];
 extern int GraphTraceLen;
+extern trace_info_t GraphTraceInfo;
 extern int s_Buff[MAX_GRAPH_TRACE_LEN];
 
 #endif
@@ -58,16 +58,24 @@ THE SOFTWARE.
 #include "proxmark3.h"
 #include "cmdhfmfhard.h"
 #include "hardnested_bf_core.h"
+#include "hardnested_threadpool.h"
+#include "hardnested_distributed.h"
 #include "ui.h"
 #include "util.h"
 #include "util_posix.h"
+#include "data.h"
 #include "crapto1/crapto1.h"
 #include "parity.h"
 
-#define NUM_BRUTE_FORCE_THREADS			(num_CPUs())
+#define NUM_BRUTE_FORCE_THREADS			(hardnested_num_workers())
 #define DEFAULT_BRUTE_FORCE_RATE		(120000000.0)		// if benchmark doesn't succeed
 #define TEST_BENCH_SIZE					(6000)				// number of odd and even states for brute force benchmark
 #define TEST_BENCH_FILENAME				"hardnested/bf_bench_data.bin"
+#define CHECKPOINT_FILENAME				"hardnested_checkpoint.bin"
+#define CHECKPOINT_MAGIC				(0x4b504342)		// "BCPK"
+#define CHECKPOINT_INTERVAL				(10000)				// save brute force progress every 10 seconds
+#define CHECKPOINT_MAX_OTHERS			(15)				// interrupted jobs kept in the file besides the running one
+#define MAX_BUCKETS						(128)
 //#define WRITE_BENCH_FILE
 
 // debugging options
@@ -84,9 +92,38 @@ static uint32_t bf_test_nonce[256];
 static uint8_t bf_test_nonce_2nd_byte[256];
 static uint8_t bf_test_nonce_par[256];
 static uint32_t bucket_count = 0;
-static statelist_t* buckets[128];
+static statelist_t* buckets[MAX_BUCKETS];
 static uint32_t keys_found = 0;
 static uint64_t num_keys_tested;
+static uint64_t found_key = -1;
+
+// search status of the buckets, shared by the local threads and remote workers
+typedef enum {
+	BUCKET_TO_BE_DONE,
+	BUCKET_IN_PROGRESS,
+	BUCKET_COMPLETED
+} bucket_status_t;
+
+static bucket_status_t bucket_status[MAX_BUCKETS];
+static uint32_t buckets_completed;
+static pthread_mutex_t bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bucket_changed = PTHREAD_COND_INITIALIZER;
+
+// brute force progress, as saved to and restored from the checkpoint file
+typedef struct {
+	uint32_t magic;
+	uint32_t bucket_count;
+	uint64_t fingerprint;
+	uint64_t num_keys_tested;					// keys tested in completed buckets
+	uint8_t bucket_done[MAX_BUCKETS];
+} checkpoint_t;
+
+static checkpoint_t checkpoint;
+static bool checkpoint_enabled = false;
+static bool checkpoint_wanted = true;
+static char checkpoint_filename[FILE_PATH_SIZE] = CHECKPOINT_FILENAME;
+static uint64_t last_checkpoint_time;
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 uint8_t trailing_zeros(uint8_t byte) 
@@ -140,48 +177,304 @@ bool verify_key(uint32_t cuid, noncelist_t *nonces, uint8_t *best_first_bytes, u
 }
 
 
-static void* crack_states_thread(void* x){
-
-	struct arg {
-		bool silent;
-		int thread_ID;
-		uint32_t cuid;
-		uint32_t num_acquired_nonces;
-		uint64_t maximum_states;
-		noncelist_t *nonces;
-		uint8_t* best_first_bytes;
-	} *thread_arg;
-
-	thread_arg = (struct arg *)x;
-    const int thread_id = thread_arg->thread_ID;
-    uint32_t current_bucket = thread_id;
-    while(current_bucket < bucket_count){
-        statelist_t *bucket = buckets[current_bucket];
-        if(bucket){
+static uint64_t fnv1a_64(uint64_t hash, uint32_t value)
+{
+	for (uint8_t i = 0; i < 4; i++) {
+		hash ^= (value >> (8*i)) & 0xff;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+
+// identify the brute force job by its candidate states. A restarted run with the same nonces
+// and the same Sum(a8) guess will end up with exactly the same buckets.
+static uint64_t checkpoint_fingerprint(uint32_t cuid, uint8_t best_first_byte)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash = fnv1a_64(hash, cuid);
+	hash = fnv1a_64(hash, best_first_byte);
+	hash = fnv1a_64(hash, bucket_count);
+	for (uint32_t i = 0; i < bucket_count; i++) {
+		for (odd_even_t odd_even = EVEN_STATE; odd_even <= ODD_STATE; odd_even++) {
+			uint32_t len = buckets[i]->len[odd_even];
+			hash = fnv1a_64(hash, len);
+			if (len == 0) continue;
+			hash = fnv1a_64(hash, buckets[i]->states[odd_even][0]);
+			hash = fnv1a_64(hash, buckets[i]->states[odd_even][len/2]);
+			hash = fnv1a_64(hash, buckets[i]->states[odd_even][len-1]);
+		}
+	}
+	return hash;
+}
+
+
+static bool checkpoint_complete(checkpoint_t *record)
+{
+	for (uint32_t i = 0; i < record->bucket_count && i < MAX_BUCKETS; i++) {
+		if (!record->bucket_done[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// read the checkpoints of other interrupted jobs from the checkpoint file, the most recent
+// CHECKPOINT_MAX_OTHERS only. Returns the number of checkpoints read.
+static uint32_t read_other_checkpoints(checkpoint_t **others)
+{
+	*others = NULL;
+	FILE *checkpoint_file = fopen(checkpoint_filename, "rb");
+	if (checkpoint_file == NULL) {
+		return 0;
+	}
+	uint32_t num_others = 0;
+	checkpoint_t record;
+	while (fread(&record, 1, sizeof(checkpoint_t), checkpoint_file) == sizeof(checkpoint_t)) {
+		if (record.magic != CHECKPOINT_MAGIC) {
+			break;
+		}
+		if (record.fingerprint == checkpoint.fingerprint || checkpoint_complete(&record)) {
+			continue;
+		}
+		if (num_others == CHECKPOINT_MAX_OTHERS) {
+			// drop the oldest one
+			memmove(*others, *others + 1, (num_others - 1) * sizeof(checkpoint_t));
+			num_others--;
+		}
+		*others = realloc(*others, (num_others + 1) * sizeof(checkpoint_t));
+		if (*others == NULL) {
+			printf("Out of memory error in read_other_checkpoints(). Aborting...\n");
+			exit(4);
+		}
+		(*others)[num_others++] = record;
+	}
+	fclose(checkpoint_file);
+	return num_others;
+}
+
+
+// rewrite the checkpoint file with the checkpoints of other jobs and (optionally) our own one
+static void write_checkpoints(bool write_own)
+{
+	checkpoint_t *others;
+	uint32_t num_others = read_other_checkpoints(&others);
+
+	if (num_others == 0 && !write_own) {
+		remove(checkpoint_filename);
+		return;
+	}
+
+	char tmp_filename[FILE_PATH_SIZE + 4];
+	sprintf(tmp_filename, "%s.tmp", checkpoint_filename);
+	FILE *checkpoint_file = fopen(tmp_filename, "wb");
+	if (checkpoint_file == NULL) {
+		free(others);
+		return;
+	}
+	bool write_ok = (fwrite(others, sizeof(checkpoint_t), num_others, checkpoint_file) == num_others);
+	if (write_own) {
+		write_ok &= (fwrite(&checkpoint, sizeof(checkpoint_t), 1, checkpoint_file) == 1);
+	}
+	free(others);
+	if (fclose(checkpoint_file) != 0 || !write_ok) {
+		remove(tmp_filename);
+		return;
+	}
+#if defined(_WIN32)
+	remove(checkpoint_filename);
+#endif
+	rename(tmp_filename, checkpoint_filename);
+}
+
+
+// restore the progress of a previous run with the same candidate states. Returns the number of completed buckets.
+static uint32_t load_checkpoint(uint32_t cuid, uint8_t best_first_byte)
+{
+	memset(&checkpoint, 0, sizeof(checkpoint_t));
+	checkpoint.magic = CHECKPOINT_MAGIC;
+	checkpoint.bucket_count = bucket_count;
+	checkpoint.fingerprint = checkpoint_fingerprint(cuid, best_first_byte);
+	last_checkpoint_time = msclock();
+
+	FILE *checkpoint_file = fopen(checkpoint_filename, "rb");
+	if (checkpoint_file == NULL) {
+		return 0;
+	}
+	uint32_t buckets_done = 0;
+	checkpoint_t record;
+	while (fread(&record, 1, sizeof(checkpoint_t), checkpoint_file) == sizeof(checkpoint_t)) {
+		if (record.magic != CHECKPOINT_MAGIC) {
+			break;
+		}
+		if (record.fingerprint == checkpoint.fingerprint && record.bucket_count == bucket_count && !checkpoint_complete(&record)) {
+			checkpoint = record;
+			for (uint32_t i = 0; i < bucket_count; i++) {
+				buckets_done += checkpoint.bucket_done[i];
+			}
+			break;
+		}
+	}
+	fclose(checkpoint_file);
+	return buckets_done;
+}
+
+
+void hardnested_set_checkpoints(bool enable, const char *filename)
+{
+	checkpoint_wanted = enable;
+	if (filename != NULL && filename[0] != '\0') {
+		strncpy(checkpoint_filename, filename, FILE_PATH_SIZE - 1);
+		checkpoint_filename[FILE_PATH_SIZE - 1] = '\0';
+	}
+}
+
+
+bool hardnested_checkpoints(char *filename)
+{
+	if (filename != NULL) {
+		strcpy(filename, checkpoint_filename);
+	}
+	return checkpoint_wanted;
+}
+
+
+// remove the checkpoint file. Returns false if there was one which couldn't be removed.
+bool hardnested_clear_checkpoints(void)
+{
+	FILE *checkpoint_file = fopen(checkpoint_filename, "rb");
+	if (checkpoint_file == NULL) {
+		return true;
+	}
+	fclose(checkpoint_file);
+	return remove(checkpoint_filename) == 0;
+}
+
+
+static void bucket_completed(uint32_t bucket)
+{
+	checkpoint.bucket_done[bucket] = 1;
+	__sync_fetch_and_add(&checkpoint.num_keys_tested, (uint64_t)buckets[bucket]->len[ODD_STATE] * buckets[bucket]->len[EVEN_STATE]);
+	if (msclock() > last_checkpoint_time + CHECKPOINT_INTERVAL && pthread_mutex_trylock(&checkpoint_mutex) == 0) {
+		last_checkpoint_time = msclock();
+		write_checkpoints(true);
+		pthread_mutex_unlock(&checkpoint_mutex);
+	}
+}
+
+
+typedef struct {
+	bool silent;
+	uint32_t cuid;
+	uint32_t num_acquired_nonces;
+	uint64_t maximum_states;
+	noncelist_t *nonces;
+	uint8_t *best_first_bytes;
+} crack_states_args_t;
+
+static crack_states_args_t crack_states_args;
+
+
+static bool brute_force_finished(void)
+{
+	return keys_found || buckets_completed == bucket_count;
+}
+
+
+// claim a specific bucket for one of the local threads
+static bool claim_local_bucket(uint32_t bucket)
+{
+	bool claimed = false;
+	pthread_mutex_lock(&bucket_mutex);
+	if (!keys_found && bucket_status[bucket] == BUCKET_TO_BE_DONE) {
+		bucket_status[bucket] = BUCKET_IN_PROGRESS;
+		claimed = true;
+	}
+	pthread_mutex_unlock(&bucket_mutex);
+	return claimed;
+}
+
+
+// claim any bucket for a remote worker. Remote workers start with the last buckets, the
+// local threads with the first ones. Returns -1 if there is no bucket left (and wait isn't set).
+int32_t hardnested_claim_bucket(bool wait)
+{
+	int32_t bucket = -1;
+	pthread_mutex_lock(&bucket_mutex);
+	while (bucket < 0 && !brute_force_finished()) {
+		for (int32_t i = bucket_count - 1; i >= 0; i--) {
+			if (bucket_status[i] == BUCKET_TO_BE_DONE) {
+				bucket_status[i] = BUCKET_IN_PROGRESS;
+				bucket = i;
+				break;
+			}
+		}
+		if (bucket < 0 && !wait) {
+			break;
+		}
+		if (bucket < 0) {
+			pthread_cond_wait(&bucket_changed, &bucket_mutex);
+		}
+	}
+	pthread_mutex_unlock(&bucket_mutex);
+	return bucket;
+}
+
+
+// a bucket has been searched completely (completed == true) or needs to be searched again
+void hardnested_bucket_searched(uint32_t bucket, bool completed, uint64_t key, uint64_t keys_tested)
+{
+	crack_states_args_t *thread_arg = &crack_states_args;
+
+	if (keys_tested) {
+		__sync_fetch_and_add(&num_keys_tested, keys_tested);
+	}
+	if (key != -1) {
+		found_key = key;
+		__sync_fetch_and_add(&keys_found, 1);
+	}
+
+	pthread_mutex_lock(&bucket_mutex);
+	bucket_status[bucket] = completed ? BUCKET_COMPLETED : BUCKET_TO_BE_DONE;
+	if (completed) {
+		buckets_completed++;
+	}
+	pthread_cond_broadcast(&bucket_changed);
+	pthread_mutex_unlock(&bucket_mutex);
+
+	if (key != -1) {
+		char progress_text[80];
+		sprintf(progress_text, "Brute force phase completed. Key found: %012" PRIx64, key);
+		hardnested_print_progress(thread_arg->num_acquired_nonces, progress_text, 0.0, 0);
+	} else if (completed) {
+		if (checkpoint_enabled) {
+			bucket_completed(bucket);
+		}
+		if (thread_arg->silent) {
+			return;
+		}
+		char progress_text[80];
+		sprintf(progress_text, "Brute force phase: %6.02f%%", 100.0*(float)num_keys_tested/(float)(thread_arg->maximum_states));
+		float remaining_bruteforce = thread_arg->nonces[thread_arg->best_first_bytes[0]].expected_num_brute_force - (float)num_keys_tested/2;
+		hardnested_print_progress(thread_arg->num_acquired_nonces, progress_text, remaining_bruteforce, 5000);
+	}
+}
+
+
+static void crack_states_task(void *x, uint32_t current_bucket)
+{
+	crack_states_args_t *thread_arg = (crack_states_args_t *)x;
+	statelist_t *bucket = buckets[current_bucket];
+
+	if (!claim_local_bucket(current_bucket)) {
+		return;
+	}
 #if defined (DEBUG_BRUTE_FORCE)	
-			printf("Thread %u starts working on bucket %u\n", thread_id, current_bucket);
+	printf("Start working on bucket %u\n", current_bucket);
 #endif			
-            const uint64_t key = crack_states_bitsliced(thread_arg->cuid, thread_arg->best_first_bytes, bucket, &keys_found, &num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, thread_arg->nonces);
-            if(key != -1){
-                __sync_fetch_and_add(&keys_found, 1);
-				char progress_text[80];
-				sprintf(progress_text, "Brute force phase completed. Key found: %012" PRIx64, key);
-				hardnested_print_progress(thread_arg->num_acquired_nonces, progress_text, 0.0, 0);
-                break;
-            } else if(keys_found){
-                break;
-            } else {
-				if (!thread_arg->silent) {
-					char progress_text[80];
-					sprintf(progress_text, "Brute force phase: %6.02f%%", 100.0*(float)num_keys_tested/(float)(thread_arg->maximum_states));
-					float remaining_bruteforce = thread_arg->nonces[thread_arg->best_first_bytes[0]].expected_num_brute_force - (float)num_keys_tested/2;
-					hardnested_print_progress(thread_arg->num_acquired_nonces, progress_text, remaining_bruteforce, 5000);
-				}
-            }
-        }
-        current_bucket += NUM_BRUTE_FORCE_THREADS;
-    }
-    return NULL;
+	const uint64_t key = crack_states_bitsliced(thread_arg->cuid, thread_arg->best_first_bytes, bucket, &keys_found, &num_keys_tested, nonces_to_bruteforce, bf_test_nonce_2nd_byte, thread_arg->nonces);
+	hardnested_bucket_searched(current_bucket, key != -1 || !keys_found, key, 0);
 }
 
 
@@ -282,7 +575,7 @@ static void write_benchfile(statelist_t *candidates) {
 #endif
 
 
-bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint32_t num_acquired_nonces, uint64_t maximum_states, noncelist_t *nonces, uint8_t *best_first_bytes)
+bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint32_t num_acquired_nonces, uint64_t maximum_states, noncelist_t *nonces, uint8_t *best_first_bytes, uint64_t *key)
 {
 #if defined (WRITE_BENCH_FILE)
 	write_benchfile(candidates);
@@ -296,6 +589,7 @@ bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint
 	
 	keys_found = 0;
 	num_keys_tested = 0;
+	found_key = -1;
 
 	bitslice_test_nonces(nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par);
 	
@@ -308,8 +602,30 @@ bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint
 		}
 	}
 
+	// continue where a previous run with the same candidates has been interrupted
+	buckets_completed = 0;
+	for (uint32_t i = 0; i < bucket_count; i++) {
+		bucket_status[i] = BUCKET_TO_BE_DONE;
+	}
+	checkpoint_enabled = checkpoint_wanted && !silent && bucket_count > 0;
+	if (checkpoint_enabled) {
+		uint32_t buckets_done = load_checkpoint(cuid, best_first_bytes[0]);
+		for (uint32_t i = 0; i < bucket_count; i++) {
+			if (checkpoint.bucket_done[i]) {
+				bucket_status[i] = BUCKET_COMPLETED;
+				buckets_completed++;
+			}
+		}
+		if (buckets_done > 0) {
+			num_keys_tested = checkpoint.num_keys_tested;
+			char progress_text[80];
+			sprintf(progress_text, "Brute force phase: resuming, %u of %u buckets already searched", buckets_done, bucket_count);
+			hardnested_print_progress(num_acquired_nonces, progress_text, nonces[best_first_bytes[0]].expected_num_brute_force - (float)num_keys_tested/2, 0);
+		}
+	}
+
 	uint64_t start_time = msclock();
-	// enumerate states using all hardware threads, each thread handles one bucket
+	// enumerate states using all hardware threads, each task handles one bucket
 	// if (!silent) {
 		// PrintAndLog("Starting %u cracking threads to search %u buckets containing a total of %" PRIu64" states...\n", NUM_BRUTE_FORCE_THREADS, bucket_count, maximum_states);
 		// printf("Common bits of first 4 2nd nonce bytes: %u %u %u\n",
@@ -318,29 +634,56 @@ bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint
 			// trailing_zeros(bf_test_nonce_2nd_byte[3] ^ bf_test_nonce_2nd_byte[2]));
 	// }
 
-	pthread_t threads[NUM_BRUTE_FORCE_THREADS];
-	struct args {
-		bool silent;
-		int thread_ID;
-		uint32_t cuid;
-		uint32_t num_acquired_nonces;
-		uint64_t maximum_states;
-		noncelist_t *nonces;
-		uint8_t *best_first_bytes;
-	} thread_args[NUM_BRUTE_FORCE_THREADS];
-	
-	for(uint32_t i = 0; i < NUM_BRUTE_FORCE_THREADS; i++){
-		thread_args[i].thread_ID = i;
-		thread_args[i].silent = silent;
-		thread_args[i].cuid = cuid;
-		thread_args[i].num_acquired_nonces = num_acquired_nonces;
-		thread_args[i].maximum_states = maximum_states;
-		thread_args[i].nonces = nonces;
-		thread_args[i].best_first_bytes = best_first_bytes;
-		pthread_create(&threads[i], NULL, crack_states_thread, (void*)&thread_args[i]);
+	crack_states_args.silent = silent;
+	crack_states_args.cuid = cuid;
+	crack_states_args.num_acquired_nonces = num_acquired_nonces;
+	crack_states_args.maximum_states = maximum_states;
+	crack_states_args.nonces = nonces;
+	crack_states_args.best_first_bytes = best_first_bytes;
+
+	// let remote workers help (not during the benchmark)
+	bool distributed = !silent && bucket_count > 0 && hardnested_coordinator_running();
+	if (distributed) {
+		hardnested_job_t job = {cuid, nonces_to_bruteforce, bf_test_nonce, bf_test_nonce_par, bf_test_nonce_2nd_byte, best_first_bytes, nonces, buckets};
+		hardnested_coordinator_start_job(&job);
 	}
-	for(uint32_t i = 0; i < NUM_BRUTE_FORCE_THREADS; i++){
-		pthread_join(threads[i], 0);
+
+	bool buckets_left;
+	do {
+		hardnested_run_tasks(crack_states_task, &crack_states_args, bucket_count);
+		// wait for the buckets of remote workers. A lost worker's buckets are searched again.
+		pthread_mutex_lock(&bucket_mutex);
+		buckets_left = false;
+		while (!brute_force_finished() && !buckets_left) {
+			for (uint32_t i = 0; i < bucket_count; i++) {
+				buckets_left |= (bucket_status[i] == BUCKET_TO_BE_DONE);
+			}
+			if (!buckets_left) {
+				pthread_cond_wait(&bucket_changed, &bucket_mutex);
+			}
+		}
+		pthread_mutex_unlock(&bucket_mutex);
+	} while (buckets_left && !brute_force_finished());
+
+	if (distributed) {
+		if (keys_found) {
+			hardnested_coordinator_abort_job();
+		}
+		// buckets which are still in progress on remote workers would access our candidates
+		pthread_mutex_lock(&bucket_mutex);
+		for (uint32_t i = 0; i < bucket_count; i++) {
+			while (bucket_status[i] == BUCKET_IN_PROGRESS) {
+				pthread_cond_wait(&bucket_changed, &bucket_mutex);
+			}
+		}
+		pthread_mutex_unlock(&bucket_mutex);
+		hardnested_coordinator_end_job();
+	}
+
+	if (checkpoint_enabled) {
+		// the job is finished, with or without a key. Only an interrupted job is resumed.
+		write_checkpoints(false);
+		checkpoint_enabled = false;
 	}
 
 	uint64_t elapsed_time = msclock() - start_time;
@@ -357,6 +700,10 @@ bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint
 	if (bf_rate != NULL) {
 		*bf_rate = (float)num_keys_tested / ((float)elapsed_time / 1000.0);
 	}
+
+	if (key != NULL) {
+		*key = found_key;
+	}
 	
 	return (keys_found != 0);
 }
@@ -461,7 +808,7 @@ float brute_force_benchmark()
 	uint64_t maximum_states = TEST_BENCH_SIZE*TEST_BENCH_SIZE*(uint64_t)NUM_BRUTE_FORCE_THREADS;
 
 	float bf_rate;
-	brute_force_bs(&bf_rate, test_candidates, 0, 0, maximum_states, NULL, 0);
+	brute_force_bs(&bf_rate, test_candidates, 0, 0, maximum_states, NULL, 0, NULL);
 	
 	free(test_candidates[0].states[ODD_STATE]);
 	free(test_candidates[0].states[EVEN_STATE]);
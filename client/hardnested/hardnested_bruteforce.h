@@ -28,9 +28,14 @@ typedef struct {
 } statelist_t;
 
 extern void prepare_bf_test_nonces(noncelist_t *nonces, uint8_t best_first_byte);
-extern bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint32_t num_acquired_nonces, uint64_t maximum_states, noncelist_t *nonces, uint8_t *best_first_bytes);
+extern bool brute_force_bs(float *bf_rate, statelist_t *candidates, uint32_t cuid, uint32_t num_acquired_nonces, uint64_t maximum_states, noncelist_t *nonces, uint8_t *best_first_bytes, uint64_t *key);
 extern float brute_force_benchmark();
 extern uint8_t trailing_zeros(uint8_t byte); 
 extern bool verify_key(uint32_t cuid, noncelist_t *nonces, uint8_t *best_first_bytes, uint32_t odd, uint32_t even);
+extern int32_t hardnested_claim_bucket(bool wait);
+extern void hardnested_bucket_searched(uint32_t bucket, bool completed, uint64_t key, uint64_t keys_tested);
+extern void hardnested_set_checkpoints(bool enable, const char *filename);
+extern bool hardnested_checkpoints(char *filename);
+extern bool hardnested_clear_checkpoints(void);
 
 #endif
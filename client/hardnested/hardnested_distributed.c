@@ -0,0 +1,789 @@
+//-----------------------------------------------------------------------------
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Distributed brute force for the hardnested attack. A coordinator hands out
+// the candidate buckets to worker processes which connect via TCP or a Unix
+// domain socket. The coordinator's own threads keep working on the buckets too.
+//
+// Protocol (all integers are sent as 32 bit values in network byte order):
+//   worker -> coordinator: HELLO magic, version, number of worker threads
+//   coordinator -> worker: JOB cuid, test nonces, best first bytes, nonce lists
+//                          BUCKET bucket number, odd and even states
+//                          ABORT (key has been found elsewhere)
+//                          END_JOB
+//   worker -> coordinator: RESULT bucket number, status, key, number of keys tested
+// A worker gets at most one bucket per thread at a time.
+//-----------------------------------------------------------------------------
+
+#define _POSIX_C_SOURCE	200112L			// need getaddrinfo()
+
+#include "hardnested_distributed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "ui.h"
+
+#if defined(_WIN32)
+
+bool hardnested_coordinator_start(char *address)
+{
+	PrintAndLog("Distributed brute force is not supported on Windows.");
+	return false;
+}
+
+void hardnested_coordinator_stop(void) {}
+bool hardnested_coordinator_running(void) { return false; }
+void hardnested_coordinator_start_job(hardnested_job_t *job) {}
+void hardnested_coordinator_abort_job(void) {}
+void hardnested_coordinator_end_job(void) {}
+
+int hardnested_worker(char *address, uint32_t num_threads)
+{
+	PrintAndLog("Distributed brute force is not supported on Windows.");
+	return 1;
+}
+
+#else
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "util_posix.h"
+#include "hardnested_bf_core.h"
+
+#define PROTOCOL_MAGIC			(0x504d3348)		// "PM3H"
+#define PROTOCOL_VERSION		(1)
+#define DEFAULT_PORT			"40100"
+#define MAX_WORKER_THREADS		(256)
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL			0
+#endif
+
+typedef enum {
+	EVEN_STATE = 0,
+	ODD_STATE = 1
+} odd_even_t;
+
+typedef enum {
+	MSG_HELLO = 1,
+	MSG_JOB,
+	MSG_BUCKET,
+	MSG_ABORT,
+	MSG_END_JOB,
+	MSG_RESULT
+} message_t;
+
+typedef enum {
+	RESULT_SEARCHED = 0,
+	RESULT_KEY_FOUND,
+	RESULT_ABORTED
+} result_t;
+
+
+//-----------------------------------------------------------------------------
+// socket helpers
+//-----------------------------------------------------------------------------
+
+static bool send_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+		p += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+
+static bool recv_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t received = recv(fd, p, len, 0);
+		if (received < 0 && errno == EINTR) continue;
+		if (received <= 0) return false;
+		p += received;
+		len -= received;
+	}
+	return true;
+}
+
+
+static bool send_u32s(int fd, const uint32_t *values, uint32_t count)
+{
+	uint32_t buf[256];
+	while (count > 0) {
+		uint32_t n = MIN(count, 256);
+		for (uint32_t i = 0; i < n; i++) {
+			buf[i] = htonl(values[i]);
+		}
+		if (!send_all(fd, buf, n * sizeof(uint32_t))) return false;
+		values += n;
+		count -= n;
+	}
+	return true;
+}
+
+
+static bool recv_u32s(int fd, uint32_t *values, uint32_t count)
+{
+	if (!recv_all(fd, values, count * sizeof(uint32_t))) return false;
+	for (uint32_t i = 0; i < count; i++) {
+		values[i] = ntohl(values[i]);
+	}
+	return true;
+}
+
+
+static bool send_u32(int fd, uint32_t value)
+{
+	return send_u32s(fd, &value, 1);
+}
+
+
+static bool recv_u32(int fd, uint32_t *value)
+{
+	return recv_u32s(fd, value, 1);
+}
+
+
+// address is either a path to a Unix domain socket (contains a '/') or [host:]port
+static void split_address(char *address, char *host, size_t host_size, char *port, size_t port_size)
+{
+	char *colon = strrchr(address, ':');
+	if (colon == NULL) {
+		snprintf(host, host_size, "%s", "");
+		snprintf(port, port_size, "%s", address[0] ? address : DEFAULT_PORT);
+	} else {
+		snprintf(host, host_size, "%.*s", (int)(colon - address), address);
+		snprintf(port, port_size, "%s", colon[1] ? colon + 1 : DEFAULT_PORT);
+	}
+}
+
+
+static bool is_unix_socket_address(char *address)
+{
+	return strchr(address, '/') != NULL;
+}
+
+
+static int open_socket(char *address, bool listening)
+{
+	if (is_unix_socket_address(address)) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(address) >= sizeof(sun.sun_path)) {
+			PrintAndLog("Unix socket path too long: %s", address);
+			return -1;
+		}
+		strcpy(sun.sun_path, address);
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			PrintAndLog("Could not create socket: %s", strerror(errno));
+			return -1;
+		}
+		if (listening) {
+			unlink(address);
+			if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 16) < 0) {
+				PrintAndLog("Could not listen on %s: %s", address, strerror(errno));
+				close(fd);
+				return -1;
+			}
+		} else if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+			PrintAndLog("Could not connect to %s: %s", address, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	char host[256];
+	char port[16];
+	split_address(address, host, sizeof(host), port, sizeof(port));
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	struct addrinfo *addresses;
+	int error = getaddrinfo(host[0] ? host : NULL, port, &hints, &addresses);
+	if (error != 0) {
+		PrintAndLog("Could not resolve %s: %s", address, gai_strerror(error));
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo *ai = addresses; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) continue;
+		if (listening) {
+			int on = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) break;
+		} else {
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if (fd < 0) {
+		PrintAndLog("Could not %s %s: %s", listening ? "listen on" : "connect to", address, strerror(errno));
+	}
+	return fd;
+}
+
+
+static void configure_connection(int fd)
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));	// fails silently for Unix sockets
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#if defined(SO_NOSIGPIPE)
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// coordinator
+//-----------------------------------------------------------------------------
+
+typedef struct connection {
+	int fd;
+	uint32_t num_threads;
+	uint32_t job;
+	char name[64];
+	pthread_mutex_t send_mutex;
+	struct connection *next;
+} connection_t;
+
+static int listen_fd = -1;
+static char listen_address[256];
+static pthread_t acceptor_thread;
+static bool coordinator_stopping = false;
+static connection_t *connections = NULL;
+static uint32_t num_connections = 0;
+static uint32_t connections_in_job = 0;
+static uint32_t job_number = 0;
+static bool job_active = false;
+static hardnested_job_t *current_job = NULL;
+static pthread_mutex_t coordinator_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coordinator_changed = PTHREAD_COND_INITIALIZER;
+
+
+static bool send_job(int fd, hardnested_job_t *job)
+{
+	bool ok = send_u32(fd, MSG_JOB)
+		&& send_u32(fd, job->cuid)
+		&& send_u32(fd, job->nonces_to_bruteforce)
+		&& send_u32s(fd, job->bf_test_nonce, 256)
+		&& send_all(fd, job->bf_test_nonce_par, 256)
+		&& send_all(fd, job->bf_test_nonce_2nd_byte, 256)
+		&& send_all(fd, job->best_first_bytes, 256);
+	for (uint16_t i = 0; i < 256 && ok; i++) {
+		uint32_t count = 0;
+		for (noncelistentry_t *p = job->nonces[i].first; p != NULL; p = p->next) {
+			count++;
+		}
+		ok = send_u32(fd, count);
+		for (noncelistentry_t *p = job->nonces[i].first; p != NULL && ok; p = p->next) {
+			ok = send_u32(fd, p->nonce_enc) && send_all(fd, &p->par_enc, 1);
+		}
+	}
+	return ok;
+}
+
+
+static bool send_bucket(int fd, uint32_t bucket, statelist_t *states)
+{
+	return send_u32(fd, MSG_BUCKET)
+		&& send_u32(fd, bucket)
+		&& send_u32(fd, states->len[ODD_STATE])
+		&& send_u32(fd, states->len[EVEN_STATE])
+		&& send_u32s(fd, states->states[ODD_STATE], states->len[ODD_STATE])
+		&& send_u32s(fd, states->states[EVEN_STATE], states->len[EVEN_STATE]);
+}
+
+
+static bool send_message(connection_t *connection, message_t message)
+{
+	pthread_mutex_lock(&connection->send_mutex);
+	bool ok = send_u32(connection->fd, message);
+	pthread_mutex_unlock(&connection->send_mutex);
+	return ok;
+}
+
+
+// serve one job to a worker. Returns false if the connection failed.
+static bool serve_job(connection_t *connection, hardnested_job_t *job)
+{
+	uint32_t outstanding[MAX_WORKER_THREADS];
+	uint32_t num_outstanding = 0;
+
+	pthread_mutex_lock(&connection->send_mutex);
+	bool ok = send_job(connection->fd, job);
+	pthread_mutex_unlock(&connection->send_mutex);
+
+	while (ok) {
+		// keep all worker threads busy
+		while (num_outstanding < connection->num_threads) {
+			int32_t bucket = hardnested_claim_bucket(num_outstanding == 0);
+			if (bucket < 0) {
+				break;
+			}
+			outstanding[num_outstanding++] = bucket;
+			pthread_mutex_lock(&connection->send_mutex);
+			ok = send_bucket(connection->fd, bucket, job->buckets[bucket]);
+			pthread_mutex_unlock(&connection->send_mutex);
+			if (!ok) break;
+		}
+		if (!ok || num_outstanding == 0) {
+			break;
+		}
+
+		uint32_t result[7];
+		ok = recv_u32s(connection->fd, result, 7) && result[0] == MSG_RESULT;
+		if (!ok) break;
+		uint32_t bucket = result[1];
+		uint32_t i;
+		for (i = 0; i < num_outstanding && outstanding[i] != bucket; i++);
+		if (i == num_outstanding) {
+			ok = false;
+			break;
+		}
+		outstanding[i] = outstanding[--num_outstanding];
+		uint64_t key = (uint64_t)result[3] << 32 | result[4];
+		uint64_t keys_tested = (uint64_t)result[5] << 32 | result[6];
+		hardnested_bucket_searched(bucket, result[2] != RESULT_ABORTED, result[2] == RESULT_KEY_FOUND ? key : -1, keys_tested);
+	}
+
+	// return the buckets of a lost worker
+	for (uint32_t i = 0; i < num_outstanding; i++) {
+		hardnested_bucket_searched(outstanding[i], false, -1, 0);
+	}
+
+	return ok && send_message(connection, MSG_END_JOB);
+}
+
+
+static void *connection_thread(void *arg)
+{
+	connection_t *connection = (connection_t *)arg;
+	bool ok = true;
+
+	pthread_mutex_lock(&coordinator_mutex);
+	while (ok && !coordinator_stopping) {
+		if (!job_active || connection->job == job_number) {
+			pthread_cond_wait(&coordinator_changed, &coordinator_mutex);
+			continue;
+		}
+		connection->job = job_number;
+		hardnested_job_t *job = current_job;
+		connections_in_job++;
+		pthread_mutex_unlock(&coordinator_mutex);
+
+		ok = serve_job(connection, job);
+
+		pthread_mutex_lock(&coordinator_mutex);
+		connections_in_job--;
+		pthread_cond_broadcast(&coordinator_changed);
+	}
+
+	// remove connection
+	for (connection_t **p = &connections; *p != NULL; p = &(*p)->next) {
+		if (*p == connection) {
+			*p = connection->next;
+			break;
+		}
+	}
+	num_connections--;
+	pthread_cond_broadcast(&coordinator_changed);
+	pthread_mutex_unlock(&coordinator_mutex);
+
+	if (!coordinator_stopping) {
+		PrintAndLog("Worker %s disconnected", connection->name);
+	}
+	close(connection->fd);
+	pthread_mutex_destroy(&connection->send_mutex);
+	free(connection);
+	return NULL;
+}
+
+
+static void *acceptor(void *arg)
+{
+	while (true) {
+		struct sockaddr_storage peer;
+		socklen_t peer_len = sizeof(peer);
+		int fd = accept(listen_fd, (struct sockaddr *)&peer, &peer_len);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			break;		// listening socket has been closed
+		}
+		configure_connection(fd);
+
+		uint32_t hello[4];
+		if (!recv_u32s(fd, hello, 4) || hello[0] != MSG_HELLO || hello[1] != PROTOCOL_MAGIC || hello[2] != PROTOCOL_VERSION) {
+			close(fd);
+			continue;
+		}
+
+		connection_t *connection = (connection_t *)calloc(1, sizeof(connection_t));
+		if (connection == NULL) {
+			printf("Out of memory error in acceptor(). Aborting...\n");
+			exit(4);
+		}
+		connection->fd = fd;
+		connection->num_threads = MAX(1, MIN(hello[3], MAX_WORKER_THREADS));
+		pthread_mutex_init(&connection->send_mutex, NULL);
+		char host[48] = "local";
+		if (peer.ss_family == AF_INET || peer.ss_family == AF_INET6) {
+			getnameinfo((struct sockaddr *)&peer, peer_len, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+		}
+		snprintf(connection->name, sizeof(connection->name), "%s#%d", host, fd);
+
+		pthread_mutex_lock(&coordinator_mutex);
+		connection->job = job_active ? job_number - 1 : job_number;		// join a running job
+		connection->next = connections;
+		connections = connection;
+		num_connections++;
+		pthread_mutex_unlock(&coordinator_mutex);
+
+		PrintAndLog("Worker %s connected with %" PRIu32 " threads", connection->name, connection->num_threads);
+		pthread_t thread;
+		pthread_create(&thread, NULL, connection_thread, connection);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+
+bool hardnested_coordinator_start(char *address)
+{
+	if (listen_fd >= 0) {
+		return true;
+	}
+	listen_fd = open_socket(address, true);
+	if (listen_fd < 0) {
+		return false;
+	}
+	snprintf(listen_address, sizeof(listen_address), "%s", address);
+	coordinator_stopping = false;
+	pthread_create(&acceptor_thread, NULL, acceptor, NULL);
+	PrintAndLog("Waiting for hardnested workers on %s", address);
+	return true;
+}
+
+
+void hardnested_coordinator_stop(void)
+{
+	if (listen_fd < 0) {
+		return;
+	}
+	shutdown(listen_fd, SHUT_RDWR);
+	close(listen_fd);
+	pthread_join(acceptor_thread, NULL);
+	listen_fd = -1;
+	if (is_unix_socket_address(listen_address)) {
+		unlink(listen_address);
+	}
+
+	// disconnect all workers
+	pthread_mutex_lock(&coordinator_mutex);
+	coordinator_stopping = true;
+	for (connection_t *p = connections; p != NULL; p = p->next) {
+		shutdown(p->fd, SHUT_RDWR);
+	}
+	pthread_cond_broadcast(&coordinator_changed);
+	while (num_connections > 0) {
+		pthread_cond_wait(&coordinator_changed, &coordinator_mutex);
+	}
+	pthread_mutex_unlock(&coordinator_mutex);
+}
+
+
+bool hardnested_coordinator_running(void)
+{
+	return listen_fd >= 0;
+}
+
+
+void hardnested_coordinator_start_job(hardnested_job_t *job)
+{
+	pthread_mutex_lock(&coordinator_mutex);
+	current_job = job;
+	job_number++;
+	job_active = true;
+	pthread_cond_broadcast(&coordinator_changed);
+	pthread_mutex_unlock(&coordinator_mutex);
+}
+
+
+// a key has been found. Stop the workers' threads early.
+void hardnested_coordinator_abort_job(void)
+{
+	pthread_mutex_lock(&coordinator_mutex);
+	for (connection_t *p = connections; p != NULL; p = p->next) {
+		if (p->job == job_number) {
+			send_message(p, MSG_ABORT);
+		}
+	}
+	pthread_mutex_unlock(&coordinator_mutex);
+}
+
+
+// wait until no connection uses the job's data any more
+void hardnested_coordinator_end_job(void)
+{
+	pthread_mutex_lock(&coordinator_mutex);
+	job_active = false;
+	while (connections_in_job > 0) {
+		pthread_cond_wait(&coordinator_changed, &coordinator_mutex);
+	}
+	current_job = NULL;
+	pthread_mutex_unlock(&coordinator_mutex);
+}
+
+
+//-----------------------------------------------------------------------------
+// worker
+//-----------------------------------------------------------------------------
+
+typedef struct {
+	uint32_t bucket;
+	statelist_t states;
+	pthread_t thread;
+} worker_bucket_t;
+
+static int worker_fd;
+static pthread_mutex_t worker_send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_thread_finished = PTHREAD_COND_INITIALIZER;
+static uint32_t worker_threads_running = 0;
+static uint32_t worker_abort = 0;
+static uint32_t worker_buckets_searched = 0;
+static uint32_t worker_keys_found = 0;
+static uint32_t worker_cuid;
+static uint32_t worker_nonces_to_bruteforce;
+static uint32_t worker_bf_test_nonce[256];
+static uint8_t worker_bf_test_nonce_par[256];
+static uint8_t worker_bf_test_nonce_2nd_byte[256];
+static uint8_t worker_best_first_bytes[256];
+static noncelist_t worker_nonces[256];
+
+
+static void free_worker_nonces(void)
+{
+	for (uint16_t i = 0; i < 256; i++) {
+		noncelistentry_t *p = worker_nonces[i].first;
+		while (p != NULL) {
+			noncelistentry_t *next = p->next;
+			free(p);
+			p = next;
+		}
+		worker_nonces[i].first = NULL;
+	}
+}
+
+
+static bool recv_job(int fd)
+{
+	free_worker_nonces();
+	bool ok = recv_u32(fd, &worker_cuid)
+		&& recv_u32(fd, &worker_nonces_to_bruteforce)
+		&& recv_u32s(fd, worker_bf_test_nonce, 256)
+		&& recv_all(fd, worker_bf_test_nonce_par, 256)
+		&& recv_all(fd, worker_bf_test_nonce_2nd_byte, 256)
+		&& recv_all(fd, worker_best_first_bytes, 256);
+	if (!ok || worker_nonces_to_bruteforce > 256) {
+		return false;
+	}
+	for (uint16_t i = 0; i < 256 && ok; i++) {
+		uint32_t count;
+		ok = recv_u32(fd, &count);
+		noncelistentry_t **tail = &worker_nonces[i].first;
+		for (uint32_t j = 0; j < count && ok; j++) {
+			noncelistentry_t *entry = (noncelistentry_t *)malloc(sizeof(noncelistentry_t));
+			if (entry == NULL) {
+				printf("Out of memory error in recv_job(). Aborting...\n");
+				exit(4);
+			}
+			entry->next = NULL;
+			ok = recv_u32(fd, &entry->nonce_enc) && recv_all(fd, &entry->par_enc, 1);
+			*tail = entry;
+			tail = (noncelistentry_t **)&entry->next;
+		}
+	}
+	if (ok) {
+		bitslice_test_nonces(worker_nonces_to_bruteforce, worker_bf_test_nonce, worker_bf_test_nonce_par);
+	}
+	return ok;
+}
+
+
+static bool recv_states(int fd, statelist_t *states, odd_even_t odd_even, uint32_t len)
+{
+	states->len[odd_even] = len;
+	states->states[odd_even] = (uint32_t *)malloc((len + 1) * sizeof(uint32_t));
+	if (states->states[odd_even] == NULL) {
+		printf("Out of memory error in recv_states(). Aborting...\n");
+		exit(4);
+	}
+	states->states[odd_even][len] = 0xffffffff;		// End Of List marker
+	return recv_u32s(fd, states->states[odd_even], len);
+}
+
+
+static bool recv_bucket(int fd, worker_bucket_t *bucket)
+{
+	uint32_t header[3];
+	if (!recv_u32s(fd, header, 3) || header[1] == 0 || header[2] == 0 || header[1] > (1<<24) || header[2] > (1<<24)) {
+		return false;
+	}
+	bucket->bucket = header[0];
+	bucket->states.next = NULL;
+	bucket->states.states[EVEN_STATE] = NULL;
+	if (!recv_states(fd, &bucket->states, ODD_STATE, header[1]) || !recv_states(fd, &bucket->states, EVEN_STATE, header[2])) {
+		free(bucket->states.states[ODD_STATE]);
+		free(bucket->states.states[EVEN_STATE]);
+		return false;
+	}
+	return true;
+}
+
+
+static void *worker_crack_thread(void *arg)
+{
+	worker_bucket_t *bucket = (worker_bucket_t *)arg;
+	uint64_t keys_tested = 0;
+
+	uint64_t key = crack_states_bitsliced(worker_cuid, worker_best_first_bytes, &bucket->states, &worker_abort, &keys_tested,
+		worker_nonces_to_bruteforce, worker_bf_test_nonce_2nd_byte, worker_nonces);
+
+	result_t status = key != -1 ? RESULT_KEY_FOUND : worker_abort ? RESULT_ABORTED : RESULT_SEARCHED;
+	uint32_t result[7] = {MSG_RESULT, bucket->bucket, status, key >> 32, key & 0xffffffff, keys_tested >> 32, keys_tested & 0xffffffff};
+	free(bucket->states.states[ODD_STATE]);
+	free(bucket->states.states[EVEN_STATE]);
+	free(bucket);
+
+	if (status == RESULT_KEY_FOUND) {
+		PrintAndLog("Key found: %012" PRIx64, key);
+		__sync_fetch_and_add(&worker_keys_found, 1);
+	}
+	__sync_fetch_and_add(&worker_buckets_searched, 1);
+
+	pthread_mutex_lock(&worker_send_mutex);
+	send_u32s(worker_fd, result, 7);
+	pthread_mutex_unlock(&worker_send_mutex);
+
+	pthread_mutex_lock(&worker_mutex);
+	worker_threads_running--;
+	pthread_cond_signal(&worker_thread_finished);
+	pthread_mutex_unlock(&worker_mutex);
+	return NULL;
+}
+
+
+int hardnested_worker(char *address, uint32_t num_threads)
+{
+	if (num_threads == 0) {
+		num_threads = num_CPUs();
+	}
+	num_threads = MIN(num_threads, MAX_WORKER_THREADS);
+
+	worker_fd = open_socket(address, false);
+	if (worker_fd < 0) {
+		return 1;
+	}
+	configure_connection(worker_fd);
+	uint32_t hello[4] = {MSG_HELLO, PROTOCOL_MAGIC, PROTOCOL_VERSION, num_threads};
+	if (!send_u32s(worker_fd, hello, 4)) {
+		PrintAndLog("Could not send to coordinator %s", address);
+		close(worker_fd);
+		return 1;
+	}
+	PrintAndLog("Connected to coordinator %s, using %" PRIu32 " threads", address, num_threads);
+
+	uint32_t jobs = 0;
+	uint64_t start_time = msclock();
+	worker_buckets_searched = 0;
+	worker_keys_found = 0;
+	bool ok = true;
+	while (ok) {
+		uint32_t message;
+		if (!recv_u32(worker_fd, &message)) {
+			break;		// coordinator closed the connection
+		}
+		switch (message) {
+			case MSG_JOB:
+				// all threads of the previous job are done when the coordinator sends a new job
+				worker_abort = 0;
+				ok = recv_job(worker_fd);
+				jobs++;
+				break;
+			case MSG_BUCKET: {
+				worker_bucket_t *bucket = (worker_bucket_t *)malloc(sizeof(worker_bucket_t));
+				if (bucket == NULL) {
+					printf("Out of memory error in hardnested_worker(). Aborting...\n");
+					exit(4);
+				}
+				ok = recv_bucket(worker_fd, bucket);
+				if (!ok) {
+					free(bucket);
+					break;
+				}
+				pthread_mutex_lock(&worker_mutex);
+				worker_threads_running++;
+				pthread_mutex_unlock(&worker_mutex);
+				pthread_create(&bucket->thread, NULL, worker_crack_thread, bucket);
+				pthread_detach(bucket->thread);
+				break;
+			}
+			case MSG_ABORT:
+				worker_abort = 1;
+				break;
+			case MSG_END_JOB:
+				break;
+			default:
+				ok = false;
+				break;
+		}
+	}
+
+	// let running threads finish quickly
+	worker_abort = 1;
+	pthread_mutex_lock(&worker_mutex);
+	while (worker_threads_running > 0) {
+		pthread_cond_wait(&worker_thread_finished, &worker_mutex);
+	}
+	pthread_mutex_unlock(&worker_mutex);
+	close(worker_fd);
+	free_worker_nonces();
+
+	if (!ok) {
+		PrintAndLog("Protocol error. Disconnected from coordinator.");
+	}
+	PrintAndLog("Worked on %" PRIu32 " jobs and searched %" PRIu32 " buckets in %1.0f seconds. Keys found: %" PRIu32,
+		jobs, worker_buckets_searched, (float)(msclock() - start_time) / 1000.0, worker_keys_found);
+	return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,41 @@
+//-----------------------------------------------------------------------------
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Distributed brute force for the hardnested attack. A coordinator hands out
+// the candidate buckets to worker processes which connect via TCP or a Unix
+// domain socket. The coordinator's own threads keep working on the buckets too.
+//-----------------------------------------------------------------------------
+
+#ifndef HARDNESTED_DISTRIBUTED_H__
+#define HARDNESTED_DISTRIBUTED_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardnested_bruteforce.h"
+
+typedef struct {
+	uint32_t cuid;
+	uint32_t nonces_to_bruteforce;
+	uint32_t *bf_test_nonce;
+	uint8_t *bf_test_nonce_par;
+	uint8_t *bf_test_nonce_2nd_byte;
+	uint8_t *best_first_bytes;
+	noncelist_t *nonces;
+	statelist_t **buckets;
+} hardnested_job_t;
+
+// coordinator side
+extern bool hardnested_coordinator_start(char *address);
+extern void hardnested_coordinator_stop(void);
+extern bool hardnested_coordinator_running(void);
+extern void hardnested_coordinator_start_job(hardnested_job_t *job);
+extern void hardnested_coordinator_abort_job(void);
+extern void hardnested_coordinator_end_job(void);
+
+// worker side
+extern int hardnested_worker(char *address, uint32_t num_threads);
+
+#endif
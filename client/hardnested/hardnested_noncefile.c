@@ -0,0 +1,511 @@
+//-----------------------------------------------------------------------------
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Nonce files for the hardnested attack. See hardnested_noncefile.h for the
+// file layout.
+//-----------------------------------------------------------------------------
+
+#include "hardnested_noncefile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "util.h"
+#include "ui.h"
+#include "crc32.h"
+
+#define NONCE_CHUNK_SYNC				0x4e4f4e43		// "NONC"
+#define MAX_PAYLOAD_LEN					(1 << 26)
+#define LEGACY_HEADER_SIZE				6
+#define LEGACY_RECORD_SIZE				9
+
+
+// crc32() returns the checksum little endian. Chunks written by x86 clients store the same value.
+static uint32_t crc(uint8_t *buf, size_t len)
+{
+	uint8_t checksum[4];
+	crc32(buf, len, checksum);
+	return le32toh(checksum);
+}
+
+
+bool nonce_file_is_header(uint8_t *buf)
+{
+	return memcmp(buf, NONCE_FILE_MAGIC, strlen(NONCE_FILE_MAGIC)) == 0;
+}
+
+
+bool nonce_file_parse_chunk_header(uint8_t *buf, nonce_chunk_t *chunk)
+{
+	if (bytes_to_num(buf, 4) != NONCE_CHUNK_SYNC
+		|| bytes_to_num(buf+32, 4) != crc(buf, 32)) {
+		return false;
+	}
+	chunk->cuid = bytes_to_num(buf+4, 4);
+	chunk->blockNo = buf[8];
+	chunk->keyType = buf[9];
+	chunk->srcBlockNo = buf[10];
+	chunk->flags = buf[11];
+	chunk->capture_time = bytes_to_num(buf+12, 8);
+	chunk->num_nonces = bytes_to_num(buf+20, 4);
+	chunk->payload_len = bytes_to_num(buf+24, 4);
+	chunk->payload_crc = bytes_to_num(buf+28, 4);
+	return chunk->payload_len <= MAX_PAYLOAD_LEN;
+}
+
+
+static void build_chunk_header(nonce_chunk_t *chunk, uint8_t *buf)
+{
+	num_to_bytes(NONCE_CHUNK_SYNC, 4, buf);
+	num_to_bytes(chunk->cuid, 4, buf+4);
+	buf[8] = chunk->blockNo;
+	buf[9] = chunk->keyType;
+	buf[10] = chunk->srcBlockNo;
+	buf[11] = chunk->flags;
+	num_to_bytes(chunk->capture_time, 8, buf+12);
+	num_to_bytes(chunk->num_nonces, 4, buf+20);
+	num_to_bytes(chunk->payload_len, 4, buf+24);
+	num_to_bytes(chunk->payload_crc, 4, buf+28);
+	num_to_bytes(crc(buf, 32), 4, buf+32);
+}
+
+
+bool nonce_file_decode_chunk(nonce_chunk_t *chunk, uint8_t *payload, nonce_handler_t handler, void *arg)
+{
+	if (crc(payload, chunk->payload_len) != chunk->payload_crc) {
+		return false;
+	}
+
+	uint8_t *p = payload;
+	uint8_t *end = payload + chunk->payload_len;
+	if (chunk->flags & NONCE_CHUNK_DELTA_COMPRESSED) {
+		uint64_t value = 0;
+		for (uint32_t i = 0; i < chunk->num_nonces; i++) {
+			uint64_t delta = 0;
+			uint8_t shift = 0;
+			do {
+				if (p == end || shift > 35) return false;
+				delta |= (uint64_t)(*p & 0x7f) << shift;
+				shift += 7;
+			} while (*p++ & 0x80);
+			value += delta;
+			handler(value >> 4, value & 0x0f, arg);
+		}
+	} else {
+		for (uint32_t i = 0; i < chunk->num_nonces; i += 2) {
+			if (i + 1 < chunk->num_nonces) {
+				if (end - p < 9) return false;
+				handler(bytes_to_num(p, 4), p[8] >> 4, arg);
+				handler(bytes_to_num(p+4, 4), p[8] & 0x0f, arg);
+				p += 9;
+			} else {	// odd number of nonces. The last one comes alone
+				if (end - p < 5) return false;
+				handler(bytes_to_num(p, 4), p[4] & 0x0f, arg);
+				p += 5;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+static nonce_target_t *find_or_add_target(nonce_file_index_t *index, nonce_chunk_t *chunk)
+{
+	for (uint32_t i = 0; i < index->num_targets; i++) {
+		nonce_target_t *target = &index->targets[i];
+		if (target->cuid == chunk->cuid && target->blockNo == chunk->blockNo && target->keyType == chunk->keyType) {
+			return target;
+		}
+	}
+	index->targets = realloc(index->targets, (index->num_targets + 1) * sizeof(nonce_target_t));
+	if (index->targets == NULL) {
+		PrintAndLog("Out of memory error in find_or_add_target(). Aborting...");
+		exit(4);
+	}
+	nonce_target_t *target = &index->targets[index->num_targets++];
+	memset(target, 0, sizeof(nonce_target_t));
+	target->cuid = chunk->cuid;
+	target->blockNo = chunk->blockNo;
+	target->keyType = chunk->keyType;
+	target->first_capture = chunk->capture_time;
+	return target;
+}
+
+
+static void add_chunk_to_index(nonce_file_index_t *index, nonce_chunk_t *chunk, long offset)
+{
+	nonce_target_t *target = find_or_add_target(index, chunk);
+	target->chunk_offsets = realloc(target->chunk_offsets, (target->num_chunks + 1) * sizeof(long));
+	if (target->chunk_offsets == NULL) {
+		PrintAndLog("Out of memory error in add_chunk_to_index(). Aborting...");
+		exit(4);
+	}
+	target->chunk_offsets[target->num_chunks++] = offset;
+	target->num_nonces += chunk->num_nonces;
+	target->srcBlockNo = chunk->srcBlockNo;
+	target->flags = chunk->flags;
+	target->first_capture = MIN(target->first_capture, chunk->capture_time);
+	target->last_capture = MAX(target->last_capture, chunk->capture_time);
+	index->last_target = target - index->targets;
+}
+
+
+// Scan the chunk headers of a nonce file. Damaged chunk headers are skipped by searching for the next
+// valid one. The payload checksums are verified when the nonces are read.
+// Returns 0 on success, 1 if the file can't be opened and 2 if it isn't a nonce file.
+static int read_index(FILE *f, nonce_file_index_t *index, uint32_t *missing_bytes)
+{
+	uint8_t buf[NONCE_CHUNK_HEADER_SIZE];
+
+	memset(index, 0, sizeof(nonce_file_index_t));
+	*missing_bytes = 0;
+
+	fseek(f, 0, SEEK_END);
+	long file_size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (fread(buf, 1, NONCE_FILE_HEADER_SIZE, f) != NONCE_FILE_HEADER_SIZE || !nonce_file_is_header(buf)) {
+		if (file_size < LEGACY_HEADER_SIZE) {
+			return 2;
+		}
+		// old format with a single target
+		nonce_chunk_t chunk = {0};
+		chunk.cuid = bytes_to_num(buf, 4);
+		chunk.blockNo = buf[4];
+		chunk.keyType = buf[5];
+		chunk.num_nonces = (file_size - LEGACY_HEADER_SIZE) / LEGACY_RECORD_SIZE * 2;
+		add_chunk_to_index(index, &chunk, LEGACY_HEADER_SIZE);
+		index->legacy = true;
+		return 0;
+	}
+
+	uint16_t version = bytes_to_num(buf+8, 2);
+	if (version > NONCE_FILE_VERSION) {
+		PrintAndLog("Nonce file version %d is not supported. Please update.", version);
+		return 2;
+	}
+
+	long offset = bytes_to_num(buf+10, 2);
+	while (offset + NONCE_CHUNK_HEADER_SIZE <= file_size) {
+		nonce_chunk_t chunk;
+		fseek(f, offset, SEEK_SET);
+		if (fread(buf, 1, NONCE_CHUNK_HEADER_SIZE, f) != NONCE_CHUNK_HEADER_SIZE) {
+			break;
+		}
+		if (!nonce_file_parse_chunk_header(buf, &chunk)) {
+			offset++;		// search for the next chunk
+			continue;
+		}
+		if (offset + NONCE_CHUNK_HEADER_SIZE + chunk.payload_len > file_size) {
+			*missing_bytes = offset + NONCE_CHUNK_HEADER_SIZE + chunk.payload_len - file_size;
+			break;			// last chunk is incomplete
+		}
+		add_chunk_to_index(index, &chunk, offset);
+		offset += NONCE_CHUNK_HEADER_SIZE + chunk.payload_len;
+	}
+
+	return 0;
+}
+
+
+int nonce_file_read_index(char *filename, nonce_file_index_t *index)
+{
+	uint32_t missing_bytes;
+
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		memset(index, 0, sizeof(nonce_file_index_t));
+		return 1;
+	}
+	int result = read_index(f, index, &missing_bytes);
+	fclose(f);
+	return result;
+}
+
+
+void nonce_file_free_index(nonce_file_index_t *index)
+{
+	for (uint32_t i = 0; i < index->num_targets; i++) {
+		free(index->targets[i].chunk_offsets);
+	}
+	free(index->targets);
+	index->targets = NULL;
+	index->num_targets = 0;
+}
+
+
+// Call handler() for all nonces of one target. Chunks with a wrong checksum are skipped.
+int nonce_file_read_target(char *filename, nonce_file_index_t *index, uint32_t target, nonce_handler_t handler, void *arg)
+{
+	uint8_t buf[NONCE_CHUNK_HEADER_SIZE];
+
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		return 1;
+	}
+
+	nonce_target_t *t = &index->targets[target];
+	if (index->legacy) {
+		fseek(f, t->chunk_offsets[0], SEEK_SET);
+		while (fread(buf, 1, LEGACY_RECORD_SIZE, f) == LEGACY_RECORD_SIZE) {
+			handler(bytes_to_num(buf, 4), buf[8] >> 4, arg);
+			handler(bytes_to_num(buf+4, 4), buf[8] & 0x0f, arg);
+		}
+		fclose(f);
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < t->num_chunks; i++) {
+		nonce_chunk_t chunk;
+		fseek(f, t->chunk_offsets[i], SEEK_SET);
+		if (fread(buf, 1, NONCE_CHUNK_HEADER_SIZE, f) != NONCE_CHUNK_HEADER_SIZE || !nonce_file_parse_chunk_header(buf, &chunk)) {
+			PrintAndLog("Could not read chunk header at offset %ld of file %s", t->chunk_offsets[i], filename);
+			continue;
+		}
+		uint8_t *payload = malloc(chunk.payload_len + 1);
+		if (payload == NULL) {
+			PrintAndLog("Out of memory error in nonce_file_read_target(). Aborting...");
+			exit(4);
+		}
+		if (fread(payload, 1, chunk.payload_len, f) != chunk.payload_len || !nonce_file_decode_chunk(&chunk, payload, handler, arg)) {
+			PrintAndLog("Skipping damaged chunk at offset %ld of file %s", t->chunk_offsets[i], filename);
+		}
+		free(payload);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+// Create an empty nonce file, replacing an existing one.
+FILE *nonce_file_create(char *filename)
+{
+	uint8_t header[NONCE_FILE_HEADER_SIZE] = {0};
+	FILE *f = fopen(filename, "wb");
+	if (f == NULL) {
+		return NULL;
+	}
+	memcpy(header, NONCE_FILE_MAGIC, strlen(NONCE_FILE_MAGIC));
+	num_to_bytes(NONCE_FILE_VERSION, 2, header+8);
+	num_to_bytes(NONCE_FILE_HEADER_SIZE, 2, header+10);
+	fwrite(header, 1, NONCE_FILE_HEADER_SIZE, f);
+	return f;
+}
+
+
+// Open a nonce file to append chunks. A new file is created if there is none or if it has the old format.
+FILE *nonce_file_open_append(char *filename)
+{
+	nonce_file_index_t index;
+	uint32_t missing_bytes = 0;
+	bool append = false;
+
+	FILE *f = fopen(filename, "rb");
+	if (f != NULL) {
+		append = (read_index(f, &index, &missing_bytes) == 0 && !index.legacy);
+		nonce_file_free_index(&index);
+		fclose(f);
+	}
+
+	if (append) {
+		f = fopen(filename, "ab");
+		if (f == NULL) {
+			return NULL;
+		}
+		// complete the incomplete last chunk of an interrupted capture. It will be skipped because of its checksum.
+		for (uint32_t i = 0; i < missing_bytes; i++) {
+			fputc(0, f);
+		}
+	} else {
+		f = nonce_file_create(filename);
+	}
+
+	return f;
+}
+
+
+static int compare_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(uint64_t *)a;
+	uint64_t y = *(uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Append a chunk with the given nonces. The target, capture time and flags are taken from chunk,
+// the remaining fields are filled in. With NONCE_CHUNK_DELTA_COMPRESSED set in chunk->flags the
+// nonces are sorted first.
+bool nonce_file_write_chunk(FILE *f, nonce_chunk_t *chunk, uint32_t *nt_enc, uint8_t *par_enc, uint32_t num_nonces)
+{
+	uint8_t header[NONCE_CHUNK_HEADER_SIZE];
+	uint8_t *payload = malloc((size_t)num_nonces * 6 + 9);
+	if (payload == NULL) {
+		PrintAndLog("Out of memory error in nonce_file_write_chunk(). Aborting...");
+		exit(4);
+	}
+
+	uint8_t *p = payload;
+	if (chunk->flags & NONCE_CHUNK_DELTA_COMPRESSED) {
+		uint64_t *values = malloc((size_t)num_nonces * sizeof(uint64_t) + 1);
+		if (values == NULL) {
+			PrintAndLog("Out of memory error in nonce_file_write_chunk(). Aborting...");
+			exit(4);
+		}
+		for (uint32_t i = 0; i < num_nonces; i++) {
+			values[i] = (uint64_t)nt_enc[i] << 4 | (par_enc[i] & 0x0f);
+		}
+		qsort(values, num_nonces, sizeof(uint64_t), compare_uint64);
+		uint64_t last_value = 0;
+		for (uint32_t i = 0; i < num_nonces; i++) {
+			uint64_t delta = values[i] - last_value;
+			last_value = values[i];
+			do {
+				*p++ = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0x00);
+				delta >>= 7;
+			} while (delta != 0);
+		}
+		free(values);
+	} else {
+		for (uint32_t i = 0; i < num_nonces; i += 2) {
+			num_to_bytes(nt_enc[i], 4, p);
+			if (i + 1 < num_nonces) {
+				num_to_bytes(nt_enc[i+1], 4, p+4);
+				p[8] = (par_enc[i] & 0x0f) << 4 | (par_enc[i+1] & 0x0f);
+				p += 9;
+			} else {
+				p[4] = par_enc[i] & 0x0f;
+				p += 5;
+			}
+		}
+	}
+
+	chunk->num_nonces = num_nonces;
+	chunk->payload_len = p - payload;
+	chunk->payload_crc = crc(payload, chunk->payload_len);
+	build_chunk_header(chunk, header);
+	bool ok = fwrite(header, 1, NONCE_CHUNK_HEADER_SIZE, f) == NONCE_CHUNK_HEADER_SIZE
+			&& fwrite(payload, 1, chunk->payload_len, f) == chunk->payload_len;
+	free(payload);
+	return ok;
+}
+
+
+int nonce_file_list(char *filename)
+{
+	nonce_file_index_t index;
+
+	int result = nonce_file_read_index(filename, &index);
+	if (result == 1) {
+		PrintAndLog("Could not open file %s", filename);
+		return 1;
+	} else if (result != 0) {
+		PrintAndLog("%s is not a nonce file", filename);
+		return 1;
+	}
+
+	PrintAndLog("%s: %s format, %" PRIu32 " target%s", filename, index.legacy ? "old nonces.bin" : "chunked", index.num_targets, index.num_targets == 1 ? "" : "s");
+	PrintAndLog("");
+	PrintAndLog("  # | cuid     | block | key type | #nonces | chunks | acquired with     | first capture       | last capture");
+	PrintAndLog("---------------------------------------------------------------------------------------------------------------------");
+	for (uint32_t i = 0; i < index.num_targets; i++) {
+		nonce_target_t *t = &index.targets[i];
+		char acquisition[20] = "unknown";
+		char first_capture[20] = "unknown";
+		char last_capture[20] = "unknown";
+		if (!index.legacy && t->first_capture != 0) {		// 0 for nonces merged from old files
+			time_t first = t->first_capture;
+			time_t last = t->last_capture;
+			sprintf(acquisition, "block %3d key %c%s", t->srcBlockNo, t->flags & NONCE_CHUNK_SOURCE_KEY_B ? 'B' : 'A', t->flags & NONCE_CHUNK_SLOW_ACQUISITION ? " s" : "");
+			strftime(first_capture, sizeof(first_capture), "%Y-%m-%d %H:%M:%S", localtime(&first));
+			strftime(last_capture, sizeof(last_capture), "%Y-%m-%d %H:%M:%S", localtime(&last));
+		}
+		PrintAndLog("%3" PRIu32 " | %08" PRIx32 " | %5d | %8c | %7" PRIu32 " | %6" PRIu32 " | %-17s | %-19s | %s",
+			i + 1,
+			t->cuid,
+			t->blockNo,
+			t->keyType ? 'B' : 'A',
+			t->num_nonces,
+			t->num_chunks,
+			acquisition,
+			first_capture,
+			last_capture);
+	}
+
+	nonce_file_free_index(&index);
+	return 0;
+}
+
+
+typedef struct {
+	uint32_t num;
+	uint32_t *nt_enc;
+	uint8_t *par_enc;
+} nonce_buffer_t;
+
+
+static void add_to_buffer(uint32_t nt_enc, uint8_t par_enc, void *arg)
+{
+	nonce_buffer_t *buffer = (nonce_buffer_t *)arg;
+	buffer->nt_enc[buffer->num] = nt_enc;
+	buffer->par_enc[buffer->num] = par_enc;
+	buffer->num++;
+}
+
+
+// Append the nonces of all targets in the input files to output, one delta compressed chunk per target and input file.
+int nonce_file_merge(char *output, char **inputs, uint32_t num_inputs)
+{
+	FILE *fout = nonce_file_open_append(output);
+	if (fout == NULL) {
+		PrintAndLog("Could not open file %s", output);
+		return 1;
+	}
+
+	int result = 0;
+	for (uint32_t i = 0; i < num_inputs && result == 0; i++) {
+		nonce_file_index_t index;
+		if (nonce_file_read_index(inputs[i], &index) != 0) {
+			PrintAndLog("Could not read nonce file %s", inputs[i]);
+			result = 1;
+			break;
+		}
+		for (uint32_t j = 0; j < index.num_targets; j++) {
+			nonce_target_t *t = &index.targets[j];
+			nonce_buffer_t buffer = {0};
+			buffer.nt_enc = malloc(sizeof(uint32_t) * t->num_nonces + 1);
+			buffer.par_enc = malloc(t->num_nonces + 1);
+			if (buffer.nt_enc == NULL || buffer.par_enc == NULL) {
+				PrintAndLog("Out of memory error in nonce_file_merge(). Aborting...");
+				exit(4);
+			}
+			nonce_file_read_target(inputs[i], &index, j, add_to_buffer, &buffer);
+			nonce_chunk_t chunk = {0};
+			chunk.cuid = t->cuid;
+			chunk.blockNo = t->blockNo;
+			chunk.keyType = t->keyType;
+			chunk.srcBlockNo = t->srcBlockNo;
+			chunk.flags = t->flags | NONCE_CHUNK_DELTA_COMPRESSED;
+			chunk.capture_time = index.legacy ? 0 : t->last_capture;
+			if (!nonce_file_write_chunk(fout, &chunk, buffer.nt_enc, buffer.par_enc, buffer.num)) {
+				PrintAndLog("Could not write to file %s", output);
+				result = 1;
+			} else {
+				PrintAndLog("%s: added %" PRIu32 " nonces of cuid %08" PRIx32 ", block %d, key type %c (%" PRIu32 " bytes)",
+					output, buffer.num, t->cuid, t->blockNo, t->keyType ? 'B' : 'A', chunk.payload_len + NONCE_CHUNK_HEADER_SIZE);
+			}
+			free(buffer.nt_enc);
+			free(buffer.par_enc);
+			if (result != 0) break;
+		}
+		nonce_file_free_index(&index);
+	}
+
+	fclose(fout);
+	return result;
+}
@@ -0,0 +1,93 @@
+//-----------------------------------------------------------------------------
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Nonce files for the hardnested attack. A nonce file holds the encrypted
+// nonces of any number of targets (cuid, block, key type). The nonces are
+// stored in checksummed chunks which are appended while nonces are acquired.
+// The chunk headers can be scanned without reading the nonces, which allows
+// to read the nonces of a single target from a large archive.
+//
+// File layout (all numbers big endian):
+//   file header:  "PM3NONCE", version (2), header size (2), reserved (4)
+//   chunk header: sync word (4), cuid (4), target block (1), target key type (1),
+//                 source block (1), flags (1), capture time (8), number of nonces (4),
+//                 payload length (4), payload crc32 (4), header crc32 (4)
+//   payload:      pairs of nonces in 9 byte records as in the old nonces.bin format,
+//                 or, if delta compressed, the sorted nonces and their parity bits
+//                 as varint coded differences
+//
+// Old nonces.bin files (6 byte header and 9 byte records) are read as a file
+// with a single target.
+//-----------------------------------------------------------------------------
+
+#ifndef HARDNESTED_NONCEFILE_H__
+#define HARDNESTED_NONCEFILE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NONCE_FILE_MAGIC				"PM3NONCE"
+#define NONCE_FILE_VERSION				1
+#define NONCE_FILE_HEADER_SIZE			16
+#define NONCE_CHUNK_HEADER_SIZE			36
+
+#define NONCE_CHUNK_DELTA_COMPRESSED	0x01
+#define NONCE_CHUNK_SLOW_ACQUISITION	0x02
+#define NONCE_CHUNK_SOURCE_KEY_B		0x04
+
+typedef struct {
+	uint32_t cuid;
+	uint8_t blockNo;
+	uint8_t keyType;
+	uint8_t srcBlockNo;
+	uint8_t flags;
+	uint64_t capture_time;					// seconds since the epoch
+	uint32_t num_nonces;
+	uint32_t payload_len;
+	uint32_t payload_crc;
+} nonce_chunk_t;
+
+typedef struct {
+	uint32_t cuid;
+	uint8_t blockNo;
+	uint8_t keyType;
+	uint8_t srcBlockNo;
+	uint8_t flags;							// of the last chunk
+	uint64_t first_capture;
+	uint64_t last_capture;
+	uint32_t num_nonces;
+	uint32_t num_chunks;
+	long *chunk_offsets;
+} nonce_target_t;
+
+typedef struct {
+	bool legacy;							// old nonces.bin format
+	uint32_t num_targets;
+	nonce_target_t *targets;
+	uint32_t last_target;					// target of the most recently written chunk
+} nonce_file_index_t;
+
+typedef void (*nonce_handler_t)(uint32_t nt_enc, uint8_t par_enc, void *arg);
+
+// reading
+extern int nonce_file_read_index(char *filename, nonce_file_index_t *index);
+extern void nonce_file_free_index(nonce_file_index_t *index);
+extern int nonce_file_read_target(char *filename, nonce_file_index_t *index, uint32_t target, nonce_handler_t handler, void *arg);
+extern bool nonce_file_is_header(uint8_t *buf);
+extern bool nonce_file_parse_chunk_header(uint8_t *buf, nonce_chunk_t *chunk);
+extern bool nonce_file_decode_chunk(nonce_chunk_t *chunk, uint8_t *payload, nonce_handler_t handler, void *arg);
+
+// writing
+extern FILE *nonce_file_create(char *filename);
+extern FILE *nonce_file_open_append(char *filename);
+extern bool nonce_file_write_chunk(FILE *f, nonce_chunk_t *chunk, uint32_t *nt_enc, uint8_t *par_enc, uint32_t num_nonces);
+
+// hf mf hardnested l and m
+extern int nonce_file_list(char *filename);
+extern int nonce_file_merge(char *output, char **inputs, uint32_t num_inputs);
+
+#endif
@@ -0,0 +1,160 @@
+//-----------------------------------------------------------------------------
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Persistent worker threads for the hardnested attack. A job is a number of
+// independent tasks (0 .. num_tasks-1). Each worker starts with a contiguous
+// share of the tasks and steals from the other workers when it runs out of work.
+//-----------------------------------------------------------------------------
+
+#include "hardnested_threadpool.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "util.h"
+
+// The tasks still to be done by a worker are the range [first, end), packed into one 64 bit word.
+// The owner takes tasks from the bottom, thieves take the upper half. Both use compare and swap.
+#define FIRST_TASK(range)			((uint32_t)((range) & 0xffffffff))
+#define END_TASK(range)				((uint32_t)((range) >> 32))
+#define TASK_RANGE(first, end)		((uint64_t)(end) << 32 | (first))
+
+typedef struct {
+	volatile uint64_t tasks;
+	uint32_t id;
+	uint32_t job;
+	pthread_t thread;
+} __attribute__((aligned(64))) worker_t;		// avoid false sharing of the task ranges
+
+static worker_t *workers = NULL;
+static uint32_t num_workers = 0;
+static uint32_t num_active_workers = 0;
+static uint32_t job_number = 0;
+static hardnested_task_t job_task;
+static void *job_arg;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_started = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_finished = PTHREAD_COND_INITIALIZER;
+
+
+static bool take_own_task(worker_t *worker, uint32_t *task)
+{
+	uint64_t range = worker->tasks;
+	while (FIRST_TASK(range) < END_TASK(range)) {
+		uint64_t old_range = __sync_val_compare_and_swap(&worker->tasks, range, TASK_RANGE(FIRST_TASK(range) + 1, END_TASK(range)));
+		if (old_range == range) {
+			*task = FIRST_TASK(range);
+			return true;
+		}
+		range = old_range;
+	}
+	return false;
+}
+
+
+static bool steal_tasks(worker_t *thief)
+{
+	for (uint32_t i = 1; i < num_workers; i++) {
+		worker_t *victim = &workers[(thief->id + i) % num_workers];
+		uint64_t range = victim->tasks;
+		while (FIRST_TASK(range) < END_TASK(range)) {
+			uint32_t split = END_TASK(range) - (END_TASK(range) - FIRST_TASK(range) + 1) / 2;
+			uint64_t old_range = __sync_val_compare_and_swap(&victim->tasks, range, TASK_RANGE(FIRST_TASK(range), split));
+			if (old_range == range) {
+				// our own range is empty and therefore not touched by other thieves
+				__sync_lock_test_and_set(&thief->tasks, TASK_RANGE(split, END_TASK(range)));
+				return true;
+			}
+			range = old_range;
+		}
+	}
+	return false;
+}
+
+
+static void *worker_thread(void *arg)
+{
+	worker_t *me = (worker_t *)arg;
+
+	while (true) {
+		pthread_mutex_lock(&pool_mutex);
+		while (job_number == me->job) {
+			pthread_cond_wait(&job_started, &pool_mutex);
+		}
+		me->job = job_number;
+		hardnested_task_t task_function = job_task;
+		void *task_arg = job_arg;
+		pthread_mutex_unlock(&pool_mutex);
+
+		uint32_t task;
+		while (take_own_task(me, &task) || (steal_tasks(me) && take_own_task(me, &task))) {
+			task_function(task_arg, task);
+		}
+
+		pthread_mutex_lock(&pool_mutex);
+		if (--num_active_workers == 0) {
+			pthread_cond_signal(&job_finished);
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	}
+
+	return NULL;
+}
+
+
+static void init_threadpool(void)
+{
+	num_workers = num_CPUs();
+	if (num_workers < 1) {
+		num_workers = 1;
+	}
+	workers = (worker_t *)calloc(num_workers, sizeof(worker_t));
+	if (workers == NULL) {
+		printf("Out of memory error in init_threadpool(). Aborting...\n");
+		exit(4);
+	}
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i].id = i;
+		workers[i].job = job_number;
+		workers[i].tasks = TASK_RANGE(0, 0);
+		pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+	}
+}
+
+
+uint32_t hardnested_num_workers(void)
+{
+	pthread_mutex_lock(&pool_mutex);
+	if (workers == NULL) {
+		init_threadpool();
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	return num_workers;
+}
+
+
+// Run task(arg, 0) ... task(arg, num_tasks-1) on the worker threads and wait until all of them completed.
+// The worker threads are started with the first call and stay alive for all following jobs.
+void hardnested_run_tasks(hardnested_task_t task, void *arg, uint32_t num_tasks)
+{
+	pthread_mutex_lock(&pool_mutex);
+	if (workers == NULL) {
+		init_threadpool();
+	}
+	job_task = task;
+	job_arg = arg;
+	for (uint32_t i = 0; i < num_workers; i++) {
+		workers[i].tasks = TASK_RANGE((uint64_t)num_tasks * i / num_workers, (uint64_t)num_tasks * (i+1) / num_workers);
+	}
+	num_active_workers = num_workers;
+	job_number++;
+	pthread_cond_broadcast(&job_started);
+	while (num_active_workers != 0) {
+		pthread_cond_wait(&job_finished, &pool_mutex);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+}
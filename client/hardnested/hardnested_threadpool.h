@@ -0,0 +1,22 @@
+//-----------------------------------------------------------------------------
+//
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Persistent worker threads for the hardnested attack. A job is a number of
+// independent tasks (0 .. num_tasks-1). Each worker starts with a contiguous
+// share of the tasks and steals from the other workers when it runs out of work.
+//-----------------------------------------------------------------------------
+
+#ifndef HARDNESTED_THREADPOOL_H__
+#define HARDNESTED_THREADPOOL_H__
+
+#include <stdint.h>
+
+typedef void (*hardnested_task_t)(void *arg, uint32_t task);
+
+extern uint32_t hardnested_num_workers(void);
+extern void hardnested_run_tasks(hardnested_task_t task, void *arg, uint32_t num_tasks);
+
+#endif
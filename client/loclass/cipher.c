@@ -45,6 +45,7 @@
 #include <stdint.h>
 #ifndef ON_DEVICE
 #include "fileutils.h"
+#include "iclass_mac_core.h"
 #endif
 
 
@@ -290,4 +291,44 @@ int testMAC()
 
 	return 0;
 }
+
+int testMACBatch()
+{
+	prnlog("[+] Testing batch MAC calculation against doMAC...");
+
+	uint8_t cc_nr[12];
+	uint8_t div_keys[3*ICLASS_MAC_LANES+5][8];
+	uint8_t macs[3*ICLASS_MAC_LANES+5][4];
+	uint8_t mac[4];
+	uint32_t seed = 0x1d49c9da;
+
+	// random keys and challenges, batch sizes that don't fill all lanes included
+	for (int round = 0; round < 64; round++) {
+		uint32_t n = 1 + round % (3*ICLASS_MAC_LANES+5);
+		for (int i = 0; i < 12; i++) {
+			seed = seed * 1103515245 + 12345;
+			cc_nr[i] = seed >> 16;
+		}
+		for (uint32_t k = 0; k < n; k++) {
+			for (int i = 0; i < 8; i++) {
+				seed = seed * 1103515245 + 12345;
+				div_keys[k][i] = seed >> 16;
+			}
+		}
+		iclass_mac_batch(cc_nr, div_keys, macs, n);
+		for (uint32_t k = 0; k < n; k++) {
+			doMAC(cc_nr, div_keys[k], mac);
+			if (memcmp(mac, macs[k], 4) != 0) {
+				prnlog("[+] FAILED: batch MAC calculation differs from doMAC:");
+				printarr("    Key           ", div_keys[k], 8);
+				printarr("    Batch MAC     ", macs[k], 4);
+				printarr("    Correct_MAC   ", mac, 4);
+				return 1;
+			}
+		}
+	}
+	prnlog("[+] Batch MAC calculation OK!");
+
+	return 0;
+}
 #endif
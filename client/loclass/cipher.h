@@ -46,6 +46,7 @@ void doMAC_N(uint8_t *address_data_p,uint8_t address_data_size, uint8_t *div_key
 
 #ifndef ON_DEVICE
 int testMAC();
+int testMACBatch();
 #endif
 
 #endif // CIPHER_H
@@ -40,6 +40,8 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "util.h"
 #include "util_posix.h"
 #include "cipherutils.h"
@@ -48,6 +50,7 @@
 #include "elite_crack.h"
 #include "fileutils.h"
 #include "des.h"
+#include "iclass_mac_core.h"
 
 /**
  * @brief Permutes a key from standard NIST format to Iclass specific format
@@ -180,11 +183,10 @@ void rk(uint8_t *key, uint8_t n, uint8_t *outp_key)
     return;
 }
 
-static des_context ctx_enc = {DES_ENCRYPT,{0}};
-static des_context ctx_dec = {DES_DECRYPT,{0}};
-
 void desdecrypt_iclass(uint8_t *iclass_key, uint8_t *input, uint8_t *output)
 {
+    // local context, so that keys can be calculated from several threads
+    des_context ctx_dec = {DES_DECRYPT,{0}};
     uint8_t key_std_format[8] = {0};
     permutekey_rev(iclass_key, key_std_format);
     des_setkey_dec( &ctx_dec, key_std_format);
@@ -192,6 +194,7 @@ void desdecrypt_iclass(uint8_t *iclass_key, uint8_t *input, uint8_t *output)
 }
 void desencrypt_iclass(uint8_t *iclass_key, uint8_t *input, uint8_t *output)
 {
+    des_context ctx_enc = {DES_ENCRYPT,{0}};
     uint8_t key_std_format[8] = {0};
     permutekey_rev(iclass_key, key_std_format);
     des_setkey_enc( &ctx_enc, key_std_format);
@@ -199,29 +202,16 @@ void desencrypt_iclass(uint8_t *iclass_key, uint8_t *input, uint8_t *output)
 }
 
 /**
- * @brief Insert uint8_t[8] custom master key to calculate hash2 and return key_select.
- * @param key unpermuted custom key
- * @param hash1 hash1
- * @param key_sel output key_sel=h[hash1[i]]
+ * @brief Calculates the 128 byte keytable hash2(K_cus), without printing anything.
+ * Thread-safe.
+ * @param key64 custom key, in iclass format
+ * @param outp_keytable output, 128 bytes
  */
-void hash2(uint8_t *key64, uint8_t *outp_keytable)
+void hash2_keytable(uint8_t *key64, uint8_t *outp_keytable)
 {
-    /**
-     *Expected:
-     * High Security Key Table
-
-00  F1 35 59 A1 0D 5A 26 7F 18 60 0B 96 8A C0 25 C1
-10  BF A1 3B B0 FF 85 28 75 F2 1F C6 8F 0E 74 8F 21
-20  14 7A 55 16 C8 A9 7D B3 13 0C 5D C9 31 8D A9 B2
-30  A3 56 83 0F 55 7E DE 45 71 21 D2 6D C1 57 1C 9C
-40  78 2F 64 51 42 7B 64 30 FA 26 51 76 D3 E0 FB B6
-50  31 9F BF 2F 7E 4F 94 B4 BD 4F 75 91 E3 1B EB 42
-60  3F 88 6F B8 6C 2C 93 0D 69 2C D5 20 3C C1 61 95
-70  43 08 A0 2F FE B3 26 D7 98 0B 34 7B 47 70 A0 AB
-
-**** The 64-bit HS Custom Key Value = 5B7C62C491C11B39 ******/
     uint8_t key64_negated[8] = {0};
     uint8_t z[8][8]={{0},{0}};
+    uint8_t y[8][8]={{0},{0}};
     uint8_t temp_output[8]={0};
     //calculate complement of key
     int i;
@@ -231,15 +221,9 @@ void hash2(uint8_t *key64, uint8_t *outp_keytable)
     // Once again, key is on iclass-format
     desencrypt_iclass(key64, key64_negated, z[0]);
 
-    prnlog("\nHigh security custom key (Kcus):");
-    printvar("z0  ",  z[0],8);
-
-    uint8_t y[8][8]={{0},{0}};
-
     // y[0]=DES_dec(z[0],~key)
     // Once again, key is on iclass-format
     desdecrypt_iclass(z[0], key64_negated, y[0]);
-    printvar("y0  ",  y[0],8);
 
     for(i=1; i<8; i++)
     {
@@ -252,16 +236,49 @@ void hash2(uint8_t *key64, uint8_t *outp_keytable)
         desencrypt_iclass(temp_output,y[i-1], y[i]);
 
     }
+    for(i = 0 ; i < 8 ; i++)
+    {
+        memcpy(outp_keytable+i*16,y[i],8);
+        memcpy(outp_keytable+8+i*16,z[i],8);
+    }
+}
+
+/**
+ * @brief Insert uint8_t[8] custom master key to calculate hash2 and return key_select.
+ * @param key unpermuted custom key
+ * @param hash1 hash1
+ * @param key_sel output key_sel=h[hash1[i]]
+ */
+void hash2(uint8_t *key64, uint8_t *outp_keytable)
+{
+    /**
+     *Expected:
+     * High Security Key Table
+
+00  F1 35 59 A1 0D 5A 26 7F 18 60 0B 96 8A C0 25 C1
+10  BF A1 3B B0 FF 85 28 75 F2 1F C6 8F 0E 74 8F 21
+20  14 7A 55 16 C8 A9 7D B3 13 0C 5D C9 31 8D A9 B2
+30  A3 56 83 0F 55 7E DE 45 71 21 D2 6D C1 57 1C 9C
+40  78 2F 64 51 42 7B 64 30 FA 26 51 76 D3 E0 FB B6
+50  31 9F BF 2F 7E 4F 94 B4 BD 4F 75 91 E3 1B EB 42
+60  3F 88 6F B8 6C 2C 93 0D 69 2C D5 20 3C C1 61 95
+70  43 08 A0 2F FE B3 26 D7 98 0B 34 7B 47 70 A0 AB
+
+**** The 64-bit HS Custom Key Value = 5B7C62C491C11B39 ******/
+    uint8_t keytable[128] = {0};
+    hash2_keytable(key64, keytable);
+
+    // keytable holds y[i] at i*16 and z[i] at 8+i*16
+    prnlog("\nHigh security custom key (Kcus):");
+    printvar("z0  ",  keytable+8,8);
+    printvar("y0  ",  keytable,8);
+
     if(outp_keytable != NULL)
     {
-        for(i = 0 ; i < 8 ; i++)
-        {
-            memcpy(outp_keytable+i*16,y[i],8);
-            memcpy(outp_keytable+8+i*16,z[i],8);
-        }
+        memcpy(outp_keytable, keytable, sizeof(keytable));
     }else
     {
-        printarr_human_readable("hash2", outp_keytable,128);
+        printarr_human_readable("hash2", keytable,128);
     }
 }
 
@@ -296,146 +313,6 @@ int _readFromDump(uint8_t dump[], dumpdata* item, uint8_t i)
 }
 
 static uint32_t startvalue = 0;
-/**
- * @brief Performs brute force attack against a dump-data item, containing csn, cc_nr and mac.
- *This method calculates the hash1 for the CSN, and determines what bytes need to be bruteforced
- *on the fly. If it finds that more than three bytes need to be bruteforced, it aborts.
- *It updates the keytable with the findings, also using the upper half of the 16-bit ints
- *to signal if the particular byte has been cracked or not.
- *
- * @param dump The dumpdata from iclass reader attack.
- * @param keytable where to write found values.
- * @return
- */
-int bruteforceItem(dumpdata item, uint16_t keytable[])
-{
-	int errors = 0;
-	uint8_t key_sel_p[8] = { 0 };
-	uint8_t div_key[8] = {0};
-	int found = false;
-	uint8_t key_sel[8] = {0};
-	uint8_t calculated_MAC[4] = { 0 };
-
-	//Get the key index (hash1)
-	uint8_t key_index[8] = {0};
-	hash1(item.csn, key_index);
-
-
-	/*
-	 * Determine which bytes to retrieve. A hash is typically
-	 * 01010000454501
-	 * We go through that hash, and in the corresponding keytable, we put markers
-	 * on what state that particular index is:
-	 * - CRACKED (this has already been cracked)
-	 * - BEING_CRACKED (this is being bruteforced now)
-	 * - CRACK_FAILED (self-explaining...)
-	 *
-	 * The markers are placed in the high area of the 16 bit key-table.
-	 * Only the lower eight bits correspond to the (hopefully cracked) key-value.
-	 **/
-	uint8_t bytes_to_recover[3] = {0};
-	uint8_t numbytes_to_recover = 0 ;
-	int i;
-	for(i =0 ; i < 8 ; i++)
-	{
-		if(keytable[key_index[i]] & (CRACKED | BEING_CRACKED)) continue;
-		bytes_to_recover[numbytes_to_recover++] = key_index[i];
-		keytable[key_index[i]] |= BEING_CRACKED;
-
-		if(numbytes_to_recover > 3)
-		{
-			prnlog("The CSN requires > 3 byte bruteforce, not supported");
-			printvar("CSN", item.csn,8);
-			printvar("HASH1", key_index,8);
-
-			//Before we exit, reset the 'BEING_CRACKED' to zero
-			keytable[bytes_to_recover[0]]  &= ~BEING_CRACKED;
-			keytable[bytes_to_recover[1]]  &= ~BEING_CRACKED;
-			keytable[bytes_to_recover[2]]  &= ~BEING_CRACKED;
-
-			return 1;
-		}
-	}
-
-	/*
-	 *A uint32 has room for 4 bytes, we'll only need 24 of those bits to bruteforce up to three bytes,
-	 */
-	uint32_t brute = startvalue;
-	/*
-	   Determine where to stop the bruteforce. A 1-byte attack stops after 256 tries,
-	   (when brute reaches 0x100). And so on...
-	   bytes_to_recover = 1 --> endmask = 0x0000100
-	   bytes_to_recover = 2 --> endmask = 0x0010000
-	   bytes_to_recover = 3 --> endmask = 0x1000000
-	*/
-
-	uint32_t endmask =  1 << 8*numbytes_to_recover;
-
-	for(i =0 ; i < numbytes_to_recover && numbytes_to_recover > 1; i++)
-		prnlog("Bruteforcing byte %d", bytes_to_recover[i]);
-
-	while(!found && !(brute & endmask))
-	{
-
-		//Update the keytable with the brute-values
-		for(i =0 ; i < numbytes_to_recover; i++)
-		{
-			keytable[bytes_to_recover[i]] &= 0xFF00;
-			keytable[bytes_to_recover[i]] |= (brute >> (i*8) & 0xFF);
-		}
-
-		// Piece together the key
-		key_sel[0] = keytable[key_index[0]] & 0xFF;key_sel[1] = keytable[key_index[1]] & 0xFF;
-		key_sel[2] = keytable[key_index[2]] & 0xFF;key_sel[3] = keytable[key_index[3]] & 0xFF;
-		key_sel[4] = keytable[key_index[4]] & 0xFF;key_sel[5] = keytable[key_index[5]] & 0xFF;
-		key_sel[6] = keytable[key_index[6]] & 0xFF;key_sel[7] = keytable[key_index[7]] & 0xFF;
-
-		//Permute from iclass format to standard format
-		permutekey_rev(key_sel,key_sel_p);
-		//Diversify
-		diversifyKey(item.csn, key_sel_p, div_key);
-		//Calc mac
-		doMAC(item.cc_nr, div_key,calculated_MAC);
-
-		if(memcmp(calculated_MAC, item.mac, 4) == 0)
-		{
-			for(i =0 ; i < numbytes_to_recover; i++)
-				prnlog("=> %d: 0x%02x", bytes_to_recover[i],0xFF & keytable[bytes_to_recover[i]]);
-			found = true;
-			break;
-		}
-		brute++;
-		if((brute & 0xFFFF) == 0)
-		{
-			printf("%d",(brute >> 16) & 0xFF);
-			fflush(stdout);
-		}
-	}
-	if(! found)
-	{
-		prnlog("Failed to recover %d bytes using the following CSN",numbytes_to_recover);
-		printvar("CSN",item.csn,8);
-		errors++;
-		//Before we exit, reset the 'BEING_CRACKED' to zero
-		for(i =0 ; i < numbytes_to_recover; i++)
-		{
-			keytable[bytes_to_recover[i]]  &= 0xFF;
-			keytable[bytes_to_recover[i]]  |= CRACK_FAILED;
-		}
-
-	}else
-	{
-		for(i =0 ; i < numbytes_to_recover; i++)
-		{
-			keytable[bytes_to_recover[i]]  &= 0xFF;
-			keytable[bytes_to_recover[i]]  |= CRACKED;
-		}
-
-	}
-	return errors;
-}
-
-
 /**
  * From dismantling iclass-paper:
  *	Assume that an adversary somehow learns the first 16 bytes of hash2(K_cus ), i.e., y [0] and z [0] .
@@ -501,6 +378,229 @@ int calculateMasterKey(uint8_t first16bytes[], uint64_t master_key[] )
 	}
 	return 0;
 }
+/*
+ * Parallel bruteforce of a dump.
+ *
+ * Every dump item becomes a job, which is split into chunks of
+ * CRACK_CHUNK_SIZE candidate values. Worker threads take chunks from the
+ * oldest job that still has some, so the up to 2^24 candidates of one item
+ * are searched by all threads. When a chunk finds the key, the job stops
+ * handing out chunks above it, but the chunks below it still run to the end.
+ * So the result is always the lowest matching candidate, like in a sequential
+ * search, no matter which thread was faster.
+ *
+ * The items are started in dump order. An item may only start when none of
+ * the bytes in its hash1 is being cracked by a running job, because it needs
+ * their values. Items whose bytes don't overlap run concurrently. This gives
+ * the same keytable as cracking the items one after the other.
+ */
+#define CRACK_CHUNK_SIZE	0x1000
+#define CRACK_NOT_FOUND		0xFFFFFFFF
+
+typedef struct crack_job {
+	dumpdata item;
+	uint8_t key_index[8];
+	uint8_t key_sel[8];		// key bytes, the bytes to recover are filled in per candidate
+	uint8_t bytes_to_recover[3];
+	uint8_t numbytes_to_recover;
+	int8_t brute_shift[8];	// where key_sel[i] comes from in the candidate value, -1 if known
+	uint32_t num_candidates;
+	uint32_t next_candidate;
+	uint32_t chunks_running;
+	volatile uint32_t found_value;	// lowest matching candidate so far, CRACK_NOT_FOUND if none
+	struct crack_job *next;
+} crack_job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work_available;	// workers wait for chunks
+	pthread_cond_t job_finished;	// the dispatcher waits for running jobs
+	crack_job_t *jobs;				// running jobs, oldest first
+	uint16_t *keytable;
+	int errors;
+	bool stop;
+} crack_engine_t;
+
+// tests count (at most ICLASS_MAC_LANES) candidates from first on. Returns the index of the right one or -1.
+static int testCandidates(crack_job_t *job, uint32_t first, uint32_t count)
+{
+	uint8_t key_sel[8];
+	uint8_t key_sel_p[8];
+	uint8_t div_keys[ICLASS_MAC_LANES][8];
+	uint8_t calculated_MACs[ICLASS_MAC_LANES][4];
+
+	for (uint32_t c = 0; c < count; c++) {
+		uint32_t brute = first + c;
+		for (int i = 0; i < 8; i++) {
+			key_sel[i] = job->brute_shift[i] < 0 ? job->key_sel[i] : brute >> job->brute_shift[i] & 0xFF;
+		}
+		//Permute from iclass format to standard format
+		permutekey_rev(key_sel, key_sel_p);
+		//Diversify
+		diversifyKey(job->item.csn, key_sel_p, div_keys[c]);
+	}
+	//Calc macs
+	iclass_mac_batch(job->item.cc_nr, div_keys, calculated_MACs, count);
+
+	for (uint32_t c = 0; c < count; c++) {
+		if (memcmp(calculated_MACs[c], job->item.mac, 4) == 0) return c;
+	}
+	return -1;
+}
+
+// called with the lock held, when the last chunk of a job returned
+static void finishJob(crack_engine_t *engine, crack_job_t *job)
+{
+	uint16_t *keytable = engine->keytable;
+	int i;
+
+	if (job->found_value != CRACK_NOT_FOUND) {
+		for (i = 0; i < job->numbytes_to_recover; i++) {
+			keytable[job->bytes_to_recover[i]] = CRACKED | (job->found_value >> (i*8) & 0xFF);
+			prnlog("=> %d: 0x%02x", job->bytes_to_recover[i], 0xFF & keytable[job->bytes_to_recover[i]]);
+		}
+	} else {
+		prnlog("Failed to recover %d bytes using the following CSN", job->numbytes_to_recover);
+		printvar("CSN", job->item.csn, 8);
+		engine->errors++;
+		for (i = 0; i < job->numbytes_to_recover; i++) {
+			keytable[job->bytes_to_recover[i]] &= 0xFF;
+			keytable[job->bytes_to_recover[i]] |= CRACK_FAILED;
+		}
+	}
+
+	crack_job_t **j = &engine->jobs;
+	while (*j != job) j = &(*j)->next;
+	*j = job->next;
+	free(job);
+	pthread_cond_broadcast(&engine->job_finished);
+}
+
+static void *crackWorker(void *arg)
+{
+	crack_engine_t *engine = (crack_engine_t *)arg;
+
+	pthread_mutex_lock(&engine->lock);
+	while (true) {
+		crack_job_t *job = engine->jobs;
+		while (job != NULL && (job->next_candidate >= job->num_candidates || job->next_candidate >= job->found_value)) {
+			job = job->next;
+		}
+		if (job == NULL) {
+			if (engine->stop) break;
+			pthread_cond_wait(&engine->work_available, &engine->lock);
+			continue;
+		}
+
+		uint32_t first = job->next_candidate;
+		uint32_t last = first + CRACK_CHUNK_SIZE;
+		if (last > job->num_candidates) last = job->num_candidates;
+		job->next_candidate = last;
+		job->chunks_running++;
+		pthread_mutex_unlock(&engine->lock);
+
+		uint32_t brute;
+		bool found = false;
+		// a lower match makes the rest of this chunk pointless
+		for (brute = first; brute < last && brute < job->found_value; brute += ICLASS_MAC_LANES) {
+			uint32_t count = last - brute < ICLASS_MAC_LANES ? last - brute : ICLASS_MAC_LANES;
+			int hit = testCandidates(job, brute, count);
+			if (hit >= 0) {
+				brute += hit;
+				found = true;
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&engine->lock);
+		if (found && brute < job->found_value) {
+			job->found_value = brute;
+		}
+		if (job->numbytes_to_recover == 3 && (last & 0xFFFF) == 0) {
+			printf("%d", (last >> 16) & 0xFF);
+			fflush(stdout);
+		}
+		job->chunks_running--;
+		if (job->chunks_running == 0 && (job->next_candidate >= job->num_candidates || job->next_candidate >= job->found_value)) {
+			finishJob(engine, job);
+		}
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	return NULL;
+}
+
+// true if one of the bytes used by this item is being cracked by a running job
+static bool needsRunningJob(crack_engine_t *engine, uint8_t key_index[8])
+{
+	for (int i = 0; i < 8; i++) {
+		if (engine->keytable[key_index[i]] & BEING_CRACKED) return true;
+	}
+	return false;
+}
+
+// called with the lock held. Sets up the job for an item, returns 1 if the item can't be cracked
+static int startJob(crack_engine_t *engine, dumpdata *item, uint8_t key_index[8])
+{
+	uint16_t *keytable = engine->keytable;
+	crack_job_t *job = calloc(1, sizeof(crack_job_t));
+	if (job == NULL) {
+		prnlog("Out of memory");
+		return 1;
+	}
+	memcpy(&job->item, item, sizeof(dumpdata));
+	memcpy(job->key_index, key_index, 8);
+
+	/*
+	 * Determine which bytes to retrieve. A hash is typically
+	 * 01010000454501
+	 * We go through that hash, and in the corresponding keytable, we put markers
+	 * on what state that particular index is:
+	 * - CRACKED (this has already been cracked)
+	 * - BEING_CRACKED (this is being bruteforced now)
+	 * - CRACK_FAILED (self-explaining...)
+	 *
+	 * The markers are placed in the high area of the 16 bit key-table.
+	 * Only the lower eight bits correspond to the (hopefully cracked) key-value.
+	 **/
+	for (int i = 0; i < 8; i++) {
+		job->key_sel[i] = keytable[key_index[i]] & 0xFF;
+		if (keytable[key_index[i]] & (CRACKED | BEING_CRACKED)) continue;
+		if (job->numbytes_to_recover == 3) {
+			prnlog("The CSN requires > 3 byte bruteforce, not supported");
+			printvar("CSN", item->csn, 8);
+			printvar("HASH1", key_index, 8);
+			for (int j = 0; j < 3; j++) {
+				keytable[job->bytes_to_recover[j]] &= ~BEING_CRACKED;
+			}
+			free(job);
+			return 1;
+		}
+		job->bytes_to_recover[job->numbytes_to_recover++] = key_index[i];
+		keytable[key_index[i]] |= BEING_CRACKED;
+	}
+
+	for (int i = 0; i < job->numbytes_to_recover && job->numbytes_to_recover > 1; i++)
+		prnlog("Bruteforcing byte %d", job->bytes_to_recover[i]);
+
+	for (int i = 0; i < 8; i++) {
+		job->brute_shift[i] = -1;
+		for (int j = 0; j < job->numbytes_to_recover; j++) {
+			if (key_index[i] == job->bytes_to_recover[j]) job->brute_shift[i] = j*8;
+		}
+	}
+
+	job->num_candidates = 1 << 8*job->numbytes_to_recover;
+	job->next_candidate = startvalue;
+	job->found_value = CRACK_NOT_FOUND;
+
+	crack_job_t **j = &engine->jobs;
+	while (*j != NULL) j = &(*j)->next;
+	*j = job;
+	pthread_cond_broadcast(&engine->work_available);
+	return 0;
+}
+
 /**
  * @brief Same as bruteforcefile, but uses a an array of dumpdata instead
  * @param dump
@@ -515,14 +615,57 @@ int bruteforceDump(uint8_t dump[], size_t dumpsize, uint16_t keytable[])
 	size_t itemsize = sizeof(dumpdata);
 	uint64_t t1 = msclock();
 
-	dumpdata* attack = (dumpdata* ) malloc(itemsize);
+	crack_engine_t engine;
+	pthread_mutex_init(&engine.lock, NULL);
+	pthread_cond_init(&engine.work_available, NULL);
+	pthread_cond_init(&engine.job_finished, NULL);
+	engine.jobs = NULL;
+	engine.keytable = keytable;
+	engine.errors = 0;
+	engine.stop = false;
+
+	int num_threads = num_CPUs();
+	int started = 0;
+	pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+	if (threads) {
+		for (; started < num_threads; started++) {
+			if (pthread_create(&threads[started], NULL, crackWorker, &engine)) break;
+		}
+	}
+	// without threads every job is cracked inline. The worker returns once it ran out of work.
+	bool serial = (started == 0);
+	if (serial) engine.stop = true;
 
-	for(i = 0 ; i * itemsize < dumpsize ; i++ )
+	dumpdata attack;
+	pthread_mutex_lock(&engine.lock);
+	for(i = 0 ; (i+1) * itemsize <= dumpsize ; i++ )
 	{
-		memcpy(attack,dump+i*itemsize, itemsize);
-		errors += bruteforceItem(*attack, keytable);
+		memcpy(&attack, dump+i*itemsize, itemsize);
+		uint8_t key_index[8];
+		hash1(attack.csn, key_index);
+		while (needsRunningJob(&engine, key_index)) {
+			pthread_cond_wait(&engine.job_finished, &engine.lock);
+		}
+		errors += startJob(&engine, &attack, key_index);
+		if (serial) {
+			pthread_mutex_unlock(&engine.lock);
+			crackWorker(&engine);
+			pthread_mutex_lock(&engine.lock);
+		}
 	}
-	free(attack);
+	engine.stop = true;
+	pthread_cond_broadcast(&engine.work_available);
+	pthread_mutex_unlock(&engine.lock);
+
+	for (int t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+	errors += engine.errors;
+	pthread_cond_destroy(&engine.job_finished);
+	pthread_cond_destroy(&engine.work_available);
+	pthread_mutex_destroy(&engine.lock);
+
 	t1 = msclock() - t1;
 	float diff = (float)t1 / 1000.0;
 	prnlog("\nPerformed full crack in %f seconds", diff);
@@ -88,18 +88,6 @@ typedef struct {
 
 }dumpdata;
 
-/**
- * @brief Performs brute force attack against a dump-data item, containing csn, cc_nr and mac.
- *This method calculates the hash1 for the CSN, and determines what bytes need to be bruteforced
- *on the fly. If it finds that more than three bytes need to be bruteforced, it aborts.
- *It updates the keytable with the findings, also using the upper half of the 16-bit ints
- *to signal if the particular byte has been cracked or not.
- *
- * @param dump The dumpdata from iclass reader attack.
- * @param keytable where to write found values.
- * @return
- */
-int bruteforceItem(dumpdata item, uint16_t keytable[]);
 /**
  * Hash1 takes CSN as input, and determines what bytes in the keytable will be used
  * when constructing the K_sel.
@@ -108,6 +96,13 @@ int bruteforceItem(dumpdata item, uint16_t keytable[]);
  */
 void hash1(uint8_t csn[] , uint8_t k[]);
 void hash2(uint8_t *key64, uint8_t *outp_keytable);
+/**
+ * Same as hash2, but silent and thread-safe. Used when calculating
+ * elite keys in bulk.
+ * @param key64 custom key, in iclass format
+ * @param outp_keytable output, 128 bytes
+ */
+void hash2_keytable(uint8_t *key64, uint8_t *outp_keytable);
 /**
  * From dismantling iclass-paper:
  *	Assume that an adversary somehow learns the first 16 bytes of hash2(K_cus ), i.e., y [0] and z [0] .
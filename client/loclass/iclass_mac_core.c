@@ -0,0 +1,158 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Table driven iClass reader MAC for many keys at once, for the host side
+// bruteforce.
+//
+// The cipher is the byte oriented version from armsrc/optimized_cipher.c.
+// The state of ICLASS_MAC_LANES keys is kept in separate arrays and all
+// keys are stepped together. The input bits are the same for every key, and
+// the only data dependent access is the lookup of the key byte selected by
+// select(), which becomes a gather on CPUs which have one. This file is
+// compiled for several instruction sets and the best one is chosen at runtime,
+// see hardnested_bitarray_core.c.
+//-----------------------------------------------------------------------------
+
+#include "iclass_mac_core.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// this needs to be compiled several times for each instruction set.
+// For each instruction set, define a dedicated function name:
+#if defined (__AVX512F__)
+#define ICLASS_MAC_BATCH iclass_mac_batch_AVX512
+#elif defined (__AVX2__)
+#define ICLASS_MAC_BATCH iclass_mac_batch_AVX2
+#elif defined (__AVX__)
+#define ICLASS_MAC_BATCH iclass_mac_batch_AVX
+#elif defined (__SSE2__)
+#define ICLASS_MAC_BATCH iclass_mac_batch_SSE2
+#elif defined (__MMX__)
+#define ICLASS_MAC_BATCH iclass_mac_batch_MMX
+#else
+#define ICLASS_MAC_BATCH iclass_mac_batch_NOSIMD
+#endif
+
+// typedefs and declaration of functions:
+typedef void iclass_mac_batch_t(const uint8_t[12], uint8_t[][8], uint8_t[][4], uint32_t);
+iclass_mac_batch_t iclass_mac_batch_AVX512, iclass_mac_batch_AVX2, iclass_mac_batch_AVX, iclass_mac_batch_SSE2, iclass_mac_batch_MMX, iclass_mac_batch_NOSIMD, iclass_mac_batch_dispatch;
+
+typedef struct {
+	uint32_t k[8][ICLASS_MAC_LANES];	// key bytes, k[i][lane]
+	uint32_t l[ICLASS_MAC_LANES];
+	uint32_t r[ICLASS_MAC_LANES];
+	uint32_t b[ICLASS_MAC_LANES];
+	uint32_t t[ICLASS_MAC_LANES];
+} lanes_t;
+
+// one successor step of all lanes with input bit y, see opt_successor()
+static inline void step(lanes_t *restrict s, uint32_t y)
+{
+	for (int i = 0; i < ICLASS_MAC_LANES; i++) {
+		uint32_t t = s->t[i];
+		uint32_t b = s->b[i];
+		uint32_t r = s->r[i];
+
+		uint32_t Tt = 1 & ((t >> 15) ^ (t >> 14) ^ (t >> 10) ^ (t >> 8) ^ (t >> 5) ^ (t >> 4) ^ (t >> 1) ^ t);
+		uint32_t Bb = 1 & ((b >> 6) ^ (b >> 5) ^ (b >> 4) ^ b);
+
+		t = (t >> 1) | ((Tt ^ (r >> 7 & 0x1) ^ (r >> 3 & 0x1)) << 15);
+		b = (b >> 1) | ((Bb ^ (r & 0x1)) << 7);
+
+		uint32_t z = (4 & (((r & (r << 2)) >> 5) ^ ((r & ~(r << 2)) >> 4) ^ ((r | r << 2) >> 3)))
+				   | (2 & (((r | r << 2) >> 6) ^ ((r | r << 2) >> 1) ^ (r >> 5) ^ r ^ ((Tt ^ y) << 1)))
+				   | (1 & (((r & ~(r << 2)) >> 4) ^ ((r & (r << 2)) >> 3) ^ r ^ Tt));
+
+		uint32_t r_new = ((s->k[z][i] ^ b) + s->l[i]) & 0xFF;
+		s->l[i] = (r_new + r) & 0xFF;
+		s->r[i] = r_new;
+		s->t[i] = t;
+		s->b[i] = b;
+	}
+}
+
+void ICLASS_MAC_BATCH(const uint8_t cc_nr[12], uint8_t div_keys[][8], uint8_t macs[][4], uint32_t n)
+{
+	lanes_t s;
+
+	for (uint32_t base = 0; base < n; base += ICLASS_MAC_LANES) {
+		uint32_t count = n - base < ICLASS_MAC_LANES ? n - base : ICLASS_MAC_LANES;
+
+		for (uint32_t i = 0; i < ICLASS_MAC_LANES; i++) {
+			// unused lanes compute the first key once more
+			const uint8_t *key = div_keys[base + (i < count ? i : 0)];
+			for (int j = 0; j < 8; j++) {
+				s.k[j][i] = key[j];
+			}
+			s.l[i] = ((key[0] ^ 0x4c) + 0xEC) & 0xFF;
+			s.r[i] = ((key[0] ^ 0x4c) + 0x21) & 0xFF;
+			s.b[i] = 0x4c;
+			s.t[i] = 0xE012;
+		}
+
+		// the cipher takes the bits of each byte lsb first
+		for (int i = 0; i < 12; i++) {
+			for (int j = 0; j < 8; j++) {
+				step(&s, (cc_nr[i] >> j) & 1);
+			}
+		}
+
+		// output bit j of each MAC byte is bit 2 of r before step j
+		uint32_t mac[4][ICLASS_MAC_LANES];
+		for (int i = 0; i < 4; i++) {
+			for (int lane = 0; lane < ICLASS_MAC_LANES; lane++) mac[i][lane] = 0;
+			for (int j = 0; j < 8; j++) {
+				for (int lane = 0; lane < ICLASS_MAC_LANES; lane++) {
+					mac[i][lane] |= ((s.r[lane] >> 2) & 1) << j;
+				}
+				step(&s, 0);
+			}
+		}
+
+		for (uint32_t lane = 0; lane < count; lane++) {
+			for (int i = 0; i < 4; i++) {
+				macs[base + lane][i] = mac[i][lane];
+			}
+		}
+	}
+}
+
+
+#ifndef __MMX__
+
+// pointers to functions:
+iclass_mac_batch_t *iclass_mac_batch_function_p = &iclass_mac_batch_dispatch;
+
+// determine the available instruction set at runtime and call the correct function
+void iclass_mac_batch_dispatch(const uint8_t cc_nr[12], uint8_t div_keys[][8], uint8_t macs[][4], uint32_t n) {
+#if defined (__i386__) || defined (__x86_64__)
+	#if !defined(__APPLE__) || (defined(__APPLE__) && (__clang_major__ > 8))
+		#if (__GNUC__ >= 5) && (__GNUC__ > 5 || __GNUC_MINOR__ > 2)
+	if (__builtin_cpu_supports("avx512f")) iclass_mac_batch_function_p = &iclass_mac_batch_AVX512;
+	else if (__builtin_cpu_supports("avx2")) iclass_mac_batch_function_p = &iclass_mac_batch_AVX2;
+		#else
+	if (__builtin_cpu_supports("avx2")) iclass_mac_batch_function_p = &iclass_mac_batch_AVX2;
+		#endif
+	else if (__builtin_cpu_supports("avx")) iclass_mac_batch_function_p = &iclass_mac_batch_AVX;
+	else if (__builtin_cpu_supports("sse2")) iclass_mac_batch_function_p = &iclass_mac_batch_SSE2;
+	else if (__builtin_cpu_supports("mmx")) iclass_mac_batch_function_p = &iclass_mac_batch_MMX;
+	else
+	#endif
+#endif
+		iclass_mac_batch_function_p = &iclass_mac_batch_NOSIMD;
+
+	// call the most optimized function for this CPU
+	(*iclass_mac_batch_function_p)(cc_nr, div_keys, macs, n);
+}
+
+///////////////////////////////////////////////
+// Entries to dispatched function calls
+
+void iclass_mac_batch(const uint8_t cc_nr[12], uint8_t div_keys[][8], uint8_t macs[][4], uint32_t n) {
+	(*iclass_mac_batch_function_p)(cc_nr, div_keys, macs, n);
+}
+
+#endif
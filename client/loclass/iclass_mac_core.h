@@ -0,0 +1,21 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Table driven iClass reader MAC for many keys at once, for the host side
+// bruteforce. Gives the same results as doMAC() in cipher.c.
+//-----------------------------------------------------------------------------
+
+#ifndef ICLASS_MAC_CORE_H__
+#define ICLASS_MAC_CORE_H__
+
+#include <stdint.h>
+
+// number of keys processed side by side. Batches should be a multiple of this.
+#define ICLASS_MAC_LANES 16
+
+// calculates the reader MAC over cc_nr (8 byte CC, 4 byte NR) for n diversified keys
+extern void iclass_mac_batch(const uint8_t cc_nr[12], uint8_t div_keys[][8], uint8_t macs[][4], uint32_t n);
+
+#endif
@@ -393,13 +393,16 @@ void hash0(uint64_t c, uint8_t k[8])
 void diversifyKey(uint8_t csn[8], uint8_t key[8], uint8_t div_key[8])
 {
 
+	// Local context, the elite bruteforce calls this from several threads
+	des_context ctx = {DES_ENCRYPT,{0}};
+
 	// Prepare the DES key
-	des_setkey_enc( &ctx_enc, key);
+	des_setkey_enc( &ctx, key);
 
 	uint8_t crypted_csn[8] = {0};
 
 	// Calculate DES(CSN, KEY)
-	des_crypt_ecb(&ctx_enc,csn, crypted_csn);
+	des_crypt_ecb(&ctx,csn, crypted_csn);
 
 	//Calculate HASH0(DES))
     uint64_t crypt_csn = x_bytes_to_num(crypted_csn, 8);
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <pthread.h>
 
 #include "crapto1/crapto1.h"
@@ -72,12 +73,75 @@ static uint32_t intersection(uint64_t *list1, uint64_t *list2)
 }
 
 
+// LSD radix sort of a list by the bytes selected in mask, using buf of the same size as temporary storage.
+// Bytes which are the same for all elements are skipped.
+static void radix_sort_uint64(uint64_t *list, uint64_t *buf, uint32_t len, uint64_t mask, bool descending)
+{
+	uint64_t *src = list;
+	uint64_t *dst = buf;
+
+	for (uint8_t byte = 0; byte < 8; byte++) {
+		uint8_t shift = byte * 8;
+		if (((mask >> shift) & 0xff) == 0) continue;
+		uint32_t count[0x100] = {0};
+		for (uint32_t i = 0; i < len; i++) {
+			count[(src[i] & mask) >> shift & 0xff]++;
+		}
+		if (count[(src[0] & mask) >> shift & 0xff] == len) continue;	// nothing to sort
+		uint32_t pos[0x100];
+		uint32_t sum = 0;
+		for (uint16_t j = 0; j < 0x100; j++) {
+			uint8_t bucket = descending ? 0xff - j : j;
+			pos[bucket] = sum;
+			sum += count[bucket];
+		}
+		for (uint32_t i = 0; i < len; i++) {
+			dst[pos[(src[i] & mask) >> shift & 0xff]++] = src[i];
+		}
+		uint64_t *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if (src != list) {
+		memcpy(list, src, len * sizeof(uint64_t));
+	}
+}
+
+
 // Darkside attack (hf mf mifare)
+
+// states are rolled back and converted to keys by several threads if there are at least this many per thread
+#define DARKSIDE_MIN_STATES_PER_THREAD	0x4000
+
+typedef struct {
+	struct Crypto1State *states;
+	uint32_t start;
+	uint32_t end;
+	uint32_t uid_nt;
+} darkside_convert_t;
+
+
+static void *darkside_convert_thread(void *arg)
+{
+	darkside_convert_t *job = arg;
+	uint64_t *keylist = (uint64_t*)job->states;
+	uint64_t key_recovered;
+
+	for (uint32_t i = job->start; i < job->end; i++) {
+		lfsr_rollback_word(job->states+i, job->uid_nt, 0);
+		crypto1_get_lfsr(job->states+i, &key_recovered);
+		keylist[i] = key_recovered;
+	}
+
+	return NULL;
+}
+
+
 static uint32_t nonce2key(uint32_t uid, uint32_t nt, uint32_t nr, uint64_t par_info, uint64_t ks_info, uint64_t **keys) {
 	struct Crypto1State *states;
 	uint32_t i, pos, rr; //nr_diff;
 	uint8_t bt, ks3x[8], par[8][8];
-	uint64_t key_recovered;
 	static uint64_t *keylist;
 	rr = 0;
 
@@ -100,16 +164,30 @@ static uint32_t nonce2key(uint32_t uid, uint32_t nt, uint32_t nr, uint64_t par_i
 	}
 
 	keylist = (uint64_t*)states;
-
-	for (i = 0; keylist[i]; i++) {
-		lfsr_rollback_word(states+i, uid^nt, 0);
-		crypto1_get_lfsr(states+i, &key_recovered);
-		keylist[i] = key_recovered;
+	uint32_t num_states;
+	for (num_states = 0; keylist[num_states]; num_states++);
+
+	// the conversion is independent for each state. Split it between the CPUs.
+	uint32_t num_threads = num_CPUs();
+	if (num_threads > num_states / DARKSIDE_MIN_STATES_PER_THREAD) num_threads = num_states / DARKSIDE_MIN_STATES_PER_THREAD;
+	if (num_threads < 1) num_threads = 1;
+	pthread_t thread_id[num_threads];
+	darkside_convert_t jobs[num_threads];
+	for (i = 0; i < num_threads; i++) {
+		jobs[i].states = states;
+		jobs[i].start = (uint64_t)num_states * i / num_threads;
+		jobs[i].end = (uint64_t)num_states * (i+1) / num_threads;
+		jobs[i].uid_nt = uid^nt;
+		if (i > 0) pthread_create(&thread_id[i], NULL, darkside_convert_thread, &jobs[i]);
 	}
-	keylist[i] = -1;
+	darkside_convert_thread(&jobs[0]);
+	for (i = 1; i < num_threads; i++) {
+		pthread_join(thread_id[i], NULL);
+	}
+	keylist[num_states] = -1;
 
 	*keys = keylist;
-	return i;
+	return num_states;
 }
 
 
@@ -178,7 +256,16 @@ int mfDarkside(uint64_t *key)
 			continue;
 		}
 
-		qsort(keylist, keycount, sizeof(*keylist), compare_uint64);
+		// keys are 48 bits. The two upper bytes are skipped by the radix sort.
+		uint64_t *sort_buf = malloc(keycount * sizeof(uint64_t));
+		if (sort_buf == NULL) {
+			PrintAndLog("Out of memory error in mfDarkside().");
+			free(keylist);
+			free(last_keylist);
+			return -6;
+		}
+		radix_sort_uint64(keylist, sort_buf, keycount, 0x0000ffffffffffff, false);
+		free(sort_buf);
 		keycount = intersection(last_keylist, keylist);
 		if (keycount == 0) {
 			free(last_keylist);
@@ -199,9 +286,9 @@ int mfDarkside(uint64_t *key)
 			int size = keycount - i > max_keys ? max_keys : keycount - i;
 			for (int j = 0; j < size; j++) {
 				if (last_keylist == NULL) {
-					num_to_bytes(keylist[i*max_keys + j], 6, keyBlock);
+					num_to_bytes(keylist[i + j], 6, keyBlock + j * 6);
 				} else {
-					num_to_bytes(last_keylist[i*max_keys + j], 6, keyBlock);
+					num_to_bytes(last_keylist[i + j], 6, keyBlock + j * 6);
 				}
 			}
 			if (!mfCheckKeys(0, 0, false, size, keyBlock, key)) {
@@ -230,10 +317,10 @@ int mfCheckKeys (uint8_t blockNo, uint8_t keyType, bool clear_trace, uint8_t key
 
 	UsbCommand c = {CMD_MIFARE_CHKKEYS, {((blockNo & 0xff) | ((keyType&0xff)<<8)), clear_trace, keycnt}};
 	memcpy(c.d.asBytes, keyBlock, 6 * keycnt);
-	SendCommand(&c);
+	uint32_t seq = SendCommandTracked(&c, CMD_ACK);
 
 	UsbCommand resp;
-	if (!WaitForResponseTimeout(CMD_ACK,&resp,3000)) return 1;
+	if (!WaitForTrackedResponse(seq, &resp, 3000)) return 1;
 	if ((resp.arg[0] & 0xff) != 0x01) return 2;
 	*key = bytes_to_num(resp.d.asBytes, 6);
 	return 0;
@@ -262,33 +349,48 @@ typedef
 		uint32_t keyType;
 		uint32_t nt;
 		uint32_t ks1;
+		struct Crypto1Arena *arena;
 	} StateList_t;
 
 
+// The tables for lfsr_recovery32() are allocated once per attack and reused for all of its targets.
+// The sort buffer of the arena is also used to radix sort the resulting state list.
+static struct Crypto1Arena nested_arenas[2];
+static bool nested_arenas_initialized = false;
+
+
+static void nested_free_arenas(void)
+{
+	if (nested_arenas_initialized) {
+		crypto1_arena_free(&nested_arenas[0]);
+		crypto1_arena_free(&nested_arenas[1]);
+		nested_arenas_initialized = false;
+	}
+}
+
+
 // wrapper function for multi-threaded lfsr_recovery32
 void* nested_worker_thread(void *arg)
 {
 	struct Crypto1State *p1;
 	StateList_t *statelist = arg;
 
-	statelist->head.slhead = lfsr_recovery32(statelist->ks1, statelist->nt ^ statelist->uid);
+	statelist->head.slhead = lfsr_recovery32_arena(statelist->ks1, statelist->nt ^ statelist->uid, statelist->arena);
 	for (p1 = statelist->head.slhead; *(uint64_t *)p1 != 0; p1++);
 	statelist->len = p1 - statelist->head.slhead;
 	statelist->tail.sltail = --p1;
-	qsort(statelist->head.slhead, statelist->len, sizeof(uint64_t), Compare16Bits);
+	// same order as qsort(..., Compare16Bits)
+	radix_sort_uint64(statelist->head.keyhead, (uint64_t *)statelist->arena->sort_buf, statelist->len, 0x00ff000000ff0000, true);
 
 	return statelist->head.slhead;
 }
 
-int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t *resultKey, bool calibrate)
+// get the nonces for a nested attack on the target block from the Proxmark
+static int nested_acquire(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, bool calibrate, StateList_t *statelists)
 {
-	uint16_t i;
 	uint32_t uid;
 	UsbCommand resp;
 
-	StateList_t statelists[2];
-	struct Crypto1State *p1, *p2, *p3, *p4;
-
 	// flush queue
 	WaitForResponseTimeout(CMD_ACK, NULL, 100);
 
@@ -307,7 +409,7 @@ int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo,
 	memcpy(&uid, resp.d.asBytes, 4);
 	PrintAndLog("uid:%08x trgbl=%d trgkey=%x", uid, (uint16_t)resp.arg[2] & 0xff, (uint16_t)resp.arg[2] >> 8);
 
-	for (i = 0; i < 2; i++) {
+	for (uint16_t i = 0; i < 2; i++) {
 		statelists[i].blockNo = resp.arg[2] & 0xff;
 		statelists[i].keyType = (resp.arg[2] >> 8) & 0xff;
 		statelists[i].uid = uid;
@@ -315,6 +417,29 @@ int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo,
 		memcpy(&statelists[i].ks1, (void *)(resp.d.asBytes + 4 + i * 8 + 4), 4);
 	}
 
+	return 0;
+}
+
+
+// calculate the possible keys from the nonces of a nested attack. Returns the number of key candidates.
+static int32_t nested_recover(StateList_t *statelists, uint64_t **candidates)
+{
+	uint16_t i;
+	struct Crypto1State *p1, *p2, *p3, *p4;
+
+	if (!nested_arenas_initialized) {
+		if (!crypto1_arena_init(&nested_arenas[0]) || !crypto1_arena_init(&nested_arenas[1])) {
+			crypto1_arena_free(&nested_arenas[0]);
+			PrintAndLog("Out of memory error in mfnested().");
+			return -4;
+		}
+		nested_arenas_initialized = true;
+	}
+
+	for (i = 0; i < 2; i++) {
+		statelists[i].arena = &nested_arenas[i];
+	}
+
 	// calc keys
 
 	pthread_t thread_id[2];
@@ -367,30 +492,252 @@ int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo,
 
 	// the statelists now contain possible keys. The key we are searching for must be in the
 	// intersection of both lists. Create the intersection:
-	qsort(statelists[0].head.keyhead, statelists[0].len, sizeof(uint64_t), compare_uint64);
-	qsort(statelists[1].head.keyhead, statelists[1].len, sizeof(uint64_t), compare_uint64);
+	radix_sort_uint64(statelists[0].head.keyhead, (uint64_t *)nested_arenas[0].sort_buf, statelists[0].len, 0xffffffffffffffff, false);
+	radix_sort_uint64(statelists[1].head.keyhead, (uint64_t *)nested_arenas[1].sort_buf, statelists[1].len, 0xffffffffffffffff, false);
 	statelists[0].len = intersection(statelists[0].head.keyhead, statelists[1].head.keyhead);
 
-	memset(resultKey, 0, 6);
-	// The list may still contain several key candidates. Test each of them with mfCheckKeys
+	// the arenas are reused by the next call. Keep a copy of the candidate keys.
+	*candidates = malloc((statelists[0].len + 1) * sizeof(uint64_t));
+	if (*candidates == NULL) {
+		PrintAndLog("Out of memory error in mfnested().");
+		return -4;
+	}
 	for (i = 0; i < statelists[0].len; i++) {
-		uint8_t keyBlock[6];
-		uint64_t key64;
-		crypto1_get_lfsr(statelists[0].head.slhead + i, &key64);
-		num_to_bytes(key64, 6, keyBlock);
-		key64 = 0;
-		if (!mfCheckKeys(statelists[0].blockNo, statelists[0].keyType, false, 1, keyBlock, &key64)) {
+		crypto1_get_lfsr(statelists[0].head.slhead + i, &(*candidates)[i]);
+	}
+
+	return statelists[0].len;
+}
+
+
+// test the key candidates with mfCheckKeys. Returns true if the key was found.
+static bool nested_check_candidates(uint8_t blockNo, uint8_t keyType, uint64_t *candidates, uint32_t num_candidates, uint8_t *resultKey)
+{
+	uint8_t keyBlock[USB_CMD_DATA_SIZE];
+	uint32_t max_keys = USB_CMD_DATA_SIZE/6;
+
+	memset(resultKey, 0, 6);
+	for (uint32_t i = 0; i < num_candidates; i += max_keys) {
+		uint32_t size = num_candidates - i > max_keys ? max_keys : num_candidates - i;
+		for (uint32_t j = 0; j < size; j++) {
+			num_to_bytes(candidates[i + j], 6, keyBlock + j * 6);
+		}
+		uint64_t key64 = 0;
+		if (!mfCheckKeys(blockNo, keyType, false, size, keyBlock, &key64)) {
 			num_to_bytes(key64, 6, resultKey);
-			break;
+			return true;
 		}
 	}
 
-	free(statelists[0].head.slhead);
-	free(statelists[1].head.slhead);
+	return false;
+}
+
+
+int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t *resultKey, bool calibrate)
+{
+	StateList_t statelists[2];
+	uint64_t *candidates;
+
+	int res = nested_acquire(blockNo, keyType, key, trgBlockNo, trgKeyType, calibrate, statelists);
+	if (res) {
+		return res;
+	}
+
+	int32_t num_candidates = nested_recover(statelists, &candidates);
+	nested_free_arenas();
+	if (num_candidates < 0) {
+		return num_candidates;
+	}
+
+	// The list may still contain several key candidates. Test them with mfCheckKeys
+	nested_check_candidates(statelists[0].blockNo, statelists[0].keyType, candidates, num_candidates, resultKey);
+	free(candidates);
 
 	return 0;
 }
 
+
+// Pipelined nested attack on several targets. The Proxmark acquires the nonces for the next
+// targets while a recovery thread calculates the key candidates of the previous ones. The
+// candidates are checked by the main thread as soon as they are ready, because all
+// communication with the Proxmark is done by the main thread. Targets which fail are queued
+// again until they have been tried max_attempts times.
+
+typedef struct nested_job {
+	StateList_t statelists[2];
+	nested_target_t *target;
+	uint64_t *candidates;
+	int32_t num_candidates;
+	struct nested_job *next;
+} nested_job_t;
+
+typedef struct {
+	nested_job_t *head;
+	nested_job_t *tail;
+} nested_queue_t;
+
+static pthread_mutex_t nested_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nested_queue_cond = PTHREAD_COND_INITIALIZER;
+static nested_queue_t nested_todo;
+static nested_queue_t nested_done;
+static bool nested_stop;
+
+
+static void nested_queue_put(nested_queue_t *queue, nested_job_t *job)
+{
+	job->next = NULL;
+	if (queue->tail) {
+		queue->tail->next = job;
+	} else {
+		queue->head = job;
+	}
+	queue->tail = job;
+}
+
+
+static nested_job_t *nested_queue_get(nested_queue_t *queue)
+{
+	nested_job_t *job = queue->head;
+	if (job) {
+		queue->head = job->next;
+		if (queue->head == NULL) queue->tail = NULL;
+	}
+	return job;
+}
+
+
+static void *nested_recovery_thread(void *arg)
+{
+	pthread_mutex_lock(&nested_queue_lock);
+	while (true) {
+		nested_job_t *job = nested_queue_get(&nested_todo);
+		if (job == NULL) {
+			if (nested_stop) break;
+			pthread_cond_wait(&nested_queue_cond, &nested_queue_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&nested_queue_lock);
+		job->num_candidates = nested_recover(job->statelists, &job->candidates);
+		pthread_mutex_lock(&nested_queue_lock);
+		nested_queue_put(&nested_done, job);
+		pthread_cond_broadcast(&nested_queue_cond);
+	}
+	pthread_mutex_unlock(&nested_queue_lock);
+
+	return NULL;
+}
+
+
+static void nested_free_queue(nested_queue_t *queue)
+{
+	nested_job_t *job;
+	while ((job = nested_queue_get(queue)) != NULL) {
+		free(job->candidates);
+		free(job);
+	}
+}
+
+
+int mfnested_pipelined(uint8_t blockNo, uint8_t keyType, uint8_t *key, nested_target_t *targets, uint32_t num_targets, uint8_t max_attempts)
+{
+	int res = 0;
+	bool calibrate = true;
+	uint32_t next_target = 0;
+	uint32_t jobs_in_flight = 0;
+	pthread_t recovery_thread;
+
+	nested_todo.head = nested_todo.tail = NULL;
+	nested_done.head = nested_done.tail = NULL;
+	nested_stop = false;
+	pthread_create(&recovery_thread, NULL, nested_recovery_thread, NULL);
+
+	while (true) {
+		// check the key candidates which are ready. The Proxmark is idle in the meantime.
+		pthread_mutex_lock(&nested_queue_lock);
+		nested_job_t *job = nested_queue_get(&nested_done);
+		pthread_mutex_unlock(&nested_queue_lock);
+		if (job != NULL) {
+			jobs_in_flight--;
+			nested_target_t *target = job->target;
+			if (job->num_candidates < 0) {
+				res = job->num_candidates;
+				free(job);
+				break;
+			}
+			uint8_t resultKey[6];
+			PrintAndLog("-----------------------------------------------");
+			PrintAndLog("trgbl=%d trgkey=%x: testing %d key candidates", target->blockNo, target->keyType, job->num_candidates);
+			if (nested_check_candidates(job->statelists[0].blockNo, job->statelists[0].keyType, job->candidates, job->num_candidates, resultKey)) {
+				target->key = bytes_to_num(resultKey, 6);
+				target->found = true;
+				PrintAndLog("Found valid key:%012" PRIx64, target->key);
+			}
+			target->pending = false;
+			free(job->candidates);
+			free(job);
+			continue;
+		}
+
+		// find the next target which still needs nonces. Failed targets are retried after all others.
+		nested_target_t *target = NULL;
+		for (uint32_t i = 0; i < num_targets && target == NULL; i++) {
+			nested_target_t *t = &targets[(next_target + i) % num_targets];
+			if (!t->found && !t->pending && t->attempts < max_attempts) {
+				target = t;
+				next_target = (t - targets + 1) % num_targets;
+			}
+		}
+
+		if (target != NULL) {
+			job = calloc(1, sizeof(nested_job_t));
+			if (job == NULL) {
+				PrintAndLog("Out of memory error in mfnested_pipelined().");
+				res = -4;
+				break;
+			}
+			PrintAndLog("-----------------------------------------------");
+			res = nested_acquire(blockNo, keyType, key, target->blockNo, target->keyType, calibrate, job->statelists);
+			if (res) {
+				free(job);
+				break;
+			}
+			calibrate = false;
+			target->attempts++;
+			target->pending = true;
+			job->target = target;
+			jobs_in_flight++;
+			pthread_mutex_lock(&nested_queue_lock);
+			nested_queue_put(&nested_todo, job);
+			pthread_cond_broadcast(&nested_queue_cond);
+			pthread_mutex_unlock(&nested_queue_lock);
+		} else if (jobs_in_flight > 0) {
+			// nothing left to acquire. Wait for the recovery thread.
+			pthread_mutex_lock(&nested_queue_lock);
+			while (nested_done.head == NULL) {
+				pthread_cond_wait(&nested_queue_cond, &nested_queue_lock);
+			}
+			pthread_mutex_unlock(&nested_queue_lock);
+		} else {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&nested_queue_lock);
+	nested_free_queue(&nested_todo);
+	nested_stop = true;
+	pthread_cond_broadcast(&nested_queue_cond);
+	pthread_mutex_unlock(&nested_queue_lock);
+	pthread_join(recovery_thread, NULL);
+	nested_free_queue(&nested_done);
+	nested_free_arenas();
+
+	for (uint32_t i = 0; i < num_targets; i++) {
+		targets[i].pending = false;
+	}
+
+	return res;
+}
+
 // EMULATOR
 
 int mfEmlGetMem(uint8_t *data, int blockNum, int blocksCount) {
@@ -24,10 +24,21 @@
 #define CSETBLOCK_SINGLE_OPER			0x1F
 #define CSETBLOCK_MAGIC_1B 			0x40
 
+// target of a pipelined nested attack
+typedef struct {
+	uint8_t blockNo;
+	uint8_t keyType;
+	uint8_t attempts;
+	bool pending;
+	bool found;
+	uint64_t key;
+} nested_target_t;
+
 extern char logHexFileName[FILE_PATH_SIZE];
 
 extern int mfDarkside(uint64_t *key);
 extern int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t *key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t *ResultKeys, bool calibrate);
+extern int mfnested_pipelined(uint8_t blockNo, uint8_t keyType, uint8_t *key, nested_target_t *targets, uint32_t num_targets, uint8_t max_attempts);
 extern int mfCheckKeys (uint8_t blockNo, uint8_t keyType, bool clear_trace, uint8_t keycnt, uint8_t *keyBlock, uint64_t *key);
 
 extern int mfEmlGetMem(uint8_t *data, int blockNum, int blocksCount);
@@ -252,6 +252,15 @@ int Plot::xCoordOf(int i, QRect r )
 	return r.left() + (int)((i - GraphStart)*GraphPixelsPerPoint);
 }
 
+// first sample at or right of pixel offset px from the left of the plot
+int Plot::sampleOfXOffset(int px)
+{
+	int i = GraphStart + (int)ceil(px / GraphPixelsPerPoint);
+	while (i > GraphStart && (int)((i - 1 - GraphStart)*GraphPixelsPerPoint) >= px) i--;
+	while ((int)((i - GraphStart)*GraphPixelsPerPoint) < px) i++;
+	return i;
+}
+
 int Plot::yCoordOf(int v, QRect r, int maxVal)
 {
 	int z = (r.bottom() - r.top())/2;
@@ -278,7 +287,7 @@ QColor Plot::getColor(int graphNum)
 	}
 }
 
-void Plot::setMaxAndStart(int *buffer, int len, QRect plotRect)
+void Plot::setMaxAndStart(const MinMaxPyramid<int> &lod, int len, QRect plotRect)
 {
 	if (len == 0) return;
 	startMax = (len - (int)((plotRect.right() - plotRect.left() - 40) / GraphPixelsPerPoint));
@@ -288,15 +297,11 @@ void Plot::setMaxAndStart(int *buffer, int len, QRect plotRect)
 	if(GraphStart > startMax) {
 		GraphStart = startMax;
 	}
-	if (GraphStart > len) return;
-	int vMin = INT_MAX, vMax = INT_MIN, v = 0;
-	int sample_index = GraphStart ;
-	for( ; sample_index < len && xCoordOf(sample_index,plotRect) < plotRect.right() ; sample_index++) {
-
-		v = buffer[sample_index];
-		if(v < vMin) vMin = v;
-		if(v > vMax) vMax = v;
-	}
+	if (GraphStart >= len) return;
+	int end = sampleOfXOffset(plotRect.right() - plotRect.left());
+	if (end > len) end = len;
+	MinMaxPyramid<int>::Node n = lod.query(GraphStart, end);
+	int vMin = n.min, vMax = n.max;
 
 	g_absVMax = 0;
 	if(fabs( (double) vMin) > g_absVMax) g_absVMax = (int)fabs( (double) vMin);
@@ -304,7 +309,7 @@ void Plot::setMaxAndStart(int *buffer, int len, QRect plotRect)
 	g_absVMax = (int)(g_absVMax*1.25 + 1);
 }
 
-void Plot::PlotDemod(uint8_t *buffer, size_t len, QRect plotRect, QRect annotationRect, QPainter *painter, int graphNum, int plotOffset)
+void Plot::PlotDemod(uint8_t *buffer, size_t len, const MinMaxPyramid<uint8_t> &lod, QRect plotRect, QRect annotationRect, QPainter *painter, int graphNum, int plotOffset)
 {
 	if (len == 0 || PlotGridX <= 0) return;
 	//clock_t begin = clock();
@@ -331,6 +336,49 @@ void Plot::PlotDemod(uint8_t *buffer, size_t len, QRect plotRect, QRect annotati
 	int x = xCoordOf(DemodStart, plotRect);
 	int y = yCoordOf((buffer[BitStart]*200-100)*-1,plotRect,absVMax);
 	penPath.moveTo(x, y);
+
+	if (GraphPixelsPerPoint < 1) {
+		// more than one sample per pixel column, draw min and max of the bits in each column
+		// bit b covers the samples [plotOffset + b*PlotGridX, plotOffset + (b+1)*PlotGridX)
+		int end = plotOffset + (int)len * PlotGridX;
+		int visibleEnd = sampleOfXOffset(plotRect.right() - plotRect.left());
+		if (end > visibleEnd) end = visibleEnd;
+		int s0 = DemodStart;
+		for (int px = x - plotRect.left(); s0 < end; px++) {
+			int s1 = sampleOfXOffset(px + 1);
+			if (s1 > end) s1 = end;
+			if (s1 <= s0) continue;
+			MinMaxPyramid<uint8_t>::Node n = lod.query((s0 - plotOffset) / PlotGridX, (s1 - 1 - plotOffset) / PlotGridX + 1);
+			int yMin = yCoordOf(n.min*200-100, plotRect, absVMax);
+			int yMax = yCoordOf(n.max*200-100, plotRect, absVMax);
+			x = plotRect.left() + px;
+			if (abs(y - yMin) < abs(y - yMax)) {
+				penPath.lineTo(x, yMin);
+				penPath.lineTo(x, yMax);
+				y = yMax;
+			} else {
+				penPath.lineTo(x, yMax);
+				penPath.lineTo(x, yMin);
+				y = yMin;
+			}
+			s0 = s1;
+		}
+		// labels only as long as they don't overlap
+		if (PlotGridX * GraphPixelsPerPoint >= 8) {
+			for (int i = BitStart; i < (int)len; i++) {
+				int s = plotOffset + i * PlotGridX + PlotGridX / 2;
+				if (s < DemodStart) continue;
+				if (s >= end) break;
+				x = xCoordOf(s, plotRect);
+				y = yCoordOf(buffer[i]*200-100, plotRect, absVMax);
+				sprintf(str, "%u",buffer[i]);
+				painter->drawText(x-8, y + ((buffer[i] > 0) ? 18 : -6), str);
+			}
+		}
+		painter->drawPath(penPath);
+		return;
+	}
+
 	delta_x = 0;
 	int clk = first_delta_x;
 	for(int i = BitStart; i < (int)len && xCoordOf(delta_x+DemodStart, plotRect) < plotRect.right(); i++) {
@@ -360,34 +408,65 @@ void Plot::PlotDemod(uint8_t *buffer, size_t len, QRect plotRect, QRect annotati
 	painter->drawPath(penPath);
 }
 
-void Plot::PlotGraph(int *buffer, int len, QRect plotRect, QRect annotationRect, QPainter *painter, int graphNum)
+void Plot::PlotGraph(int *buffer, int len, const MinMaxPyramid<int> &lod, QRect plotRect, QRect annotationRect, QPainter *painter, int graphNum)
 {
-	if (len == 0) return;
+	if (len == 0 || GraphStart >= len) return;
 	//clock_t begin = clock();
 	QPainterPath penPath;
-	int vMin = INT_MAX, vMax = INT_MIN, vMean = 0, v = 0, i = 0;
+	int vMin = 0, vMax = 0, vMean = 0, v = 0, i = 0;
 	int x = xCoordOf(GraphStart, plotRect);
 	int y = yCoordOf(buffer[GraphStart],plotRect,g_absVMax);
 	penPath.moveTo(x, y);
-	for(i = GraphStart; i < len && xCoordOf(i, plotRect) < plotRect.right(); i++) {
 
-		x = xCoordOf(i, plotRect);
-		v = buffer[i];
+	int end = sampleOfXOffset(plotRect.right() - plotRect.left());
+	if (end > len) end = len;
+	if (GraphPixelsPerPoint < 1) {
+		// more than one sample per pixel column, draw a vertical line from min to max
+		// of each column, starting at the end nearest to the previous column
+		int s0 = GraphStart;
+		for (int px = 0; s0 < end; px++) {
+			int s1 = sampleOfXOffset(px + 1);
+			if (s1 > end) s1 = end;
+			if (s1 <= s0) continue;
+			MinMaxPyramid<int>::Node n = lod.query(s0, s1);
+			int yMin = yCoordOf(n.min, plotRect, g_absVMax);
+			int yMax = yCoordOf(n.max, plotRect, g_absVMax);
+			x = plotRect.left() + px;
+			if (abs(y - yMin) < abs(y - yMax)) {
+				penPath.lineTo(x, yMin);
+				penPath.lineTo(x, yMax);
+				y = yMax;
+			} else {
+				penPath.lineTo(x, yMax);
+				penPath.lineTo(x, yMin);
+				y = yMin;
+			}
+			s0 = s1;
+		}
+	} else {
+		for(i = GraphStart; i < end; i++) {
 
-		y = yCoordOf( v, plotRect, g_absVMax);
+			x = xCoordOf(i, plotRect);
+			v = buffer[i];
 
-		penPath.lineTo(x, y);
+			y = yCoordOf( v, plotRect, g_absVMax);
 
-		if(GraphPixelsPerPoint > 10) {
-			QRect f(QPoint(x - 3, y - 3),QPoint(x + 3, y + 3));
-			painter->fillRect(f, QColor(100, 255, 100));
+			penPath.lineTo(x, y);
+
+			if(GraphPixelsPerPoint > 10) {
+				QRect f(QPoint(x - 3, y - 3),QPoint(x + 3, y + 3));
+				painter->fillRect(f, QColor(100, 255, 100));
+			}
 		}
-		//catch stats
-		if(v < vMin) vMin = v;
-		if(v > vMax) vMax = v;
-		vMean += v;
 	}
-	vMean /= (i - GraphStart);
+	//catch stats
+	i = end;
+	if (end > GraphStart) {
+		MinMaxPyramid<int>::Node n = lod.query(GraphStart, end);
+		vMin = n.min;
+		vMax = n.max;
+		vMean = (int)(n.sum / (end - GraphStart));
+	}
 
 	painter->setPen(getColor(graphNum));
 
@@ -496,7 +575,8 @@ void Plot::paintEvent(QPaintEvent *event)
 	painter.fillRect(plotRect, QColor(0, 0, 0));
 
 	//init graph variables
-	setMaxAndStart(GraphBuffer,GraphTraceLen,plotRect);
+	graphLOD.update(GraphBuffer, GraphTraceLen);
+	setMaxAndStart(graphLOD,GraphTraceLen,plotRect);
 
 	// center line
 	int zeroHeight = plotRect.top() + (plotRect.bottom() - plotRect.top()) / 2;
@@ -506,14 +586,16 @@ void Plot::paintEvent(QPaintEvent *event)
 	plotGridLines(&painter, plotRect);
 
 	//Start painting graph
-	PlotGraph(GraphBuffer, GraphTraceLen,plotRect,infoRect,&painter,0);
+	PlotGraph(GraphBuffer, GraphTraceLen,graphLOD,plotRect,infoRect,&painter,0);
 	if (showDemod && DemodBufferLen	> 8) {
-		PlotDemod(DemodBuffer, DemodBufferLen,plotRect,infoRect,&painter,2,g_DemodStartIdx);
+		demodLOD.update(DemodBuffer, DemodBufferLen);
+		PlotDemod(DemodBuffer, DemodBufferLen,demodLOD,plotRect,infoRect,&painter,2,g_DemodStartIdx);
 	}
 	if (g_useOverlays) {
 		//init graph variables
-		setMaxAndStart(s_Buff,GraphTraceLen,plotRect);
-		PlotGraph(s_Buff, GraphTraceLen,plotRect,infoRect,&painter,1);
+		overlayLOD.update(s_Buff, GraphTraceLen);
+		setMaxAndStart(overlayLOD,GraphTraceLen,plotRect);
+		PlotGraph(s_Buff, GraphTraceLen,overlayLOD,plotRect,infoRect,&painter,1);
 	}
 	// End graph drawing
 
@@ -13,6 +13,8 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <limits>
+#include <vector>
 
 #include <QApplication>
 #include <QPushButton>
@@ -22,6 +24,111 @@
 #include <QtGui>
 
 #include "ui/ui_overlays.h"
+
+// samples per block in the lowest level of the MinMaxPyramid
+#define LOD_BLOCK 16
+
+/**
+ * @brief Min/max pyramid over a sample buffer, used to draw zoomed out traces
+ * with one vertical line per pixel column instead of one line per sample.
+ * Level 0 holds min, max and sum of LOD_BLOCK samples, each level above
+ * combines two nodes of the level below. update() keeps a copy of the buffer
+ * and only recalculates the blocks that changed since the last call.
+ */
+template <typename T>
+class MinMaxPyramid
+{
+public:
+	struct Node {
+		T min;
+		T max;
+		int64_t sum;
+	};
+
+	MinMaxPyramid() : len(0) {}
+
+	void update(const T *buffer, int newLen) {
+		int blocks = (newLen + LOD_BLOCK - 1) / LOD_BLOCK;
+		int lo = blocks, hi = -1;
+		int oldLen = len;
+
+		shadow.resize(newLen);
+		if (levels.empty()) levels.resize(1);
+		levels[0].resize(blocks);
+		for (int b = 0; b < blocks; b++) {
+			int start = b * LOD_BLOCK;
+			int end = start + LOD_BLOCK < newLen ? start + LOD_BLOCK : newLen;
+			int oldEnd = start + LOD_BLOCK < oldLen ? start + LOD_BLOCK : oldLen;
+			if (end == oldEnd && memcmp(&shadow[start], buffer + start, (end - start) * sizeof(T)) == 0) continue;
+
+			memcpy(&shadow[start], buffer + start, (end - start) * sizeof(T));
+			Node n = empty();
+			for (int i = start; i < end; i++) add(n, buffer[i]);
+			levels[0][b] = n;
+			if (b < lo) lo = b;
+			hi = b;
+		}
+		len = newLen;
+		// the last parents may have lost a child
+		if (newLen != oldLen) hi = blocks - 1;
+
+		size_t k = 0;
+		for (size_t size = blocks; size > 1; k++) {
+			size = (size + 1) / 2;
+			if (levels.size() <= k + 1) {
+				levels.resize(k + 2);
+				lo = 0;
+			}
+			levels[k + 1].resize(size);
+			lo >>= 1;
+			hi >>= 1;
+			for (int i = lo; i <= hi; i++) {
+				Node n = levels[k][2 * i];
+				if (2 * i + 1 < (int)levels[k].size()) merge(n, levels[k][2 * i + 1]);
+				levels[k + 1][i] = n;
+			}
+		}
+		levels.resize(k + 1);
+	}
+
+	// min, max and sum of the samples [start, end)
+	Node query(int start, int end) const {
+		Node n = empty();
+		// samples which don't fill a whole block
+		while (start < end && start % LOD_BLOCK) add(n, shadow[start++]);
+		while (end > start && end % LOD_BLOCK) add(n, shadow[--end]);
+
+		int lo = start / LOD_BLOCK, hi = end / LOD_BLOCK;
+		for (size_t k = 0; lo < hi; k++) {
+			if (lo & 1) merge(n, levels[k][lo++]);
+			if (hi & 1) merge(n, levels[k][--hi]);
+			lo >>= 1;
+			hi >>= 1;
+		}
+		return n;
+	}
+
+private:
+	int len;
+	std::vector<T> shadow;
+	std::vector<std::vector<Node> > levels;
+
+	static Node empty(void) {
+		Node n = { std::numeric_limits<T>::max(), std::numeric_limits<T>::min(), 0 };
+		return n;
+	}
+	static void add(Node &n, T v) {
+		if (v < n.min) n.min = v;
+		if (v > n.max) n.max = v;
+		n.sum += v;
+	}
+	static void merge(Node &n, const Node &m) {
+		if (m.min < n.min) n.min = m.min;
+		if (m.max > n.max) n.max = m.max;
+		n.sum += m.sum;
+	}
+};
+
 /**
  * @brief The actual plot, black area were we paint the graph
  */
@@ -32,13 +139,17 @@ private:
 	double GraphPixelsPerPoint;
 	int CursorAPos;
 	int CursorBPos;
-	void PlotGraph(int *buffer, int len, QRect r,QRect r2, QPainter* painter, int graphNum);
-	void PlotDemod(uint8_t *buffer, size_t len, QRect r,QRect r2, QPainter* painter, int graphNum, int plotOffset);
+	MinMaxPyramid<int> graphLOD;
+	MinMaxPyramid<int> overlayLOD;
+	MinMaxPyramid<uint8_t> demodLOD;
+	void PlotGraph(int *buffer, int len, const MinMaxPyramid<int> &lod, QRect r,QRect r2, QPainter* painter, int graphNum);
+	void PlotDemod(uint8_t *buffer, size_t len, const MinMaxPyramid<uint8_t> &lod, QRect r,QRect r2, QPainter* painter, int graphNum, int plotOffset);
 	void plotGridLines(QPainter* painter,QRect r);
 	int xCoordOf(int i, QRect r );
 	int yCoordOf(int v, QRect r, int maxVal);
 	int valueOf_yCoord(int y, QRect r, int maxVal);
-	void setMaxAndStart(int *buffer, int len, QRect plotRect);
+	int sampleOfXOffset(int px);
+	void setMaxAndStart(const MinMaxPyramid<int> &lod, int len, QRect plotRect);
 	QColor getColor(int graphNum);
 public:
 	Plot(QWidget *parent = 0);
@@ -25,14 +25,23 @@
 #include "cmdparser.h"
 #include "cmdhw.h"
 #include "whereami.h"
+#include "virtualdev.h"
 
 
 // a global mutex to prevent interlaced printing from different threads
 pthread_mutex_t print_lock;
 
 static serial_port sp;
-static UsbCommand txcmd;
-volatile static bool txcmd_pending = false;
+
+// outbound commands, queued by SendCommand() and sent by the uart_writer thread
+#define TX_BUFFER_SIZE 32
+static UsbCommand txBuffer[TX_BUFFER_SIZE];
+static int tx_head; // next empty position to write to
+static int tx_tail; // next command to send
+static bool tx_run = false;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tx_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tx_not_full = PTHREAD_COND_INITIALIZER;
 
 void SendCommand(UsbCommand *c) {
 	#if 0
@@ -43,14 +52,22 @@ void SendCommand(UsbCommand *c) {
       PrintAndLog("Sending bytes to proxmark failed - offline");
       return;
     }
-  /**
-	The while-loop below causes hangups at times, when the pm3 unit is unresponsive
-	or disconnected. The main console thread is alive, but comm thread just spins here.
-	Not good.../holiman
-	**/
-	while(txcmd_pending);
-	txcmd = *c;
-	txcmd_pending = true;
+
+	pthread_mutex_lock(&tx_lock);
+	// block until there is room in the ring. Callers may queue several
+	// commands back to back, the writer thread sends them in order.
+	while (tx_run && (tx_head + 1) % TX_BUFFER_SIZE == tx_tail) {
+		pthread_cond_wait(&tx_not_full, &tx_lock);
+	}
+	if (!tx_run) {
+		pthread_mutex_unlock(&tx_lock);
+		PrintAndLog("Sending bytes to proxmark failed - not connected");
+		return;
+	}
+	txBuffer[tx_head] = *c;
+	tx_head = (tx_head + 1) % TX_BUFFER_SIZE;
+	pthread_cond_signal(&tx_not_empty);
+	pthread_mutex_unlock(&tx_lock);
 }
 
 struct receiver_arg {
@@ -75,14 +92,36 @@ static void *uart_receiver(void *targ) {
 			UsbCommandReceived((UsbCommand*)rx);
 		}
 		prx = rx;
+	}
 
-		if(txcmd_pending) {
-			if (!uart_send(sp, (byte_t*) &txcmd, sizeof(UsbCommand))) {
-				PrintAndLog("Sending bytes to proxmark failed");
-			}
-			txcmd_pending = false;
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void *uart_writer(void *targ) {
+	UsbCommand txcmd;
+
+	pthread_mutex_lock(&tx_lock);
+	while (true) {
+		while (tx_run && tx_head == tx_tail) {
+			pthread_cond_wait(&tx_not_empty, &tx_lock);
 		}
+		// drain whatever is still queued before stopping
+		if (tx_head == tx_tail) {
+			break;
+		}
+		txcmd = txBuffer[tx_tail];
+		tx_tail = (tx_tail + 1) % TX_BUFFER_SIZE;
+		pthread_cond_signal(&tx_not_full);
+		pthread_mutex_unlock(&tx_lock);
+
+		if (!uart_send(sp, (byte_t*) &txcmd, sizeof(UsbCommand))) {
+			PrintAndLog("Sending bytes to proxmark failed");
+		}
+
+		pthread_mutex_lock(&tx_lock);
 	}
+	pthread_mutex_unlock(&tx_lock);
 
 	pthread_exit(NULL);
 	return NULL;
@@ -93,10 +132,13 @@ void main_loop(char *script_cmds_file, bool usb_present) {
 	struct receiver_arg rarg;
 	char *cmd = NULL;
 	pthread_t reader_thread;
+	pthread_t writer_thread;
 
 	if (usb_present) {
 		rarg.run = 1;
+		tx_run = true;
 		pthread_create(&reader_thread, NULL, &uart_receiver, &rarg);
+		pthread_create(&writer_thread, NULL, &uart_writer, NULL);
 		// cache Version information now:
 		CmdVersion(NULL);
 	}
@@ -163,6 +205,12 @@ void main_loop(char *script_cmds_file, bool usb_present) {
 	write_history(".history");
   
 	if (usb_present) {
+		pthread_mutex_lock(&tx_lock);
+		tx_run = false;
+		pthread_cond_broadcast(&tx_not_empty);
+		pthread_cond_broadcast(&tx_not_full);
+		pthread_mutex_unlock(&tx_lock);
+		pthread_join(writer_thread, NULL);
 		rarg.run = 0;
 		pthread_join(reader_thread, NULL);
 	}
@@ -219,6 +267,7 @@ int main(int argc, char* argv[]) {
 	if (argc < 2) {
 		printf("syntax: %s <port>\n\n",argv[0]);
 		printf("\tLinux example:'%s /dev/ttyACM0'\n\n", argv[0]);
+		printf("\tVirtual device:'%s virtual[:traces/EM4102-1.pm3]'\n\n", argv[0]);
 		printf("help:   %s -h\n\n", argv[0]);
 		printf("\tDump all interactive help at once\n");
 		printf("markdown:   %s -m\n\n", argv[0]);
@@ -228,6 +277,7 @@ int main(int argc, char* argv[]) {
 	if (strcmp(argv[1], "-h") == 0) {
 		printf("syntax: %s <port>\n\n",argv[0]);
 		printf("\tLinux example:'%s /dev/ttyACM0'\n\n", argv[0]);
+		printf("\tVirtual device:'%s virtual[:traces/EM4102-1.pm3]'\n\n", argv[0]);
 		dumpAllHelp(0);
 		return 0;
 	}
@@ -241,7 +291,13 @@ int main(int argc, char* argv[]) {
 	bool usb_present = false;
 	char *script_cmds_file = NULL;
   
-	sp = uart_open(argv[1]);
+	const char *port = argv[1];
+	if (virtualdev_requested(port)) {
+		port = virtualdev_start(argv[1]);
+		if (port == NULL) port = "";
+	}
+
+	sp = uart_open(port);
 	if (sp == INVALID_SERIAL_PORT) {
 		printf("ERROR: invalid serial port\n");
 		usb_present = false;
@@ -284,6 +340,7 @@ int main(int argc, char* argv[]) {
 	if (usb_present) {
 		uart_close(sp);
 	}
+	virtualdev_stop();
 
 	// clean up mutex
 	pthread_mutex_destroy(&print_lock);
@@ -0,0 +1,299 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Sample trace files: text with one sample per line, or binary
+//-----------------------------------------------------------------------------
+
+#include "tracefile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+
+static voidpf trace_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	return malloc(items*size);
+}
+
+static void trace_zfree(voidpf opaque, voidpf address)
+{
+	free(address);
+}
+
+static int loadText(FILE *f, int *samples, size_t max)
+{
+	int len = 0;
+	char line[80];
+	while (len < max && fgets(line, sizeof(line), f)) {
+		samples[len++] = atoi(line);
+	}
+	return len;
+}
+
+static void put_le(uint8_t *p, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		p[i] = value >> (8*i);
+	}
+}
+
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; i++) {
+		value |= (uint64_t)p[i] << (8*i);
+	}
+	return value;
+}
+
+static void packHeader(const trace_header_t *hdr, uint8_t *buf)
+{
+	memset(buf, 0, TRACE_HEADER_LEN);
+	memcpy(buf, hdr->magic, sizeof(hdr->magic));
+	put_le(buf + 8, hdr->version, 2);
+	put_le(buf + 10, hdr->flags, 2);
+	put_le(buf + 12, hdr->header_len, 2);
+	buf[14] = hdr->sample_size;
+	buf[15] = hdr->bits_per_sample;
+	put_le(buf + 16, hdr->sample_count, 4);
+	put_le(buf + 20, hdr->data_len, 4);
+	put_le(buf + 24, hdr->sample_rate, 4);
+	buf[28] = hdr->decimation;
+	buf[29] = hdr->averaging;
+	put_le(buf + 32, (uint64_t)hdr->timestamp, 8);
+}
+
+static void unpackHeader(const uint8_t *buf, trace_header_t *hdr)
+{
+	memcpy(hdr->magic, buf, sizeof(hdr->magic));
+	hdr->version = get_le(buf + 8, 2);
+	hdr->flags = get_le(buf + 10, 2);
+	hdr->header_len = get_le(buf + 12, 2);
+	hdr->sample_size = buf[14];
+	hdr->bits_per_sample = buf[15];
+	hdr->sample_count = get_le(buf + 16, 4);
+	hdr->data_len = get_le(buf + 20, 4);
+	hdr->sample_rate = get_le(buf + 24, 4);
+	hdr->decimation = buf[28];
+	hdr->averaging = buf[29];
+	hdr->timestamp = (int64_t)get_le(buf + 32, 8);
+}
+
+#define TRACE_INFLATE_BLOCK 4096
+
+// inflates until the output is full or the stream ends, reading the deflated
+// data from the file in blocks. *data_left counts down the bytes left in the file.
+static int inflateBlocks(FILE *f, z_stream *stream, uint8_t *in, uint32_t *data_left)
+{
+	int ret = Z_OK;
+	while (ret == Z_OK && stream->avail_out > 0) {
+		if (stream->avail_in == 0) {
+			size_t chunk = *data_left < TRACE_INFLATE_BLOCK ? *data_left : TRACE_INFLATE_BLOCK;
+			if (chunk == 0 || fread(in, 1, chunk, f) != chunk) return Z_DATA_ERROR;
+			*data_left -= chunk;
+			stream->next_in = in;
+			stream->avail_in = chunk;
+		}
+		ret = inflate(stream, Z_NO_FLUSH);
+	}
+	return ret;
+}
+
+// inflates the first out_len bytes of the data_len bytes of deflated samples at
+// the current file position, so a bogus data_len can't make us allocate more than
+// the output. With whole set the stream must end right after them.
+static bool inflateSamples(FILE *f, uint32_t data_len, uint8_t *out, size_t out_len, bool whole)
+{
+	uint8_t in[TRACE_INFLATE_BLOCK];
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	stream.zalloc = trace_zalloc;
+	stream.zfree = trace_zfree;
+	if (inflateInit(&stream) != Z_OK) return false;
+
+	stream.next_out = out;
+	stream.avail_out = out_len;
+	int ret = inflateBlocks(f, &stream, in, &data_len);
+	bool ok = (stream.total_out == out_len);
+	if (whole && ret == Z_OK) {
+		uint8_t extra;
+		stream.next_out = &extra;
+		stream.avail_out = 1;
+		ret = inflateBlocks(f, &stream, in, &data_len);
+	}
+	if (whole) ok = ok && ret == Z_STREAM_END && stream.total_out == out_len;
+	inflateEnd(&stream);
+	return ok;
+}
+
+static int loadBinary(FILE *f, int *samples, size_t max, trace_info_t *info)
+{
+	uint8_t buf[TRACE_HEADER_LEN];
+	trace_header_t hdr;
+	if (fread(buf, sizeof(buf), 1, f) != 1) return TRACE_ERR_FORMAT;
+	unpackHeader(buf, &hdr);
+	if (hdr.version != TRACE_VERSION || hdr.header_len < TRACE_HEADER_LEN
+		|| (hdr.sample_size != 1 && hdr.sample_size != 4)) {
+		return TRACE_ERR_FORMAT;
+	}
+	bool deflated = hdr.flags & TRACE_FLAG_DEFLATE;
+	if (!deflated && hdr.data_len != (uint64_t)hdr.sample_count * hdr.sample_size) return TRACE_ERR_FORMAT;
+
+	// the sample data must be in the file
+	if (fseek(f, 0, SEEK_END)) return TRACE_ERR_FORMAT;
+	long file_len = ftell(f);
+	if (file_len < 0 || (uint64_t)hdr.header_len + hdr.data_len > (uint64_t)file_len) return TRACE_ERR_FORMAT;
+	if (fseek(f, hdr.header_len, SEEK_SET)) return TRACE_ERR_FORMAT;
+
+	// only the samples which fit are read
+	size_t len = (hdr.sample_count < max) ? hdr.sample_count : max;
+	size_t raw_len = len * hdr.sample_size;
+	uint8_t *raw = malloc(raw_len ? raw_len : 1);
+	if (raw == NULL) return TRACE_ERR_MEMORY;
+
+	int ret = TRACE_ERR_FORMAT;
+	if (deflated) {
+		if (!inflateSamples(f, hdr.data_len, raw, raw_len, len == hdr.sample_count)) goto out;
+	} else {
+		if (fread(raw, 1, raw_len, f) != raw_len) goto out;
+	}
+
+	if (hdr.sample_size == 1) {
+		for (size_t i = 0; i < len; i++) {
+			samples[i] = (int8_t)raw[i];
+		}
+	} else {
+		for (size_t i = 0; i < len; i++) {
+			samples[i] = (int32_t)get_le(raw + 4*i, 4);
+		}
+	}
+	if (info) {
+		info->sample_rate = hdr.sample_rate;
+		info->bits_per_sample = hdr.bits_per_sample;
+		info->decimation = hdr.decimation;
+		info->averaging = hdr.averaging;
+		info->timestamp = hdr.timestamp;
+	}
+	ret = len;
+
+out:
+	free(raw);
+	return ret;
+}
+
+int loadTraceFile(const char *filename, int *samples, size_t max, trace_info_t *info)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f) return TRACE_ERR_OPEN;
+
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	int ret;
+	if (fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+		rewind(f);
+		ret = loadBinary(f, samples, max, info);
+	} else {
+		rewind(f);
+		if (info) memset(info, 0, sizeof(trace_info_t));
+		ret = loadText(f, samples, max);
+	}
+	fclose(f);
+	return ret;
+}
+
+static bool saveText(FILE *f, const int *samples, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		fprintf(f, "%d\n", samples[i]);
+	}
+	return !ferror(f);
+}
+
+static bool saveBinary(FILE *f, const int *samples, size_t len, const trace_info_t *info, bool compress)
+{
+	trace_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.header_len = TRACE_HEADER_LEN;
+	hdr.sample_count = len;
+	if (info) {
+		hdr.bits_per_sample = info->bits_per_sample;
+		hdr.sample_rate = info->sample_rate;
+		hdr.decimation = info->decimation;
+		hdr.averaging = info->averaging;
+		hdr.timestamp = info->timestamp;
+	}
+
+	// samples straight from the device fit int8, processed ones may not
+	hdr.sample_size = 1;
+	for (size_t i = 0; i < len; i++) {
+		if (samples[i] < -128 || samples[i] > 127) {
+			hdr.sample_size = 4;
+			break;
+		}
+	}
+	size_t raw_len = len * hdr.sample_size;
+	uint8_t *raw = malloc(raw_len ? raw_len : 1);
+	if (raw == NULL) return false;
+	for (size_t i = 0; i < len; i++) {
+		if (hdr.sample_size == 1) {
+			raw[i] = (uint8_t)samples[i];
+		} else {
+			put_le(raw + 4*i, (uint32_t)samples[i], 4);
+		}
+	}
+
+	uint8_t *data = raw;
+	hdr.data_len = raw_len;
+	if (compress) {
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		stream.zalloc = trace_zalloc;
+		stream.zfree = trace_zfree;
+		if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			free(raw);
+			return false;
+		}
+		uLong bound = deflateBound(&stream, raw_len);
+		data = malloc(bound);
+		if (data != NULL) {
+			stream.next_in = raw;
+			stream.avail_in = raw_len;
+			stream.next_out = data;
+			stream.avail_out = bound;
+			if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+				hdr.flags |= TRACE_FLAG_DEFLATE;
+				hdr.data_len = stream.total_out;
+			} else {
+				free(data);
+				data = NULL;
+			}
+		}
+		deflateEnd(&stream);
+		if (data == NULL) {
+			free(raw);
+			return false;
+		}
+	}
+
+	uint8_t buf[TRACE_HEADER_LEN];
+	packHeader(&hdr, buf);
+	bool ok = fwrite(buf, sizeof(buf), 1, f) == 1
+		&& fwrite(data, 1, hdr.data_len, f) == hdr.data_len;
+	if (data != raw) free(data);
+	free(raw);
+	return ok;
+}
+
+bool saveTraceFile(const char *filename, const int *samples, size_t len, const trace_info_t *info, bool binary, bool compress)
+{
+	FILE *f = fopen(filename, binary ? "wb" : "w");
+	if (!f) return false;
+
+	bool ok = binary ? saveBinary(f, samples, len, info, compress) : saveText(f, samples, len);
+	if (fclose(f)) ok = false;
+	return ok;
+}
@@ -0,0 +1,63 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Sample trace files: text with one sample per line, or binary
+//-----------------------------------------------------------------------------
+
+#ifndef TRACEFILE_H__
+#define TRACEFILE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC          "PM3TRACE"
+#define TRACE_VERSION        1
+#define TRACE_FLAG_DEFLATE   0x0001
+#define TRACE_HEADER_LEN     64
+
+#define TRACE_ERR_OPEN       -1
+#define TRACE_ERR_FORMAT     -2
+#define TRACE_ERR_MEMORY     -3
+
+// how the samples were taken, 0 where unknown
+typedef struct {
+	uint32_t sample_rate;     // Hz, after decimation
+	uint8_t bits_per_sample;
+	uint8_t decimation;
+	bool averaging;
+	int64_t timestamp;        // seconds since 1970
+} trace_info_t;
+
+// Binary trace header. In the file it takes TRACE_HEADER_LEN bytes, every
+// field little endian at the offset given in its comment, the rest is 0.
+// The samples follow at header_len, as int8 or, if any of them doesn't fit,
+// int32. Unless they are deflated the file can be mapped and the samples
+// used in place.
+typedef struct {
+	char magic[8];            // 0: TRACE_MAGIC, not 0 terminated
+	uint16_t version;         // 8
+	uint16_t flags;           // 10
+	uint16_t header_len;      // 12
+	uint8_t sample_size;      // 14: 1 or 4 bytes
+	uint8_t bits_per_sample;  // 15
+	uint32_t sample_count;    // 16
+	uint32_t data_len;        // 20: bytes of sample data in the file
+	uint32_t sample_rate;     // 24
+	uint8_t decimation;       // 28
+	uint8_t averaging;        // 29
+	int64_t timestamp;        // 32
+} trace_header_t;
+
+// Loads a text or binary trace, telling them apart by the header. Reads at
+// most max samples and returns their number, or a TRACE_ERR_*. Never allocates
+// more than max samples, whatever the header says. info may be NULL.
+extern int loadTraceFile(const char *filename, int *samples, size_t max, trace_info_t *info);
+
+// Saves samples as text, or binary with the info (may be NULL) in the header.
+// Returns false if the file couldn't be written.
+extern bool saveTraceFile(const char *filename, const int *samples, size_t len, const trace_info_t *info, bool binary, bool compress);
+
+#endif
@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <readline/readline.h>
 #include <pthread.h>
@@ -30,6 +31,46 @@ extern pthread_mutex_t print_lock;
 
 static char *logfilename = "proxmark3.log";
 
+// where PrintAndLog() collects the lines of this thread, if it holds them back
+static __thread held_log_t *held_log = NULL;
+
+static void HoldLine(held_log_t *log, const char *fmt, va_list args)
+{
+	va_list args2;
+	va_copy(args2, args);
+	int n = vsnprintf(NULL, 0, fmt, args2);
+	va_end(args2);
+	if (n < 0) return;
+
+	// lines are kept one after another, each with its terminating 0
+	if (log->len + n + 1 > log->size) {
+		size_t size = log->size ? log->size : 1024;
+		while (size < log->len + n + 1) size *= 2;
+		char *buf = realloc(log->buf, size);
+		if (buf == NULL) return;
+		log->buf = buf;
+		log->size = size;
+	}
+	vsnprintf(log->buf + log->len, n + 1, fmt, args);
+	log->len += n + 1;
+}
+
+void PrintAndLogHold(held_log_t *log)
+{
+	held_log = log;
+}
+
+void PrintAndLogRelease(held_log_t *log, bool print)
+{
+	if (print) {
+		for (size_t i = 0; i < log->len; i += strlen(log->buf + i) + 1) {
+			PrintAndLog("%s", log->buf + i);
+		}
+	}
+	free(log->buf);
+	memset(log, 0, sizeof(held_log_t));
+}
+
 void PrintAndLog(char *fmt, ...)
 {
 	char *saved_line;
@@ -38,6 +79,13 @@ void PrintAndLog(char *fmt, ...)
 	static FILE *logfile = NULL;
 	static int logging=1;
 
+	if (held_log) {
+		va_start(argptr, fmt);
+		HoldLine(held_log, fmt, argptr);
+		va_end(argptr);
+		return;
+	}
+
 	// lock this section to avoid interlacing prints from different threads
 	pthread_mutex_lock(&print_lock);
   
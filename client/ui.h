@@ -13,12 +13,22 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+
+// output of a thread held back by PrintAndLogHold(), to be printed in order
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} held_log_t;
 
 void ShowGui(void);
 void HideGraphWindow(void);
 void ShowGraphWindow(void);
 void RepaintGraphWindow(void);
 void PrintAndLog(char *fmt, ...);
+void PrintAndLogHold(held_log_t *log); // NULL prints again
+void PrintAndLogRelease(held_log_t *log, bool print);
 void SetLogFilename(char *fn);
 
 extern double CursorScaleFactor;
@@ -0,0 +1,225 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Virtual proxmark3 device behind a pseudo terminal, for running the client
+// without hardware
+//
+// The client opens the slave side of the pty through the normal uart code.
+// A responder thread on the master side answers the UsbCommands the way the
+// firmware would. The emulated BigBuf can be filled from a graph trace file
+// (traces/*.pm3), which is served to 'lf read', 'data samples' and friends.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32)
+#define _XOPEN_SOURCE 600               // need posix_openpt() and friends
+#endif
+
+#include "virtualdev.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "usb_cmd.h"
+#include "cmddata.h"
+#include "tracefile.h"
+#include "ui.h"
+#include "util.h"
+
+bool virtualdev_requested(const char *port)
+{
+	size_t len = strlen(VIRTUALDEV_PREFIX);
+	return strncmp(port, VIRTUALDEV_PREFIX, len) == 0 && (port[len] == '\0' || port[len] == ':');
+}
+
+#if !defined(_WIN32)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define VIRTUALDEV_VERSION "virtual device, no hardware attached"
+#define VIRTUALDEV_CHIPID  0x270B0A40    // AT91SAM7S512 Rev A
+
+static int master_fd = -1;
+static pthread_t responder_thread;
+static volatile bool responder_run = false;
+
+// the emulated device memory
+static uint8_t bigbuf[BIGBUF_SIZE];
+static uint32_t bigbuf_samples = 0;
+static uint32_t trace_len = 0;
+
+static void reply(uint64_t cmd, uint64_t arg0, uint64_t arg1, uint64_t arg2, const void *data, size_t len)
+{
+	UsbCommand c;
+	memset(&c, 0, sizeof(UsbCommand));
+	c.cmd = cmd;
+	c.arg[0] = arg0;
+	c.arg[1] = arg1;
+	c.arg[2] = arg2;
+	if (data != NULL) {
+		memcpy(c.d.asBytes, data, MIN(len, USB_CMD_DATA_SIZE));
+	}
+
+	const uint8_t *p = (const uint8_t *)&c;
+	size_t left = sizeof(UsbCommand);
+	while (left > 0) {
+		ssize_t n = write(master_fd, p, left);
+		if (n < 0) {
+			struct pollfd pfd = {master_fd, POLLOUT, 0};
+			poll(&pfd, 1, 100);
+			if (!responder_run) return;
+			continue;
+		}
+		p += n;
+		left -= n;
+	}
+}
+
+static void handle_command(UsbCommand *c)
+{
+	switch (c->cmd) {
+		case CMD_PING:
+			reply(CMD_ACK, 0, 0, 0, NULL, 0);
+			break;
+
+		case CMD_VERSION:
+			reply(CMD_ACK, VIRTUALDEV_CHIPID, 0, 0, VIRTUALDEV_VERSION, strlen(VIRTUALDEV_VERSION));
+			break;
+
+		case CMD_ACQUIRE_RAW_ADC_SAMPLES_125K:
+			// nothing to acquire, the loaded trace is what we "read". arg[0] is in bits.
+			reply(CMD_ACK, bigbuf_samples * 8, 0, 0, NULL, 0);
+			break;
+
+		case CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K: {
+			// same framing as the firmware, see appmain.c
+			sample_config config = {1, 8, false, 95, 0};
+			size_t start = MIN(c->arg[0], BIGBUF_SIZE);
+			size_t numofbytes = MIN(c->arg[1], BIGBUF_SIZE - start);
+			if (c->arg[2] & FLAG_DOWNLOAD_TRACE) {
+				numofbytes = MIN(trace_len, BIGBUF_SIZE - start);
+			}
+			for (size_t i = 0; i < numofbytes; i += USB_CMD_DATA_SIZE) {
+				size_t len = MIN(numofbytes - i, USB_CMD_DATA_SIZE);
+				reply(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K, i, len, trace_len, bigbuf + start + i, len);
+			}
+			reply(CMD_ACK, 1, c->arg[2] & FLAG_DOWNLOAD_TRACE, trace_len, &config, sizeof(sample_config));
+			break;
+		}
+
+		case CMD_BUFF_CLEAR:
+			memset(bigbuf, 0, sizeof(bigbuf));
+			bigbuf_samples = 0;
+			trace_len = 0;
+			break;
+
+		default:
+			// like the firmware, ignore what we don't know
+			break;
+	}
+}
+
+static void *responder(void *arg)
+{
+	UsbCommand rx;
+	size_t rxlen = 0;
+
+	while (responder_run) {
+		struct pollfd pfd = {master_fd, POLLIN, 0};
+		if (poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+		ssize_t n = read(master_fd, ((uint8_t *)&rx) + rxlen, sizeof(UsbCommand) - rxlen);
+		if (n <= 0) {
+			// no client attached to the slave side (yet)
+			usleep(10000);
+			continue;
+		}
+		rxlen += n;
+		if (rxlen == sizeof(UsbCommand)) {
+			handle_command(&rx);
+			rxlen = 0;
+		}
+	}
+	return NULL;
+}
+
+// loads a graph trace as written by 'data save', text or binary
+static bool load_trace(const char *filename)
+{
+	static int samples[BIGBUF_SIZE];
+	int len = loadTraceFile(filename, samples, BIGBUF_SIZE, NULL);
+	if (len < 0) {
+		PrintAndLog("virtual device: could not %s trace %s", len == TRACE_ERR_OPEN ? "open" : "read", filename);
+		return false;
+	}
+
+	for (bigbuf_samples = 0; bigbuf_samples < (uint32_t)len; bigbuf_samples++) {
+		int sample = samples[bigbuf_samples] + 128;
+		bigbuf[bigbuf_samples] = sample < 0 ? 0 : (sample > 255 ? 255 : sample);
+	}
+
+	PrintAndLog("virtual device: loaded %d samples from %s", bigbuf_samples, filename);
+	return true;
+}
+
+const char *virtualdev_start(const char *port)
+{
+	const char *tracefile = strchr(port, ':');
+	if (tracefile != NULL && !load_trace(tracefile + 1)) {
+		return NULL;
+	}
+
+	master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master_fd == -1 || grantpt(master_fd) != 0 || unlockpt(master_fd) != 0) {
+		PrintAndLog("virtual device: could not create a pseudo terminal");
+		virtualdev_stop();
+		return NULL;
+	}
+	fcntl(master_fd, F_SETFL, fcntl(master_fd, F_GETFL) | O_NONBLOCK);
+
+	const char *slave = ptsname(master_fd);
+	if (slave == NULL) {
+		virtualdev_stop();
+		return NULL;
+	}
+
+	responder_run = true;
+	if (pthread_create(&responder_thread, NULL, responder, NULL) != 0) {
+		responder_run = false;
+		virtualdev_stop();
+		return NULL;
+	}
+	return slave;
+}
+
+void virtualdev_stop(void)
+{
+	if (responder_run) {
+		responder_run = false;
+		pthread_join(responder_thread, NULL);
+	}
+	if (master_fd != -1) {
+		close(master_fd);
+		master_fd = -1;
+	}
+}
+
+#else // _WIN32
+
+const char *virtualdev_start(const char *port)
+{
+	PrintAndLog("virtual device: not supported on Windows");
+	return NULL;
+}
+
+void virtualdev_stop(void)
+{
+}
+
+#endif
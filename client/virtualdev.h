@@ -0,0 +1,23 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Virtual proxmark3 device behind a pseudo terminal, for running the client
+// without hardware
+//-----------------------------------------------------------------------------
+
+#ifndef VIRTUALDEV_H__
+#define VIRTUALDEV_H__
+
+#include <stdbool.h>
+
+#define VIRTUALDEV_PREFIX "virtual"
+
+// true if port names the virtual device ("virtual" or "virtual:<tracefile>")
+extern bool virtualdev_requested(const char *port);
+// starts the virtual device and returns the name of the pty to uart_open(), NULL on failure
+extern const char *virtualdev_start(const char *port);
+extern void virtualdev_stop(void);
+
+#endif
@@ -35,13 +35,6 @@ static void __attribute__((constructor)) fill_lut()
 
 
 
-typedef struct bucket {
-	uint32_t *head;
-	uint32_t *bp;
-} bucket_t;
-
-typedef bucket_t bucket_array_t[2][0x100];
-
 typedef struct bucket_info {
 	struct {
 		uint32_t *head, *tail;
@@ -50,34 +43,46 @@ typedef struct bucket_info {
 	} bucket_info_t;
 
 
+/** bucket_sort_intersect
+ * counting sort both lists by their MSB (contribution bits) and keep only the
+ * entries whose MSB occurs in both lists. sort_buf must hold the longer list.
+ * Most calls get short lists, therefore only the buckets in use are visited.
+ */
 static void bucket_sort_intersect(uint32_t* const estart, uint32_t* const estop,
 								  uint32_t* const ostart, uint32_t* const ostop,
-								  bucket_info_t *bucket_info, bucket_array_t bucket)
+								  bucket_info_t *bucket_info, uint32_t *sort_buf)
 {
 	uint32_t *p1, *p2;
 	uint32_t *start[2];
 	uint32_t *stop[2];
+	uint64_t used[2][4] = {{0}};
+	uint64_t both[4];
+	uint32_t count[2][0x100];
+	uint32_t *dest[0x100];
+	uint32_t dest_inc[0x100];
+	uint32_t discard;
 
 	start[0] = estart;
 	stop[0] = estop;
 	start[1] = ostart;
 	stop[1] = ostop;
 
-	// init buckets to be empty
-	for (uint32_t i = 0; i < 2; i++) {
-		for (uint32_t j = 0x00; j <= 0xff; j++) {
-			bucket[i][j].bp = bucket[i][j].head;
-		}
-	}
-
-	// sort the lists into the buckets based on the MSB (contribution bits)
+	// count the list entries per bucket
 	for (uint32_t i = 0; i < 2; i++) {
 		for (p1 = start[i]; p1 <= stop[i]; p1++) {
-			uint32_t bucket_index = (*p1 & 0xff000000) >> 24;
-			*(bucket[i][bucket_index].bp++) = *p1;
+			uint32_t bucket_index = *p1 >> 24;
+			uint64_t bit = 1ULL << (bucket_index & 0x3f);
+			if (used[i][bucket_index >> 6] & bit) {
+				count[i][bucket_index]++;
+			} else {
+				used[i][bucket_index >> 6] |= bit;
+				count[i][bucket_index] = 1;
+			}
 		}
 	}
-
+	for (uint32_t k = 0; k < 4; k++) {
+		both[k] = used[0][k] & used[1][k];
+	}
 
 	// write back intersecting buckets as sorted list.
 	// fill in bucket_info with head and tail of the bucket contents in the list and number of non-empty buckets.
@@ -85,16 +90,32 @@ static void bucket_sort_intersect(uint32_t* const estart, uint32_t* const estop,
 	for (uint32_t i = 0; i < 2; i++) {
 		p1 = start[i];
 		nonempty_bucket = 0;
-		for (uint32_t j = 0x00; j <= 0xff; j++) {
-			if (bucket[0][j].bp != bucket[0][j].head && bucket[1][j].bp != bucket[1][j].head) { // non-empty intersecting buckets only
-				bucket_info->bucket_info[i][nonempty_bucket].head = p1;
-				for (p2 = bucket[i][j].head; p2 < bucket[i][j].bp; *p1++ = *p2++);
-				bucket_info->bucket_info[i][nonempty_bucket].tail = p1 - 1;
-				nonempty_bucket++;
+		for (uint32_t k = 0; k < 4; k++) {
+			for (uint64_t bits = used[i][k]; bits; bits &= bits - 1) {
+				uint32_t j = k << 6 | __builtin_ctzll(bits);
+				if (both[k] & (1ULL << (j & 0x3f))) { // non-empty intersecting buckets only
+					bucket_info->bucket_info[i][nonempty_bucket].head = p1;
+					dest[j] = p1;
+					dest_inc[j] = 1;
+					p1 += count[i][j];
+					bucket_info->bucket_info[i][nonempty_bucket].tail = p1 - 1;
+					nonempty_bucket++;
+				} else {		// entries of other buckets are dropped
+					dest[j] = &discard;
+					dest_inc[j] = 0;
+				}
 			}
 		}
 		bucket_info->numbuckets = nonempty_bucket;
+
+		uint32_t len = stop[i] - start[i] + 1;
+		for (p1 = start[i], p2 = sort_buf; p1 <= stop[i]; *p2++ = *p1++);
+		for (p2 = sort_buf; p2 < sort_buf + len; p2++) {
+			uint32_t bucket_index = *p2 >> 24;
+			*dest[bucket_index] = *p2;
+			dest[bucket_index] += dest_inc[bucket_index];
 		}
+	}
 }
 /** binsearch
  * Binary search for the first occurence of *stop's MSB in sorted [start,stop]
@@ -169,7 +190,7 @@ static inline void extend_table_simple(uint32_t *tbl, uint32_t **end, int bit)
 static struct Crypto1State*
 recover(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
 	uint32_t *e_head, uint32_t *e_tail, uint32_t eks, int rem,
-	struct Crypto1State *sl, uint32_t in, bucket_array_t bucket)
+	struct Crypto1State *sl, uint32_t in, uint32_t *sort_buf)
 {
 	uint32_t *o, *e, i;
 	bucket_info_t bucket_info;
@@ -200,26 +221,51 @@ recover(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
 		if(e_head > e_tail)
 			return sl;
 	}
-	bucket_sort_intersect(e_head, e_tail, o_head, o_tail, &bucket_info, bucket);
+	bucket_sort_intersect(e_head, e_tail, o_head, o_tail, &bucket_info, sort_buf);
 
 	for (int i = bucket_info.numbuckets - 1; i >= 0; i--) {
 		sl = recover(bucket_info.bucket_info[1][i].head, bucket_info.bucket_info[1][i].tail, oks,
 					 bucket_info.bucket_info[0][i].head, bucket_info.bucket_info[0][i].tail, eks,
-					 rem, sl, in, bucket);
+					 rem, sl, in, sort_buf);
 	}
 
 	return sl;
 }
-/** lfsr_recovery
- * recover the state of the lfsr given 32 bits of the keystream
- * additionally you can use the in parameter to specify the value
- * that was fed into the lfsr at the time the keystream was generated
+/** crypto1_arena_init
+ * allocate the tables used by lfsr_recovery32_arena(). They can be reused for any number of calls.
  */
-struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
+int crypto1_arena_init(struct Crypto1Arena *arena)
 {
-	struct Crypto1State *statelist;
-	uint32_t *odd_head = 0, *odd_tail = 0, oks = 0;
-	uint32_t *even_head = 0, *even_tail = 0, eks = 0;
+	arena->odd = malloc(sizeof(uint32_t) << 21);
+	arena->even = malloc(sizeof(uint32_t) << 21);
+	arena->sort_buf = malloc(sizeof(uint32_t) << 21);
+	arena->statelist = malloc(sizeof(struct Crypto1State) << 18);
+	if(!arena->odd || !arena->even || !arena->sort_buf || !arena->statelist) {
+		crypto1_arena_free(arena);
+		return 0;
+	}
+	return 1;
+}
+
+void crypto1_arena_free(struct Crypto1Arena *arena)
+{
+	free(arena->odd);
+	free(arena->even);
+	free(arena->sort_buf);
+	free(arena->statelist);
+	arena->odd = arena->even = arena->sort_buf = 0;
+	arena->statelist = 0;
+}
+
+/** lfsr_recovery32_arena
+ * like lfsr_recovery32(), but uses the tables of an initialized arena. The returned
+ * statelist is arena->statelist and is valid until the next call with the same arena.
+ */
+struct Crypto1State* lfsr_recovery32_arena(uint32_t ks2, uint32_t in, struct Crypto1Arena *arena)
+{
+	struct Crypto1State *statelist = arena->statelist;
+	uint32_t *odd_head = arena->odd, *odd_tail = arena->odd - 1, oks = 0;
+	uint32_t *even_head = arena->even, *even_tail = arena->even - 1, eks = 0;
 	int i;
 
 	for(i = 31; i >= 0; i -= 2)
@@ -227,27 +273,8 @@ struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
 	for(i = 30; i >= 0; i -= 2)
  		eks = eks << 1 | BEBIT(ks2, i);
 
-	odd_head = odd_tail = malloc(sizeof(uint32_t) << 21);
-	even_head = even_tail = malloc(sizeof(uint32_t) << 21);
-	statelist =  malloc(sizeof(struct Crypto1State) << 18);
-	if(!odd_tail-- || !even_tail-- || !statelist) {
-		free(statelist);
-		statelist = 0;
-		goto out;
-	}
 	statelist->odd = statelist->even = 0;
 
-	// allocate memory for out of place bucket_sort
-	bucket_array_t bucket;
-	for (uint32_t i = 0; i < 2; i++)
-		for (uint32_t j = 0; j <= 0xff; j++) {
-			bucket[i][j].head = malloc(sizeof(uint32_t)<<14);
-			if (!bucket[i][j].head) {
-				goto out;
-			}
-		}
-
-
 	for(i = 1 << 20; i >= 0; --i) {
 		if(filter(i) == (oks & 1))
 			*++odd_tail = i;
@@ -262,14 +289,29 @@ struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
 
 	in = (in >> 16 & 0xff) | (in << 16) | (in & 0xff00);
 	recover(odd_head, odd_tail, oks,
-		even_head, even_tail, eks, 11, statelist, in << 1, bucket);
+		even_head, even_tail, eks, 11, statelist, in << 1, arena->sort_buf);
 
-out:
-	free(odd_head);
-	free(even_head);
-	for (uint32_t i = 0; i < 2; i++)
-		for (uint32_t j = 0; j <= 0xff; j++)
-			free(bucket[i][j].head);
+	return statelist;
+}
+
+/** lfsr_recovery
+ * recover the state of the lfsr given 32 bits of the keystream
+ * additionally you can use the in parameter to specify the value
+ * that was fed into the lfsr at the time the keystream was generated
+ */
+struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
+{
+	struct Crypto1Arena arena;
+	struct Crypto1State *statelist;
+
+	if(!crypto1_arena_init(&arena))
+		return 0;
+
+	statelist = lfsr_recovery32_arena(ks2, in, &arena);
+
+	// the caller owns the statelist
+	arena.statelist = 0;
+	crypto1_arena_free(&arena);
 
 	return statelist;
 }
@@ -38,6 +38,10 @@ uint32_t crypto1_word(struct Crypto1State*, uint32_t, int);
 uint32_t prng_successor(uint32_t x, uint32_t n);
 
 struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in);
+struct Crypto1Arena {uint32_t *odd, *even, *sort_buf; struct Crypto1State *statelist;};
+int crypto1_arena_init(struct Crypto1Arena *arena);
+void crypto1_arena_free(struct Crypto1Arena *arena);
+struct Crypto1State* lfsr_recovery32_arena(uint32_t ks2, uint32_t in, struct Crypto1Arena *arena);
 struct Crypto1State* lfsr_recovery64(uint32_t ks2, uint32_t ks3);
 uint32_t *lfsr_prefix_ks(uint8_t ks[8], int isodd);
 struct Crypto1State*
@@ -405,10 +405,20 @@ int DetectStrongAskClock(uint8_t dest[], size_t size, int high, int low, int *cl
 	return shortestWaveIdx;
 }
 
+// the samples DetectASKClock counts as being on a peak
+static inline bool askIsPeak(uint8_t dest[], size_t size, size_t i, int peak, int low) {
+	return i < size && (dest[i] >= peak || dest[i] <= low);
+}
+
 // by marshmellow
 // not perfect especially with lower clocks or VERY good antennas (heavy wave clipping)
 // maybe somehow adjust peak trimming value based on samples to fix?
 // return start index of best starting position for that clock and return clock (by reference)
+//
+// A start ii is scored by the samples ii, ii+clk, ii+2*clk... which are not on a
+// peak (within tol). All starts with the same ii % clk share that lattice and run
+// to the same end, so one pass over the samples per clock counts the misses per
+// residue, and a start's errors are its residue's misses less those before it.
 int DetectASKClock(uint8_t dest[], size_t size, int *clock, int maxErr) {
 	size_t i=1;
 	uint8_t clk[] = {255,8,16,32,40,50,64,100,128,255};
@@ -441,7 +451,7 @@ int DetectASKClock(uint8_t dest[], size_t size, int *clock, int maxErr) {
 	uint16_t bestErr[]={1000,1000,1000,1000,1000,1000,1000,1000,1000};
 	uint8_t bestStart[]={0,0,0,0,0,0,0,0,0};
 	size_t errCnt = 0;
-	size_t arrLoc, loopEnd;
+	size_t loopEnd;
 
 	if (clockFnd>0) {
 		clkCnt = clockFnd;
@@ -450,42 +460,55 @@ int DetectASKClock(uint8_t dest[], size_t size, int *clock, int maxErr) {
 	else clkCnt=1;
 
 	//test each valid clock from smallest to greatest to see which lines up
+	uint32_t misses[128];  //misses on each residue of the clock
+	uint8_t before[128];   //misses on each residue before the current start
 	for(; clkCnt < clkEnd; clkCnt++){
-		if (clk[clkCnt] <= 32){
+		uint8_t curClk = clk[clkCnt];
+		if (curClk <= 32){
 			tol=1;
 		}else{
 			tol=0;
 		}
+		//count the misses of every lattice in one pass
+		//last sample of a lattice that is tested, size > 255 so this doesn't wrap
+		size_t lastIdx = size - curClk*2 - tol;
+		memset(misses, 0, curClk * sizeof(misses[0]));
+		// bitwise rather than || so the loop doesn't branch per sample
+		uint8_t prevPeak = 0, curPeak = (dest[0] >= peak) | (dest[0] <= low);
+		uint8_t r = 0;
+		for (i = 0; i <= lastIdx; ++i) {
+			uint8_t nextPeak = (dest[i+1] >= peak) | (dest[i+1] <= low);
+			misses[r] += 1 ^ (curPeak | (tol & (prevPeak | nextPeak)));
+			prevPeak = curPeak;
+			curPeak = nextPeak;
+			if (++r == curClk) r = 0;
+		}
+
 		//if no errors allowed - keep start within the first clock
-		if (!maxErr && size > clk[clkCnt]*2 + tol && clk[clkCnt]<128) loopCnt=clk[clkCnt]*2;
+		if (!maxErr && size > curClk*2 + tol && curClk<128) loopCnt=curClk*2;
 		bestErr[clkCnt]=1000;
+		memset(before, 0, curClk * sizeof(before[0]));
 		//try lining up the peaks by moving starting point (try first few clocks)
-		for (ii=0; ii < loopCnt; ii++){
-			if (dest[ii] < peak && dest[ii] > low) continue;
-
-			errCnt=0;
-			// now that we have the first one lined up test rest of wave array
-			loopEnd = ((size-ii-tol) / clk[clkCnt]) - 1;
-			for (i=0; i < loopEnd; ++i){
-				arrLoc = ii + (i * clk[clkCnt]);
-				if (dest[arrLoc] >= peak || dest[arrLoc] <= low){
-				}else if (dest[arrLoc-tol] >= peak || dest[arrLoc-tol] <= low){
-				}else if (dest[arrLoc+tol] >= peak || dest[arrLoc+tol] <= low){
-				}else{  //error no peak detected
-					errCnt++;
+		r = 0;
+		for (ii=0; ii < loopCnt; ii++, r = (r+1 == curClk) ? 0 : r+1){
+			bool onPeak = askIsPeak(dest, size, ii, peak, low);
+			if (onPeak) {
+				errCnt = misses[r] - before[r];
+				loopEnd = (size-ii-tol >= curClk*2) ? ((size-ii-tol) / curClk) - 1 : 0;
+				//if we found no errors then we can stop here and a low clock (common clocks)
+				//  this is correct one - return this clock
+				if (g_debugMode == 2) prnt("DEBUG ASK: clk %d, err %d, startpos %d, endpos %d",curClk,errCnt,ii,loopEnd);
+				if(errCnt==0 && clkCnt<7) { 
+					if (!clockFnd) *clock = curClk;
+					return ii;
 				}
-			}
-			//if we found no errors then we can stop here and a low clock (common clocks)
-			//  this is correct one - return this clock
-			if (g_debugMode == 2) prnt("DEBUG ASK: clk %d, err %d, startpos %d, endpos %d",clk[clkCnt],errCnt,ii,i);
-			if(errCnt==0 && clkCnt<7) { 
-				if (!clockFnd) *clock = clk[clkCnt];
-				return ii;
-			}
-			//if we found errors see if it is lowest so far and save it as best run
-			if(errCnt<bestErr[clkCnt]){
-				bestErr[clkCnt]=errCnt;
-				bestStart[clkCnt]=ii;
+				//if we found errors see if it is lowest so far and save it as best run
+				if(errCnt<bestErr[clkCnt]){
+					bestErr[clkCnt]=errCnt;
+					bestStart[clkCnt]=ii;
+				}
+			} else if (ii <= lastIdx && !(tol && ((ii && askIsPeak(dest, size, ii-1, peak, low)) || askIsPeak(dest, size, ii+1, peak, low)))) {
+				before[r]++;
 			}
 		}
 	}
@@ -232,6 +232,10 @@ typedef struct{
 #define FLAG_ICLASS_READER_CEDITKEY     0x40
 
 
+//BigBuf download flags
+#define FLAG_DOWNLOAD_TRACE   0x01  // send the recorded trace, echoed in the ACK's arg[1]
+
+
 //hw tune args
 #define FLAG_TUNE_LF   1
 #define FLAG_TUNE_HF   2